@@ -30,13 +30,14 @@
  * handle a very lightweight event-loop based on the most common IO
  * multiplexing implementations available on Unix-based systems:
  *
- * - Linux-based: epoll
+ * - Linux-based: epoll, io_uring
  * - BSD-based (osx): kqueue
  * - All around: poll, select
  *
  * By setting a pre-processor macro definition it's possible to force the use
  * of a wanted implementation.
  *
+ * #define IO_URING 1 // set to use io_uring, falling back to epoll
  * #define EPOLL  1   // set to use epoll
  * #define KQUEUE 1   // set to use kqueue
  * #define POLL   1   // set to use poll
@@ -66,7 +67,11 @@
 
 #ifdef __linux__
 #include <linux/version.h>
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(2, 5, 44)
+#if defined(IO_URING) && LINUX_VERSION_CODE >= KERNEL_VERSION(5, 19, 0)
+#define EPOLL 1
+#define EVENTLOOP_BACKEND "io_uring"
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 5, 44)
+#undef IO_URING
 #define EPOLL 1
 #define EVENTLOOP_BACKEND "epoll"
 #elif LINUX_VERSION_CODE >= KERNEL_VERSION(2, 1, 23)
@@ -129,7 +134,8 @@ enum ev_type {
     EV_DISCONNECT = 0x04,
     EV_EVENTFD    = 0x08,
     EV_TIMERFD    = 0x10,
-    EV_CLOSEFD    = 0x20
+    EV_CLOSEFD    = 0x20,
+    EV_COMPLETION = 0x40
 };
 
 /*
@@ -147,6 +153,9 @@ enum ev_type {
  * definetly a possibility to run multiple theads each one with his own loop,
  * depending on the scenario, use-case by use-case it can be a feasible
  * solutiion.
+ *
+ * An optional `on_cycle` callback is called at the end of every loop cycle
+ * processing some events, with the nanoseconds it took, to monitor it.
  */
 typedef struct ev_ctx {
     int events_nr;
@@ -158,6 +167,8 @@ typedef struct ev_ctx {
     unsigned long long fired_events;
     struct ev *events_monitored;
     void *api; // opaque pointer to platform defined backends
+    void (*on_cycle)(struct ev_ctx *, long long, void *);
+    void *cycle_data;
 } ev_context;
 
 /*
@@ -220,6 +231,15 @@ int ev_run(ev_context *);
  */
 void ev_stop(ev_context *);
 
+/*
+ * Set a callback to be called at the end of every loop cycle processing some
+ * events, with the time it took in nanoseconds and an opaque pointer to its
+ * arguments, NULL to unset it
+ */
+void ev_set_on_cycle(ev_context *,
+                     void (*on_cycle)(ev_context *, long long, void *),
+                     void *);
+
 /*
  * Add a single FD to the underlying backend of the event loop. Equal to
  * ev_fire_event just without an event to be carried. Useful to add simple
@@ -255,6 +275,58 @@ int ev_register_cron(ev_context *,
 int ev_fire_event(ev_context *, int, int,
                   void (*callback)(ev_context *, void *), void *);
 
+#if defined(IO_URING)
+
+#include <sys/socket.h>
+
+/*
+ * Completion-based I/O, served by the io_uring backend. An operation is
+ * submitted on a descriptor with a callback, run once it's done with its
+ * result, the bytes transferred or the descriptor accepted, or a negative
+ * errno, and for receives the bytes themselves, valid only during the call.
+ * A single operation of each kind can be in flight on a descriptor, a
+ * receive, a send, and an accept or a no-op; all of them are cancelled by
+ * ev_cancel or ev_del_fd, the completions of the latter aren't reported.
+ * Where the kernel lacks the support the loop runs on epoll alone,
+ * ev_completions returns 0 and the readiness APIs are the ones to use.
+ */
+typedef void (*ev_io_callback)(ev_context *, void *, int, const char *);
+
+int ev_completions(const ev_context *);
+
+/*
+ * Accept connections on a listening socket till cancelled, the callback is
+ * run for each one with the new descriptor, non-blocking
+ */
+int ev_submit_accept(ev_context *, int, ev_io_callback, void *);
+
+/*
+ * Receive the next bytes available, up to EV_URING_BUFSIZE, 0 means
+ * disconnection by the peer
+ */
+int ev_submit_recv(ev_context *, int, ev_io_callback, void *);
+
+/*
+ * Send the buffers of a message, which has to stay valid till submitted,
+ * that is till the next loop cycle, the buffers till completed
+ */
+int ev_submit_sendmsg(ev_context *, int, const struct msghdr *,
+                      ev_io_callback, void *);
+
+/*
+ * Run a callback on the next loop cycle, ordered with the completions of
+ * the descriptor
+ */
+int ev_submit_nop(ev_context *, int, ev_io_callback, void *);
+
+/*
+ * Cancel the operations in flight on a descriptor, their callbacks are run
+ * with -ECANCELED unless they had completed already
+ */
+int ev_cancel(ev_context *, int);
+
+#endif
+
 #ifdef EV_SOURCE
 #ifndef EV_SOURCE_ONCE
 #define EV_SOURCE_ONCE
@@ -273,9 +345,17 @@ int ev_fire_event(ev_context *, int, int,
 
 #include <sys/epoll.h>
 
+/*
+ * Served by the io_uring backend, `ring` is the one set up, if any, `ready`
+ * the number of epoll events of the last poll, followed by the completions
+ */
 struct epoll_api {
     int fd;
     struct epoll_event *events;
+#if defined(IO_URING)
+    int ready;
+    struct ev_uring *ring;
+#endif
 };
 
 /*
@@ -322,15 +402,447 @@ static int epoll_del(int efd, int fd) {
     return epoll_ctl(efd, EPOLL_CTL_DEL, fd, NULL);
 }
 
+#if defined(IO_URING)
+
+/*
+ * ===========================
+ *  io_uring backend functions
+ * ===========================
+ *
+ * The io_uring backend extends the epoll one: descriptors registered for
+ * readiness are still watched by epoll, its own descriptor being polled
+ * through the ring, while the operations submitted by the completion APIs,
+ * accepts, receives and sends, run on the ring and are reported done along
+ * with their result. All the requests queued in a loop cycle go out at once
+ * with the io_uring_enter(2) call waiting for the next completions, so a
+ * connection served by completions costs no syscall of its own.
+ * Receives pick a buffer from a pool provided to the kernel, handed to the
+ * callback and given back right after it. Every descriptor carries a
+ * generation, moved forward as it's removed, the completions of its
+ * operations still in flight are dropped. If the ring can't be set up, or
+ * the kernel lacks some operation, the loop runs on epoll alone.
+ */
+
+#include <poll.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Number and size of the buffers provided to the kernel for the receives.
+ * Tweakable values.
+ */
+#define EV_URING_BUFS    128
+#define EV_URING_BUFSIZE 16384
+
+/*
+ * Tags of the completions not bound to an operation, the ones of buffers
+ * provided and cancels are ignored, the other marks the epoll descriptor
+ * ready. Operations carry their generation, kind and descriptor instead
+ */
+#define URING_IGNORE 0ULL
+#define URING_EPOLL  1ULL
+#define URING_OP     (1ULL << 63)
+
+enum { URING_RECV, URING_SEND, URING_AUX, URING_KINDS };
+
+struct uring_op {
+    ev_io_callback callback;
+    void *data;
+    int opcode;
+    int armed;
+};
+
+struct uring_fd {
+    unsigned gen;
+    struct uring_op ops[URING_KINDS];
+};
+
+/* A completion taken off the ring, to be processed by the loop */
+struct uring_cqe {
+    unsigned long long data;
+    int res;
+    unsigned flags;
+};
+
+struct ev_uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned to_submit;
+    int epoll_armed;
+    int multishot;
+    char *bufs;
+    int fds_nr;
+    struct uring_fd *fds;
+    int done_nr;
+    struct uring_cqe *done;
+};
+
+static int uring_enter(struct ev_uring *u, unsigned min_complete,
+                       unsigned flags, void *arg, size_t argsz) {
+    int n = syscall(__NR_io_uring_enter, u->fd, u->to_submit,
+                    min_complete, flags, arg, argsz);
+    if (n > 0)
+        u->to_submit -= n;
+    return n;
+}
+
+/*
+ * Take the next submission queue entry, zeroed, submitting the ones queued
+ * so far first if the ring is full. The kernel reads the entries only on
+ * the next io_uring_enter(2), so it can be filled after being queued
+ */
+static struct io_uring_sqe *uring_sqe(struct ev_uring *u) {
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) == u->sq_entries)
+        uring_enter(u, 0, 0, NULL, 0);
+    unsigned idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0x00, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->to_submit++;
+    return sqe;
+}
+
+static inline unsigned long long uring_data(const struct ev_uring *u,
+                                            int fd, int kind) {
+    return URING_OP |
+        (unsigned long long) (u->fds[fd].gen & 0x1FFFFFFF) << 34 |
+        (unsigned long long) kind << 32 | (uint32_t) fd;
+}
+
+static struct uring_fd *uring_fd(struct ev_uring *u, int fd) {
+    if (fd >= u->fds_nr) {
+        int fds_nr = u->fds_nr;
+        while (u->fds_nr <= fd)
+            u->fds_nr *= 2;
+        u->fds = realloc(u->fds, u->fds_nr * sizeof(*u->fds));
+        memset(u->fds + fds_nr, 0x00,
+               (u->fds_nr - fds_nr) * sizeof(*u->fds));
+    }
+    return &u->fds[fd];
+}
+
+static inline void uring_poll32(struct io_uring_sqe *sqe, unsigned events) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    events = events << 16 | events >> 16;
+#endif
+    sqe->poll32_events = events;
+}
+
+/* Give a buffer back to the pool, once its bytes have been handed over */
+static void uring_provide(struct ev_uring *u, unsigned bid, unsigned nbufs) {
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = nbufs;
+    sqe->addr = (unsigned long long) (uintptr_t)
+        (u->bufs + (size_t) bid * EV_URING_BUFSIZE);
+    sqe->len = EV_URING_BUFSIZE;
+    sqe->off = bid;
+    sqe->buf_group = 0;
+    sqe->user_data = URING_IGNORE;
+}
+
+/*
+ * Queue an operation of a kind on a descriptor, the entry returned is left
+ * to be filled with its arguments
+ */
+static struct io_uring_sqe *uring_submit(struct ev_uring *u, int fd, int kind,
+                                         int opcode, ev_io_callback callback,
+                                         void *data) {
+    struct uring_op *op = &uring_fd(u, fd)->ops[kind];
+    op->callback = callback;
+    op->data = data;
+    op->opcode = opcode;
+    op->armed = 1;
+    struct io_uring_sqe *sqe = uring_sqe(u);
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = uring_data(u, fd, kind);
+    return sqe;
+}
+
+static void uring_recv(struct ev_uring *u, int fd, ev_io_callback callback,
+                       void *data) {
+    struct io_uring_sqe *sqe =
+        uring_submit(u, fd, URING_RECV, IORING_OP_RECV, callback, data);
+    sqe->len = EV_URING_BUFSIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+}
+
+static void uring_accept(struct ev_uring *u, int fd, ev_io_callback callback,
+                         void *data) {
+    struct io_uring_sqe *sqe =
+        uring_submit(u, fd, URING_AUX, IORING_OP_ACCEPT, callback, data);
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    if (u->multishot)
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void uring_cancel(struct ev_uring *u, int fd) {
+    if (fd < 0 || fd >= u->fds_nr)
+        return;
+    for (int kind = 0; kind < URING_KINDS; ++kind) {
+        if (!u->fds[fd].ops[kind].armed)
+            continue;
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = uring_data(u, fd, kind);
+        sqe->user_data = URING_IGNORE;
+    }
+}
+
+/*
+ * Drop the operations of a descriptor removed, the cancels go out right
+ * away, before the descriptor is closed and its buffers are released
+ */
+static void uring_forget(struct ev_uring *u, int fd) {
+    if (fd < 0 || fd >= u->fds_nr)
+        return;
+    int armed = 0;
+    for (int kind = 0; kind < URING_KINDS; ++kind)
+        armed |= u->fds[fd].ops[kind].armed;
+    if (!armed)
+        return;
+    uring_cancel(u, fd);
+    for (int kind = 0; kind < URING_KINDS; ++kind)
+        u->fds[fd].ops[kind].armed = 0;
+    u->fds[fd].gen++;
+    uring_enter(u, 0, 0, NULL, 0);
+}
+
+static void uring_destroy(struct ev_uring *u) {
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != MAP_FAILED)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring && u->sq_ring != MAP_FAILED)
+        munmap(u->sq_ring, u->sq_ring_size);
+    close(u->fd);
+    /*
+     * Unmapped only after the ring is gone, a receive still running writes
+     * nowhere
+     */
+    if (u->bufs && u->bufs != MAP_FAILED)
+        munmap(u->bufs, (size_t) EV_URING_BUFS * EV_URING_BUFSIZE);
+    free(u->fds);
+    free(u->done);
+    free(u);
+}
+
+/*
+ * Check the kernel serves every operation the backend relies on, multishot
+ * accepts can't be probed, they're turned off on the first refusal
+ */
+static int uring_probe(struct ev_uring *u) {
+    static const int opcodes[] = {
+        IORING_OP_NOP, IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SENDMSG,
+        IORING_OP_PROVIDE_BUFFERS
+    };
+    size_t len = sizeof(struct io_uring_probe) +
+        256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe *probe = calloc(1, len);
+    int ok = syscall(__NR_io_uring_register, u->fd, IORING_REGISTER_PROBE,
+                     probe, 256) == 0;
+    for (size_t i = 0; ok && i < sizeof(opcodes) / sizeof(*opcodes); ++i)
+        ok = opcodes[i] <= probe->last_op &&
+            (probe->ops[opcodes[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return ok;
+}
+
+/*
+ * Set up a ring sized on the number of events, with its pool of buffers
+ * provided, NULL if the kernel doesn't allow it, errno telling why
+ */
+static struct ev_uring *uring_setup(int events_nr) {
+    const unsigned features =
+        IORING_FEAT_NODROP | IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_FAST_POLL;
+    struct ev_uring *u = calloc(1, sizeof(*u));
+    struct io_uring_params params;
+    memset(&params, 0x00, sizeof(params));
+    params.flags = IORING_SETUP_COOP_TASKRUN;
+    u->fd = syscall(__NR_io_uring_setup, events_nr, &params);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&params, 0x00, sizeof(params));
+        u->fd = syscall(__NR_io_uring_setup, events_nr, &params);
+    }
+    if (u->fd < 0) {
+        free(u);
+        return NULL;
+    }
+    int err = EOPNOTSUPP;
+    if ((params.features & features) != features || !uring_probe(u))
+        goto err;
+    u->sq_ring_size = params.sq_off.array +
+        params.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = params.cq_off.cqes +
+        params.cq_entries * sizeof(struct io_uring_cqe);
+    u->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    u->bufs = mmap(NULL, (size_t) EV_URING_BUFS * EV_URING_BUFSIZE,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    err = errno;
+    if (u->sq_ring == MAP_FAILED || u->cq_ring == MAP_FAILED
+        || u->sqes == MAP_FAILED || u->bufs == MAP_FAILED)
+        goto err;
+    u->sq_entries = params.sq_entries;
+    u->sq_head = (unsigned *) ((char *) u->sq_ring + params.sq_off.head);
+    u->sq_tail = (unsigned *) ((char *) u->sq_ring + params.sq_off.tail);
+    u->sq_mask = (unsigned *) ((char *) u->sq_ring + params.sq_off.ring_mask);
+    u->sq_array = (unsigned *) ((char *) u->sq_ring + params.sq_off.array);
+    u->cq_head = (unsigned *) ((char *) u->cq_ring + params.cq_off.head);
+    u->cq_tail = (unsigned *) ((char *) u->cq_ring + params.cq_off.tail);
+    u->cq_mask = (unsigned *) ((char *) u->cq_ring + params.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) ((char *) u->cq_ring +
+                                       params.cq_off.cqes);
+    u->multishot = 1;
+    u->fds_nr = events_nr;
+    u->fds = calloc(events_nr, sizeof(*u->fds));
+    u->done = calloc(events_nr, sizeof(*u->done));
+    /* The whole pool goes in at once, its outcome tells it's usable */
+    uring_provide(u, 0, EV_URING_BUFS);
+    err = EOPNOTSUPP;
+    if (uring_enter(u, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        goto err;
+    unsigned head = *u->cq_head;
+    if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)
+        || u->cqes[head & *u->cq_mask].res < 0)
+        goto err;
+    __atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+    return u;
+
+err:
+
+    uring_destroy(u);
+    errno = err;
+    return NULL;
+}
+
+/*
+ * Take the completions posted off the ring, up to the number of events of
+ * the context, the stale ones are dropped, their buffers given back
+ */
+static int uring_reap(ev_context *ctx, struct ev_uring *u) {
+    unsigned head = *u->cq_head;
+    unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    int ready = 0;
+    u->done_nr = 0;
+    while (head != tail && u->done_nr < ctx->events_nr) {
+        struct io_uring_cqe *cqe = &u->cqes[head++ & *u->cq_mask];
+        if (cqe->user_data == URING_EPOLL) {
+            u->epoll_armed = 0;
+            ready = 1;
+            continue;
+        }
+        if (!(cqe->user_data & URING_OP))
+            continue;
+        int fd = (int) (uint32_t) cqe->user_data;
+        int kind = (cqe->user_data >> 32) & 0x03;
+        if (fd >= u->fds_nr || !u->fds[fd].ops[kind].armed
+            || cqe->user_data != uring_data(u, fd, kind)) {
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                uring_provide(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT, 1);
+            continue;
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+            u->fds[fd].ops[kind].armed = 0;
+        u->done[u->done_nr++] =
+            (struct uring_cqe) { cqe->user_data, cqe->res, cqe->flags };
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    return ready;
+}
+
+/*
+ * Run the callback of a completion taken off the ring. Receives finding the
+ * pool empty are just submitted again, as accepts are till cancelled
+ */
+static int uring_complete(struct ev_uring *u, ev_context *ctx,
+                          const struct uring_cqe *c) {
+    int fd = (int) (uint32_t) c->data;
+    int kind = (c->data >> 32) & 0x03;
+    struct uring_op *op = &u->fds[fd].ops[kind];
+    const char *buf = NULL;
+    int fired = 0;
+    if (c->flags & IORING_CQE_F_BUFFER)
+        buf = u->bufs +
+            (size_t) (c->flags >> IORING_CQE_BUFFER_SHIFT) * EV_URING_BUFSIZE;
+    /* Removed by a callback run before in the same cycle */
+    if (c->data != uring_data(u, fd, kind))
+        goto exit;
+    ev_io_callback callback = op->callback;
+    void *data = op->data;
+    if (kind == URING_RECV && c->res == -ENOBUFS) {
+        uring_recv(u, fd, callback, data);
+        goto exit;
+    }
+    if (op->opcode == IORING_OP_ACCEPT) {
+        if (c->res == -EINVAL && u->multishot) {
+            u->multishot = 0;
+            uring_accept(u, fd, callback, data);
+            goto exit;
+        }
+        if (!op->armed)
+            uring_accept(u, fd, callback, data);
+    }
+    callback(ctx, data, c->res, buf);
+    fired = 1;
+
+exit:
+
+    if (buf)
+        uring_provide(u, c->flags >> IORING_CQE_BUFFER_SHIFT, 1);
+    return fired;
+}
+
+#endif // IO_URING
+
 static void ev_api_init(ev_context *ctx, int events_nr) {
     struct epoll_api *e_api = malloc(sizeof(*e_api));
     e_api->fd = epoll_create1(0);
     e_api->events = calloc(events_nr, sizeof(struct epoll_event));
+#if defined(IO_URING)
+    e_api->ready = 0;
+    e_api->ring = uring_setup(events_nr);
+    if (!e_api->ring)
+        fprintf(stderr, "io_uring unavailable (%s), running on epoll\n",
+                strerror(errno));
+#endif
     ctx->api = e_api;
     ctx->maxfd = events_nr;
 }
 
 static void ev_api_destroy(ev_context *ctx) {
+#if defined(IO_URING)
+    if (((struct epoll_api *) ctx->api)->ring)
+        uring_destroy(((struct epoll_api *) ctx->api)->ring);
+#endif
     close(((struct epoll_api *) ctx->api)->fd);
     free(((struct epoll_api *) ctx->api)->events);
     free(ctx->api);
@@ -338,6 +850,10 @@ static void ev_api_destroy(ev_context *ctx) {
 
 static int ev_api_get_event_type(ev_context *ctx, int idx) {
     struct epoll_api *e_api = ctx->api;
+#if defined(IO_URING)
+    if (idx >= e_api->ready)
+        return EV_COMPLETION;
+#endif
     int events = e_api->events[idx].events;
     int ev_mask = ctx->events_monitored[e_api->events[idx].data.fd].mask;
     // We want to remember the previous events only if they're not of type
@@ -349,9 +865,63 @@ static int ev_api_get_event_type(ev_context *ctx, int idx) {
     return mask;
 }
 
+#if defined(IO_URING)
+
+/*
+ * Submit the requests queued and wait for completions with a single syscall,
+ * the epoll descriptor being one of them, then collect its events if ready.
+ * Epoll events come first, the completions follow
+ */
+static int uring_poll(ev_context *ctx, time_t timeout) {
+    struct epoll_api *e_api = ctx->api;
+    struct ev_uring *u = e_api->ring;
+    e_api->ready = 0;
+    if (!u->epoll_armed) {
+        struct io_uring_sqe *sqe = uring_sqe(u);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = e_api->fd;
+        uring_poll32(sqe, POLLIN);
+        sqe->user_data = URING_EPOLL;
+        u->epoll_armed = 1;
+    }
+    int n = 0;
+    if (timeout > 0) {
+        struct __kernel_timespec ts = {
+            .tv_sec = timeout / 1000,
+            .tv_nsec = (timeout % 1000) * 1000000
+        };
+        struct io_uring_getevents_arg arg = {
+            .ts = (unsigned long long) (uintptr_t) &ts
+        };
+        n = uring_enter(u, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+                        &arg, sizeof(arg));
+    } else {
+        n = uring_enter(u, timeout == 0 ? 0 : 1, IORING_ENTER_GETEVENTS,
+                        NULL, 0);
+    }
+    if (n < 0 && errno != ETIME)
+        return -1;
+    int ready = uring_reap(ctx, u);
+    if (ready && u->done_nr < ctx->events_nr) {
+        n = epoll_wait(e_api->fd, e_api->events,
+                       ctx->events_nr - u->done_nr, 0);
+        e_api->ready = n > 0 ? n : 0;
+    }
+    return e_api->ready + u->done_nr;
+}
+
+#endif // IO_URING
+
 static int ev_api_poll(ev_context *ctx, time_t timeout) {
     struct epoll_api *e_api = ctx->api;
+#if defined(IO_URING)
+    if (e_api->ring)
+        return uring_poll(ctx, timeout);
+    return e_api->ready =
+        epoll_wait(e_api->fd, e_api->events, ctx->events_nr, timeout);
+#else
     return epoll_wait(e_api->fd, e_api->events, ctx->events_nr, timeout);
+#endif
 }
 
 static int ev_api_watch_fd(ev_context *ctx, int fd) {
@@ -361,6 +931,10 @@ static int ev_api_watch_fd(ev_context *ctx, int fd) {
 
 static int ev_api_del_fd(ev_context *ctx, int fd) {
     struct epoll_api *e_api = ctx->api;
+#if defined(IO_URING)
+    if (e_api->ring)
+        uring_forget(e_api->ring, fd);
+#endif
     return epoll_del(e_api->fd, fd);
 }
 
@@ -806,6 +1380,13 @@ static void ev_stop_callback(ev_context *ctx, void *arg) {
  */
 static int ev_process_event(ev_context *ctx, int idx, int mask) {
     if (mask == EV_NONE) return EV_OK;
+#if defined(IO_URING)
+    if (mask & EV_COMPLETION) {
+        struct epoll_api *e_api = ctx->api;
+        return uring_complete(e_api->ring, ctx,
+                              &e_api->ring->done[idx - e_api->ready]);
+    }
+#endif
     struct ev *e = ev_api_fetch_event(ctx, idx, mask);
     int err = 0, fired = 0, fd = e->fd;
     if (mask & EV_CLOSEFD) {
@@ -912,6 +1493,8 @@ void ev_init(ev_context *ctx, int events_nr) {
     ctx->maxevents = events_nr;
     ctx->events_nr = events_nr;
     ctx->events_monitored = calloc(events_nr, sizeof(struct ev));
+    ctx->on_cycle = NULL;
+    ctx->cycle_data = NULL;
 }
 
 int ev_is_running(const ev_context *ctx) {
@@ -942,8 +1525,16 @@ int ev_poll(ev_context *ctx, time_t timeout) {
  * Blocks forever in a loop polling for events with ev_poll calls. At every
  * cycle executes callbacks registered with each event
  */
+/* Monotonic clock in nanoseconds, to time the loop cycles */
+static inline long long ev_clock(void) {
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * 1000000000LL + tv.tv_nsec;
+}
+
 int ev_run(ev_context *ctx) {
     int n = 0, events = 0;
+    long long start = 0;
     /*
      * Start an infinite loop, can be stopped only by scheduling an ev_stop
      * callback or if an error on the underlying backend occur
@@ -962,10 +1553,14 @@ int ev_run(ev_context *ctx) {
             /* Error occured, break the loop */
             break;
         }
+        if (ctx->on_cycle && n > 0)
+            start = ev_clock();
         for (int i = 0; i < n; ++i) {
             events = ev_get_event_type(ctx, i);
             ctx->fired_events += ev_process_event(ctx, i, events);
         }
+        if (ctx->on_cycle && n > 0)
+            ctx->on_cycle(ctx, ev_clock() - start, ctx->cycle_data);
     }
     return n;
 }
@@ -979,6 +1574,13 @@ void ev_stop(ev_context *ctx) {
     ctx->stop = 1;
 }
 
+void ev_set_on_cycle(ev_context *ctx,
+                     void (*on_cycle)(ev_context *, long long, void *),
+                     void *data) {
+    ctx->on_cycle = on_cycle;
+    ctx->cycle_data = data;
+}
+
 /*
  * Add a single FD to the underlying backend of the event loop. Equal to
  * ev_fire_event just without an event to be carried. Useful to add simple
@@ -1102,6 +1704,76 @@ int ev_fire_event(ev_context *ctx, int fd, int mask,
     return EV_OK;
 }
 
+#if defined(IO_URING)
+
+int ev_completions(const ev_context *ctx) {
+    return ((struct epoll_api *) ctx->api)->ring != NULL;
+}
+
+/*
+ * Descriptors served by completions aren't registered to epoll, they're just
+ * tracked as monitored without events, till removed by ev_del_fd
+ */
+static struct ev_uring *ev_uring(ev_context *ctx, int fd) {
+    struct ev_uring *u = ((struct epoll_api *) ctx->api)->ring;
+    if (!u || fd < 0)
+        return NULL;
+    ev_add_monitored(ctx, fd, EV_NONE, NULL, NULL);
+    return u;
+}
+
+int ev_submit_accept(ev_context *ctx, int fd,
+                     ev_io_callback callback, void *data) {
+    struct ev_uring *u = ev_uring(ctx, fd);
+    if (!u)
+        return EV_ERR;
+    uring_accept(u, fd, callback, data);
+    return EV_OK;
+}
+
+int ev_submit_recv(ev_context *ctx, int fd,
+                   ev_io_callback callback, void *data) {
+    struct ev_uring *u = ev_uring(ctx, fd);
+    if (!u)
+        return EV_ERR;
+    uring_recv(u, fd, callback, data);
+    return EV_OK;
+}
+
+int ev_submit_sendmsg(ev_context *ctx, int fd, const struct msghdr *msg,
+                      ev_io_callback callback, void *data) {
+    struct ev_uring *u = ev_uring(ctx, fd);
+    if (!u)
+        return EV_ERR;
+    struct io_uring_sqe *sqe =
+        uring_submit(u, fd, URING_SEND, IORING_OP_SENDMSG, callback, data);
+    sqe->addr = (unsigned long long) (uintptr_t) msg;
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    return EV_OK;
+}
+
+int ev_submit_nop(ev_context *ctx, int fd,
+                  ev_io_callback callback, void *data) {
+    struct ev_uring *u = ev_uring(ctx, fd);
+    if (!u)
+        return EV_ERR;
+    struct io_uring_sqe *sqe =
+        uring_submit(u, fd, URING_AUX, IORING_OP_NOP, callback, data);
+    sqe->fd = -1;
+    return EV_OK;
+}
+
+int ev_cancel(ev_context *ctx, int fd) {
+    struct ev_uring *u = ((struct epoll_api *) ctx->api)->ring;
+    if (!u)
+        return EV_ERR;
+    uring_cancel(u, fd);
+    return EV_OK;
+}
+
+#endif // IO_URING
+
 #endif // EV_SOURCE_ONCE
 #endif // EV_SOURCE
 
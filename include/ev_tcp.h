@@ -31,6 +31,7 @@
 #include <netdb.h>
 #include <fcntl.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #ifdef HAVE_OPENSSL
 #include <openssl/ssl.h>
@@ -69,7 +70,31 @@
  */
 #define EV_TCP_BUFSIZE           2048
 
+/*
+ * Size past which a buffer of a list isn't grown anymore, the bytes following
+ * go to a new one, and maximum number of buffers per gather write
+ */
+#define EV_TCP_SEGMENT_SIZE      65536
+#define EV_TCP_IOV_MAX           64
+
+#if defined(IO_URING)
+
+/*
+ * State of a handle served by completions, the operations in flight, the
+ * bytes received while writing, held till it's over, the peer gone and the
+ * close requested
+ */
+#define EV_TCP_IO_RECV           0x01
+#define EV_TCP_IO_SEND           0x02
+#define EV_TCP_IO_NOP            0x04
+#define EV_TCP_IO_HELD           0x08
+#define EV_TCP_IO_EOF            0x10
+#define EV_TCP_IO_CLOSING        0x20
+
+#endif
+
 typedef struct ev_buf ev_buf;
+typedef struct ev_buf_list ev_buf_list;
 typedef struct ev_connection ev_connection;
 typedef struct ev_tcp_server ev_tcp_server;
 typedef struct ev_tcp_handle ev_tcp_handle;
@@ -113,6 +138,21 @@ struct ev_buf {
     char *buf;
 };
 
+/*
+ * List of buffers written out in order by a single gather write, `size` is
+ * the total of bytes pending, `head` and `offset` track the first buffer not
+ * entirely written out yet. Buffers past `len` are kept up to `capacity` to be
+ * reused once the list is reset
+ */
+struct ev_buf_list {
+    size_t len;
+    size_t capacity;
+    size_t size;
+    size_t head;
+    size_t offset;
+    ev_buf *bufs;
+};
+
 /*
  * Connection abstraction, as of now it's pretty self-explanatory, it is
  * composed of the file descriptor for socket and 3 main callbacks:
@@ -171,8 +211,15 @@ struct ev_tls_options {
  * General wrapper around a connection, it is comprised of a buffer, a pointer
  * to the ev_context that must be set on creation, two optionally sentinels
  * for the read/write queue and an err reporting field.
+ * An output list of buffers can be set, in which case writes send it in place
+ * of the buffer, leaving that to the incoming bytes.
  * Two fieds are added if TLS is enabled, ssl, a flag indicating it's
  * abilitation and a pointer to an SSL_CTX to be used as the server context.
+ * On the io_uring backend plain connections are served by completions,
+ * `uring` set, `io` tracks their state and the message sent carries the
+ * buffers written out. The incoming bytes are copied to the buffer as they
+ * come, so it can be handled and moved at will; the ones being written out
+ * are to be left untouched till on_send, as with readiness.
  */
 struct ev_tcp_handle {
     int err;
@@ -186,14 +233,23 @@ struct ev_tcp_handle {
 #endif
     ev_connection *c;
     ev_buf buffer;
+    ev_buf_list *out;
     ev_context *ctx;
+#if defined(IO_URING)
+    int uring;
+    int io;
+    struct msghdr msg;
+    struct iovec iov[EV_TCP_IOV_MAX];
+#endif
 };
 
 /*
  * Server abstraction, beside the handle storing the listening socket and
  * optionally some callbacks, it is composed of the backlog to be set on listen
  * system call, a running switch to be used to stop the server, host and port
- * to listen on.
+ * to listen on. Accepting through completions, `accepted` is the descriptor
+ * of the connection to be taken by the next ev_tcp_server_accept, -1 if
+ * none, the handle being the first member.
  */
 struct ev_tcp_server {
     ev_tcp_handle handle;
@@ -203,6 +259,9 @@ struct ev_tcp_server {
     int run[2];
 #endif
     int backlog;
+#if defined(IO_URING)
+    int accepted;
+#endif
 };
 
 /*
@@ -252,7 +311,9 @@ void ev_tcp_server_stop(ev_tcp_server *);
  * Accept the connection, requires a pointer to ev_tcp_client and a on_recv
  * callback, othersiwse it will return an err. Up to the user to manage the
  * ownership of the client, tough generally it's advisable to allocate it on
- * the heap to being able to juggle it around other callbacks
+ * the heap to being able to juggle it around other callbacks. A client handle
+ * recycled from a closed connection keeps its buffer, a new one must have it
+ * zeroed
  */
 int ev_tcp_server_accept(ev_tcp_handle *, ev_tcp_handle *,
                          recv_callback, send_callback);
@@ -288,16 +349,35 @@ ssize_t ev_tcp_read(ev_tcp_handle *);
  * Write the content of the client buffer to the connected client FD and reset
  * the client buffer length to according to the numeber of bytes sent out.
  * Apply decryption algorithms to the plain data on the buffer just before
- * sending it out through TCP
+ * sending it out through TCP. With an output list set, its buffers are sent
+ * instead, by a single writev for plain connections
  */
 ssize_t ev_tcp_write(ev_tcp_handle *);
 
 /*
  * Close a connection by removing the client FD from the underlying ev_context
- * and closing it, free all resources allocated
+ * and closing it, free all resources allocated. With an on_close callback set,
+ * the buffer is left to it, to be released or reused along with the handle
  */
 void ev_tcp_close_handle(ev_tcp_handle *);
 
+/*
+ * Return a buffer of the list with room for at least `len` bytes, the last
+ * one is grown up to EV_TCP_SEGMENT_SIZE, past that the next one is used.
+ * The bytes written there are to be accounted on both the buffer and the list
+ */
+ev_buf *ev_buf_list_reserve(ev_buf_list *, size_t);
+
+/*
+ * Empty the list, its buffers are kept allocated to be reused
+ */
+void ev_buf_list_reset(ev_buf_list *);
+
+/*
+ * Release all the buffers of the list
+ */
+void ev_buf_list_free(ev_buf_list *);
+
 /*
  * Just a simple helper function to retrieve a text explanation of the common
  * errors returned by the helper APIs
@@ -383,6 +463,11 @@ close:
     ev_tcp_enqueue_close(handle);
 }
 
+/* Bytes still to be written out, either the buffer or the output list */
+static inline size_t ev_tcp_pending(const ev_tcp_handle *handle) {
+    return handle->out ? handle->out->size : handle->buffer.size;
+}
+
 static void ev_on_send(ev_context *ctx, void *data) {
     (void) ctx;
     ev_tcp_handle *handle = data;
@@ -392,13 +477,19 @@ static void ev_on_send(ev_context *ctx, void *data) {
      * for a write on the next loop cycle, hopefully the kernel will be
      * available to send remaining data
      */
-    if (handle->buffer.size > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    if (ev_tcp_pending(handle) > 0
+        && (errno == EAGAIN || errno == EWOULDBLOCK)) {
         ev_tcp_enqueue_write(handle);
     } else {
+        handle->to_write = 0;
         if (handle->c->on_send)
             handle->c->on_send(handle);
-        handle->to_write = 0;
-        ev_tcp_enqueue_read(handle);
+        /*
+         * Go back reading unless the on_send callback enqueued a new write,
+         * e.g. to stream out a response in multiple rounds
+         */
+        if (handle->to_write == 0)
+            ev_tcp_enqueue_read(handle);
     }
 }
 
@@ -413,6 +504,221 @@ static void ev_server_on_stop(ev_context *ctx, void *data) {
     ctx->stop = 1;
 }
 
+#if defined(IO_URING)
+
+/*
+ * =======================================================
+ *  Completion callbacks, for the handles served by them
+ * =======================================================
+ *
+ * A receive is kept in flight while a connection isn't writing, the bytes it
+ * brings are appended to the buffer and handed to on_recv, or held till the
+ * write is over, the next receive submitted only then, so a client not
+ * reading its responses stops being read as with readiness. A close waits
+ * for the operations still in flight, cancelled, so the buffers are
+ * released only once the kernel is done with them.
+ */
+
+static void ev_buf_list_consume(ev_buf_list *, size_t);
+
+static void ev_on_recvd(ev_context *, void *, int, const char *);
+static void ev_on_sent(ev_context *, void *, int, const char *);
+static void ev_on_nop(ev_context *, void *, int, const char *);
+
+static void ev_tcp_uring_recv(ev_tcp_handle *handle) {
+    if (handle->io & (EV_TCP_IO_RECV | EV_TCP_IO_CLOSING))
+        return;
+    if (ev_submit_recv(handle->ctx, handle->c->fd,
+                       ev_on_recvd, handle) == EV_OK)
+        handle->io |= EV_TCP_IO_RECV;
+}
+
+/* Gather the bytes pending, either the output list or the buffer */
+static int ev_tcp_uring_send(ev_tcp_handle *handle) {
+    ev_buf_list *out = handle->out;
+    int iovcnt = 0;
+    if (handle->io & (EV_TCP_IO_SEND | EV_TCP_IO_CLOSING))
+        return EV_OK;
+    if (out) {
+        for (size_t i = out->head; i < out->len && iovcnt < EV_TCP_IOV_MAX;
+             ++i) {
+            size_t skip = i == out->head ? out->offset : 0;
+            handle->iov[iovcnt].iov_base = out->bufs[i].buf + skip;
+            handle->iov[iovcnt++].iov_len = out->bufs[i].size - skip;
+        }
+    } else if (handle->buffer.size > 0) {
+        handle->iov[0].iov_base = handle->buffer.buf;
+        handle->iov[iovcnt++].iov_len = handle->buffer.size;
+    }
+    memset(&handle->msg, 0x00, sizeof(handle->msg));
+    handle->msg.msg_iov = handle->iov;
+    handle->msg.msg_iovlen = iovcnt;
+    if (ev_submit_sendmsg(handle->ctx, handle->c->fd, &handle->msg,
+                          ev_on_sent, handle) < 0)
+        return EV_ERR;
+    handle->io |= EV_TCP_IO_SEND;
+    return EV_OK;
+}
+
+static void ev_tcp_uring_close(ev_tcp_handle *handle) {
+    if (handle->io & EV_TCP_IO_CLOSING)
+        return;
+    handle->io |= EV_TCP_IO_CLOSING;
+    if (handle->io & (EV_TCP_IO_RECV | EV_TCP_IO_SEND))
+        ev_cancel(handle->ctx, handle->c->fd);
+    else if (ev_submit_nop(handle->ctx, handle->c->fd,
+                           ev_on_nop, handle) == EV_OK)
+        handle->io |= EV_TCP_IO_NOP;
+}
+
+/*
+ * Close a handle whose close was requested once the last operation in
+ * flight is over, return 1 if it was requested, nothing else is to be done
+ */
+static int ev_tcp_uring_drained(ev_tcp_handle *handle) {
+    if (!(handle->io & EV_TCP_IO_CLOSING))
+        return 0;
+    if (!(handle->io & (EV_TCP_IO_RECV | EV_TCP_IO_SEND | EV_TCP_IO_NOP)))
+        ev_tcp_close_handle(handle);
+    return 1;
+}
+
+/* Hand the bytes received to on_recv, then go on receiving if not writing */
+static void ev_tcp_uring_deliver(ev_tcp_handle *handle) {
+    handle->err = handle->buffer.size;
+    handle->c->on_recv(handle);
+    if (handle->to_write == 0)
+        ev_tcp_uring_recv(handle);
+}
+
+static void ev_on_recvd(ev_context *ctx, void *data, int res,
+                        const char *buf) {
+    (void) ctx;
+    ev_tcp_handle *handle = data;
+    handle->io &= ~EV_TCP_IO_RECV;
+    if (ev_tcp_uring_drained(handle))
+        return;
+    /* 0 bytes read means disconnection by the client */
+    if (res <= 0) {
+        handle->err = res < 0 ? EV_TCP_FAILURE : EV_TCP_SUCCESS;
+        if (res < 0)
+            errno = -res;
+        if (handle->to_write > 0)
+            handle->io |= EV_TCP_IO_EOF;
+        else
+            ev_tcp_uring_close(handle);
+        return;
+    }
+    /* A byte is always left spare, as ev_tcp_read does */
+    size_t capacity = handle->buffer.capacity;
+    while (handle->buffer.capacity - handle->buffer.size <= (size_t) res)
+        handle->buffer.capacity *= 2;
+    if (handle->buffer.capacity != capacity)
+        handle->buffer.buf =
+            realloc(handle->buffer.buf, handle->buffer.capacity);
+    memcpy(handle->buffer.buf + handle->buffer.size, buf, res);
+    handle->buffer.size += res;
+    if (handle->to_write > 0)
+        handle->io |= EV_TCP_IO_HELD;
+    else
+        ev_tcp_uring_deliver(handle);
+}
+
+static void ev_on_sent(ev_context *ctx, void *data, int res,
+                       const char *buf) {
+    (void) ctx;
+    (void) buf;
+    ev_tcp_handle *handle = data;
+    handle->io &= ~EV_TCP_IO_SEND;
+    if (ev_tcp_uring_drained(handle))
+        return;
+    if (res < 0) {
+        errno = -res;
+        handle->err = EV_TCP_FAILURE;
+        ev_tcp_uring_close(handle);
+        return;
+    }
+    if (handle->out) {
+        ev_buf_list_consume(handle->out, res);
+    } else {
+        handle->buffer.size -= res;
+        memmove(handle->buffer.buf, handle->buffer.buf + res,
+                handle->buffer.size);
+    }
+    handle->err = res;
+    /* Partially written out, the rest goes right away */
+    if (ev_tcp_pending(handle) > 0) {
+        if (ev_tcp_uring_send(handle) < 0)
+            ev_tcp_uring_close(handle);
+        return;
+    }
+    handle->to_write = 0;
+    if (handle->c->on_send)
+        handle->c->on_send(handle);
+    /*
+     * Go back reading unless the on_send callback enqueued a new write,
+     * e.g. to stream out a response in multiple rounds, handing over first
+     * what came in the meanwhile
+     */
+    if (handle->to_write > 0 || (handle->io & EV_TCP_IO_CLOSING))
+        return;
+    if (handle->io & EV_TCP_IO_HELD) {
+        handle->io &= ~EV_TCP_IO_HELD;
+        handle->err = handle->buffer.size;
+        handle->c->on_recv(handle);
+        if (handle->to_write > 0 || (handle->io & EV_TCP_IO_CLOSING))
+            return;
+    }
+    if (handle->io & EV_TCP_IO_EOF)
+        ev_tcp_uring_close(handle);
+    else
+        ev_tcp_uring_recv(handle);
+}
+
+static void ev_on_nop(ev_context *ctx, void *data, int res,
+                      const char *buf) {
+    (void) ctx;
+    (void) res;
+    (void) buf;
+    ev_tcp_handle *handle = data;
+    handle->io &= ~EV_TCP_IO_NOP;
+    ev_tcp_uring_drained(handle);
+}
+
+/*
+ * Every accepted connection is handed to on_conn, to be taken by
+ * ev_tcp_server_accept, closed if it's not
+ */
+static void ev_on_accepted(ev_context *ctx, void *data, int res,
+                           const char *buf) {
+    (void) ctx;
+    (void) buf;
+    ev_tcp_server *server = data;
+    server->accepted = res;
+    server->handle.c->on_conn(&server->handle);
+    if (server->accepted >= 0)
+        close(server->accepted);
+    server->accepted = -1;
+}
+
+#endif // IO_URING
+
+/*
+ * Watch the listening socket of a server, accepting through completions
+ * when the loop supports them
+ */
+static int ev_tcp_server_watch(ev_tcp_server *server) {
+#if defined(IO_URING)
+    if (ev_completions(server->handle.ctx)) {
+        server->accepted = -1;
+        return ev_submit_accept(server->handle.ctx, server->handle.c->fd,
+                                ev_on_accepted, server);
+    }
+#endif
+    return ev_register_event(server->handle.ctx, server->handle.c->fd,
+                             EV_READ, ev_on_accept, server);
+}
+
 static ev_connection *ev_connection_new(int fd) {
     ev_connection *conn = malloc(sizeof(*conn));
     conn->fd = fd;
@@ -446,12 +752,20 @@ static void ev_buf_init(ev_buf *buf, size_t capacity) {
 }
 
 /*
- * init a fresh new tcp_handle which can be used as a server or a client
+ * init a fresh new tcp_handle which can be used as a server or a client, a
+ * recycled one keeps its buffer, whatever capacity it has grown to
  */
 static void ev_tcp_handle_init(ev_tcp_handle *handle, int fd) {
     handle->c = ev_connection_new(fd);
-    ev_buf_init(&handle->buffer, EV_TCP_BUFSIZE);
+    if (handle->buffer.buf)
+        handle->buffer.size = 0;
+    else
+        ev_buf_init(&handle->buffer, EV_TCP_BUFSIZE);
+    handle->out = NULL;
     handle->to_read = handle->to_write = 0;
+#if defined(IO_URING)
+    handle->uring = handle->io = 0;
+#endif
 }
 
 #ifdef HAVE_OPENSSL
@@ -571,9 +885,16 @@ static SSL *ssl_accept(SSL_CTX *ctx, int fd) {
 
 static void ev_tls_tcp_handle_init(ev_tcp_handle *handle, int fd, SSL *ssl) {
     handle->c = ev_tls_connection_new(fd, ssl);
-    ev_buf_init(&handle->buffer, EV_TCP_BUFSIZE);
+    if (handle->buffer.buf)
+        handle->buffer.size = 0;
+    else
+        ev_buf_init(&handle->buffer, EV_TCP_BUFSIZE);
+    handle->out = NULL;
     handle->ssl = 1;
     handle->to_read = handle->to_write = 0;
+#if defined(IO_URING)
+    handle->uring = handle->io = 0;
+#endif
 }
 
 #endif // HAVE_OPENSSL
@@ -639,8 +960,7 @@ int ev_tcp_server_listen_unix(ev_tcp_server *server, const char *socketpath,
     server->handle.c->on_conn = on_connection;
 
     // Register to service callback
-    ev_register_event(server->handle.ctx, server->handle.c->fd,
-                      EV_READ, ev_on_accept, server);
+    ev_tcp_server_watch(server);
 
     return EV_TCP_SUCCESS;
 err:
@@ -677,6 +997,16 @@ int ev_tcp_server_listen(ev_tcp_server *server, const char *host,
                        &(int) { 1 }, sizeof(int)) < 0)
             goto err;
 
+#ifdef SO_REUSEPORT
+        /*
+         * Allow multiple listening sockets on the same port, one per event
+         * loop, the kernel balances incoming connections among them
+         */
+        if (setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT,
+                       &(int) { 1 }, sizeof(int)) < 0)
+            goto err;
+#endif
+
         /* Bind it to the addr:port opened on the network interface */
         if (bind(listen_fd, rp->ai_addr, rp->ai_addrlen) == 0)
             break; // Succesful bind
@@ -703,8 +1033,7 @@ int ev_tcp_server_listen(ev_tcp_server *server, const char *host,
     server->handle.c->on_conn = on_connection;
 
     // Register to service callback
-    ev_register_event(server->handle.ctx, server->handle.c->fd,
-                      EV_READ, ev_on_accept, server);
+    ev_tcp_server_watch(server);
 
     return EV_TCP_SUCCESS;
 err:
@@ -741,42 +1070,78 @@ int ev_tcp_server_accept(ev_tcp_handle *server, ev_tcp_handle *client,
                          recv_callback on_data, send_callback on_send) {
     if (!on_data)
         return EV_TCP_MISSING_CALLBACK;
-    while (1) {
-        struct sockaddr_in addr;
-        int fd = ev_accept(server->c->fd, &addr);
-        if (fd < 0)
-            break;
-        if (fd == 0)
-            continue;
-
-        // XXX placeholder
+    /*
+     * Accept a single connection per call, as the caller provides a single
+     * handle; the listening socket is level triggered so the loop fires again
+     * while there's more connections pending
+     */
+    struct sockaddr_in addr;
+    int fd = -1;
+#if defined(IO_URING)
+    if (ev_completions(server->ctx)) {
+        ev_tcp_server *s = (ev_tcp_server *) server;
+        socklen_t addrlen = sizeof(addr);
+        fd = s->accepted;
+        s->accepted = -1;
+        if (fd < 0) {
+            errno = -fd;
+            return EV_TCP_FAILURE;
+        }
+        memset(&addr, 0x00, sizeof(addr));
+        (void) getpeername(fd, (struct sockaddr *) &addr, &addrlen);
+    } else {
+        fd = ev_accept(server->c->fd, &addr);
+    }
+#else
+    fd = ev_accept(server->c->fd, &addr);
+#endif
+    if (fd <= 0)
+        return EV_TCP_FAILURE;
+
+    // XXX placeholder
 #ifdef HAVE_OPENSSL
-        if (server->ssl == 1) {
-            ev_tls_tcp_handle_init(client, fd, ssl_accept(server->ssl_ctx, fd));
-        } else {
+    if (server->ssl == 1) {
+        ev_tls_tcp_handle_init(client, fd, ssl_accept(server->ssl_ctx, fd));
+    } else {
 #endif
-            ev_tcp_handle_init(client, fd);
+        ev_tcp_handle_init(client, fd);
 #ifdef HAVE_OPENSSL
-        }
+    }
 #endif
-        inet_ntop(AF_INET, &addr.sin_addr, client->addr, sizeof(server->addr));
-        client->port = ntohs(addr.sin_port);
+    inet_ntop(AF_INET, &addr.sin_addr, client->addr, sizeof(server->addr));
+    client->port = ntohs(addr.sin_port);
 
-        client->ctx = server->ctx;
-        int err = ev_register_event(server->ctx, fd,
-                                    EV_READ, ev_on_recv, client);
-        if (err < 0)
-            return EV_TCP_FAILURE;
-        client->c->on_recv = on_data;
-        client->c->on_send = on_send;
+    client->ctx = server->ctx;
+    client->c->on_recv = on_data;
+    client->c->on_send = on_send;
+#if defined(IO_URING)
+#ifdef HAVE_OPENSSL
+    client->uring = ev_completions(server->ctx) && client->ssl != 1;
+#else
+    client->uring = ev_completions(server->ctx);
+#endif
+    if (client->uring) {
+        ev_tcp_uring_recv(client);
+        return client->io & EV_TCP_IO_RECV ?
+            EV_TCP_SUCCESS : EV_TCP_FAILURE;
     }
+#endif
+    int err = ev_register_event(server->ctx, fd,
+                                EV_READ, ev_on_recv, client);
+    if (err < 0)
+        return EV_TCP_FAILURE;
     return EV_TCP_SUCCESS;
 }
 
 int ev_tcp_enqueue_write(ev_tcp_handle *client) {
     if (!client->c->on_send)
         return EV_TCP_MISSING_CALLBACK;
-    client->to_write = client->buffer.size;
+    client->to_write = ev_tcp_pending(client);
+#if defined(IO_URING)
+    if (client->uring)
+        return ev_tcp_uring_send(client) < 0 ?
+            EV_TCP_FAILURE : EV_TCP_SUCCESS;
+#endif
     int err = ev_fire_event(client->ctx, client->c->fd,
                             EV_WRITE, ev_on_send, client);
     if (err < 0)
@@ -787,6 +1152,12 @@ int ev_tcp_enqueue_write(ev_tcp_handle *client) {
 int ev_tcp_enqueue_read(ev_tcp_handle *client) {
     if (!client->c->on_recv)
         return EV_TCP_MISSING_CALLBACK;
+#if defined(IO_URING)
+    if (client->uring) {
+        ev_tcp_uring_recv(client);
+        return EV_TCP_SUCCESS;
+    }
+#endif
     int err = ev_fire_event(client->ctx, client->c->fd,
                             EV_READ, ev_on_recv, client);
     if (err < 0)
@@ -795,6 +1166,12 @@ int ev_tcp_enqueue_read(ev_tcp_handle *client) {
 }
 
 int ev_tcp_enqueue_close(ev_tcp_handle *client) {
+#if defined(IO_URING)
+    if (client->uring) {
+        ev_tcp_uring_close(client);
+        return EV_TCP_SUCCESS;
+    }
+#endif
     return ev_fire_event(client->ctx, client->c->fd, EV_WRITE, ev_on_close, client);
 }
 
@@ -843,10 +1220,12 @@ ssize_t ev_tcp_read(ev_tcp_handle *client) {
 
     } else {
 #endif
-        size_t size = client->to_read > 0 ? client->to_read : client->buffer.capacity;
+        size_t size = 0;
         ssize_t n = 0;
         /* Read incoming stream of bytes */
         do {
+            /* The buffer could have been grown on the previous read */
+            size = client->to_read > 0 ? client->to_read : client->buffer.capacity;
             n = read(client->c->fd, client->buffer.buf + client->buffer.size,
                      size - client->buffer.size);
             if (n < 0) {
@@ -874,7 +1253,86 @@ ssize_t ev_tcp_read(ev_tcp_handle *client) {
 #endif
 }
 
+/*
+ * Move the head of the list forward by `n` bytes written out
+ */
+static void ev_buf_list_consume(ev_buf_list *list, size_t n) {
+    list->size -= n;
+    while (n > 0) {
+        size_t left = list->bufs[list->head].size - list->offset;
+        if (n < left) {
+            list->offset += n;
+            return;
+        }
+        n -= left;
+        list->head++;
+        list->offset = 0;
+    }
+}
+
+/*
+ * Write out the output list of a client, the pending buffers are gathered in
+ * a single writev, EV_TCP_IOV_MAX at a time
+ */
+static ssize_t ev_tcp_writev(ev_tcp_handle *client) {
+    ev_buf_list *out = client->out;
+    struct iovec iov[EV_TCP_IOV_MAX];
+    ssize_t n = 0, wrote = 0;
+#ifdef HAVE_OPENSSL
+    if (client->ssl == 1) {
+        SSL *ssl = ((ev_tls_connection *) client->c)->ssl;
+        ERR_clear_error();
+        while (out->size > 0) {
+            ev_buf *buf = &out->bufs[out->head];
+            if (buf->size == 0) {
+                out->head++;
+                continue;
+            }
+            n = SSL_write(ssl, buf->buf + out->offset,
+                          buf->size - out->offset);
+            if (n <= 0) {
+                int err = SSL_get_error(ssl, n);
+                if (err == SSL_ERROR_WANT_WRITE)
+                    continue;
+                if (err == SSL_ERROR_ZERO_RETURN
+                    || (err == SSL_ERROR_SYSCALL && !errno))
+                    return EV_TCP_SUCCESS;  // Connection closed
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                fprintf(stderr, "SSL_write(2) - error sending data: %s\n",
+                        strerror(errno));
+                return EV_TCP_FAILURE;
+            }
+            ev_buf_list_consume(out, n);
+            wrote += n;
+        }
+        return wrote;
+    }
+#endif
+    while (out->size > 0) {
+        int iovcnt = 0;
+        for (size_t i = out->head; i < out->len && iovcnt < EV_TCP_IOV_MAX;
+             ++i) {
+            size_t skip = i == out->head ? out->offset : 0;
+            iov[iovcnt].iov_base = out->bufs[i].buf + skip;
+            iov[iovcnt++].iov_len = out->bufs[i].size - skip;
+        }
+        n = writev(client->c->fd, iov, iovcnt);
+        if (n == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            else
+                return n;
+        }
+        ev_buf_list_consume(out, n);
+        wrote += n;
+    }
+    return wrote;
+}
+
 ssize_t ev_tcp_write(ev_tcp_handle *client) {
+    if (client->out)
+        return ev_tcp_writev(client);
 #ifdef HAVE_OPENSSL
     if (client->ssl == 1) {
         size_t total = client->buffer.size;
@@ -884,7 +1342,8 @@ ssize_t ev_tcp_write(ev_tcp_handle *client) {
         ERR_clear_error();
 
         while (client->buffer.size > 0) {
-            if ((n = SSL_write(ssl, client->buffer.buf + n,
+            if ((n = SSL_write(ssl, client->buffer.buf +
+                               (total - client->buffer.size),
                                client->buffer.size)) <= 0) {
                 int err = SSL_get_error(ssl, n);
                 if (err == SSL_ERROR_WANT_WRITE || SSL_ERROR_NONE)
@@ -900,6 +1359,12 @@ ssize_t ev_tcp_write(ev_tcp_handle *client) {
             client->buffer.size -= n;
         }
 
+        /* Move what's left at the start, to be sent on the next cycle */
+        if (client->buffer.size > 0 && client->buffer.size < total)
+            memmove(client->buffer.buf,
+                    client->buffer.buf + (total - client->buffer.size),
+                    client->buffer.size);
+
         return total - client->buffer.size;
 
     err:
@@ -913,7 +1378,8 @@ ssize_t ev_tcp_write(ev_tcp_handle *client) {
 
         /* Let's reply to the client */
         while (client->buffer.size > 0) {
-            n = write(client->c->fd, client->buffer.buf + n, client->buffer.size);
+            n = write(client->c->fd, client->buffer.buf + wrote,
+                      client->buffer.size);
             if (n == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK)
                     break;
@@ -924,6 +1390,11 @@ ssize_t ev_tcp_write(ev_tcp_handle *client) {
             wrote += n;
         }
 
+        /* Move what's left at the start, to be sent on the next cycle */
+        if (client->buffer.size > 0 && wrote > 0)
+            memmove(client->buffer.buf, client->buffer.buf + wrote,
+                    client->buffer.size);
+
         return wrote;
 #ifdef HAVE_OPENSSL
     }
@@ -941,9 +1412,10 @@ void ev_tcp_close_handle(ev_tcp_handle *handle) {
     if (ssl_enabled == 1)
         ssl = ((ev_tls_connection *) handle->c)->ssl;
 #endif
+    close_callback on_close = handle->c->on_close;
     handle->err = handle->err > 0 ? EV_TCP_SUCCESS : handle->err;
-    if (handle->c->on_close)
-        handle->c->on_close(handle, handle->err);
+    if (on_close)
+        on_close(handle, handle->err);
 #ifdef HAVE_OPENSSL
     if (ssl_enabled == 1)
         SSL_free(ssl);
@@ -951,7 +1423,46 @@ void ev_tcp_close_handle(ev_tcp_handle *handle) {
     ev_del_fd(h_ctx, fd);
     close(fd);
     free(c);
-    free(buf);
+    if (!on_close)
+        free(buf);
+}
+
+ev_buf *ev_buf_list_reserve(ev_buf_list *list, size_t len) {
+    ev_buf *buf = list->len > 0 ? &list->bufs[list->len - 1] : NULL;
+    if (buf && buf->capacity - buf->size >= len)
+        return buf;
+    if (!buf || (buf->size > 0 && buf->size + len > EV_TCP_SEGMENT_SIZE)) {
+        if (list->len == list->capacity) {
+            list->capacity = list->capacity == 0 ? 4 : list->capacity * 2;
+            list->bufs = realloc(list->bufs,
+                                 list->capacity * sizeof(*list->bufs));
+            for (size_t i = list->len; i < list->capacity; ++i)
+                list->bufs[i] = (ev_buf) { 0, 0, NULL };
+        }
+        buf = &list->bufs[list->len++];
+        buf->size = 0;
+        if (buf->capacity == 0)
+            buf->capacity = list->len == 1 ? EV_TCP_BUFSIZE :
+                EV_TCP_SEGMENT_SIZE;
+    }
+    size_t capacity = buf->capacity;
+    while (buf->capacity - buf->size < len)
+        buf->capacity *= 2;
+    if (!buf->buf || buf->capacity != capacity)
+        buf->buf = realloc(buf->buf, buf->capacity);
+    return buf;
+}
+
+void ev_buf_list_reset(ev_buf_list *list) {
+    list->len = list->size = list->head = list->offset = 0;
+}
+
+void ev_buf_list_free(ev_buf_list *list) {
+    for (size_t i = 0; i < list->capacity; ++i)
+        free(list->bufs[i].buf);
+    free(list->bufs);
+    list->bufs = NULL;
+    list->len = list->capacity = list->size = list->head = list->offset = 0;
 }
 
 void ev_tcp_handle_set_on_close(ev_tcp_handle *h, close_callback on_close) {
@@ -31,16 +31,91 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 
 #define TTS_VECTOR_BASE_SIZE 4
 
+/*
+ * Past this size in bytes geometric vectors grow by half their capacity
+ * instead of doubling it, so huge columns don't end up with as much spare
+ * room as the items they hold
+ */
+#define TTS_VECTOR_LARGE_SIZE (64 * 1024 * 1024)
+
+/*
+ * Growth policies of the vectors:
+ *
+ * - TTS_VECTOR_GEOMETRIC doubles from TTS_VECTOR_BASE_SIZE items, by half
+ *   past TTS_VECTOR_LARGE_SIZE bytes, shrinking leaves room for as many
+ *   items as the vector holds
+ * - TTS_VECTOR_COMPACT grows by half from a single item and shrinks to fit,
+ *   for the plenty of tiny vectors, like the rows of a label value
+ *
+ * The policy is given to the macros growing and shrinking a vector, the
+ * `_POLICY` ones, rather than stored, taking no room in the tiny vectors it's
+ * meant for, so a vector must be always handled by the same one.
+ * Items are always contiguous, every vector is handed around as a plain
+ * array and read through its `data`, so growing reallocates it as a whole,
+ * which may copy every item: growing huge columns by half rather than
+ * doubling them keeps those copies, and the room left spare, bounded.
+ */
+enum tts_vector_policy { TTS_VECTOR_GEOMETRIC, TTS_VECTOR_COMPACT };
+
 #define TTS_VECTOR(T) struct { \
     size_t size;               \
     size_t capacity;           \
     T *data;                   \
 }
 
+/*
+ * Capacity for a vector of `capacity` items `size` bytes each to hold at
+ * least `n` of them, following `policy`
+ */
+static inline size_t tts_vector_grow(size_t capacity, size_t n, size_t size,
+                                     int policy) {
+    if (policy == TTS_VECTOR_COMPACT) {
+        if (capacity == 0)
+            capacity = 1;
+        while (capacity < n)
+            capacity += capacity / 2 + 1;
+        return capacity;
+    }
+    if (capacity == 0)
+        capacity = TTS_VECTOR_BASE_SIZE;
+    while (capacity < n) {
+        if (capacity * size < TTS_VECTOR_LARGE_SIZE)
+            capacity *= 2;
+        else
+            capacity += capacity / 2;
+    }
+    return capacity;
+}
+
+/*
+ * Capacity a vector of `size` items is shrunk to, following `policy`
+ */
+static inline size_t tts_vector_fit(size_t size, int policy) {
+    if (policy == TTS_VECTOR_COMPACT)
+        return size > 0 ? size : 1;
+    return size * 2 > TTS_VECTOR_BASE_SIZE ? size * 2 : TTS_VECTOR_BASE_SIZE;
+}
+
+/*
+ * Reallocate the items of a vector, failures can't be reported from within
+ * the macros, so running out of memory is fatal, as it is for the hash tables
+ */
+static inline void *tts_vector_realloc(void *data,
+                                       size_t capacity, size_t size) {
+    void *ptr = realloc(data, capacity * size);
+    if (!ptr) {
+        fprintf(stderr, "Out of memory resizing a vector to %zu bytes\n",
+                capacity * size);
+        abort();
+    }
+    return ptr;
+}
+
 #define TTS_VECTOR_INIT(vec, cap) do {                  \
     assert((cap) > 0);                                  \
     (vec).size = 0;                                     \
@@ -51,26 +126,84 @@
 #define TTS_VECTOR_NEW(vec) \
     TTS_VECTOR_INIT((vec), TTS_VECTOR_BASE_SIZE)
 
+/*
+ * Initialize a vector without allocating anything, the first append does,
+ * for the vectors likely to stay empty
+ */
+#define TTS_VECTOR_EMPTY(vec) do {          \
+    (vec).size = (vec).capacity = 0;        \
+    (vec).data = NULL;                      \
+} while (0)
+
 #define TTS_VECTOR_DESTROY(vec) free((vec).data)
 
 #define TTS_VECTOR_SIZE(vec) (vec).size
 
 #define TTS_VECTOR_CAPACITY(vec) (vec).capacity
 
-#define TTS_VECTOR_APPEND(vec, item) do {                               \
-    if (TTS_VECTOR_SIZE((vec)) + 1 == TTS_VECTOR_CAPACITY((vec))) {     \
-        (vec).capacity *= 2;                                            \
-        (vec).data = realloc((vec).data,                                \
-                             (vec).capacity * sizeof((vec).data[0]));   \
+/*
+ * Grow the capacity to hold at least `n` items
+ */
+#define TTS_VECTOR_RESERVE_POLICY(vec, n, policy) do {                  \
+    if (TTS_VECTOR_CAPACITY((vec)) < (n)) {                             \
+        (vec).capacity = tts_vector_grow((vec).capacity, (n),           \
+                                         sizeof((vec).data[0]),         \
+                                         (policy));                     \
+        (vec).data = tts_vector_realloc((vec).data, (vec).capacity,     \
+                                        sizeof((vec).data[0]));         \
     }                                                                   \
+} while (0)
+
+#define TTS_VECTOR_RESERVE(vec, n) \
+    TTS_VECTOR_RESERVE_POLICY((vec), (n), TTS_VECTOR_GEOMETRIC)
+
+#define TTS_VECTOR_APPEND_POLICY(vec, item, policy) do {                \
+    TTS_VECTOR_RESERVE_POLICY((vec), TTS_VECTOR_SIZE((vec)) + 1,        \
+                              (policy));                                \
     (vec).data[(vec).size++] = (item);                                  \
 } while (0)
 
-#define TTS_VECTOR_REMOVE(vec, index) do {                      \
-    assert((index) > 0 && (index) < TTS_VECTOR_SIZE((vec)));    \
-    memmove((vec).data + (index),                               \
-            (vec).data + (index) + 1, (vec).size - (index));    \
-    (vec).size--;                                               \
+#define TTS_VECTOR_APPEND(vec, item) \
+    TTS_VECTOR_APPEND_POLICY((vec), (item), TTS_VECTOR_GEOMETRIC)
+
+/*
+ * Append the `n` items of the array `items` at once, growing the capacity
+ * a single time for the whole batch
+ */
+#define TTS_VECTOR_APPEND_N_POLICY(vec, items, n, policy) do {          \
+    TTS_VECTOR_RESERVE_POLICY((vec), TTS_VECTOR_SIZE((vec)) + (n),      \
+                              (policy));                                \
+    memcpy((vec).data + (vec).size, (items),                            \
+           (n) * sizeof((vec).data[0]));                                \
+    (vec).size += (n);                                                  \
+} while (0)
+
+#define TTS_VECTOR_APPEND_N(vec, items, n) \
+    TTS_VECTOR_APPEND_N_POLICY((vec), (items), (n), TTS_VECTOR_GEOMETRIC)
+
+/*
+ * Release the spare room of a vector using less than a quarter of its
+ * capacity, down to the capacity its policy fits its size in. Meant to
+ * follow the trims.
+ */
+#define TTS_VECTOR_SHRINK_POLICY(vec, policy) do {                      \
+    size_t fit = tts_vector_fit(TTS_VECTOR_SIZE((vec)), (policy));      \
+    if (TTS_VECTOR_CAPACITY((vec)) > fit &&                             \
+        TTS_VECTOR_SIZE((vec)) < TTS_VECTOR_CAPACITY((vec)) / 4) {      \
+        (vec).capacity = fit;                                           \
+        (vec).data = tts_vector_realloc((vec).data, (vec).capacity,     \
+                                        sizeof((vec).data[0]));         \
+    }                                                                   \
+} while (0)
+
+#define TTS_VECTOR_SHRINK(vec) \
+    TTS_VECTOR_SHRINK_POLICY((vec), TTS_VECTOR_GEOMETRIC)
+
+#define TTS_VECTOR_REMOVE(vec, index) do {                          \
+    assert((index) < TTS_VECTOR_SIZE((vec)));                       \
+    memmove((vec).data + (index), (vec).data + (index) + 1,         \
+            ((vec).size - (index) - 1) * sizeof((vec).data[0]));    \
+    (vec).size--;                                                   \
 } while (0)
 
 #define TTS_VECTOR_REMOVE_PTR(vec, ptr) do {                \
@@ -80,7 +213,7 @@
             break;                                          \
         }                                                   \
     }                                                       \
-} while (0);
+} while (0)
 
 #define TTS_VECTOR_AT(vec, index) (vec).data[(index)]
 
@@ -88,9 +221,14 @@
 
 #define TTS_VECTOR_LAST(vec) TTS_VECTOR_AT((vec), TTS_VECTOR_SIZE((vec)) - 1)
 
-#define TTS_VECTOR_RESIZE(vec, start) do {                              \
-    memmove((vec).data, (vec).data + (start), (vec).size - (start));    \
-    (vec).size -= (start);                                              \
+/*
+ * Drop the first `start` items, moving the ones left to the front
+ */
+#define TTS_VECTOR_RESIZE(vec, start) do {                          \
+    assert((start) <= TTS_VECTOR_SIZE((vec)));                      \
+    memmove((vec).data, (vec).data + (start),                       \
+            ((vec).size - (start)) * sizeof((vec).data[0]));        \
+    (vec).size -= (start);                                          \
 } while (0)
 
 #define TTS_VECTOR_BINSEARCH(vec, target, res) do {          \
@@ -153,10 +153,28 @@ int64_t unpacki64(uint8_t *buf) {
 
 #define pack754_16(f) (pack754((f), 16, 8))
 #define pack754_32(f) (pack754((f), 32, 8))
-#define pack754_64(f) (pack754((f), 64, 11))
 #define unpack754_16(i) (unpack754((i), 16, 8))
 #define unpack754_32(i) (unpack754((i), 32, 8))
-#define unpack754_64(i) (unpack754((i), 64, 11))
+
+/*
+ * Fast path for 64 bits reals, the most common ones on the wire: a double is
+ * already an IEEE 754 binary64, its bit pattern is the encoding, no need to
+ * normalize it bit by bit. It also covers the subnormals, infinities and NaNs
+ */
+_Static_assert(sizeof(double) == sizeof(uint64_t), "double must be 64 bits");
+
+static inline uint64_t pack754_64(long double f) {
+    double d = f;
+    uint64_t i = 0;
+    memcpy(&i, &d, sizeof(i));
+    return i;
+}
+
+static inline long double unpack754_64(uint64_t i) {
+    double d = 0.0;
+    memcpy(&d, &i, sizeof(d));
+    return d;
+}
 
 uint64_t pack754(long double f, unsigned bits, unsigned expbits) {
     long double fnorm;
@@ -183,7 +201,7 @@ uint64_t pack754(long double f, unsigned bits, unsigned expbits) {
     exp = shift + ((1<<(expbits-1)) - 1); // shift + bias
 
     // return the final answer
-    return (sign<<(bits-1)) | (exp<<(bits-expbits-1)) | significand;
+    return ((uint64_t) sign << (bits-1)) | (exp<<(bits-expbits-1)) | significand;
 }
 
 long double unpack754(uint64_t i, unsigned bits, unsigned expbits) {
@@ -378,6 +396,63 @@ size_t unpack_bytes(uint8_t **buf, size_t len, uint8_t *dst) {
     return len;
 }
 
+/*
+ * Pack `len` bytes from `src` into the buffer, without any terminator, the
+ * counterpart of `unpack_bytes`, strings are prefixed by their length
+ */
+size_t pack_bytes(uint8_t **buf, const uint8_t *src, size_t len) {
+    memcpy(*buf, src, len);
+    *buf += len;
+    return len;
+}
+
+/*
+ * Pack an unsigned integer as a LEB128 varint, 7 bits per byte, least
+ * significant group first, the most significant bit of each byte set when
+ * another one follows; takes 1 to 10 bytes
+ */
+size_t pack_varint(uint8_t **buf, uint64_t val) {
+    size_t len = 0;
+    while (val >= 0x80) {
+        (*buf)[len++] = (uint8_t) (val | 0x80);
+        val >>= 7;
+    }
+    (*buf)[len++] = (uint8_t) val;
+    *buf += len;
+    return len;
+}
+
+/*
+ * Unpack a LEB128 varint, bytes past the 10th, which can't carry any bit of
+ * a 64 bit integer, end the integer anyway
+ */
+size_t unpack_varint(uint8_t **buf, uint64_t *val) {
+    size_t len = 0;
+    unsigned shift = 0;
+    *val = 0;
+    do {
+        if (shift < 64)
+            *val |= (uint64_t) ((*buf)[len] & 0x7F) << shift;
+        shift += 7;
+    } while (((*buf)[len++] & 0x80) && len < 10);
+    *buf += len;
+    return len;
+}
+
+/*
+ * Fixed-layout fast path of `unpack` for the "BQQgH" shape, the header of
+ * every result of a query, decoded without walking the format string
+ */
+uint64_t unpack_bqqgh(uint8_t *buf, uint8_t *B, uint64_t *Q1, uint64_t *Q2,
+                      long double *g, uint16_t *H) {
+    *B = buf[0];
+    *Q1 = unpacku64(buf + 1);
+    *Q2 = unpacku64(buf + 9);
+    *g = unpack754_64(unpacku64(buf + 17));
+    *H = unpacku16(buf + 33);
+    return 35;
+}
+
 /*
  * unpack() -- unpack data dictated by the format string into the buffer
  *
@@ -417,6 +492,16 @@ uint64_t unpack(uint8_t *buf, char *format, ...) {
 
     va_start(ap, format);
 
+    if (strcmp(format, "BQQgH") == 0) {
+        B = va_arg(ap, uint8_t *);
+        Q = va_arg(ap, uint64_t *);
+        uint64_t *Q2 = va_arg(ap, uint64_t *);
+        g = va_arg(ap, long double *);
+        H = va_arg(ap, uint16_t *);
+        va_end(ap);
+        return unpack_bqqgh(buf, B, Q, Q2, g, H);
+    }
+
     for(; *format != '\0'; format++) {
         switch(*format) {
             case 'b': // 8-bit
@@ -31,11 +31,20 @@
 #include <stdio.h>
 #include <stdint.h>
 
+void packi16(uint8_t *, uint16_t);
+void packi64(uint8_t *, uint64_t);
+uint16_t unpacku16(uint8_t *);
+uint64_t unpacku64(uint8_t *);
 size_t pack_integer(uint8_t **, int8_t, int64_t);
 size_t pack_real(uint8_t **, int8_t, long double);
 size_t unpack_integer(uint8_t **, int8_t, int64_t *);
 size_t unpack_real(uint8_t **, int8_t, long double *);
 size_t unpack_bytes(uint8_t **, size_t, uint8_t *);
+size_t pack_bytes(uint8_t **, const uint8_t *, size_t);
+size_t pack_varint(uint8_t **, uint64_t);
+size_t unpack_varint(uint8_t **, uint64_t *);
+uint64_t unpack_bqqgh(uint8_t *, uint8_t *, uint64_t *, uint64_t *,
+                      long double *, uint16_t *);
 uint64_t unpack(uint8_t *, char *, ...);
 uint64_t pack(uint8_t *, char *, ...);
 
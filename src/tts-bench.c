@@ -0,0 +1,903 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "pack.h"
+#include "tts.h"
+#include "tts_arena.h"
+#include "tts_async.h"
+#include "tts_client.h"
+#include "tts_config.h"
+#include "tts_kernel.h"
+#include "tts_protocol.h"
+#include "tts_aggregate.h"
+
+#define LOCALHOST    "127.0.0.1"
+#define DEFAULT_PORT 19191
+
+/*
+ * Points written by the load generator are 1 ms apart on each timeseries,
+ * range queries select the last `range` of them
+ */
+#define POINT_STEP   1000000ULL
+#define LABEL_VALUES 10
+
+/*
+ * Latencies are counted in a log-linear histogram of nanoseconds, values are
+ * bucketed by their most significant bit and then by the 4 bits following
+ * it, within about 6% of the actual value
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (64 * HIST_SUB)
+
+enum bench_workload {
+    BENCH_ADD, BENCH_MADD, BENCH_QUERY, BENCH_MIXED, BENCH_COLLECT
+};
+
+static const char *workloads[] = {
+    "add", "madd", "query", "mixed", "collect"
+};
+
+struct bench_options {
+    int mode;
+    int port;
+    char *host;
+    int version;
+    int connections;
+    unsigned long requests;
+    unsigned pipeline;
+    enum bench_workload workload;
+    unsigned series;
+    unsigned labels;
+    unsigned points;
+    unsigned queries;
+    unsigned range;
+    unsigned window;
+};
+
+struct histogram {
+    uint64_t total;
+    uint64_t max;
+    uint64_t counts[HIST_BUCKETS];
+};
+
+/*
+ * Every worker runs on its own connection, writing to the timeseries whose
+ * index modulo the number of connections is its own, so the points of a
+ * timeseries always come in order
+ */
+struct bench_worker {
+    pthread_t thread;
+    int id;
+    const struct bench_options *opts;
+    tts_client client;
+    unsigned long requests;
+    unsigned long points;
+    unsigned long errors;
+    unsigned long long *seq;
+    unsigned seed;
+    struct histogram hist;
+};
+
+static const char *flag_description[] = {
+    "Print this help",
+    "Set the execution mode, the connection to use, accepts inet|unix",
+    "Set an address hostname to connect to",
+    "Set a different port other than 19191",
+    "Set the highest version of the wire format to negotiate, 1 or 2",
+    "Set the number of connections, one thread each, 4 by default",
+    "Set the number of requests per connection, 100000 by default",
+    "Set the number of requests pipelined in a single write, 16 by default",
+    "Set the workload, add|madd|query|mixed|collect, add by default",
+    "Set the number of timeseries written and queried, 1000 by default",
+    "Set the number of labels per point, 0 by default",
+    "Set the number of points per ADD or MADD request, 1 by default",
+    "Set the percent of range queries of the mixed workload, 10 by default",
+    "Set the number of points selected by range queries, 100 by default",
+    "Set the AVG window of range queries in milliseconds, 0 for none",
+    "Run the microbenchmarks instead, no server needed"
+};
+
+static void print_help(const char *me) {
+    printf("\ntts-bench - Transient Time Series load generator\n\n");
+    printf("Usage: %s [-a addr] [-p port] [-m mode] [-v version] [-c conns] "
+           "[-n requests] [-P pipeline] [-t workload] [-k series] "
+           "[-l labels] [-b points] [-q percent] [-r range] [-w window] "
+           "[-M] [-h]\n\n", me);
+    const char flags[16] = "hmapvcnPtklbqrwM";
+    for (int i = 0; i < 16; ++i)
+        printf(" -%c: %s\n", flags[i], flag_description[i]);
+    printf("\n");
+}
+
+static int modetoi(const char *str) {
+    if (strcasecmp(str, "inet") == 0)
+        return AF_INET;
+    if (strcasecmp(str, "unix") == 0)
+        return AF_UNIX;
+    return -1;
+}
+
+static int workloadtoi(const char *str) {
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(*workloads); ++i)
+        if (strcasecmp(str, workloads[i]) == 0)
+            return i;
+    return -1;
+}
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline size_t hist_bucket(uint64_t v) {
+    if (v < HIST_SUB)
+        return v;
+    int msb = 63 - __builtin_clzll(v);
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB +
+        ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/* Lowest value counted by a bucket */
+static inline uint64_t hist_value(size_t bucket) {
+    if (bucket < HIST_SUB)
+        return bucket;
+    int msb = bucket / HIST_SUB + HIST_SUB_BITS - 1;
+    return (1ULL << msb) |
+        ((uint64_t) (bucket % HIST_SUB) << (msb - HIST_SUB_BITS));
+}
+
+static void hist_record(struct histogram *h, uint64_t v) {
+    h->counts[hist_bucket(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(struct histogram *dst, const struct histogram *src) {
+    for (size_t i = 0; i < HIST_BUCKETS; ++i)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static uint64_t hist_quantile(const struct histogram *h, double q) {
+    uint64_t rank = (uint64_t) (q * h->total), seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; ++i) {
+        seen += h->counts[i];
+        if (seen > rank)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+/*
+ * ================
+ *  Load generator
+ * ================
+ */
+
+/*
+ * Requests of a pipelined batch, all the arrays are allocated once, names and
+ * labels are formatted in place on every request
+ */
+struct bench_batch {
+    struct tts_packet *packets;
+    struct tts_addpoints *adds;
+    char (*names)[32];
+    char (*labels)[2][16];
+};
+
+/*
+ * ADD requests carry all their points in the array of the first entry of
+ * their slice, MADD ones a single point per entry
+ */
+static inline size_t batch_capacity(const struct bench_options *o, size_t i) {
+    return o->workload != BENCH_MADD && i % o->points == 0 ? o->points : 1;
+}
+
+static void batch_init(struct bench_batch *b, const struct bench_options *o) {
+    size_t entries = (size_t) o->pipeline * o->points;
+    b->packets = calloc(o->pipeline, sizeof(*b->packets));
+    b->adds = calloc(entries, sizeof(*b->adds));
+    b->names = calloc(entries, sizeof(*b->names));
+    b->labels = calloc(o->labels > 0 ? o->labels : 1, sizeof(*b->labels));
+    for (unsigned i = 0; i < o->labels; ++i) {
+        snprintf(b->labels[i][0], sizeof(b->labels[i][0]), "label%u", i);
+        snprintf(b->labels[i][1], sizeof(b->labels[i][1]), "value%u",
+                 i % LABEL_VALUES);
+    }
+    for (size_t i = 0; i < entries; ++i) {
+        size_t capacity = batch_capacity(o, i);
+        b->adds[i].points = calloc(capacity, sizeof(*b->adds[i].points));
+        for (size_t j = 0; j < capacity && o->labels > 0; ++j)
+            b->adds[i].points[j].labels =
+                calloc(o->labels, sizeof(*b->adds[i].points[j].labels));
+    }
+}
+
+static void batch_destroy(struct bench_batch *b,
+                          const struct bench_options *o) {
+    size_t entries = (size_t) o->pipeline * o->points;
+    for (size_t i = 0; i < entries; ++i) {
+        for (size_t j = 0; j < batch_capacity(o, i); ++j)
+            free(b->adds[i].points[j].labels);
+        free(b->adds[i].points);
+    }
+    free(b->packets);
+    free(b->adds);
+    free(b->names);
+    free(b->labels);
+}
+
+static inline unsigned worker_series(struct bench_worker *w) {
+    const struct bench_options *o = w->opts;
+    /* More connections than timeseries, some have to share them */
+    if ((unsigned) w->id >= o->series)
+        return w->id % o->series;
+    unsigned owned = (o->series - w->id + o->connections - 1) / o->connections;
+    return w->id + (rand_r(&w->seed) % owned) * o->connections;
+}
+
+static void fill_point(struct bench_worker *w, struct bench_batch *b,
+                       struct tts_addpoints *add, size_t i, unsigned series) {
+    tts_timestamp t = (w->seq[series]++ + 1) * POINT_STEP;
+    add->points[i].bits.ts_sec_set = 1;
+    add->points[i].bits.ts_nsec_set = 1;
+    add->points[i].ts_sec = t / (tts_timestamp) 1e9;
+    add->points[i].ts_nsec = t % (tts_timestamp) 1e9;
+    add->points[i].value = rand_r(&w->seed) % 10000 / 100.0;
+    add->points[i].labels_len = w->opts->labels;
+    for (unsigned j = 0; j < w->opts->labels; ++j) {
+        add->points[i].labels[j].label_len = strlen(b->labels[j][0]);
+        add->points[i].labels[j].label = (uint8_t *) b->labels[j][0];
+        add->points[i].labels[j].value_len = strlen(b->labels[j][1]);
+        add->points[i].labels[j].value = (uint8_t *) b->labels[j][1];
+    }
+}
+
+static void set_name(struct tts_addpoints *add, char *name, unsigned series) {
+    add->ts_name_len = snprintf(name, 32, "bench.%u", series);
+    add->ts_name = (uint8_t *) name;
+}
+
+static void fill_add(struct bench_worker *w, struct bench_batch *b, size_t i) {
+    struct tts_packet *p = &b->packets[i];
+    struct tts_addpoints *add = &b->adds[i * w->opts->points];
+    unsigned series = worker_series(w);
+    TTS_SET_REQUEST_HEADER(p, TTS_ADDPOINTS);
+    set_name(add, b->names[i * w->opts->points], series);
+    add->points_len = w->opts->points;
+    for (size_t j = 0; j < w->opts->points; ++j)
+        fill_point(w, b, add, j, series);
+    p->addpoints = *add;
+}
+
+static void fill_madd(struct bench_worker *w, struct bench_batch *b,
+                      size_t i) {
+    struct tts_packet *p = &b->packets[i];
+    struct tts_addpoints *adds = &b->adds[i * w->opts->points];
+    TTS_SET_REQUEST_HEADER(p, TTS_MADDPOINTS);
+    for (size_t j = 0; j < w->opts->points; ++j) {
+        unsigned series = worker_series(w);
+        set_name(&adds[j], b->names[i * w->opts->points + j], series);
+        adds[j].points_len = 1;
+        fill_point(w, b, &adds[j], 0, series);
+    }
+    p->maddpoints.points_len = w->opts->points;
+    p->maddpoints.pts = adds;
+}
+
+/*
+ * Range query on a random timeseries, selecting its first `range` points,
+ * the ones written in the warm up
+ */
+static void fill_query(struct bench_worker *w, struct bench_batch *b,
+                       size_t i) {
+    const struct bench_options *o = w->opts;
+    struct tts_packet *p = &b->packets[i];
+    unsigned series = rand_r(&w->seed) % o->series;
+    memset(&p->query, 0x00, sizeof(p->query));
+    TTS_SET_REQUEST_HEADER(p, TTS_QUERY);
+    p->query.ts_name_len = snprintf(b->names[i * o->points], 32,
+                                    "bench.%u", series);
+    p->query.ts_name = (uint8_t *) b->names[i * o->points];
+    p->query.bits.major_of = 1;
+    p->query.bits.minor_of = 1;
+    p->query.major_of = POINT_STEP;
+    p->query.minor_of = (tts_timestamp) o->range * POINT_STEP;
+    if (o->window > 0) {
+        p->query.bits.mean = 1;
+        p->query.mean_val = o->window;
+    }
+}
+
+static int is_query(struct bench_worker *w) {
+    if (w->opts->workload == BENCH_QUERY)
+        return 1;
+    if (w->opts->workload == BENCH_MIXED)
+        return (unsigned) rand_r(&w->seed) % 100 < w->opts->queries;
+    return 0;
+}
+
+/*
+ * Send a batch and wait for all its responses, every latency is measured
+ * from the write of the batch to the response, as seen by a pipelining
+ * client
+ */
+static int run_batch(struct bench_worker *w, struct bench_batch *b,
+                     size_t n, int record) {
+    struct tts_packet response;
+    uint64_t start = now_ns();
+    if (tts_client_send_packets(&w->client, b->packets, n) < 0)
+        return TTS_CLIENT_FAILURE;
+    for (size_t i = 0; i < n; ++i) {
+        if (tts_client_recv_response(&w->client, &response) < 0)
+            return TTS_CLIENT_FAILURE;
+        if (response.header.opcode == TTS_ACK && response.header.status != 0)
+            w->errors++;
+        if (!record)
+            continue;
+        hist_record(&w->hist, now_ns() - start);
+        w->requests++;
+        if (b->packets[i].header.opcode == TTS_ADDPOINTS)
+            w->points += b->packets[i].addpoints.points_len;
+        else if (b->packets[i].header.opcode == TTS_MADDPOINTS)
+            w->points += b->packets[i].maddpoints.points_len;
+    }
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * Query workloads need some points to select, every worker writes the first
+ * `range` points of the timeseries it owns before starting
+ */
+static int warm_up(struct bench_worker *w, struct bench_batch *b) {
+    const struct bench_options *o = w->opts;
+    for (unsigned s = w->id; s < o->series; s += o->connections) {
+        for (unsigned done = 0; done < o->range; ) {
+            size_t n = 0;
+            for (; n < o->pipeline && done < o->range; ++n) {
+                struct tts_addpoints *add = &b->adds[n * o->points];
+                struct tts_packet *p = &b->packets[n];
+                size_t len = batch_capacity(o, n * o->points);
+                if (len > o->range - done)
+                    len = o->range - done;
+                TTS_SET_REQUEST_HEADER(p, TTS_ADDPOINTS);
+                set_name(add, b->names[n * o->points], s);
+                for (size_t j = 0; j < len; ++j)
+                    fill_point(w, b, add, j, s);
+                add->points_len = len;
+                p->addpoints = *add;
+                done += len;
+            }
+            if (run_batch(w, b, n, 0) < 0)
+                return TTS_CLIENT_FAILURE;
+        }
+    }
+    return TTS_CLIENT_SUCCESS;
+}
+
+static void *worker_run(void *arg) {
+    struct bench_worker *w = arg;
+    const struct bench_options *o = w->opts;
+    struct bench_batch batch;
+    batch_init(&batch, o);
+    for (unsigned long r = 0; r < o->requests; r += o->pipeline) {
+        size_t n = o->requests - r < o->pipeline ?
+            o->requests - r : o->pipeline;
+        for (size_t i = 0; i < n; ++i) {
+            if (is_query(w))
+                fill_query(w, &batch, i);
+            else if (o->workload == BENCH_MADD)
+                fill_madd(w, &batch, i);
+            else
+                fill_add(w, &batch, i);
+        }
+        if (run_batch(w, &batch, n, 1) < 0) {
+            fprintf(stderr, "Connection %i failed: %s\n",
+                    w->id, strerror(errno));
+            break;
+        }
+    }
+    batch_destroy(&batch, o);
+    return NULL;
+}
+
+static int run_load(const struct bench_options *o) {
+    struct bench_worker *workers = calloc(o->connections, sizeof(*workers));
+    struct tts_connect_options conn_opts;
+    struct histogram hist;
+    unsigned long requests = 0, points = 0, errors = 0;
+    int rc = EXIT_SUCCESS;
+    memset(&conn_opts, 0x00, sizeof(conn_opts));
+    memset(&hist, 0x00, sizeof(hist));
+    conn_opts.s_family = o->mode;
+    conn_opts.s_addr = o->host;
+    conn_opts.s_port = o->port;
+    conn_opts.version = o->version;
+    for (int i = 0; i < o->connections; ++i) {
+        workers[i].id = i;
+        workers[i].opts = o;
+        workers[i].seed = i + 1;
+        workers[i].seq = calloc(o->series, sizeof(*workers[i].seq));
+        tts_client_init(&workers[i].client, &conn_opts);
+        if (tts_client_connect(&workers[i].client) < 0) {
+            fprintf(stderr, "Unable to connect to %s:%i\n", o->host, o->port);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (o->workload == BENCH_QUERY || o->workload == BENCH_MIXED) {
+        for (int i = 0; i < o->connections; ++i) {
+            struct bench_batch batch;
+            batch_init(&batch, o);
+            if (warm_up(&workers[i], &batch) < 0) {
+                fprintf(stderr, "Warm up failed: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+            }
+            batch_destroy(&batch, o);
+        }
+    }
+    uint64_t start = now_ns();
+    for (int i = 0; i < o->connections; ++i)
+        pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+    for (int i = 0; i < o->connections; ++i)
+        pthread_join(workers[i].thread, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+    for (int i = 0; i < o->connections; ++i) {
+        hist_merge(&hist, &workers[i].hist);
+        requests += workers[i].requests;
+        points += workers[i].points;
+        errors += workers[i].errors;
+        tts_client_disconnect(&workers[i].client);
+        tts_client_destroy(&workers[i].client);
+        free(workers[i].seq);
+    }
+    if (requests < (unsigned long) o->connections * o->requests)
+        rc = EXIT_FAILURE;
+    printf("workload %s, %i connections, pipeline %u, %u timeseries, "
+           "%u labels, %u points per request\n",
+           workloads[o->workload], o->connections, o->pipeline, o->series,
+           o->labels, o->points);
+    if (o->workload == BENCH_QUERY || o->workload == BENCH_MIXED)
+        printf("range queries of %u points, AVG window %u ms\n",
+               o->range, o->window);
+    printf("%lu requests in %.3f s, %.0f req/s, %.0f points/s, %lu errors\n",
+           requests, elapsed, requests / elapsed, points / elapsed, errors);
+    printf("latency (us): p50 %.1f p99 %.1f p999 %.1f max %.1f\n",
+           hist_quantile(&hist, 0.50) / 1e3, hist_quantile(&hist, 0.99) / 1e3,
+           hist_quantile(&hist, 0.999) / 1e3, hist.max / 1e3);
+    free(workers);
+    return rc;
+}
+
+/*
+ * Points acknowledged to a collector, by the ACKs of its batches
+ */
+struct collect_state {
+    unsigned long batches;
+    unsigned long points;
+    unsigned long errors;
+};
+
+static void on_collect_batch(const struct tts_packet *ack, void *data) {
+    struct collect_state *st = data;
+    st->batches++;
+    if (!ack || ack->header.status != TTS_OK)
+        st->errors++;
+    for (uint32_t i = 0; ack && i < ack->ack.series_nr; ++i)
+        st->points += ack->ack.series[i].points;
+}
+
+/*
+ * A collector agent, a single thread adding points one at a time through the
+ * asynchronous client, coalesced into MADD batches of `points` points spread
+ * over the pool of `connections`, never waiting for a response
+ */
+static int run_collect(const struct bench_options *o) {
+    struct tts_connect_options conn_opts;
+    struct collect_state st = { 0 };
+    struct tts_async_options async_opts = {
+        .connections = o->connections,
+        .batch_points = o->points,
+        .on_batch = on_collect_batch,
+        .batch_data = &st
+    };
+    struct tts_async async;
+    struct tts_async_label *labels = calloc(o->labels > 0 ? o->labels : 1,
+                                            sizeof(*labels));
+    char (*strings)[2][16] = calloc(o->labels > 0 ? o->labels : 1,
+                                    sizeof(*strings));
+    unsigned long long *seq = calloc(o->series, sizeof(*seq));
+    unsigned long total = (unsigned long) o->connections * o->requests;
+    unsigned seed = 1;
+    char name[32];
+    int rc = EXIT_SUCCESS;
+    memset(&conn_opts, 0x00, sizeof(conn_opts));
+    conn_opts.s_family = o->mode;
+    conn_opts.s_addr = o->host;
+    conn_opts.s_port = o->port;
+    conn_opts.version = o->version;
+    for (unsigned i = 0; i < o->labels; ++i) {
+        snprintf(strings[i][0], sizeof(strings[i][0]), "label%u", i);
+        snprintf(strings[i][1], sizeof(strings[i][1]), "value%u",
+                 i % LABEL_VALUES);
+        labels[i].label = strings[i][0];
+        labels[i].value = strings[i][1];
+    }
+    if (tts_async_init(&async, &conn_opts, &async_opts) < 0) {
+        fprintf(stderr, "Unable to connect to %s:%i\n", o->host, o->port);
+        exit(EXIT_FAILURE);
+    }
+    uint64_t start = now_ns();
+    for (unsigned long i = 0; i < total; ++i) {
+        unsigned series = i % o->series;
+        snprintf(name, sizeof(name), "bench.%u", series);
+        if (tts_async_add(&async, name, ++seq[series] * POINT_STEP,
+                          rand_r(&seed) % 10000 / 100.0,
+                          labels, o->labels) < 0)
+            break;
+        /* Run the callbacks of the responses come so far, without waiting */
+        if (i % o->points == 0 && tts_async_poll(&async, 0) < 0)
+            break;
+    }
+    if (tts_async_wait(&async) < 0)
+        fprintf(stderr, "Connection failed: %s\n", strerror(errno));
+    double elapsed = (now_ns() - start) / 1e9;
+    tts_async_destroy(&async);
+    if (st.points < total)
+        rc = EXIT_FAILURE;
+    printf("workload collect, %i connections, %u timeseries, %u labels, "
+           "%u points per batch\n", o->connections, o->series, o->labels,
+           o->points);
+    printf("%lu points acknowledged in %.3f s, %.0f points/s, %lu batches, "
+           "%lu errors\n", st.points, elapsed, st.points / elapsed,
+           st.batches, st.errors);
+    free(labels);
+    free(strings);
+    free(seq);
+    return rc;
+}
+
+/*
+ * =================
+ *  Microbenchmarks
+ * =================
+ */
+
+static volatile uint64_t sink;
+
+static void report(const char *name, uint64_t start, size_t ops,
+                   const char *unit) {
+    printf("%-40s %8.2f ns/%s\n", name, (double) (now_ns() - start) / ops,
+           unit);
+}
+
+static void micro_pack(void) {
+    enum { N = 10000000 };
+    uint8_t buf[16], *ptr;
+    int64_t n = 0;
+    uint64_t u = 0, start = now_ns();
+    long double r = 0.0;
+    for (int64_t i = 0; i < N; ++i) {
+        ptr = buf;
+        pack_integer(&ptr, 'Q', i);
+        ptr = buf;
+        unpack_integer(&ptr, 'Q', &n);
+        sink += n;
+    }
+    report("pack_integer/unpack_integer Q", start, N, "op");
+    start = now_ns();
+    for (int64_t i = 0; i < N; ++i) {
+        ptr = buf;
+        pack_real(&ptr, 'd', i * 0.5);
+        ptr = buf;
+        unpack_real(&ptr, 'd', &r);
+        sink += (uint64_t) r;
+    }
+    report("pack_real/unpack_real d", start, N, "op");
+    start = now_ns();
+    for (uint64_t i = 0; i < N; ++i) {
+        ptr = buf;
+        pack_varint(&ptr, i * 977);
+        ptr = buf;
+        unpack_varint(&ptr, &u);
+        sink += u;
+    }
+    report("pack_varint/unpack_varint", start, N, "op");
+}
+
+/*
+ * Round trip of an ADD of a chunk worth of points, with a label each, in
+ * both wire formats, the second one through a pair of codecs as a client and
+ * a server would do
+ */
+static void micro_codec(void) {
+    enum { N = 20000, POINTS = 256 };
+    struct tts_packet p, out;
+    struct tts_codec enc, dec;
+    struct tts_arena arena;
+    char label[] = "host", value[] = "host-1", name[] = "bench.codec";
+    uint8_t *buf;
+    memset(&p, 0x00, sizeof(p));
+    TTS_SET_REQUEST_HEADER(&p, TTS_ADDPOINTS);
+    p.addpoints.ts_name_len = strlen(name);
+    p.addpoints.ts_name = (uint8_t *) name;
+    p.addpoints.points_len = POINTS;
+    p.addpoints.points = calloc(POINTS, sizeof(*p.addpoints.points));
+    for (size_t i = 0; i < POINTS; ++i) {
+        p.addpoints.points[i].bits.ts_sec_set = 1;
+        p.addpoints.points[i].bits.ts_nsec_set = 1;
+        p.addpoints.points[i].ts_sec = 1600000000 + i;
+        p.addpoints.points[i].ts_nsec = i * 1000;
+        p.addpoints.points[i].value = 20.0 + (i % 7) * 0.25;
+        p.addpoints.points[i].labels_len = 1;
+        p.addpoints.points[i].labels =
+            calloc(1, sizeof(*p.addpoints.points[i].labels));
+        p.addpoints.points[i].labels->label_len = strlen(label);
+        p.addpoints.points[i].labels->label = (uint8_t *) label;
+        p.addpoints.points[i].labels->value_len = strlen(value);
+        p.addpoints.points[i].labels->value = (uint8_t *) value;
+    }
+    tts_arena_init(&arena);
+    for (uint8_t version = TTS_PROTOCOL_V1;
+         version <= TTS_PROTOCOL_V2; ++version) {
+        char title[64];
+        size_t len = 0;
+        tts_codec_init(&enc);
+        tts_codec_init(&dec);
+        tts_codec_reset(&enc, version);
+        tts_codec_reset(&dec, version);
+        buf = malloc(tts_codec_packet_size(&enc, &p));
+        uint64_t start = now_ns();
+        for (int i = 0; i < N; ++i) {
+            len = tts_codec_pack(&enc, &p, buf);
+            tts_codec_unpack(&dec, buf, &out, &arena);
+            sink += out.addpoints.points_len;
+            tts_arena_reset(&arena);
+        }
+        snprintf(title, sizeof(title), "codec v%u ADD pack/unpack (%zu B)",
+                 version, len);
+        report(title, start, (size_t) N * POINTS, "point");
+        free(buf);
+        tts_codec_destroy(&enc);
+        tts_codec_destroy(&dec);
+    }
+    tts_arena_destroy(&arena);
+    for (size_t i = 0; i < POINTS; ++i)
+        free(p.addpoints.points[i].labels);
+    free(p.addpoints.points);
+}
+
+/*
+ * Search of the bound of a range or of a window in a sorted column of
+ * timestamps, a vectorized scan as the column searched is a chunk at most,
+ * on a short window, a chunk and a long window
+ */
+static void micro_search(void) {
+    size_t sizes[] = { 16, 256, 4096 }, ops[] = { 5000000, 2000000, 200000 };
+    unsigned seed = 1;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+        char title[64];
+        tts_timestamp *column = malloc(sizes[s] * sizeof(*column));
+        for (size_t i = 0; i < sizes[s]; ++i)
+            column[i] = (i + 1) * POINT_STEP;
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < ops[s]; ++i) {
+            tts_timestamp t = (rand_r(&seed) % sizes[s]) * POINT_STEP;
+            sink += tts_kernel_upper_bound(column, sizes[s], t);
+        }
+        snprintf(title, sizeof(title), "upper_bound %s (%zu)",
+                 tts_kernels.name, sizes[s]);
+        report(title, start, ops[s], "op");
+        free(column);
+    }
+}
+
+/*
+ * Binary search of TTS_VECTOR_BINSEARCH in a sorted vector of timestamps,
+ * from a chunk to columns way larger than any chunk, half of the targets
+ * falling between two items
+ */
+static void micro_binsearch(void) {
+    size_t sizes[] = { 256, 4096, 1 << 16, 1 << 20 };
+    size_t ops[] = { 5000000, 5000000, 2000000, 2000000 };
+    unsigned seed = 1;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(*sizes); ++s) {
+        char title[64];
+        size_t res = 0;
+        TTS_VECTOR(tts_timestamp) column;
+        TTS_VECTOR_INIT(column, sizes[s]);
+        for (size_t i = 0; i < sizes[s]; ++i)
+            TTS_VECTOR_APPEND(column, (i + 1) * POINT_STEP);
+        uint64_t start = now_ns();
+        for (size_t i = 0; i < ops[s]; ++i) {
+            tts_timestamp t = (rand_r(&seed) % sizes[s] + 1) * POINT_STEP -
+                (i & 1) * POINT_STEP / 2;
+            TTS_VECTOR_BINSEARCH(column, t, &res);
+            sink += res;
+        }
+        snprintf(title, sizeof(title), "TTS_VECTOR_BINSEARCH (%zu)",
+                 sizes[s]);
+        report(title, start, ops[s], "op");
+        TTS_VECTOR_DESTROY(column);
+    }
+}
+
+/*
+ * Single pass of the aggregation over a run of values, as fed by the spans
+ * of a timeseries, with the cheap aggregates only, adding the standard
+ * deviation and adding quantiles
+ */
+static void micro_aggregate(void) {
+    enum { N = 200, LEN = 1 << 16 };
+    struct {
+        const char *name;
+        unsigned aggregates;
+    } cases[] = {
+        { "avg,sum,min,max", TTS_AGG_AVG | TTS_AGG_SUM |
+            TTS_AGG_MIN | TTS_AGG_MAX },
+        { "avg,sum,min,max,stddev", TTS_AGG_AVG | TTS_AGG_SUM |
+            TTS_AGG_MIN | TTS_AGG_MAX | TTS_AGG_STDDEV },
+        { "avg,sum,min,max,p99", TTS_AGG_AVG | TTS_AGG_SUM |
+            TTS_AGG_MIN | TTS_AGG_MAX | TTS_AGG_QUANTILE }
+    };
+    double *values = malloc(LEN * sizeof(*values));
+    unsigned seed = 1;
+    for (size_t i = 0; i < LEN; ++i)
+        values[i] = rand_r(&seed) % 100000 / 100.0;
+    for (size_t c = 0; c < sizeof(cases) / sizeof(*cases); ++c) {
+        char title[64];
+        struct tts_aggregate agg;
+        tts_aggregate_init(&agg, cases[c].aggregates);
+        uint64_t start = now_ns();
+        for (int i = 0; i < N; ++i) {
+            tts_aggregate_reset(&agg);
+            tts_aggregate_update(&agg, values, LEN);
+            sink += agg.count;
+        }
+        snprintf(title, sizeof(title), "aggregate %s", cases[c].name);
+        report(title, start, (size_t) N * LEN, "point");
+        tts_aggregate_destroy(&agg);
+    }
+    free(values);
+}
+
+static void run_micro(void) {
+    tts_kernel_init();
+    micro_pack();
+    micro_codec();
+    micro_search();
+    micro_binsearch();
+    micro_aggregate();
+}
+
+int main(int argc, char **argv) {
+    int opt, micro = 0;
+    struct bench_options o = {
+        .mode = AF_INET,
+        .port = DEFAULT_PORT,
+        .host = LOCALHOST,
+        .version = TTS_PROTOCOL_V2,
+        .connections = 4,
+        .requests = 100000,
+        .pipeline = 16,
+        .workload = BENCH_ADD,
+        .series = 1000,
+        .labels = 0,
+        .points = 1,
+        .queries = 10,
+        .range = 100,
+        .window = 0
+    };
+    tts_config_set_default();
+    while ((opt = getopt(argc, argv, "hm:a:p:v:c:n:P:t:k:l:b:q:r:w:M")) != -1) {
+        switch (opt) {
+            case 'm':
+                o.mode = modetoi(optarg);
+                if (o.mode == -1) {
+                    fprintf(stderr, "Unknown mode '%s'\n", optarg);
+                    print_help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'a':
+                o.host = optarg;
+                break;
+            case 'p':
+                o.port = atoi(optarg);
+                break;
+            case 'v':
+                o.version = atoi(optarg);
+                break;
+            case 'c':
+                o.connections = atoi(optarg);
+                break;
+            case 'n':
+                o.requests = strtoul(optarg, NULL, 10);
+                break;
+            case 'P':
+                o.pipeline = atoi(optarg);
+                break;
+            case 't':
+                if ((opt = workloadtoi(optarg)) == -1) {
+                    fprintf(stderr, "Unknown workload '%s'\n", optarg);
+                    print_help(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                o.workload = opt;
+                break;
+            case 'k':
+                o.series = atoi(optarg);
+                break;
+            case 'l':
+                o.labels = atoi(optarg);
+                break;
+            case 'b':
+                o.points = atoi(optarg);
+                break;
+            case 'q':
+                o.queries = atoi(optarg);
+                break;
+            case 'r':
+                o.range = atoi(optarg);
+                break;
+            case 'w':
+                o.window = atoi(optarg);
+                break;
+            case 'M':
+                micro = 1;
+                break;
+            case 'h':
+                print_help(argv[0]);
+                exit(EXIT_SUCCESS);
+            default:
+                print_help(argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if (micro) {
+        run_micro();
+        return EXIT_SUCCESS;
+    }
+    if (o.connections < 1 || o.pipeline < 1 || o.series < 1 || o.points < 1
+        || o.range < 1) {
+        fprintf(stderr, "Connections, pipeline, timeseries, points and range "
+                "must be at least 1\n");
+        exit(EXIT_FAILURE);
+    }
+    if (o.workload == BENCH_COLLECT)
+        return run_collect(&o);
+    return run_load(&o);
+}
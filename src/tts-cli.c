@@ -39,13 +39,14 @@ static const char *flag_description[] = {
     "Set the execution mode, the connection to use, accepts inet|unix",
     "Set an address hostname to listen on",
     "Set a different port other than 19191",
+    "Set the highest version of the wire format to negotiate, 1 or 2",
 };
 
 static void print_help(const char *me) {
     printf("\ntts - Transient Time Series CLI\n\n");
-    printf("Usage: %s [-a addr] [-p port] [-m mode] [-h]\n\n", me);
-    const char flags[4] = "hmap";
-    for (int i = 0; i < 4; ++i)
+    printf("Usage: %s [-a addr] [-p port] [-m mode] [-v version] [-h]\n\n", me);
+    const char flags[5] = "hmapv";
+    for (int i = 0; i < 5; ++i)
         printf(" -%c: %s\n", flags[i], flag_description[i]);
     printf("\n");
 }
@@ -58,7 +59,13 @@ static const char *cmd_usage(const char *cmd) {
     if (strncasecmp(cmd, "add", 3) == 0)
         return "ADD timeseries-name timestamp|* value [label value ..] - ..";
     if (strncasecmp(cmd, "query", 5) == 0)
-        return "QUERY timeseries-name [>|<|RANGE] start_timestamp [end_timestamp] [AVG value]";
+        return "QUERY timeseries-name [>|<|RANGE] start_timestamp [end_timestamp] [AVG value] [AGG aggregate,..] [WINDOW value] [WHERE label value ..]";
+    if (strncasecmp(cmd, "mlast", 5) == 0)
+        return "MLAST timeseries-name .. [POINTS n]";
+    if (strncasecmp(cmd, "info", 4) == 0)
+        return "INFO [pattern]";
+    if (strncasecmp(cmd, "subscribe", 9) == 0)
+        return "SUBSCRIBE timeseries-name [WINDOW value] [AGG aggregate,..] [WHERE label value ..]";
     return NULL;
 }
 
@@ -86,13 +93,25 @@ static const char *errors_description[] = {
     "NOK - Timeseries doesn't exist",
     "NOK - Timeseries already exists",
     "NOK - Server rejected command: unknown command",
-    "NOK - Server rejected command: Out of memory"
+    "NOK - Server rejected command: Out of memory",
+    "NOK - Points too far out of order rejected",
+    "NOK - Cluster node unreachable",
+    "NOK - Server rejected command: write-ahead log failed"
 };
 
 static void print_tts_response(const struct tts_packet *tts_p) {
     if (tts_p->header.opcode == TTS_ACK) {
         printf("%s\n", errors_description[tts_p->header.status]);
-    } else if (tts_p->header.opcode == TTS_QUERY_RESPONSE) {
+        /* Statuses not fitting the header come in the body */
+        for (uint32_t i = 0; i < tts_p->ack.series_nr; ++i)
+            if (tts_p->ack.series[i].status != tts_p->header.status &&
+                tts_p->ack.series[i].status < sizeof(errors_description) /
+                sizeof(*errors_description))
+                printf("%s, %u points stored\n",
+                       errors_description[tts_p->ack.series[i].status],
+                       tts_p->ack.series[i].points);
+    } else if (tts_p->header.opcode == TTS_QUERY_RESPONSE ||
+               tts_p->header.opcode == TTS_SUBSCRIBE) {
         unsigned long long ts = 0ULL;
         for (size_t i = 0; i < tts_p->query_r.len; ++i) {
             ts = tts_p->query_r.results[i].ts_sec * 1e9 + \
@@ -105,17 +124,22 @@ static void print_tts_response(const struct tts_packet *tts_p) {
             }
             printf("\n");
         }
+        /* Merged by a cluster node from the others, one didn't answer */
+        if (tts_p->header.status != TTS_OK)
+            printf("NOK - Partial results, a cluster node didn't answer\n");
+    } else if (tts_p->header.opcode == TTS_INFO) {
+        printf("%.*s", (int) tts_p->info.len, (const char *) tts_p->info.data);
     }
 }
 
 int main(int argc, char **argv) {
-    int opt, port = DEFAULT_PORT, mode = AF_INET;
+    int opt, port = DEFAULT_PORT, mode = AF_INET, version = TTS_PROTOCOL_V2;
     char *host = LOCALHOST;
     size_t line_len = 0LL;
     char *line = NULL;
     struct tts_packet tts_p;
     double delta = 0.0;
-    while ((opt = getopt(argc, argv, "h:m:a:p:h:")) != -1) {
+    while ((opt = getopt(argc, argv, "h:m:a:p:v:h:")) != -1) {
         switch (opt) {
             case 'm':
                 mode = modetoi(optarg);
@@ -131,6 +155,9 @@ int main(int argc, char **argv) {
             case 'p':
                 port = atoi(optarg);
                 break;
+            case 'v':
+                version = atoi(optarg);
+                break;
             case 'h':
                 print_help(argv[0]);
                 exit(EXIT_SUCCESS);
@@ -146,6 +173,7 @@ int main(int argc, char **argv) {
     conn_opts.s_family = mode;
     conn_opts.s_addr = host;
     conn_opts.s_port = port;
+    conn_opts.version = version;
     tts_client_init(&c, &conn_opts);
     if (tts_client_connect(&c) < 0)
         exit(EXIT_FAILURE);
@@ -177,7 +205,17 @@ int main(int argc, char **argv) {
             delta = time_spec_seconds(&tend) - time_spec_seconds(&tstart);
             printf("%lu results in %lf seconds.\n", tts_p.query_r.len, delta);
         }
-        tts_client_packet_destroy(&tts_p);
+        /* Once subscribed, results are printed as they're pushed */
+        if (strncasecmp(line, "subscribe", 9) == 0 &&
+            tts_p.header.opcode == TTS_ACK && tts_p.header.status == TTS_OK) {
+            fflush(stdout);
+            while (tts_client_recv_response(&c, &tts_p) > 0) {
+                print_tts_response(&tts_p);
+                fflush(stdout);
+            }
+            tts_client_disconnect(&c);
+            break;
+        }
     }
     tts_client_destroy(&c);
     free(line);
@@ -39,15 +39,18 @@ static const char *flag_description[] = {
     "Set an address hostname to listen on",
     "Set a different port other than 19191",
     "Enable all logs, setting log level to DEBUG",
-    "Run in daemon mode"
+    "Run in daemon mode",
+    "Set the number of worker threads, defaults to the number of cores",
+    "Set the snapshot file path, enabling persistence"
 };
 
 static void print_help(const char *me) {
     printf("\ntts v%s Transient Time Series, a lightweight in-memory TSDB\n\n",
            VERSION);
-    printf("Usage: %s [-c conf] [-a addr] [-p port] [-m mode] [-v|-d|-h]\n\n", me);
-    const char flags[7] = "hcmapvd";
-    for (int i = 0; i < 7; ++i)
+    printf("Usage: %s [-c conf] [-a addr] [-p port] [-m mode] [-w workers] "
+           "[-s snapshot] [-v|-d|-h]\n\n", me);
+    const char flags[9] = "hcmapvdws";
+    for (int i = 0; i < 9; ++i)
         printf(" -%c: %s\n", flags[i], flag_description[i]);
     printf("\n");
 }
@@ -63,12 +66,13 @@ static int modetoi(const char *str) {
 int main(int argc, char **argv) {
     char *confpath = DEFAULT_CONF_PATH, *host = DEFAULT_HOSTNAME;
     int debug = 0, daemon = 0, port = DEFAULT_PORT, mode = DEFAULT_MODE;
-    int opt;
+    char *snapshot = NULL;
+    int workers = 0, opt;
 
     // Set default configuration
     tts_config_set_default();
 
-    while ((opt = getopt(argc, argv, "m:c:a:p:vhd:")) != -1) {
+    while ((opt = getopt(argc, argv, "m:c:a:p:w:s:vhd:")) != -1) {
         switch (opt) {
             case 'm':
                 mode = modetoi(optarg);
@@ -87,6 +91,12 @@ int main(int argc, char **argv) {
             case 'c':
                 confpath = optarg;
                 break;
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 's':
+                snapshot = optarg;
+                break;
             case 'v':
                 debug = 1;
                 break;
@@ -109,11 +119,17 @@ int main(int argc, char **argv) {
     strcpy(conf->host, host);
 
     tts_config_load(confpath);
-    tts_log_init(conf->logpath);
-
+    if (workers > 0)
+        conf->workers = workers;
+    if (snapshot)
+        snprintf(conf->snapshot_path, sizeof(conf->snapshot_path),
+                 "%s", snapshot);
+    // Daemonize first, the log writer thread wouldn't survive the fork
     if (daemon == 1)
         tts_daemonize();
 
+    tts_log_init(conf->logpath);
+
     // Print configuration
     tts_config_print();
 
@@ -29,67 +29,397 @@
 #define TTS_H
 
 #include <time.h>
+#include <stdint.h>
+#include <pthread.h>
 #include "uthash.h"
 #include "tts_vector.h"
 
 #define TTS_TS_FIELDS_MAX_NUMBER 1 << 8
 #define TTS_TS_NAME_MAX_LENGTH   1 << 9
 
+/*
+ * Number of points sealed into every compressed chunk, it's also the maximum
+ * size reached by the uncompressed head of a timeseries
+ */
+#define TTS_CHUNK_POINTS         256
+
 typedef unsigned long long int tts_timestamp;
 
 /*
- * Simple record struct, wrap around a column inside the database, defined as a
- * key-val couple alike, though it's used only to describe the value of each
- * column
+ * Chunk of points, immutable compressed block of `len` sealed rows.
+ * Following the Gorilla paper from Facebook, timestamps are encoded as
+ * delta-of-delta and values as the XOR with the previous one, all bit-packed
+ * into the `data` stream. Time bounds are tracked to entirely skip chunks not
+ * overlapping a query range. Chunks loaded from a snapshot are `mapped`, their
+ * `data` points straight into the snapshot file mapping and it's not owned.
  */
-struct tts_record {
+struct tts_chunk {
+    tts_timestamp min_ts;
+    tts_timestamp max_ts;
     size_t index;
-    long double value;
+    size_t len;
+    size_t size;
+    int mapped;
+    uint8_t *data;
+};
+
+/*
+ * Release the data of a chunk, unless it's mapped from a snapshot, do not
+ * pass functions as arguments, they will be evaluated multiple times
+ */
+#define TTS_CHUNK_DESTROY(chunk) do {   \
+    if ((chunk)->mapped == 0)           \
+        free((chunk)->data);            \
+} while (0)
+
+/*
+ * Maximum number of labels carried by a single point, the exceeding ones are
+ * ignored
+ */
+#define TTS_LABELS_MAX 255
+
+/*
+ * String interned into a labels dictionary, label names and values are stored
+ * just once, everything else references them, so two labels are equal only
+ * if they point to the same interned string. `refs` counts the references
+ * held, the string is released with the last one.
+ */
+struct tts_string {
+    uint32_t refs;
+    uint16_t len;
+    char *str;
+    UT_hash_handle hh;
+};
+
+/*
+ * A label, pair of interned name and value
+ */
+struct tts_label {
+    struct tts_string *field;
+    struct tts_string *value;
+};
+
+/*
+ * Set of labels carried by a point, interned as well, the pairs themselves
+ * are the key: all the points carrying the same labels, in the same order,
+ * share the same set, whatever the timeseries they belong to
+ */
+struct tts_labelset {
+    uint32_t refs;
     unsigned char labels_nr;
-    struct {
-        char *field;
-        void *value;
-    } *labels;
+    struct tts_label *labels;
+    UT_hash_handle hh;
+};
+
+/*
+ * Labels dictionary, interned strings and label sets, there's one for each
+ * shard of the database, guarded by the shard lock as the timeseries using
+ * it, this way interning never contends with the other shards
+ */
+struct tts_labels {
+    struct tts_string *strings;
+    struct tts_labelset *sets;
+};
+
+/*
+ * Take one more reference to an interned string
+ */
+static inline struct tts_string *tts_labels_retain(struct tts_string *str) {
+    ++str->refs;
+    return str;
+}
+
+/*
+ * Take one more reference to an interned set of labels
+ */
+static inline struct tts_labelset *tts_labels_set_retain(
+    struct tts_labelset *set) {
+    ++set->refs;
+    return set;
+}
+
+/*
+ * Labels record, labels are stored apart from the values of the timeseries,
+ * just for points actually carrying them, a record covers a run of `len`
+ * consecutive rows carrying the same labels set, starting with the row of
+ * absolute index `index` (see `offset` on `struct tts_timeseries`)
+ */
+struct tts_record {
+    size_t index;
+    size_t len;
+    struct tts_labelset *set;
 };
 
 /*
  * Tags structure, used to track secondary tags defined by label fields on
- * timeseries, each tag carries a multi-level hashmap to track them
+ * timeseries, each tag carries a multi-level hashmap to track them, keyed by
+ * the interned strings, the leaves store the sorted absolute indexes of the
+ * rows labelled
  */
 struct tts_tag {
-    char *tag_name;
-    TTS_VECTOR(struct tts_record *) column;
+    struct tts_string *name;
+    TTS_VECTOR(size_t) column;
     struct tts_tag *tag;
     UT_hash_handle hh;
 };
 
+/*
+ * Rollup tiers, the points of every timeseries are also pre-aggregated into
+ * buckets of fixed width on each tier, updated as they're appended, so
+ * aggregations on wide windows read buckets instead of raw points. A bucket
+ * covers the interval (end - width, end], `end` being a multiple of the
+ * width, the same way windows aligned to a lower bound are left-open. Each
+ * tier has its own retention, relative to the latest bucket, 0 disables it.
+ */
+#define TTS_ROLLUP_TIERS 3
+
+struct tts_rollup_tier {
+    tts_timestamp width;
+    tts_timestamp retention;
+};
+
+extern struct tts_rollup_tier tts_rollup_tiers[TTS_ROLLUP_TIERS];
+
+/*
+ * The mean of a bucket is its sum over its count, `m2` is the sum of the
+ * squared deviations from it
+ */
+struct tts_bucket {
+    tts_timestamp end;
+    uint64_t count;
+    double sum;
+    double m2;
+    double min;
+    double max;
+    double first;
+    double last;
+    tts_timestamp first_ts;
+    tts_timestamp last_ts;
+};
+
+/*
+ * Buckets of a tier sorted by their end, `since` is the end of the latest one
+ * dropped by the retention, the tier holds every point following it
+ */
+struct tts_rollup {
+    tts_timestamp since;
+    TTS_VECTOR(struct tts_bucket) buckets;
+};
+
+/*
+ * A point arrived out of order, older than the latest one stored, points are
+ * staged this way, sorted by timestamp and in order of arrival for the equal
+ * ones, till they're merged into the columns, holding a reference to their
+ * labels set, NULL if they carry none
+ */
+struct tts_late {
+    tts_timestamp timestamp;
+    double value;
+    struct tts_labelset *set;
+};
+
+/*
+ * Maximum number of points staged out of order before they're merged
+ */
+#define TTS_LATE_POINTS TTS_CHUNK_POINTS
+
+/*
+ * How far back a point out of order may reach, in chunks: the rows following
+ * it are laid out again once it's merged, so this bounds the cost of a merge
+ * regardless of the length of the timeseries
+ */
+#define TTS_LATE_CHUNKS 4
+
+/*
+ * Latest points of a timeseries, the last TTS_LAST_POINTS rows copied into a
+ * ring as they're stored, so the most frequent queries, for the latest
+ * values, never decode a chunk; `next` is the position of the next row to
+ * store, `size` the number of rows held
+ */
+#define TTS_LAST_POINTS 16
+
+struct tts_latest {
+    size_t size;
+    size_t next;
+    tts_timestamp timestamps[TTS_LAST_POINTS];
+    double values[TTS_LAST_POINTS];
+};
+
 /*
  * Time series, main data structure to handle the time-series, loosely
  * approachable as a `measurement` concept on influx DB, it carries some basic
- * informations like the name of the series and the data. Data are stored as
- * two paired arrays, one indexing the timestamp of each row, the other being
- * an array of arrays of `tts_record`, this way we can easily store different
- * number of columns for each row, depending on the presence of the data during
- * the insertion.
- * A third array is used to store the fields name, each row (index in the
- * columns array) will be paired with the fields array to retrieve what field
- * it refers to, if present.
+ * informations like the name of the series and the data. Older data are
+ * sealed into compressed chunks, while the most recent points are stored into
+ * an uncompressed head of columns, two dense paired arrays, one indexing the
+ * timestamp of each row, the other the value, this way the head accepts
+ * appends and scans just walk contiguous memory sequentially. Once the head
+ * reaches TTS_CHUNK_POINTS rows it's sealed into a new chunk.
+ * Labels are optional and sparse, they're stored in a third array of
+ * `tts_record`, sorted by the absolute index of the rows they refer to,
+ * referencing the sets interned into the `labels` dictionary of the shard.
+ * Each chunk tracks the absolute index of its first row and `offset` the
+ * index of the first row of the head, so the row at position `i` in the head
+ * columns has index `offset + i`.
+ * Rows are sorted by timestamp, points arriving out of order are staged into
+ * `late`, iterators merge them into the rows as they read, and they're
+ * merged into the rows for good later on, the rows following the oldest late
+ * point are laid out again, that's the only time indexes change.
+ * Points older than `cutoff` are expired by the retention and just waiting
+ * for their chunk to be dropped, queries ignore them.
+ * Every point is also accounted in the `rollups`, one for each tier, the
+ * latest rows are copied into `latest` as well.
  */
 struct tts_timeseries {
     size_t fields_nr;
+    size_t offset;
     int64_t retention;
+    tts_timestamp cutoff;
     char name[TTS_TS_NAME_MAX_LENGTH];
+    TTS_VECTOR(struct tts_chunk) chunks;
     TTS_VECTOR(tts_timestamp) timestamps;
-    TTS_VECTOR(struct tts_record *) columns;
+    TTS_VECTOR(double) values;
+    TTS_VECTOR(struct tts_record) records;
+    TTS_VECTOR(struct tts_late) late;
     struct tts_tag *tags;
+    struct tts_labels *labels;
+    struct tts_rollup rollups[TTS_ROLLUP_TIERS];
+    struct tts_latest latest;
     UT_hash_handle hh;
 };
 
 /*
- * Just a general store for all the timeseries, KISS as possible
+ * Number of shards the keyspace is partitioned into, must be a power of 2
  */
-struct tts_database {
+#define TTS_DB_SHARDS 64
+
+/*
+ * A partition of the keyspace, each one guarded by its own lock, this way
+ * concurrent workers contend only on the timeseries they actually touch
+ */
+struct tts_shard {
+    pthread_mutex_t lock;
     struct tts_timeseries *timeseries;
+    struct tts_labels labels;
+};
+
+/*
+ * Sorted index of the names of all the timeseries, to select them by pattern
+ * in name order without visiting every shard. It's guarded by a lock of its
+ * own, taken alone or with the lock of a shard already held, never the other
+ * way around: names are copied out before reaching their shard.
+ */
+struct tts_names {
+    pthread_mutex_t lock;
+    TTS_VECTOR(char *) names;
+};
+
+/*
+ * Just a general store for all the timeseries, KISS as possible, timeseries
+ * are spread across the shards by hashing their names
+ */
+struct tts_database {
+    struct tts_shard shards[TTS_DB_SHARDS];
+    struct tts_names names;
+};
+
+/*
+ * Select the shard of a timeseries by FNV-1a hashing of its name, uthash
+ * uses a different function for its buckets, so shards end up evenly filled.
+ * Names are hashed by length, they may be views of a request not being
+ * nul-terminated
+ */
+static inline size_t tts_database_shard_index(const char *name, size_t len) {
+    uint32_t hash = 2166136261U;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t) name[i];
+        hash *= 16777619U;
+    }
+    return hash & (TTS_DB_SHARDS - 1);
+}
+
+static inline struct tts_shard *tts_database_shard(struct tts_database *db,
+                                                   const char *name,
+                                                   size_t len) {
+    return &db->shards[tts_database_shard_index(name, len)];
+}
+
+/*
+ * A run of points of a timeseries, as returned by the iterators, `index` is
+ * the absolute index of the first row. Points are contiguous rows unless
+ * `rows` is set, in that case it carries the absolute index of every point.
+ * Spans merging points staged out of order carry the labels set of every
+ * point into `sets` too, staged points don't have a row yet, they take the
+ * index of the point following them, or past the last one.
+ */
+struct tts_span {
+    size_t index;
+    size_t len;
+    const size_t *rows;
+    const tts_timestamp *timestamps;
+    const double *values;
+    struct tts_labelset *const *sets;
+};
+
+/*
+ * Absolute index of the row of the i-th point of a span
+ */
+static inline size_t tts_span_index(const struct tts_span *span, size_t i) {
+    return span->rows ? span->rows[i] : span->index + i;
+}
+
+/*
+ * Timeseries iterator, it streams through the chunks, decoding them one at a
+ * time into its own buffers, and finally through the head columns, returning
+ * each block of points as a `tts_span`. The points staged out of order are
+ * merged on the fly, `late` is the position of the next one to return, the
+ * spans getting any are copied into the `merged` buffers.
+ */
+struct tts_timeseries_iter {
+    const struct tts_timeseries *ts;
+    size_t chunk;
+    int head_done;
+    tts_timestamp from;
+    size_t index;
+    size_t late;
+    tts_timestamp timestamps[TTS_CHUNK_POINTS];
+    double values[TTS_CHUNK_POINTS];
+    size_t merged_rows[TTS_CHUNK_POINTS + TTS_LATE_POINTS];
+    tts_timestamp merged_timestamps[TTS_CHUNK_POINTS + TTS_LATE_POINTS];
+    double merged_values[TTS_CHUNK_POINTS + TTS_LATE_POINTS];
+    struct tts_labelset *merged_sets[TTS_CHUNK_POINTS + TTS_LATE_POINTS];
+};
+
+/*
+ * Column of rows of a label value taking part to a selection, `pos` is the
+ * position of the last row visited, selections only move forward. The
+ * interned label is kept as well, to match the points staged out of order,
+ * `tag` is NULL if no row carries it.
+ */
+struct tts_select_column {
+    const struct tts_tag *tag;
+    const struct tts_string *field;
+    const struct tts_string *value;
+    size_t pos;
+};
+
+/*
+ * Selection of the rows of a timeseries carrying a set of labels, each label
+ * value is resolved to its tag, the sorted column of the rows carrying it,
+ * acting as a posting list: the rows carrying all of them are found by
+ * intersecting the columns, leapfrogging from one to the other. It wraps an
+ * iterator, seeking it to the rows selected, so chunks without any of them
+ * are never decoded, and returns spans made only of the selected points,
+ * merged with the points staged out of order carrying the same labels.
+ * Without labels it just returns the spans of the iterator.
+ */
+struct tts_timeseries_select {
+    struct tts_timeseries_iter it;
+    int empty;
+    size_t next;
+    TTS_VECTOR(struct tts_select_column) columns;
+    size_t rows[TTS_CHUNK_POINTS];
+    tts_timestamp timestamps[TTS_CHUNK_POINTS];
+    double values[TTS_CHUNK_POINTS];
 };
 
 /*
@@ -117,15 +447,78 @@ static inline int timespec_compare(const struct timespec *t1,
 }
 
 /*
- * Init a timeseries structure pointer, do not pass functions as arguments,
- * they will be evaluated multiple times inside the macro
+ * Return the position in the records vector of the first record covering a
+ * row with absolute index greater or equal than `index`, the size of the
+ * vector if there's none
  */
-#define TTS_TIMESERIES_INIT(ts, ts_name, ret) do {                  \
-    snprintf((ts)->name, TTS_TS_NAME_MAX_LENGTH, "%s", (ts_name));  \
+static inline size_t tts_timeseries_record_lower_bound(
+    const struct tts_timeseries *ts, size_t index) {
+    size_t left = 0, right = TTS_VECTOR_SIZE(ts->records), middle = 0;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (TTS_VECTOR_AT(ts->records, middle).index +
+            TTS_VECTOR_AT(ts->records, middle).len <= index)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    return left;
+}
+
+/*
+ * Labels set of the row with absolute index `index`, NULL if it carries none,
+ * the `rec` cursor tracks the next record to check, starting from the one
+ * found by `tts_timeseries_record_lower_bound`, rows are expected to be
+ * visited in ascending order so records are scanned sequentially
+ */
+static inline struct tts_labelset *tts_timeseries_row_labels(
+    const struct tts_timeseries *ts, size_t index, size_t *rec) {
+    while (*rec < TTS_VECTOR_SIZE(ts->records) &&
+           TTS_VECTOR_AT(ts->records, *rec).index +
+           TTS_VECTOR_AT(ts->records, *rec).len <= index)
+        ++*rec;
+    if (*rec == TTS_VECTOR_SIZE(ts->records) ||
+        TTS_VECTOR_AT(ts->records, *rec).index > index)
+        return NULL;
+    return TTS_VECTOR_AT(ts->records, *rec).set;
+}
+
+/*
+ * Labels set of the i-th point of a span, carried by the span itself if it
+ * merged points staged out of order, looked up into the records otherwise,
+ * see `tts_timeseries_row_labels`
+ */
+static inline struct tts_labelset *tts_span_labels(
+    const struct tts_timeseries *ts, const struct tts_span *span,
+    size_t i, size_t *rec) {
+    if (span->sets)
+        return span->sets[i];
+    return tts_timeseries_row_labels(ts, tts_span_index(span, i), rec);
+}
+
+/*
+ * Init a timeseries structure pointer, the name is copied by its length, do
+ * not pass functions as arguments, they will be evaluated multiple times
+ * inside the macro
+ */
+#define TTS_TIMESERIES_INIT(ts, ts_name, len, ret, dict) do {       \
+    snprintf((ts)->name, TTS_TS_NAME_MAX_LENGTH, "%.*s",            \
+             (int) (len), (const char *) (ts_name));                \
     (ts)->retention = (ret);                                        \
+    (ts)->labels = (dict);                                          \
+    (ts)->offset = 0;                                               \
+    (ts)->cutoff = 0;                                               \
+    TTS_VECTOR_NEW((ts)->chunks);                                   \
     TTS_VECTOR_NEW((ts)->timestamps);                               \
-    TTS_VECTOR_NEW((ts)->columns);                                  \
+    TTS_VECTOR_NEW((ts)->values);                                   \
+    TTS_VECTOR_NEW((ts)->records);                                  \
+    TTS_VECTOR_NEW((ts)->late);                                     \
     (ts)->tags = NULL;                                              \
+    (ts)->latest.size = (ts)->latest.next = 0;                      \
+    for (int tier = 0; tier < TTS_ROLLUP_TIERS; ++tier) {           \
+        (ts)->rollups[tier].since = 0;                              \
+        TTS_VECTOR_NEW((ts)->rollups[tier].buckets);                \
+    }                                                               \
 } while (0)
 
 /*
@@ -134,43 +527,140 @@ static inline int timespec_compare(const struct timespec *t1,
  * evaluated multiple times inside the macro
  */
 #define TTS_TIMESERIES_DESTROY(ts) do {                         \
-    struct tts_record *record = NULL;                           \
     struct tts_tag *tag, *ttmp, *sub_tag, *sub_tmp;             \
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(ts->chunks); ++i)    \
+        TTS_CHUNK_DESTROY(&TTS_VECTOR_AT(ts->chunks, i));       \
+    TTS_VECTOR_DESTROY(ts->chunks);                             \
     TTS_VECTOR_DESTROY(ts->timestamps);                         \
-    for (size_t i = 0; i < TTS_VECTOR_SIZE(ts->columns); ++i) { \
-        record = TTS_VECTOR_AT(ts->columns, i);                 \
-        for (size_t j = 0; j < record->labels_nr; ++j) {        \
-            free(record->labels[j].field);                      \
-            free(record->labels[j].value);                      \
-        }                                                       \
-        free(record->labels);                                   \
-        free(record);                                           \
-    }                                                           \
-    TTS_VECTOR_DESTROY(ts->columns);                            \
+    TTS_VECTOR_DESTROY(ts->values);                             \
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(ts->records); ++i)   \
+        tts_labels_set_release(ts->labels,                      \
+                               TTS_VECTOR_AT(ts->records, i).set); \
+    TTS_VECTOR_DESTROY(ts->records);                            \
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(ts->late); ++i)      \
+        if (TTS_VECTOR_AT(ts->late, i).set)                     \
+            tts_labels_set_release(ts->labels,                  \
+                                   TTS_VECTOR_AT(ts->late, i).set); \
+    TTS_VECTOR_DESTROY(ts->late);                               \
+    for (int tier = 0; tier < TTS_ROLLUP_TIERS; ++tier)         \
+        TTS_VECTOR_DESTROY(ts->rollups[tier].buckets);          \
     HASH_ITER(hh, ts->tags, tag, ttmp) {                        \
         HASH_DEL(ts->tags, tag);                                \
         TTS_VECTOR_DESTROY(tag->column);                        \
         HASH_ITER(hh, tag->tag, sub_tag, sub_tmp) {             \
             HASH_DEL(tag->tag, sub_tag);                        \
             TTS_VECTOR_DESTROY(sub_tag->column);                \
+            tts_labels_release(ts->labels, sub_tag->name);      \
             free(sub_tag);                                      \
         }                                                       \
+        tts_labels_release(ts->labels, tag->name);              \
         free(tag);                                              \
     }                                                           \
     free(ts);                                                   \
 } while (0)
 
-#define TTS_TIMESERIES_REMOVE_RECORD(ts, rec) do {              \
-    struct tts_tag *t, *sub;                                    \
-    for (int i = 0; i < (rec)->labels_nr; ++i) {                \
-        HASH_FIND_STR((ts)->tags, (rec)->labels[i].field, t);   \
-        if (t) {                                                \
-            HASH_FIND_STR(t->tag, (rec)->labels[i].value, sub); \
-            if (sub) {                                          \
-                TTS_VECTOR_REMOVE_PTR(sub->column, (rec));      \
-            }                                                   \
-        }                                                       \
-    }                                                           \
-} while (0)
+/*
+ * Absolute index of the first live row of a timeseries
+ */
+static inline size_t tts_timeseries_first_index(const struct tts_timeseries *ts) {
+    return TTS_VECTOR_SIZE(ts->chunks) > 0 ?
+        TTS_VECTOR_FIRST(ts->chunks).index : ts->offset;
+}
+
+/*
+ * Absolute index following the last row of a timeseries
+ */
+static inline size_t tts_timeseries_end_index(const struct tts_timeseries *ts) {
+    return ts->offset + TTS_VECTOR_SIZE(ts->timestamps);
+}
+
+/*
+ * Oldest timestamp a point may carry to be stored: points out of order can
+ * reach back TTS_LATE_CHUNKS chunks at most, and never past the retention
+ */
+static inline tts_timestamp tts_timeseries_horizon(
+    const struct tts_timeseries *ts) {
+    size_t n = TTS_VECTOR_SIZE(ts->chunks);
+    tts_timestamp horizon = ts->retention > 0 ? ts->cutoff : 0;
+    if (n >= TTS_LATE_CHUNKS &&
+        TTS_VECTOR_AT(ts->chunks, n - TTS_LATE_CHUNKS).min_ts > horizon)
+        horizon = TTS_VECTOR_AT(ts->chunks, n - TTS_LATE_CHUNKS).min_ts;
+    return horizon;
+}
+
+static inline int tts_timeseries_empty(const struct tts_timeseries *ts) {
+    return TTS_VECTOR_SIZE(ts->chunks) == 0 &&
+        TTS_VECTOR_SIZE(ts->timestamps) == 0 &&
+        TTS_VECTOR_SIZE(ts->late) == 0;
+}
+
+/*
+ * Return the position of the first bucket of a rollup ending at or after
+ * `end`, the number of buckets if there's none
+ */
+static inline size_t tts_rollup_lower_bound(const struct tts_rollup *rollup,
+                                            tts_timestamp end) {
+    size_t left = 0, right = TTS_VECTOR_SIZE(rollup->buckets), middle = 0;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (TTS_VECTOR_AT(rollup->buckets, middle).end < end)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    return left;
+}
+
+void tts_names_init(struct tts_names *);
+void tts_names_destroy(struct tts_names *);
+void tts_names_add(struct tts_names *, const char *);
+void tts_names_del(struct tts_names *, const char *);
+int tts_names_next(struct tts_names *, const char *, const char *, char *);
+
+void tts_labels_init(struct tts_labels *);
+void tts_labels_destroy(struct tts_labels *);
+struct tts_string *tts_labels_intern(struct tts_labels *,
+                                     const char *, size_t);
+struct tts_string *tts_labels_lookup(const struct tts_labels *,
+                                     const char *, size_t);
+void tts_labels_release(struct tts_labels *, struct tts_string *);
+struct tts_labelset *tts_labels_set(struct tts_labels *,
+                                    const struct tts_label *, size_t);
+void tts_labels_set_release(struct tts_labels *, struct tts_labelset *);
+void tts_chunk_encode(struct tts_chunk *, const tts_timestamp *,
+                      const double *, size_t);
+size_t tts_chunk_decode(const struct tts_chunk *,
+                        tts_timestamp *, double *);
+void tts_timeseries_append(struct tts_timeseries *, tts_timestamp, double);
+void tts_timeseries_append_batch(struct tts_timeseries *,
+                                 const tts_timestamp *, const double *,
+                                 struct tts_labelset *const *, size_t);
+void tts_timeseries_seal(struct tts_timeseries *);
+void tts_timeseries_merge(struct tts_timeseries *);
+void tts_timeseries_trim(struct tts_timeseries *);
+size_t tts_timeseries_memory(const struct tts_timeseries *);
+void tts_timeseries_label(struct tts_timeseries *, size_t,
+                          struct tts_labelset *);
+int tts_timeseries_rollup(const struct tts_timeseries *,
+                          tts_timestamp, tts_timestamp);
+int tts_timeseries_last(const struct tts_timeseries *,
+                        tts_timestamp *, double *, size_t *);
+size_t tts_timeseries_latest(const struct tts_timeseries *, size_t,
+                             tts_timestamp *, double *,
+                             struct tts_labelset **);
+void tts_timeseries_iter_init(struct tts_timeseries_iter *,
+                              const struct tts_timeseries *, tts_timestamp);
+void tts_timeseries_iter_seek(struct tts_timeseries_iter *, size_t);
+int tts_timeseries_iter_next(struct tts_timeseries_iter *, struct tts_span *);
+void tts_timeseries_select_init(struct tts_timeseries_select *,
+                                const struct tts_timeseries *, tts_timestamp);
+void tts_timeseries_select_label(struct tts_timeseries_select *,
+                                 const char *, size_t, const char *, size_t);
+void tts_timeseries_select_seek(struct tts_timeseries_select *, size_t);
+int tts_timeseries_select_next(struct tts_timeseries_select *,
+                               struct tts_span *);
+int tts_timeseries_select_last(struct tts_timeseries_select *,
+                               struct tts_span *);
+void tts_timeseries_select_destroy(struct tts_timeseries_select *);
 
 #endif
@@ -0,0 +1,280 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <math.h>
+#include <float.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tts.h"
+#include "tts_protocol.h"
+#include "tts_kernel.h"
+#include "tts_aggregate.h"
+
+#define SKETCH_GAMMA ((1 + TTS_SKETCH_ALPHA) / (1 - TTS_SKETCH_ALPHA))
+
+const char *const tts_aggregate_names[TTS_AGGREGATE_NAMES_NR] = {
+    "avg", "sum", "min", "max", "count", "first", "last", "stddev"
+};
+
+static inline int sketch_key(double value) {
+    return (int) ceil(log(value) / log(SKETCH_GAMMA));
+}
+
+/* Representative value of a bucket, the one minimizing the relative error */
+static inline double sketch_value(int key) {
+    return 2 * pow(SKETCH_GAMMA, key) / (1 + SKETCH_GAMMA);
+}
+
+static void store_reset(struct tts_sketch_store *s) {
+    if (s->count > 0)
+        memset(s->bins + (s->lo - s->offset), 0x00,
+               (s->hi - s->lo + 1) * sizeof(*s->bins));
+    s->count = 0;
+}
+
+/*
+ * Move the buckets to cover the keys from `lo` to `hi`, centering them in
+ * the room available; if they don't fit, the lowest keys are collapsed into
+ * the lowest bucket left, trading the accuracy of the smallest magnitudes
+ */
+static void store_rebase(struct tts_sketch_store *s, int lo, int hi) {
+    uint64_t bins[TTS_SKETCH_BINS] = {0};
+    if (hi - lo >= TTS_SKETCH_BINS)
+        lo = hi - TTS_SKETCH_BINS + 1;
+    int offset = lo - (TTS_SKETCH_BINS - (hi - lo + 1)) / 2;
+    for (int k = s->lo; k <= s->hi; ++k)
+        bins[(k < lo ? lo : k) - offset] += s->bins[k - s->offset];
+    memcpy(s->bins, bins, sizeof(bins));
+    s->offset = offset;
+    s->lo = lo;
+    s->hi = hi;
+}
+
+static void store_add(struct tts_sketch_store *s, int key) {
+    if (s->count == 0) {
+        s->offset = key - TTS_SKETCH_BINS / 2;
+        s->lo = s->hi = key;
+    } else if (key < s->lo || key > s->hi) {
+        int lo = key < s->lo ? key : s->lo, hi = key > s->hi ? key : s->hi;
+        if (lo < s->offset || hi >= s->offset + TTS_SKETCH_BINS)
+            store_rebase(s, lo, hi);
+        else
+            s->lo = lo, s->hi = hi;
+        if (key < s->lo)
+            key = s->lo;
+    }
+    s->bins[key - s->offset]++;
+    s->count++;
+}
+
+static void sketch_add(struct tts_sketch *sketch, double value) {
+    if (!isfinite(value))
+        return;
+    if (fabs(value) < DBL_MIN)
+        sketch->zeros++;
+    else if (value > 0)
+        store_add(&sketch->positive, sketch_key(value));
+    else
+        store_add(&sketch->negative, sketch_key(-value));
+}
+
+void tts_aggregate_init(struct tts_aggregate *agg, unsigned aggregates) {
+    agg->aggregates = aggregates;
+    agg->sketch = NULL;
+    if (aggregates & TTS_AGG_QUANTILE)
+        agg->sketch = calloc(1, sizeof(*agg->sketch));
+    tts_aggregate_reset(agg);
+}
+
+void tts_aggregate_reset(struct tts_aggregate *agg) {
+    agg->count = 0;
+    agg->sum = agg->mean = agg->m2 = 0.0;
+    agg->min = agg->max = agg->first = agg->last = 0.0;
+    if (agg->sketch) {
+        agg->sketch->zeros = 0;
+        store_reset(&agg->sketch->positive);
+        store_reset(&agg->sketch->negative);
+    }
+}
+
+/*
+ * Feed a run of consecutive values of the window, the basic aggregates are
+ * computed in a single pass by the reduction kernel, the variance of the run
+ * is computed against its own mean, while it's still hot in cache, then
+ * merged
+ */
+void tts_aggregate_update(struct tts_aggregate *agg,
+                          const double *values, size_t len) {
+    double sum = 0.0, min = 0.0, max = 0.0;
+    if (len == 0)
+        return;
+    tts_kernel_reduce(values, len, &sum, &min, &max);
+    if (agg->count == 0) {
+        agg->first = values[0];
+        agg->min = min;
+        agg->max = max;
+    } else {
+        if (min < agg->min)
+            agg->min = min;
+        if (max > agg->max)
+            agg->max = max;
+    }
+    agg->last = values[len - 1];
+    if (agg->aggregates & TTS_AGG_STDDEV) {
+        double mean = sum / len, m2 = tts_kernel_m2(values, len, mean);
+        double n = agg->count + len, delta = mean - agg->mean;
+        agg->mean += delta * len / n;
+        agg->m2 += m2 + delta * delta * agg->count * len / n;
+    }
+    if (agg->sketch)
+        for (size_t i = 0; i < len; ++i)
+            sketch_add(agg->sketch, values[i]);
+    agg->sum += sum;
+    agg->count += len;
+}
+
+/*
+ * Merge a rollup bucket into the window, the same way a run of values is,
+ * the bucket carrying already its own sum of squared deviations
+ */
+void tts_aggregate_merge(struct tts_aggregate *agg,
+                         const struct tts_bucket *bucket) {
+    if (bucket->count == 0)
+        return;
+    if (agg->count == 0) {
+        agg->first = bucket->first;
+        agg->min = bucket->min;
+        agg->max = bucket->max;
+    } else {
+        if (bucket->min < agg->min)
+            agg->min = bucket->min;
+        if (bucket->max > agg->max)
+            agg->max = bucket->max;
+    }
+    agg->last = bucket->last;
+    if (agg->aggregates & TTS_AGG_STDDEV) {
+        double n = agg->count + bucket->count;
+        double delta = bucket->sum / bucket->count - agg->mean;
+        agg->mean += delta * bucket->count / n;
+        agg->m2 += bucket->m2 + delta * delta * agg->count * bucket->count / n;
+    }
+    agg->sum += bucket->sum;
+    agg->count += bucket->count;
+}
+
+/*
+ * Return the value of a single aggregate of the window, `aggregate` being one
+ * of the TTS_AGG_* bits apart from the quantiles
+ */
+double tts_aggregate_value(const struct tts_aggregate *agg,
+                                unsigned aggregate) {
+    switch (aggregate) {
+        case TTS_AGG_AVG:
+            return agg->count > 0 ? agg->sum / agg->count : 0.0;
+        case TTS_AGG_SUM:
+            return agg->sum;
+        case TTS_AGG_MIN:
+            return agg->min;
+        case TTS_AGG_MAX:
+            return agg->max;
+        case TTS_AGG_COUNT:
+            return agg->count;
+        case TTS_AGG_FIRST:
+            return agg->first;
+        case TTS_AGG_LAST:
+            return agg->last;
+        case TTS_AGG_STDDEV:
+            return agg->count > 0 ? sqrt(agg->m2 / agg->count) : 0.0;
+    }
+    return 0.0;
+}
+
+/*
+ * Estimate the quantile `q` of the window, expressed in hundredths of a
+ * percent, walking the buckets from the most negative value to the most
+ * positive one, the estimate is clamped to the bounds of the window
+ */
+double tts_aggregate_quantile(const struct tts_aggregate *agg,
+                                   unsigned q) {
+    const struct tts_sketch *sketch = agg->sketch;
+    const struct tts_sketch_store *s = NULL;
+    double value = 0.0;
+    if (!sketch || agg->count == 0)
+        return 0.0;
+    uint64_t total = sketch->zeros + sketch->positive.count +
+        sketch->negative.count;
+    if (total == 0)
+        return 0.0;
+    if (q > 10000)
+        q = 10000;
+    uint64_t rank = (uint64_t) (q / 10000.0 * (total - 1)), seen = 0;
+    s = &sketch->negative;
+    for (int k = s->hi; s->count > 0 && k >= s->lo; --k) {
+        seen += s->bins[k - s->offset];
+        if (seen > rank) {
+            value = -sketch_value(k);
+            goto clamp;
+        }
+    }
+    seen += sketch->zeros;
+    if (seen > rank)
+        goto clamp;
+    s = &sketch->positive;
+    for (int k = s->lo; s->count > 0 && k <= s->hi; ++k) {
+        seen += s->bins[k - s->offset];
+        if (seen > rank) {
+            value = sketch_value(k);
+            break;
+        }
+    }
+clamp:
+    if (value < agg->min)
+        value = agg->min;
+    if (value > agg->max)
+        value = agg->max;
+    return value;
+}
+
+void tts_aggregate_destroy(struct tts_aggregate *agg) {
+    free(agg->sketch);
+    agg->sketch = NULL;
+}
+
+/*
+ * Name of a quantile expressed in hundredths of a percent, in the form p99 or
+ * p99.9
+ */
+void tts_aggregate_quantile_name(char *name, size_t len, unsigned q) {
+    if (q % 100 == 0)
+        snprintf(name, len, "p%u", q / 100);
+    else if (q % 10 == 0)
+        snprintf(name, len, "p%u.%u", q / 100, (q % 100) / 10);
+    else
+        snprintf(name, len, "p%u.%02u", q / 100, q % 100);
+}
@@ -0,0 +1,103 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TTS_AGGREGATE_H
+#define TTS_AGGREGATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Windowed aggregation, points of a window are fed in contiguous runs of
+ * values, straight from the spans of the timeseries, every aggregate
+ * requested is updated in a single pass over each run:
+ *
+ * - AVG, SUM, MIN, MAX, COUNT, FIRST and LAST are computed exactly
+ * - STDDEV is the population standard deviation, runs are merged into the
+ *   window with the pairwise update of Chan et al. to stay numerically stable
+ * - Quantiles are estimated by a sketch with logarithmic buckets, à la
+ *   DDSketch, with a relative error of at most TTS_SKETCH_ALPHA on the value,
+ *   bounded by the min and max of the window
+ *
+ * The sketch is allocated only if quantiles are requested, the aggregate is
+ * reset between windows, so a query allocates it once. Pre-aggregated rollup
+ * buckets can be merged as well, apart from quantiles which need the values.
+ */
+
+/* Names of the aggregates labelling their results, in the order of the bits */
+#define TTS_AGGREGATE_NAMES_NR 8
+
+extern const char *const tts_aggregate_names[TTS_AGGREGATE_NAMES_NR];
+
+#define TTS_SKETCH_ALPHA 0.01
+#define TTS_SKETCH_BINS  1024
+
+/*
+ * Buckets of the values of a single sign, bucket `i` counts the magnitudes
+ * with key `offset + i`, `lo` and `hi` bound the keys in use; once the range
+ * gets wider than the buckets available, the lowest ones are collapsed
+ */
+struct tts_sketch_store {
+    int offset;
+    int lo;
+    int hi;
+    uint64_t count;
+    uint64_t bins[TTS_SKETCH_BINS];
+};
+
+struct tts_sketch {
+    uint64_t zeros;
+    struct tts_sketch_store positive;
+    struct tts_sketch_store negative;
+};
+
+struct tts_aggregate {
+    unsigned aggregates;
+    uint64_t count;
+    double sum;
+    double min;
+    double max;
+    double first;
+    double last;
+    double mean;
+    double m2;
+    struct tts_sketch *sketch;
+};
+
+struct tts_bucket;
+
+void tts_aggregate_init(struct tts_aggregate *, unsigned);
+void tts_aggregate_reset(struct tts_aggregate *);
+void tts_aggregate_update(struct tts_aggregate *, const double *, size_t);
+void tts_aggregate_merge(struct tts_aggregate *, const struct tts_bucket *);
+double tts_aggregate_value(const struct tts_aggregate *, unsigned);
+double tts_aggregate_quantile(const struct tts_aggregate *, unsigned);
+void tts_aggregate_destroy(struct tts_aggregate *);
+void tts_aggregate_quantile_name(char *, size_t, unsigned);
+
+#endif
@@ -0,0 +1,119 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tts_arena.h"
+
+#define ARENA_ALIGN _Alignof(max_align_t)
+
+static inline size_t align_up(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static struct tts_arena_block *block_new(size_t size) {
+    struct tts_arena_block *block = malloc(sizeof(*block) + size);
+    if (!block)
+        return NULL;
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+static void blocks_free(struct tts_arena_block *block) {
+    struct tts_arena_block *next = NULL;
+    for (; block; block = next) {
+        next = block->next;
+        free(block);
+    }
+}
+
+void tts_arena_init(struct tts_arena *arena) {
+    arena->head = NULL;
+    arena->allocated = 0;
+}
+
+/*
+ * Allocate `size` bytes, aligned for any type, from the current block, or a
+ * new one if it doesn't fit, the previous blocks are left as they are
+ */
+void *tts_arena_alloc(struct tts_arena *arena, size_t size) {
+    struct tts_arena_block *block = arena->head;
+    size = align_up(size);
+    if (!block || block->size - block->used < size) {
+        size_t block_size = TTS_ARENA_BLOCK;
+        if (block && block->size * 2 < TTS_ARENA_MAX_BLOCK)
+            block_size = block->size * 2;
+        else if (block)
+            block_size = TTS_ARENA_MAX_BLOCK;
+        block = block_new(size > block_size ? size : block_size);
+        if (!block)
+            return NULL;
+        block->next = arena->head;
+        arena->head = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->allocated += size;
+    return ptr;
+}
+
+void *tts_arena_calloc(struct tts_arena *arena, size_t nmemb, size_t size) {
+    if (size > 0 && nmemb > SIZE_MAX / size)
+        return NULL;
+    void *ptr = tts_arena_alloc(arena, nmemb * size);
+    if (ptr)
+        memset(ptr, 0x00, nmemb * size);
+    return ptr;
+}
+
+/*
+ * Release every allocation at once, the memory is kept for the next request,
+ * merged into a single block if it was spread over many
+ */
+void tts_arena_reset(struct tts_arena *arena) {
+    struct tts_arena_block *head = arena->head;
+    if (head && (head->next || head->size > TTS_ARENA_MAX_BLOCK)) {
+        size_t size = align_up(arena->allocated);
+        if (size > TTS_ARENA_MAX_BLOCK)
+            size = TTS_ARENA_MAX_BLOCK;
+        blocks_free(head);
+        arena->head = block_new(size > TTS_ARENA_BLOCK ? size : TTS_ARENA_BLOCK);
+    } else if (head) {
+        head->used = 0;
+    }
+    arena->allocated = 0;
+}
+
+void tts_arena_destroy(struct tts_arena *arena) {
+    blocks_free(arena->head);
+    arena->head = NULL;
+    arena->allocated = 0;
+}
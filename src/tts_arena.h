@@ -0,0 +1,68 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TTS_ARENA_H
+#define TTS_ARENA_H
+
+#include <stddef.h>
+
+/*
+ * Bump allocator backing the decoding of a request, every allocation made
+ * while unpacking a packet comes from the arena and is released all at once
+ * by resetting it, once the request has been handled; what must outlive the
+ * request is copied elsewhere, like labels interned into the dictionary.
+ *
+ * Memory is carved out of a chain of blocks, a new one is added once the
+ * current is exhausted, at least as big as the allocation requested. On
+ * reset, if the request needed more than a block, the blocks are merged
+ * into a single one big enough for all of them, up to TTS_ARENA_MAX_BLOCK,
+ * so similar requests are served from a single block from then on.
+ */
+
+#define TTS_ARENA_BLOCK     4096
+#define TTS_ARENA_MAX_BLOCK (1 << 20)
+
+struct tts_arena_block {
+    struct tts_arena_block *next;
+    size_t size;
+    size_t used;
+    _Alignas(max_align_t) unsigned char data[];
+};
+
+struct tts_arena {
+    struct tts_arena_block *head;
+    size_t allocated;
+};
+
+void tts_arena_init(struct tts_arena *);
+void *tts_arena_alloc(struct tts_arena *, size_t);
+void *tts_arena_calloc(struct tts_arena *, size_t, size_t);
+void tts_arena_reset(struct tts_arena *);
+void tts_arena_destroy(struct tts_arena *);
+
+#endif
@@ -0,0 +1,552 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "pack.h"
+#include "tts_async.h"
+
+/* Bytes packed on a connection after which they're written straight away */
+#define OUT_HIGH_WATER (64 * 1024)
+
+#define REQUESTS_BASE_SLOTS 64
+
+static inline uint64_t async_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * (uint64_t) 1e9 + ts.tv_nsec;
+}
+
+/*
+ * Connect a client of the pool, negotiating the wire format, then make its
+ * socket non-blocking, from then on the connection is driven by poll
+ */
+static int conn_connect(struct tts_async_conn *conn) {
+    if (tts_client_connect(&conn->client) < 0)
+        return TTS_CLIENT_FAILURE;
+    int flags = fcntl(conn->client.fd, F_GETFL, 0);
+    if (flags < 0 ||
+        fcntl(conn->client.fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        tts_client_disconnect(&conn->client);
+        return TTS_CLIENT_FAILURE;
+    }
+    conn->client.bufsize = 0;
+    conn->connected = 1;
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * Drop a connection, the requests in flight on it are answered with no
+ * response, it's connected again once a request needs it
+ */
+static void conn_fail(struct tts_async_conn *conn) {
+    tts_client_disconnect(&conn->client);
+    tts_codec_reset(&conn->client.codec, TTS_PROTOCOL_V1);
+    conn->connected = 0;
+    conn->client.bufsize = 0;
+    conn->size = conn->sent = 0;
+    while (conn->inflight > 0) {
+        struct tts_async_request *r = &conn->requests[conn->head];
+        conn->head = (conn->head + 1) % conn->slots;
+        --conn->inflight;
+        if (r->cb)
+            r->cb(NULL, r->data);
+    }
+    conn->head = 0;
+}
+
+/* Queue the callback of a request just packed, growing the ring if full */
+static void conn_push(struct tts_async_conn *conn, tts_async_cb cb,
+                      void *data) {
+    if (conn->inflight == conn->slots) {
+        size_t slots = conn->slots * 2;
+        struct tts_async_request *requests =
+            malloc(slots * sizeof(*requests));
+        for (size_t i = 0; i < conn->inflight; ++i)
+            requests[i] = conn->requests[(conn->head + i) % conn->slots];
+        free(conn->requests);
+        conn->requests = requests;
+        conn->slots = slots;
+        conn->head = 0;
+    }
+    size_t tail = (conn->head + conn->inflight++) % conn->slots;
+    conn->requests[tail].cb = cb;
+    conn->requests[tail].data = data;
+}
+
+/*
+ * Write as much as the socket takes of the requests packed, return -1 if the
+ * connection failed
+ */
+static int conn_write(struct tts_async_conn *conn) {
+    while (conn->sent < conn->size) {
+        ssize_t n = write(conn->client.fd, conn->out + conn->sent,
+                          conn->size - conn->sent);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return TTS_CLIENT_SUCCESS;
+        if (n <= 0) {
+            conn_fail(conn);
+            return TTS_CLIENT_FAILURE;
+        }
+        conn->sent += n;
+    }
+    conn->size = conn->sent = 0;
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * Length of the frame starting at `offset` of the bytes received, 0 if it
+ * isn't whole yet
+ */
+static size_t conn_frame(const struct tts_async_conn *conn, size_t offset) {
+    const tts_client *c = &conn->client;
+    if (c->bufsize - offset < TTS_HEADER_SIZE)
+        return 0;
+    int64_t len = 0;
+    uint8_t *ptr = (uint8_t *) c->buf + offset + 1;
+    unpack_integer(&ptr, 'I', &len);
+    if (c->bufsize - offset - TTS_HEADER_SIZE < (size_t) len)
+        return 0;
+    return TTS_HEADER_SIZE + len;
+}
+
+/*
+ * Length of the response starting at `offset`, spanning all its frames when
+ * streamed, 0 if it isn't whole yet
+ */
+static size_t conn_response(const struct tts_async_conn *conn, size_t offset) {
+    union tts_header header;
+    size_t end = offset, len = 0;
+    do {
+        if ((len = conn_frame(conn, end)) == 0)
+            return 0;
+        header.byte = conn->client.buf[end];
+        end += len;
+    } while (header.opcode == TTS_QUERY_RESPONSE && header.more == 1);
+    return end - offset;
+}
+
+/*
+ * Decode every whole response received and hand it to the callback of its
+ * request. The payloads of a response streamed in multiple frames are moved
+ * right after the header of the first, as `tts_client_recv_response` does,
+ * to be decoded at once, with the status of the last. Return the number of
+ * responses handled
+ */
+static int conn_dispatch(struct tts_async_conn *conn) {
+    tts_client *c = &conn->client;
+    size_t offset = 0, end = 0, len = 0, payload = 0, next = 0;
+    union tts_header header, last;
+    struct tts_packet packet;
+    int n = 0;
+    while (conn->inflight > 0 && (len = conn_response(conn, offset)) > 0) {
+        end = offset + len;
+        payload = conn_frame(conn, offset) - TTS_HEADER_SIZE;
+        last.byte = c->buf[offset];
+        for (next = offset + TTS_HEADER_SIZE + payload; next < end;) {
+            len = conn_frame(conn, next);
+            last.byte = c->buf[next];
+            memmove(c->buf + offset + TTS_HEADER_SIZE + payload,
+                    c->buf + next + TTS_HEADER_SIZE, len - TTS_HEADER_SIZE);
+            payload += len - TTS_HEADER_SIZE;
+            next += len;
+        }
+        header.byte = c->buf[offset];
+        header.more = 0;
+        header.status = last.status;
+        c->buf[offset] = header.byte;
+        uint8_t *ptr = (uint8_t *) c->buf + offset + 1;
+        pack_integer(&ptr, 'I', payload);
+        int rc = tts_codec_unpack(&c->codec, (uint8_t *) c->buf + offset,
+                                  &packet, &c->arena);
+        struct tts_async_request r = conn->requests[conn->head];
+        conn->head = (conn->head + 1) % conn->slots;
+        --conn->inflight;
+        /* A malformed response is handed as no response */
+        if (r.cb)
+            r.cb(rc == 0 ? &packet : NULL, r.data);
+        ++n;
+        /* The callback may have made a request failing the connection */
+        if (!conn->connected)
+            return n;
+        tts_arena_reset(&c->arena);
+        offset = end;
+    }
+    if (offset > 0) {
+        memmove(c->buf, c->buf + offset, c->bufsize - offset);
+        c->bufsize -= offset;
+    }
+    return n;
+}
+
+/*
+ * Read everything the socket has to give, then hand the responses whole to
+ * their callbacks. Return the number of responses handled, -1 if the
+ * connection failed
+ */
+static int conn_read(struct tts_async_conn *conn) {
+    tts_client *c = &conn->client;
+    int n = 0;
+    for (;;) {
+        if (c->bufsize == c->capacity) {
+            c->capacity *= 2;
+            c->buf = realloc(c->buf, c->capacity);
+        }
+        ssize_t r = read(c->fd, c->buf + c->bufsize, c->capacity - c->bufsize);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (r <= 0) {
+            conn_fail(conn);
+            return TTS_CLIENT_FAILURE;
+        }
+        c->bufsize += r;
+        n += conn_dispatch(conn);
+        if (!conn->connected)
+            break;
+    }
+    return n;
+}
+
+/*
+ * Pick the connection with the fewest requests in flight, connecting again
+ * the ones lost if none is left
+ */
+static struct tts_async_conn *async_pick(struct tts_async *async) {
+    struct tts_async_conn *conn = NULL;
+    for (unsigned i = 0; i < async->options.connections; ++i) {
+        struct tts_async_conn *c = &async->conns[i];
+        if (c->connected && (!conn || c->inflight < conn->inflight))
+            conn = c;
+    }
+    for (unsigned i = 0; !conn && i < async->options.connections; ++i)
+        if (conn_connect(&async->conns[i]) == TTS_CLIENT_SUCCESS)
+            conn = &async->conns[i];
+    return conn;
+}
+
+/*
+ * Pack a request on a connection of the pool, it's written once enough have
+ * been packed, or on the next poll; the packet can be released as soon as
+ * this returns
+ */
+static int async_send(struct tts_async *async, const struct tts_packet *p,
+                      tts_async_cb cb, void *data) {
+    struct tts_async_conn *conn = async_pick(async);
+    if (!conn)
+        return TTS_CLIENT_FAILURE;
+    size_t size = tts_codec_packet_size(&conn->client.codec, p);
+    if (conn->capacity < conn->size + size) {
+        while (conn->capacity < conn->size + size)
+            conn->capacity *= 2;
+        conn->out = realloc(conn->out, conn->capacity);
+    }
+    conn->size += tts_codec_pack(&conn->client.codec, p,
+                                 (uint8_t *) conn->out + conn->size);
+    conn_push(conn, cb, data);
+    if (conn->size - conn->sent >= OUT_HIGH_WATER)
+        conn_write(conn);
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * Set up the pool and connect all of its connections, fields of `options`
+ * left to 0 get their default, at least one connection must succeed
+ */
+int tts_async_init(struct tts_async *async,
+                   const struct tts_connect_options *opts,
+                   const struct tts_async_options *options) {
+    int connected = 0;
+    memset(async, 0x00, sizeof(*async));
+    async->opts = opts;
+    if (options)
+        async->options = *options;
+    if (async->options.connections == 0)
+        async->options.connections = TTS_ASYNC_CONNECTIONS;
+    if (async->options.batch_points == 0)
+        async->options.batch_points = TTS_ASYNC_BATCH_POINTS;
+    if (async->options.batch_delay == 0)
+        async->options.batch_delay = TTS_ASYNC_BATCH_DELAY;
+    async->conns = calloc(async->options.connections, sizeof(*async->conns));
+    async->fds = calloc(async->options.connections, sizeof(*async->fds));
+    for (unsigned i = 0; i < async->options.connections; ++i) {
+        struct tts_async_conn *conn = &async->conns[i];
+        tts_client_init(&conn->client, opts);
+        conn->capacity = OUT_HIGH_WATER;
+        conn->out = malloc(conn->capacity);
+        conn->slots = REQUESTS_BASE_SLOTS;
+        conn->requests = malloc(conn->slots * sizeof(*conn->requests));
+        if (conn_connect(conn) == TTS_CLIENT_SUCCESS)
+            ++connected;
+    }
+    TTS_VECTOR_NEW(async->batch);
+    tts_arena_init(&async->arena);
+    if (connected == 0) {
+        tts_async_destroy(async);
+        return TTS_CLIENT_FAILURE;
+    }
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * Close every connection, requests still in flight are answered with no
+ * response and points not flushed are discarded
+ */
+void tts_async_destroy(struct tts_async *async) {
+    for (unsigned i = 0; i < async->options.connections; ++i) {
+        struct tts_async_conn *conn = &async->conns[i];
+        if (conn->connected)
+            conn_fail(conn);
+        tts_client_destroy(&conn->client);
+        free(conn->out);
+        free(conn->requests);
+    }
+    free(async->conns);
+    free(async->fds);
+    TTS_VECTOR_DESTROY(async->batch);
+    tts_arena_destroy(&async->arena);
+}
+
+/* Create a timeseries, `retention` in milliseconds, 0 for none */
+int tts_async_create(struct tts_async *async, const char *name,
+                     int64_t retention, tts_async_cb cb, void *data) {
+    struct tts_packet p = { 0 };
+    size_t len = strlen(name);
+    if (len > UINT8_MAX || retention < 0)
+        return TTS_CLIENT_FAILURE;
+    TTS_SET_REQUEST_HEADER(&p, TTS_CREATE_TS);
+    p.create.ts_name_len = len;
+    p.create.ts_name = (uint8_t *) name;
+    p.create.retention = retention * 1e6;
+    return async_send(async, &p, cb, data);
+}
+
+int tts_async_delete(struct tts_async *async, const char *name,
+                     tts_async_cb cb, void *data) {
+    struct tts_packet p = { 0 };
+    size_t len = strlen(name);
+    if (len > UINT8_MAX)
+        return TTS_CLIENT_FAILURE;
+    TTS_SET_REQUEST_HEADER(&p, TTS_DELETE_TS);
+    p.drop.ts_name_len = len;
+    p.drop.ts_name = (uint8_t *) name;
+    return async_send(async, &p, cb, data);
+}
+
+static uint8_t *arena_strdup(struct tts_arena *arena, const char *str,
+                             size_t len) {
+    uint8_t *copy = tts_arena_alloc(arena, len + 1);
+    memcpy(copy, str, len + 1);
+    return copy;
+}
+
+/*
+ * Add a point to the batch, `t` in nanoseconds, 0 to let the server stamp it
+ * on arrival; name and labels are copied, so they can be released right
+ * after. The batch is sent once it reaches `batch_points` points
+ */
+int tts_async_add(struct tts_async *async, const char *name, tts_timestamp t,
+                  double value, const struct tts_async_label *labels,
+                  size_t labels_nr) {
+    struct tts_addpoints add = { 0 };
+    size_t len = strlen(name);
+    if (len > UINT8_MAX || labels_nr > UINT16_MAX)
+        return TTS_CLIENT_FAILURE;
+    add.ts_name_len = len;
+    add.ts_name = arena_strdup(&async->arena, name, len);
+    add.points_len = 1;
+    add.points = tts_arena_calloc(&async->arena, 1, sizeof(*add.points));
+    if (t != 0) {
+        add.points->bits.ts_sec_set = 1;
+        add.points->bits.ts_nsec_set = 1;
+        add.points->ts_sec = t / (tts_timestamp) 1e9;
+        add.points->ts_nsec = t % (tts_timestamp) 1e9;
+    }
+    add.points->value = value;
+    add.points->labels_len = labels_nr;
+    if (labels_nr > 0)
+        add.points->labels = tts_arena_calloc(&async->arena, labels_nr,
+                                              sizeof(*add.points->labels));
+    for (size_t i = 0; i < labels_nr; ++i) {
+        size_t label_len = strlen(labels[i].label);
+        size_t value_len = strlen(labels[i].value);
+        if (label_len > UINT16_MAX || value_len > UINT16_MAX)
+            return TTS_CLIENT_FAILURE;
+        add.points->labels[i].label_len = label_len;
+        add.points->labels[i].label =
+            arena_strdup(&async->arena, labels[i].label, label_len);
+        add.points->labels[i].value_len = value_len;
+        add.points->labels[i].value =
+            arena_strdup(&async->arena, labels[i].value, value_len);
+    }
+    if (TTS_VECTOR_SIZE(async->batch) == 0)
+        async->batch_since = async_clock();
+    TTS_VECTOR_APPEND(async->batch, add);
+    if (TTS_VECTOR_SIZE(async->batch) >= async->options.batch_points)
+        return tts_async_flush(async);
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * Run a query, filled as `struct tts_query` describes, the response holds
+ * the points or aggregates selected
+ */
+int tts_async_query(struct tts_async *async, const struct tts_query *query,
+                    tts_async_cb cb, void *data) {
+    struct tts_packet p = { 0 };
+    TTS_SET_REQUEST_HEADER(&p, TTS_QUERY);
+    p.query = *query;
+    return async_send(async, &p, cb, data);
+}
+
+/* Retrieve the latest `points` points of each of the `n` timeseries named */
+int tts_async_mlast(struct tts_async *async, const char **names, size_t n,
+                    uint16_t points, tts_async_cb cb, void *data) {
+    struct tts_packet p = { 0 };
+    int rc = TTS_CLIENT_FAILURE;
+    TTS_SET_REQUEST_HEADER(&p, TTS_MLAST);
+    p.mlast.points = points;
+    p.mlast.series_nr = n;
+    p.mlast.series = calloc(n, sizeof(*p.mlast.series));
+    for (size_t i = 0; i < n; ++i) {
+        size_t len = strlen(names[i]);
+        if (len > UINT8_MAX)
+            goto out;
+        p.mlast.series[i].ts_name_len = len;
+        p.mlast.series[i].ts_name = (uint8_t *) names[i];
+    }
+    rc = async_send(async, &p, cb, data);
+out:
+    free(p.mlast.series);
+    return rc;
+}
+
+/*
+ * Send the points batched so far as a single MADD and write out every
+ * request packed on the connections, as far as their sockets take them
+ */
+int tts_async_flush(struct tts_async *async) {
+    int rc = TTS_CLIENT_SUCCESS;
+    if (TTS_VECTOR_SIZE(async->batch) > 0) {
+        struct tts_packet p = { 0 };
+        TTS_SET_REQUEST_HEADER(&p, TTS_MADDPOINTS);
+        p.maddpoints.points_len = TTS_VECTOR_SIZE(async->batch);
+        p.maddpoints.pts = async->batch.data;
+        rc = async_send(async, &p, async->options.on_batch,
+                        async->options.batch_data);
+        TTS_VECTOR_SIZE(async->batch) = 0;
+        tts_arena_reset(&async->arena);
+    }
+    for (unsigned i = 0; i < async->options.connections; ++i)
+        if (async->conns[i].connected && async->conns[i].size > 0)
+            conn_write(&async->conns[i]);
+    return rc;
+}
+
+/*
+ * Milliseconds left before the batch is due, -1 without a batch pending
+ */
+static int batch_timeout(const struct tts_async *async) {
+    if (TTS_VECTOR_SIZE(async->batch) == 0)
+        return -1;
+    uint64_t elapsed = (async_clock() - async->batch_since) / 1000000;
+    if (elapsed >= async->options.batch_delay)
+        return 0;
+    return async->options.batch_delay - elapsed;
+}
+
+/*
+ * Drive the connections, write out the requests packed, read the responses
+ * and run their callbacks, waiting up to `timeout` milliseconds, -1 for no
+ * limit, for something to happen, or less if a batch is due before. Not to be
+ * called from a callback. Return the number of responses handled, -1 if no
+ * connection is left
+ */
+int tts_async_poll(struct tts_async *async, int timeout) {
+    int batch = batch_timeout(async), n = 0, handled = 0, live = 0;
+    if (batch == 0) {
+        tts_async_flush(async);
+        batch = -1;
+    }
+    if (batch >= 0 && (timeout < 0 || batch < timeout))
+        timeout = batch;
+    /* Connections lost are left out by a negative descriptor */
+    for (unsigned i = 0; i < async->options.connections; ++i) {
+        struct tts_async_conn *conn = &async->conns[i];
+        if (conn->connected && conn->size > 0)
+            conn_write(conn);
+        async->fds[i].fd = conn->connected ? conn->client.fd : -1;
+        async->fds[i].events = POLLIN | (conn->size > 0 ? POLLOUT : 0);
+        async->fds[i].revents = 0;
+        live += conn->connected;
+    }
+    if (live == 0)
+        return TTS_CLIENT_FAILURE;
+    if ((n = poll(async->fds, async->options.connections, timeout)) < 0)
+        return errno == EINTR ? 0 : TTS_CLIENT_FAILURE;
+    for (unsigned i = 0; n > 0 && i < async->options.connections; ++i) {
+        struct tts_async_conn *conn = &async->conns[i];
+        short revents = async->fds[i].revents;
+        if (conn->connected && (revents & POLLOUT))
+            conn_write(conn);
+        if (conn->connected && (revents & (POLLIN | POLLERR | POLLHUP))) {
+            int r = conn_read(conn);
+            if (r > 0)
+                handled += r;
+        }
+    }
+    if (batch_timeout(async) == 0)
+        tts_async_flush(async);
+    return handled;
+}
+
+/*
+ * Flush the batch and wait till every request in flight has been answered
+ */
+int tts_async_wait(struct tts_async *async) {
+    if (tts_async_flush(async) < 0)
+        return TTS_CLIENT_FAILURE;
+    while (tts_async_inflight(async) > 0)
+        if (tts_async_poll(async, -1) < 0)
+            return TTS_CLIENT_FAILURE;
+    return TTS_CLIENT_SUCCESS;
+}
+
+/* Number of requests waiting for their response, on all the connections */
+size_t tts_async_inflight(const struct tts_async *async) {
+    size_t n = 0;
+    for (unsigned i = 0; i < async->options.connections; ++i)
+        n += async->conns[i].inflight;
+    return n;
+}
@@ -0,0 +1,132 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TTS_ASYNC_H
+#define TTS_ASYNC_H
+
+#include <poll.h>
+#include <stdint.h>
+#include "tts_arena.h"
+#include "tts_vector.h"
+#include "tts_client.h"
+
+/* Defaults of `struct tts_async_options` fields left to 0 */
+#define TTS_ASYNC_CONNECTIONS  1
+#define TTS_ASYNC_BATCH_POINTS 512
+#define TTS_ASYNC_BATCH_DELAY  10
+
+/*
+ * Called with the response to a request, decoded into the arena of its
+ * connection, valid only for the time of the call; NULL if the connection
+ * was lost before the response came
+ */
+typedef void (*tts_async_cb)(const struct tts_packet *, void *);
+
+/*
+ * Options of an asynchronous client:
+ * - connections  number of connections in the pool, requests go to the one
+ *                with the fewest in flight
+ * - batch_points points added after which the batch is sent as a MADD
+ * - batch_delay  milliseconds after which a batch is sent anyway, counting
+ *                from its first point
+ * - on_batch     called with the ACK of every batch sent, along with
+ *                `batch_data`, optional
+ */
+struct tts_async_options {
+    unsigned connections;
+    size_t batch_points;
+    unsigned batch_delay;
+    tts_async_cb on_batch;
+    void *batch_data;
+};
+
+struct tts_async_label {
+    const char *label;
+    const char *value;
+};
+
+/* A request waiting for its response */
+struct tts_async_request {
+    tts_async_cb cb;
+    void *data;
+};
+
+/*
+ * A connection of the pool, requests are packed into `out` as they're made,
+ * `sent` bytes of it already written, and their callbacks queued in order
+ * into a ring, as the server answers in the same order; received bytes are
+ * accumulated into the buffer of the client till a response is whole
+ */
+struct tts_async_conn {
+    tts_client client;
+    int connected;
+    size_t size;
+    size_t sent;
+    size_t capacity;
+    char *out;
+    size_t head;
+    size_t inflight;
+    size_t slots;
+    struct tts_async_request *requests;
+};
+
+/*
+ * Asynchronous pipelined client, requests are made by typed calls instead of
+ * commands to parse, they don't wait for their response, which is given to
+ * their callback once received by `tts_async_poll`, in the meanwhile any
+ * number of requests can be in flight. Points added are coalesced into a
+ * batch, owned by the arena, sent as a single MADD request once it's big or
+ * old enough, or on `tts_async_flush`.
+ */
+struct tts_async {
+    const struct tts_connect_options *opts;
+    struct tts_async_options options;
+    struct tts_async_conn *conns;
+    struct pollfd *fds;
+    TTS_VECTOR(struct tts_addpoints) batch;
+    struct tts_arena arena;
+    uint64_t batch_since;
+};
+
+int tts_async_init(struct tts_async *, const struct tts_connect_options *,
+                   const struct tts_async_options *);
+void tts_async_destroy(struct tts_async *);
+int tts_async_create(struct tts_async *, const char *, int64_t,
+                     tts_async_cb, void *);
+int tts_async_delete(struct tts_async *, const char *, tts_async_cb, void *);
+int tts_async_add(struct tts_async *, const char *, tts_timestamp, double,
+                  const struct tts_async_label *, size_t);
+int tts_async_query(struct tts_async *, const struct tts_query *,
+                    tts_async_cb, void *);
+int tts_async_mlast(struct tts_async *, const char **, size_t, uint16_t,
+                    tts_async_cb, void *);
+int tts_async_flush(struct tts_async *);
+int tts_async_poll(struct tts_async *, int);
+int tts_async_wait(struct tts_async *);
+size_t tts_async_inflight(const struct tts_async *);
+
+#endif
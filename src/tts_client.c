@@ -39,7 +39,7 @@
 #include "tts_client.h"
 
 #define BUFSIZE             2048
-#define COMMANDS_NR         5
+#define COMMANDS_NR         8
 
 typedef int (*tts_cmd_handler)(char *, struct tts_packet *);
 
@@ -48,13 +48,19 @@ static int tts_handle_delete(char *, struct tts_packet *);
 static int tts_handle_add(char *, struct tts_packet *);
 static int tts_handle_madd(char *, struct tts_packet *);
 static int tts_handle_query(char *, struct tts_packet *);
+static int tts_handle_mlast(char *, struct tts_packet *);
+static int tts_handle_info(char *, struct tts_packet *);
+static int tts_handle_subscribe(char *, struct tts_packet *);
 
 static const char *cmds[COMMANDS_NR] = {
     "create",
     "delete",
     "add",
     "madd",
-    "query"
+    "query",
+    "mlast",
+    "info",
+    "subscribe"
 };
 
 static tts_cmd_handler handlers[COMMANDS_NR] = {
@@ -62,7 +68,10 @@ static tts_cmd_handler handlers[COMMANDS_NR] = {
     tts_handle_delete,
     tts_handle_add,
     tts_handle_madd,
-    tts_handle_query
+    tts_handle_query,
+    tts_handle_mlast,
+    tts_handle_info,
+    tts_handle_subscribe
 };
 
 static inline unsigned count_tokens(const char *str, char delim) {
@@ -112,6 +121,10 @@ static inline long double read_real(const char *str) {
     return n;
 }
 
+/*
+ * Release a request parsed from a command, responses are owned by the arena
+ * of the client instead
+ */
 void tts_client_packet_destroy(struct tts_packet *tts_p) {
     if (tts_p->header.type == TTS_REQUEST) {
         switch (tts_p->header.opcode) {
@@ -123,7 +136,7 @@ void tts_client_packet_destroy(struct tts_packet *tts_p) {
                 break;
             case TTS_ADDPOINTS:
                 free(tts_p->addpoints.ts_name);
-                for (int i = 0; i < tts_p->addpoints.points_len; ++i) {
+                for (uint32_t i = 0; i < tts_p->addpoints.points_len; ++i) {
                     for (int j = 0; j < tts_p->addpoints.points[i].labels_len; ++j) {
                         free(tts_p->addpoints.points[i].labels[j].label);
                         free(tts_p->addpoints.points[i].labels[j].value);
@@ -133,27 +146,25 @@ void tts_client_packet_destroy(struct tts_packet *tts_p) {
                 free(tts_p->addpoints.points);
                 break;
             case TTS_MADDPOINTS:
-                for (int i = 0; i < tts_p->maddpoints.points_len; ++i) {
+                for (uint32_t i = 0; i < tts_p->maddpoints.points_len; ++i) {
                     free(tts_p->maddpoints.pts[i].ts_name);
                     free(tts_p->maddpoints.pts[i].points);
                 }
                 free(tts_p->maddpoints.pts);
                 break;
             case TTS_QUERY:
+            case TTS_SUBSCRIBE:
                 free(tts_p->query.ts_name);
+                tts_query_filters_destroy(tts_p->query.filters,
+                                          tts_p->query.filters_nr);
                 break;
-        }
-    } else {
-        switch (tts_p->header.opcode) {
-            case TTS_QUERY_RESPONSE:
-                for (size_t i = 0; i < tts_p->query_r.len; ++i) {
-                    for (int j = 0; j < tts_p->query_r.results[i].labels_len; ++j) {
-                        free(tts_p->query_r.results[i].labels[j].label);
-                        free(tts_p->query_r.results[i].labels[j].value);
-                    }
-                    free(tts_p->query_r.results[i].labels);
-                }
-                free(tts_p->query_r.results);
+            case TTS_MLAST:
+                for (uint32_t i = 0; i < tts_p->mlast.series_nr; ++i)
+                    free(tts_p->mlast.series[i].ts_name);
+                free(tts_p->mlast.series);
+                break;
+            case TTS_INFO:
+                free(tts_p->info.data);
                 break;
         }
     }
@@ -307,6 +318,38 @@ static int tts_handle_madd(char *line, struct tts_packet *tts_p) {
     return TTS_CLIENT_SUCCESS;
 }
 
+/*
+ * Parse a comma separated list of aggregates, quantiles are in the form p99
+ * or p99.9, up to TTS_QUERY_QUANTILES_MAX of them
+ */
+static int parse_aggregates(char *list, struct tts_query *query) {
+    static const char *names[] = {
+        "avg", "sum", "min", "max", "count", "first", "last", "stddev"
+    };
+    char *save = NULL, *name = strtok_r(list, ",", &save);
+    query->bits.aggregate = 1;
+    for (; name; name = strtok_r(NULL, ",", &save)) {
+        size_t i = 0;
+        for (; i < sizeof(names) / sizeof(*names); ++i)
+            if (strcasecmp(name, names[i]) == 0)
+                break;
+        if (i < sizeof(names) / sizeof(*names)) {
+            query->aggregates |= 1 << i;
+            continue;
+        }
+        if ((*name != 'p' && *name != 'P') || name[1] == '\0' ||
+            query->quantiles_nr == TTS_QUERY_QUANTILES_MAX)
+            return -1;
+        char *end = NULL;
+        double q = strtod(name + 1, &end);
+        if (*end != '\0' || q < 0 || q > 100)
+            return -1;
+        query->aggregates |= TTS_AGG_QUANTILE;
+        query->quantiles[query->quantiles_nr++] = (uint16_t) (q * 100 + 0.5);
+    }
+    return 0;
+}
+
 static int tts_handle_query(char *line, struct tts_packet *tts_p) {
     TTS_SET_REQUEST_HEADER(tts_p, TTS_QUERY);
     char *token = strtok(line, " ");
@@ -314,9 +357,12 @@ static int tts_handle_query(char *line, struct tts_packet *tts_p) {
     tts_p->query.ts_name = malloc(tts_p->query.ts_name_len + 1);
     snprintf((char *) tts_p->query.ts_name,
              tts_p->query.ts_name_len + 1, "%s", token);
+    /* Names carrying glob characters select all the timeseries matching */
+    if (strpbrk(token, "*?[") != NULL)
+        tts_p->query.bits.select = 1;
     while ((token = strtok(NULL, " "))) {
         if (strcmp(token, "*") == 0) {
-            tts_p->query.byte = 0x00;
+            tts_p->query.byte &= TTS_QUERY_SELECT;
         } else if (strcmp(token, ">") == 0) {
             tts_p->query.bits.major_of = 1;
             token = strtok(NULL, " ");
@@ -348,15 +394,103 @@ static int tts_handle_query(char *line, struct tts_packet *tts_p) {
             token = strtok(NULL, " ");
             tts_p->query.mean_val = atoll(token);
             tts_p->query.bits.mean = 1;
+        } else if (strcasecmp(token, "window") == 0) {
+            token = strtok(NULL, " ");
+            if (!token)
+                return TTS_CLIENT_FAILURE;
+            tts_p->query.mean_val = atoll(token);
+            tts_p->query.bits.mean = 1;
+        } else if (strcasecmp(token, "agg") == 0) {
+            token = strtok(NULL, " ");
+            if (!token || parse_aggregates(token, &tts_p->query) < 0)
+                return TTS_CLIENT_FAILURE;
+        } else if (strcasecmp(token, "where") == 0) {
+            /* Label filters, pairs of label and value till the end */
+            tts_p->query.bits.filter = 1;
+            while ((token = strtok(NULL, " "))) {
+                char *value = strtok(NULL, " ");
+                if (!value)
+                    return TTS_CLIENT_FAILURE;
+                size_t i = tts_p->query.filters_nr++;
+                tts_p->query.filters =
+                    realloc(tts_p->query.filters,
+                            tts_p->query.filters_nr *
+                            sizeof(*tts_p->query.filters));
+                tts_p->query.filters[i].label_len = strlen(token);
+                tts_p->query.filters[i].label = (uint8_t *) strdup(token);
+                tts_p->query.filters[i].value_len = strlen(value);
+                tts_p->query.filters[i].value = (uint8_t *) strdup(value);
+            }
+            break;
         }
     }
     return TTS_CLIENT_SUCCESS;
 }
 
-static ssize_t tts_parse_request(char *cmd, char *buf) {
+/*
+ * MLAST timeseries-name .. [POINTS n], the latest n points, 1 by default, of
+ * each timeseries
+ */
+static int tts_handle_mlast(char *line, struct tts_packet *tts_p) {
+    if (count_tokens(line, ' ') < 1)
+        return TTS_CLIENT_UNKNOWN_CMD;
+    TTS_SET_REQUEST_HEADER(tts_p, TTS_MLAST);
+    struct tts_mlast *mlast = &tts_p->mlast;
+    char *token = strtok(line, " ");
+    mlast->points = 1;
+    while (token) {
+        if (strcasecmp(token, "points") == 0) {
+            token = strtok(NULL, " ");
+            long long n = token ? read_number(token) : TTS_CLIENT_FAILURE;
+            if (n <= 0 || n > UINT16_MAX)
+                return TTS_CLIENT_FAILURE;
+            mlast->points = n;
+        } else {
+            uint32_t i = mlast->series_nr++;
+            mlast->series = realloc(mlast->series,
+                                    mlast->series_nr * sizeof(*mlast->series));
+            mlast->series[i].ts_name_len = strlen(token);
+            mlast->series[i].ts_name = malloc(mlast->series[i].ts_name_len + 1);
+            snprintf((char *) mlast->series[i].ts_name,
+                     mlast->series[i].ts_name_len + 1, "%s", token);
+        }
+        token = strtok(NULL, " ");
+    }
+    return mlast->series_nr > 0 ? TTS_CLIENT_SUCCESS : TTS_CLIENT_UNKNOWN_CMD;
+}
+
+/*
+ * INFO [pattern], the statistics of the server, reporting one by one the
+ * timeseries matching the pattern, every one without it
+ */
+static int tts_handle_info(char *line, struct tts_packet *tts_p) {
+    TTS_SET_REQUEST_HEADER(tts_p, TTS_INFO);
+    char *token = strtok(line, " ");
+    if (!token)
+        return TTS_CLIENT_SUCCESS;
+    if (strtok(NULL, " "))
+        return TTS_CLIENT_UNKNOWN_CMD;
+    tts_p->info.len = strlen(token);
+    tts_p->info.data = (uint8_t *) strdup(token);
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * SUBSCRIBE timeseries-name [WINDOW value] [AGG aggregate,..] [WHERE label
+ * value ..], the arguments of a query, ranges, first and last are ignored
+ */
+static int tts_handle_subscribe(char *line, struct tts_packet *tts_p) {
+    int err = tts_handle_query(line, tts_p);
+    TTS_SET_REQUEST_HEADER(tts_p, TTS_SUBSCRIBE);
+    return err;
+}
+
+static ssize_t tts_parse_request(struct tts_codec *codec,
+                                 char *cmd, char *buf) {
     if (strncasecmp(cmd, "quit", 4) == 0 || strncasecmp(cmd, "exit", 4) == 0)
         return TTS_CLIENT_SUCCESS;
-    if (count_tokens(cmd, ' ') < 1)
+    /* INFO is the only command not requiring arguments */
+    if (count_tokens(cmd, ' ') < 1 && strncasecmp(cmd, "info", 4) != 0)
         return TTS_CLIENT_UNKNOWN_CMD;
     int cmd_id = -1, i, err = 0;
     ssize_t len = 0LL;
@@ -370,10 +504,12 @@ static ssize_t tts_parse_request(char *cmd, char *buf) {
         goto err;
     remove_newline(cmd);
     err = handlers[cmd_id](cmd + strlen(cmds[cmd_id]), &tts_p);
-    if (err < 0)
+    if (err < 0) {
+        tts_client_packet_destroy(&tts_p);
         goto err;
+    }
 
-    len = pack_tts_packet(&tts_p, (uint8_t *) buf);
+    len = tts_codec_pack(codec, &tts_p, (uint8_t *) buf);
     tts_client_packet_destroy(&tts_p);
 
     return len;
@@ -381,8 +517,11 @@ err:
     return TTS_CLIENT_FAILURE;
 }
 
-static ssize_t tts_parse_response(char *res, struct tts_packet *tts_p) {
-    unpack_tts_packet((uint8_t *) res, tts_p);
+static ssize_t tts_parse_response(struct tts_codec *codec, char *res,
+                                  struct tts_packet *tts_p,
+                                  struct tts_arena *arena) {
+    if (tts_codec_unpack(codec, (uint8_t *) res, tts_p, arena) < 0)
+        return TTS_CLIENT_FAILURE;
     return TTS_CLIENT_SUCCESS;
 }
 
@@ -457,10 +596,33 @@ void tts_client_init(tts_client *client,
     client->bufsize = 0;
     client->capacity = BUFSIZE;
     client->opts = opts;
+    tts_arena_init(&client->arena);
+    tts_codec_init(&client->codec);
 }
 
 void tts_client_destroy(tts_client *client) {
     free(client->buf);
+    tts_arena_destroy(&client->arena);
+    tts_codec_destroy(&client->codec);
+}
+
+/*
+ * Negotiate the second version of the wire format, servers not supporting it
+ * answer with a TTS_UNKNOWN_CMD ACK, the connection stays on the first one
+ */
+static int tts_client_hello(tts_client *client) {
+    struct tts_packet hello = { .hello = { .version = TTS_PROTOCOL_V2 } };
+    struct tts_packet response;
+    TTS_SET_REQUEST_HEADER(&hello, TTS_HELLO);
+    tts_codec_reset(&client->codec, TTS_PROTOCOL_V1);
+    client->bufsize = pack_tts_packet(&hello, (uint8_t *) client->buf);
+    if (write(client->fd, client->buf, client->bufsize) <= 0)
+        return TTS_CLIENT_FAILURE;
+    if (tts_client_recv_response(client, &response) < 0)
+        return TTS_CLIENT_FAILURE;
+    if (response.header.opcode == TTS_HELLO)
+        tts_codec_reset(&client->codec, response.hello.version);
+    return TTS_CLIENT_SUCCESS;
 }
 
 int tts_client_connect(tts_client *client) {
@@ -468,6 +630,8 @@ int tts_client_connect(tts_client *client) {
     if (fd < 0)
         return TTS_CLIENT_FAILURE;
     client->fd = fd;
+    if (client->opts->version > TTS_PROTOCOL_V1)
+        return tts_client_hello(client);
     return TTS_CLIENT_SUCCESS;
 }
 
@@ -476,7 +640,7 @@ void tts_client_disconnect(tts_client *client) {
 }
 
 int tts_client_send_command(tts_client *client, char *command) {
-    ssize_t size = tts_parse_request(command, client->buf);
+    ssize_t size = tts_parse_request(&client->codec, command, client->buf);
     if (size <= 0)
         return size;
     client->bufsize = size;
@@ -486,17 +650,96 @@ int tts_client_send_command(tts_client *client, char *command) {
     return n;
 }
 
+/*
+ * Pack a batch of requests back to back and send them in a single write, to
+ * pipeline them, their responses are to be received one by one, in the same
+ * order. Each one is sized right before being packed, as in the second wire
+ * format the size depends on the strings sent before it
+ */
+int tts_client_send_packets(tts_client *client,
+                            const struct tts_packet *packets, size_t n) {
+    size_t len = 0, size = 0;
+    ssize_t written = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size = tts_codec_packet_size(&client->codec, &packets[i]);
+        if (client->capacity < len + size) {
+            while (client->capacity < len + size)
+                client->capacity *= 2;
+            client->buf = realloc(client->buf, client->capacity);
+        }
+        len += tts_codec_pack(&client->codec, &packets[i],
+                              (uint8_t *) client->buf + len);
+    }
+    client->bufsize = len;
+    for (size = 0; size < len; size += written) {
+        written = write(client->fd, client->buf + size, len - size);
+        if (written <= 0)
+            return TTS_CLIENT_FAILURE;
+    }
+    return len;
+}
+
+/*
+ * Read exactly `len` bytes from the socket into the client buffer, starting
+ * at `offset`, growing the buffer if needed
+ */
+static int tts_client_read(tts_client *client, size_t offset, size_t len) {
+    ssize_t n = 0;
+    if (client->capacity < offset + len) {
+        while (client->capacity < offset + len)
+            client->capacity *= 2;
+        client->buf = realloc(client->buf, client->capacity);
+    }
+    while (len > 0) {
+        n = read(client->fd, client->buf + offset, len);
+        if (n <= 0)
+            return TTS_CLIENT_FAILURE;
+        offset += n;
+        len -= n;
+    }
+    client->bufsize = offset;
+    return TTS_CLIENT_SUCCESS;
+}
+
+/*
+ * Receive a response, query responses can be streamed by the server in
+ * multiple frames, each one but the last with the `more` header bit set,
+ * their payloads are read one after the other, right after the header of the
+ * first frame, so they're decoded at once as a single packet, into the arena,
+ * with the status of the last frame, telling if the results are complete
+ */
 int tts_client_recv_response(tts_client *client, struct tts_packet *tts_p) {
-    int64_t val;
-    uint8_t *ptr = (uint8_t *) client->buf + 1;
-    int n = read(client->fd, client->buf, 5);
-    unpack_integer(&ptr, 'I', &val);
-    if (val == 0)
-        goto parse;
-    n = read(client->fd, client->buf+5, val);
-    if (n <= 0)
+    union tts_header header;
+    int64_t val = 0;
+    uint8_t *ptr = NULL;
+    size_t offset = 0;
+    uint8_t status = TTS_OK;
+    int n = 0;
+    tts_arena_reset(&client->arena);
+    do {
+        if (tts_client_read(client, offset, TTS_HEADER_SIZE) < 0)
+            return TTS_CLIENT_FAILURE;
+        header.byte = client->buf[offset];
+        ptr = (uint8_t *) client->buf + offset + 1;
+        unpack_integer(&ptr, 'I', &val);
+        // Only the header of the first frame is kept, the payloads of the
+        // others overwrite theirs
+        if (offset == 0)
+            offset = TTS_HEADER_SIZE;
+        if (val > 0 && tts_client_read(client, offset, val) < 0)
+            return TTS_CLIENT_FAILURE;
+        offset += val;
+        n += TTS_HEADER_SIZE + val;
+    } while (header.opcode == TTS_QUERY_RESPONSE && header.more == 1);
+    status = header.status;
+    header.byte = client->buf[0];
+    header.more = 0;
+    header.status = status;
+    client->buf[0] = header.byte;
+    ptr = (uint8_t *) client->buf + 1;
+    pack_integer(&ptr, 'I', offset - TTS_HEADER_SIZE);
+    if (tts_parse_response(&client->codec, client->buf,
+                           tts_p, &client->arena) < 0)
         return TTS_CLIENT_FAILURE;
-parse:
-    tts_parse_response(client->buf, tts_p);
     return n;
 }
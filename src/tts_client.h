@@ -30,29 +30,33 @@
 
 #include <stdio.h>
 #include <netdb.h>
+#include "tts_arena.h"
+#include "tts_protocol.h"
 
 #define TTS_CLIENT_SUCCESS       0
 #define TTS_CLIENT_FAILURE      -1
 #define TTS_CLIENT_UNKNOWN_CMD  -2
 
-struct tts_packet;
-
 typedef struct tts_client tts_client;
 
 /*
  * Connection options, use this structure to specify connection related opts
- * like socket family, host port and timeout for communication
+ * like socket family, host port and timeout for communication, and the
+ * highest version of the wire format to negotiate
  */
 struct tts_connect_options {
     int timeout;
     int s_family;
     int s_port;
     char *s_addr;
+    int version;
 };
 
 /*
  * Pretty basic connection wrapper, just a FD with a buffer tracking bytes and
- * some options for connection
+ * some options for connection, responses are decoded into the arena, they're
+ * valid till the next one is received, the codec tracks the wire format
+ * negotiated
  */
 struct tts_client {
     int fd;
@@ -60,6 +64,8 @@ struct tts_client {
     size_t bufsize;
     size_t capacity;
     char *buf;
+    struct tts_arena arena;
+    struct tts_codec codec;
 };
 
 void tts_client_init(tts_client *, const struct tts_connect_options *);
@@ -67,6 +73,7 @@ void tts_client_destroy(tts_client *);
 int tts_client_connect(tts_client *);
 void tts_client_disconnect(tts_client *);
 int tts_client_send_command(tts_client *, char *);
+int tts_client_send_packets(tts_client *, const struct tts_packet *, size_t);
 int tts_client_recv_response(tts_client *, struct tts_packet *);
 void tts_client_packet_destroy(struct tts_packet *);
 
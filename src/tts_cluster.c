@@ -0,0 +1,1277 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "pack.h"
+#include "tts_log.h"
+#include "tts_stats.h"
+#include "tts_cluster.h"
+
+/* 64 bit FNV-1a, mixed by the finalizer of splitmix64 to spread the ring */
+static uint64_t cluster_hash(const char *key, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i) {
+        hash ^= (uint8_t) key[i];
+        hash *= 1099511628211ULL;
+    }
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9ULL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebULL;
+    return hash ^ (hash >> 31);
+}
+
+static int vnode_cmp(const void *a, const void *b) {
+    const struct tts_cluster_vnode *x = a, *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+/* Parse a `host:port` address into a node */
+static int parse_node(const char *addr, size_t len,
+                      struct tts_cluster_node *node) {
+    const char *colon = memrchr(addr, ':', len);
+    if (!colon || colon == addr ||
+        (size_t) (colon - addr) >= sizeof(node->host))
+        return -1;
+    snprintf(node->host, sizeof(node->host), "%.*s",
+             (int) (colon - addr), addr);
+    node->port = atoi(colon + 1);
+    return node->port > 0 ? 0 : -1;
+}
+
+/*
+ * Set up the cluster from a comma separated list of `host:port` addresses,
+ * the same on every node, `self` being the address of this node among them.
+ * Return 0 on success, -1 if the list is malformed or `self` isn't in it
+ */
+int tts_cluster_init(struct tts_cluster *cluster, const char *nodes,
+                     const char *self) {
+    const char *ptr = nodes, *end = NULL;
+    char addr[0x1FF];
+    unsigned n = 1;
+    for (const char *c = nodes; *c; ++c)
+        n += *c == ',';
+    cluster->nodes = calloc(n, sizeof(*cluster->nodes));
+    cluster->ring = calloc((size_t) n * TTS_CLUSTER_VNODES,
+                           sizeof(*cluster->ring));
+    cluster->nodes_nr = 0;
+    cluster->self = n;
+    for (unsigned i = 0; i < n; ++i, ptr = end + 1) {
+        struct tts_cluster_node *node = &cluster->nodes[i];
+        end = strchr(ptr, ',');
+        if (!end)
+            end = ptr + strlen(ptr);
+        if (parse_node(ptr, end - ptr, node) < 0) {
+            log_error("Malformed cluster node \"%.*s\"",
+                      (int) (end - ptr), ptr);
+            goto err;
+        }
+        if (strlen(self) == (size_t) (end - ptr) &&
+            strncmp(self, ptr, end - ptr) == 0)
+            cluster->self = i;
+        for (unsigned j = 0; j < TTS_CLUSTER_VNODES; ++j) {
+            int len = snprintf(addr, sizeof(addr), "%s:%i-%u",
+                               node->host, node->port, j);
+            cluster->ring[i * TTS_CLUSTER_VNODES + j] =
+                (struct tts_cluster_vnode) { cluster_hash(addr, len), i };
+        }
+        cluster->nodes_nr++;
+    }
+    if (cluster->self == n) {
+        log_error("Cluster node %s not found among the nodes", self);
+        goto err;
+    }
+    qsort(cluster->ring, (size_t) n * TTS_CLUSTER_VNODES,
+          sizeof(*cluster->ring), vnode_cmp);
+    return 0;
+
+err:
+    tts_cluster_destroy(cluster);
+    return -1;
+}
+
+void tts_cluster_destroy(struct tts_cluster *cluster) {
+    free(cluster->nodes);
+    free(cluster->ring);
+    cluster->nodes = NULL;
+    cluster->ring = NULL;
+    cluster->nodes_nr = 0;
+}
+
+/*
+ * Node owning a timeseries, the one of the first point of the ring following
+ * the hash of its name
+ */
+unsigned tts_cluster_owner(const struct tts_cluster *cluster,
+                           const char *name, size_t len) {
+    uint64_t hash = cluster_hash(name, len);
+    size_t lo = 0, hi = (size_t) cluster->nodes_nr * TTS_CLUSTER_VNODES;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (cluster->ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == (size_t) cluster->nodes_nr * TTS_CLUSTER_VNODES)
+        lo = 0;
+    return cluster->ring[lo].node;
+}
+
+/*
+ * States of a peer, connected once its socket is writable; requests packed
+ * in the meanwhile are written right after
+ */
+enum { PEER_DOWN, PEER_CONNECTING, PEER_CONNECTED };
+
+static void cluster_cron(ev_context *, void *);
+
+void tts_cluster_links_init(struct tts_cluster_links *links,
+                            const struct tts_cluster *cluster,
+                            ev_context *ctx) {
+    memset(links, 0x00, sizeof(*links));
+    links->cluster = cluster;
+    links->ctx = ctx;
+    links->peers = calloc(cluster->nodes_nr, sizeof(*links->peers));
+    for (unsigned i = 0; i < cluster->nodes_nr; ++i) {
+        struct tts_cluster_peer *peer = &links->peers[i];
+        peer->links = links;
+        peer->node = i;
+        peer->fd = -1;
+        tts_codec_init(&peer->codec);
+        TTS_VECTOR_NEW(peer->waits);
+    }
+    tts_arena_init(&links->arena);
+    ev_register_cron(ctx, cluster_cron, links, 1, 0);
+}
+
+static void forward_free(struct tts_cluster_forward *forward) {
+    tts_arena_destroy(&forward->arena);
+    tts_stream_close(&forward->stream);
+    ev_buf_list_free(&forward->out);
+    free(forward);
+}
+
+/*
+ * Close every connection, the forwards still waiting on them are dropped
+ * once no connection is left to answer them, unless a client still holds
+ * them, the ones done are released
+ */
+void tts_cluster_links_destroy(struct tts_cluster_links *links) {
+    for (unsigned i = 0; i < links->cluster->nodes_nr; ++i) {
+        struct tts_cluster_peer *peer = &links->peers[i];
+        if (peer->fd >= 0)
+            close(peer->fd);
+        for (size_t j = peer->head; j < TTS_VECTOR_SIZE(peer->waits); ++j) {
+            struct tts_cluster_forward *forward =
+                TTS_VECTOR_AT(peer->waits, j);
+            if (--forward->pending == 0 && !forward->cb)
+                forward_free(forward);
+        }
+        TTS_VECTOR_DESTROY(peer->waits);
+        tts_codec_destroy(&peer->codec);
+        free(peer->out);
+        free(peer->in);
+    }
+    while (links->pool) {
+        struct tts_cluster_forward *forward = links->pool;
+        links->pool = forward->next;
+        forward_free(forward);
+    }
+    free(links->peers);
+    ev_buf_list_free(&links->out);
+    tts_arena_destroy(&links->arena);
+    free(links->buf);
+}
+
+/* Take a forward from the pool of the links, or allocate it zeroed */
+static struct tts_cluster_forward *forward_get(struct tts_cluster_links *links,
+                                               tts_cluster_cb cb, void *data) {
+    struct tts_cluster_forward *forward = links->pool;
+    if (forward) {
+        links->pool = forward->next;
+        links->pool_len--;
+    } else {
+        forward = calloc(1, sizeof(*forward));
+        tts_arena_init(&forward->arena);
+    }
+    forward->links = links;
+    forward->next = NULL;
+    forward->cb = cb;
+    forward->data = data;
+    forward->pending = 0;
+    forward->done = 0;
+    forward->relay = 0;
+    memset(&forward->stream, 0x00, sizeof(forward->stream));
+    ev_buf_list_reset(&forward->out);
+    return forward;
+}
+
+/* Give a forward done back to the pool, or release it if the pool is full */
+static void forward_put(struct tts_cluster_forward *forward) {
+    struct tts_cluster_links *links = forward->links;
+    if (links->pool_len == TTS_CLUSTER_POOL_SIZE) {
+        forward_free(forward);
+        return;
+    }
+    tts_arena_reset(&forward->arena);
+    forward->next = links->pool;
+    links->pool = forward;
+    links->pool_len++;
+}
+
+static void relay_drop(struct tts_cluster_forward *);
+
+/*
+ * Release a forward once its response has been packed, or give it up before
+ * it's done, if the client is gone; it's then released as its last part is
+ * answered, the results relayed in the meanwhile are dropped
+ */
+void tts_cluster_forward_release(struct tts_cluster_forward *forward) {
+    if (forward->done) {
+        forward_put(forward);
+        return;
+    }
+    forward->cb = NULL;
+    if (forward->relay)
+        relay_drop(forward);
+}
+
+static void forward_merge(struct tts_cluster_forward *);
+
+/*
+ * Account a part of a forward answered, or given up; the last one puts the
+ * responses together and hands them over
+ */
+static void forward_answered(struct tts_cluster_forward *forward) {
+    if (--forward->pending > 0)
+        return;
+    forward_merge(forward);
+    forward->done = 1;
+    if (forward->cb)
+        forward->cb(forward, forward->data);
+    else
+        forward_put(forward);
+}
+
+/*
+ * Decode a response into the arena of a forward, copied there as the
+ * strings decoded point into it, a malformed one counts as not answered
+ */
+static void part_store(struct tts_cluster_forward *forward,
+                       struct tts_cluster_part *part,
+                       struct tts_codec *codec,
+                       const uint8_t *buf, size_t size) {
+    uint8_t *copy = tts_arena_alloc(&forward->arena, size);
+    memcpy(copy, buf, size);
+    part->ok = tts_codec_unpack(codec, copy, &part->response,
+                                &forward->arena) == 0;
+}
+
+/*
+ * Relay a frame of the results of a part, decoded into the scratch arena of
+ * the links and packed right away for the client, if it's still there; the
+ * last one, or an ACK in place of the results, tells the status of the part.
+ * Return 1 if the part is over, 0 if more frames follow, -1 if the frame is
+ * malformed
+ */
+static int relay_frame(struct tts_cluster_forward *forward,
+                       struct tts_cluster_part *part,
+                       struct tts_codec *codec, uint8_t *buf) {
+    struct tts_cluster_links *links = forward->links;
+    struct tts_payload client = {
+        .out = &forward->out,
+        .codec = forward->codec
+    };
+    struct tts_packet packet;
+    int last = 0;
+    if (tts_codec_unpack(codec, buf, &packet, &links->arena) < 0) {
+        tts_arena_reset(&links->arena);
+        return -1;
+    }
+    last = packet.header.opcode != TTS_QUERY_RESPONSE ||
+        packet.header.more == 0;
+    if (last) {
+        part->ok = 1;
+        part->response.header = packet.header;
+    }
+    if (forward->cb && packet.header.opcode == TTS_QUERY_RESPONSE &&
+        packet.query_r.len > 0) {
+        packet.header.more = 1;
+        tts_handle_response(&client, &packet);
+    }
+    tts_arena_reset(&links->arena);
+    return last;
+}
+
+static void on_peer(ev_context *, void *);
+
+/*
+ * Watch the socket of a peer for writes too, only while it has bytes left,
+ * and for reads unless it's paused
+ */
+static void peer_arm(struct tts_cluster_peer *peer, int mask) {
+    if (peer->paused)
+        mask &= ~EV_READ;
+    if (peer->mask == mask)
+        return;
+    peer->mask = mask;
+    ev_fire_event(peer->links->ctx, peer->fd, mask, on_peer, peer);
+}
+
+/*
+ * Go on reading a peer paused, through the loop, as the forwards waiting on
+ * it could be the ones being taken; the socket is writable, so being
+ * watched for writes wakes it up right away to handle the bytes left
+ */
+static void peer_resume(struct tts_cluster_peer *peer) {
+    peer->paused = 0;
+    peer->since = tts_stats_clock();
+    peer->mask = -1;
+    peer_arm(peer, EV_READ | EV_WRITE);
+}
+
+/*
+ * Drop the connection to a peer, the forwards waiting on it get no response
+ * for their part, the connection is opened again by the next request
+ * needing it. They're taken out first, as their callbacks could route new
+ * requests to the same node right away
+ */
+static void peer_fail(struct tts_cluster_peer *peer) {
+    const struct tts_cluster_node *n = &peer->links->cluster->nodes[peer->node];
+    size_t waiting = TTS_VECTOR_SIZE(peer->waits) - peer->head;
+    struct tts_cluster_forward **failed = NULL;
+    log_error("Cluster node %s:%i unreachable", n->host, n->port);
+    ev_del_fd(peer->links->ctx, peer->fd);
+    close(peer->fd);
+    peer->fd = -1;
+    peer->state = PEER_DOWN;
+    peer->hello = 0;
+    peer->mask = 0;
+    peer->paused = 0;
+    peer->size = peer->sent = peer->in_size = 0;
+    if (waiting > 0) {
+        failed = malloc(waiting * sizeof(*failed));
+        memcpy(failed, peer->waits.data + peer->head,
+               waiting * sizeof(*failed));
+    }
+    TTS_VECTOR_SIZE(peer->waits) = 0;
+    peer->head = 0;
+    for (size_t i = 0; i < waiting; ++i)
+        forward_answered(failed[i]);
+    free(failed);
+}
+
+/*
+ * Write as much as the socket takes of the requests packed, watching it for
+ * writes till they're all out. Return -1 if the connection failed
+ */
+static int peer_write(struct tts_cluster_peer *peer) {
+    while (peer->sent < peer->size) {
+        ssize_t n = send(peer->fd, peer->out + peer->sent,
+                         peer->size - peer->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n <= 0)
+            return -1;
+        peer->sent += n;
+    }
+    if (peer->sent == peer->size)
+        peer->size = peer->sent = 0;
+    peer_arm(peer, peer->size > 0 ? EV_READ | EV_WRITE : EV_READ);
+    return 0;
+}
+
+/*
+ * Length of the frame starting at `offset` of the bytes received, 0 if it
+ * isn't whole yet
+ */
+static size_t peer_frame(const struct tts_cluster_peer *peer, size_t offset) {
+    if (peer->in_size - offset < TTS_HEADER_SIZE)
+        return 0;
+    int64_t len = 0;
+    uint8_t *ptr = peer->in + offset + 1;
+    unpack_integer(&ptr, 'I', &len);
+    if (peer->in_size - offset - TTS_HEADER_SIZE < (size_t) len)
+        return 0;
+    return TTS_HEADER_SIZE + len;
+}
+
+/*
+ * Length of the response starting at `offset`, spanning all its frames when
+ * streamed, 0 if it isn't whole yet
+ */
+static size_t peer_response(const struct tts_cluster_peer *peer,
+                            size_t offset) {
+    union tts_header header;
+    size_t end = offset, len = 0;
+    do {
+        if ((len = peer_frame(peer, end)) == 0)
+            return 0;
+        header.byte = peer->in[end];
+        end += len;
+    } while (header.opcode == TTS_QUERY_RESPONSE && header.more == 1);
+    return end - offset;
+}
+
+/*
+ * Decode every whole response received into the forward waiting for it,
+ * the payloads of a response streamed in multiple frames moved right after
+ * the header of the first to be decoded at once, as `tts_async` does, but
+ * for the forwards relaying them, handed each frame as it comes, pausing
+ * the peer once their client has too many left to take. The first one
+ * answers the HELLO opening the connection. Return -1 if the node doesn't
+ * speak the wire format the requests were packed in, or sent a frame
+ * malformed
+ */
+static int peer_dispatch(struct tts_cluster_peer *peer) {
+    const struct tts_cluster_node *n = &peer->links->cluster->nodes[peer->node];
+    size_t offset = 0, end = 0, len = 0, payload = 0, next = 0;
+    union tts_header header, last;
+    struct tts_packet hello;
+    struct tts_cluster_forward *forward = NULL;
+    int rc = 0;
+    while (peer->hello || peer->head < TTS_VECTOR_SIZE(peer->waits)) {
+        forward = peer->hello ? NULL : TTS_VECTOR_AT(peer->waits, peer->head);
+        if (forward && forward->relay) {
+            /* Relayed frame by frame, till the client falls behind */
+            if (forward->cb && forward->out.size >= TTS_CLUSTER_RELAY_MAX) {
+                peer->paused = 1;
+                peer_arm(peer, peer->size > 0 ? EV_WRITE : 0);
+                break;
+            }
+            if ((len = peer_frame(peer, offset)) == 0)
+                break;
+            rc = relay_frame(forward, &forward->parts[peer->node],
+                             &peer->codec, peer->in + offset);
+            if (rc < 0)
+                return -1;
+            offset += len;
+            peer->since = tts_stats_clock();
+            if (rc == 1) {
+                peer->head++;
+                forward_answered(forward);
+            } else if (forward->cb) {
+                forward->cb(forward, forward->data);
+            }
+            continue;
+        }
+        if ((len = peer_response(peer, offset)) == 0)
+            break;
+        end = offset + len;
+        payload = peer_frame(peer, offset) - TTS_HEADER_SIZE;
+        last.byte = peer->in[offset];
+        for (next = offset + TTS_HEADER_SIZE + payload; next < end;) {
+            len = peer_frame(peer, next);
+            last.byte = peer->in[next];
+            memmove(peer->in + offset + TTS_HEADER_SIZE + payload,
+                    peer->in + next + TTS_HEADER_SIZE, len - TTS_HEADER_SIZE);
+            payload += len - TTS_HEADER_SIZE;
+            next += len;
+        }
+        header.byte = peer->in[offset];
+        header.more = 0;
+        header.status = last.status;
+        peer->in[offset] = header.byte;
+        uint8_t *ptr = peer->in + offset + 1;
+        pack_integer(&ptr, 'I', payload);
+        if (peer->hello) {
+            int rc = tts_codec_unpack(NULL, peer->in + offset, &hello,
+                                      &peer->links->arena);
+            tts_arena_reset(&peer->links->arena);
+            if (rc < 0 || hello.header.opcode != TTS_HELLO ||
+                hello.hello.version != TTS_PROTOCOL_V2) {
+                log_error("Cluster node %s:%i doesn't speak the second "
+                          "version of the wire format", n->host, n->port);
+                return -1;
+            }
+            peer->hello = 0;
+        } else {
+            peer->head++;
+            part_store(forward, &forward->parts[peer->node], &peer->codec,
+                       peer->in + offset, TTS_HEADER_SIZE + payload);
+            peer->since = tts_stats_clock();
+            forward_answered(forward);
+        }
+        offset = end;
+    }
+    if (offset > 0) {
+        memmove(peer->in, peer->in + offset, peer->in_size - offset);
+        peer->in_size -= offset;
+    }
+    if (peer->head == TTS_VECTOR_SIZE(peer->waits)) {
+        TTS_VECTOR_SIZE(peer->waits) = 0;
+        peer->head = 0;
+    }
+    return 0;
+}
+
+/*
+ * Read everything the socket has to give, then hand the responses whole to
+ * the forwards waiting for them, till the peer is paused. Return -1 if the
+ * connection failed
+ */
+static int peer_read(struct tts_cluster_peer *peer) {
+    /* What was received before a pause goes first */
+    if (peer->in_size > 0 && peer_dispatch(peer) < 0)
+        return -1;
+    while (!peer->paused) {
+        if (peer->in_size == peer->in_capacity) {
+            peer->in_capacity = peer->in_capacity ?
+                peer->in_capacity * 2 : EV_TCP_BUFSIZE;
+            peer->in = realloc(peer->in, peer->in_capacity);
+        }
+        ssize_t n = recv(peer->fd, peer->in + peer->in_size,
+                         peer->in_capacity - peer->in_size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        peer->in_size += n;
+        if (peer_dispatch(peer) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static void on_peer(ev_context *ctx, void *data) {
+    (void) ctx;
+    struct tts_cluster_peer *peer = data;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (peer->state == PEER_CONNECTING) {
+        if (getsockopt(peer->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 ||
+            err != 0) {
+            peer_fail(peer);
+            return;
+        }
+        peer->state = PEER_CONNECTED;
+    }
+    if (peer_write(peer) < 0 || peer_read(peer) < 0)
+        peer_fail(peer);
+}
+
+/*
+ * Start connecting to a peer without waiting for it, announcing this node
+ * as a member of the cluster by the HELLO opening the connection, so the
+ * requests it forwards are always handled by the receiving node, never
+ * forwarded again. The ones following are packed on the second version of
+ * the wire format straight away, as every node runs the same server
+ */
+static int peer_connect(struct tts_cluster_peer *peer) {
+    const struct tts_cluster_node *node =
+        &peer->links->cluster->nodes[peer->node];
+    struct tts_packet hello = {
+        .hello = { .version = TTS_PROTOCOL_V2 | TTS_HELLO_PEER }
+    };
+    struct addrinfo hints = {
+        .ai_family = AF_INET,
+        .ai_socktype = SOCK_STREAM
+    }, *addr = NULL;
+    char port[8];
+    int fd = -1, one = 1;
+    snprintf(port, sizeof(port), "%i", node->port);
+    if (getaddrinfo(node->host, port, &hints, &addr) != 0)
+        return -1;
+    fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0 || (connect(fd, addr->ai_addr, addr->ai_addrlen) < 0 &&
+                   errno != EINPROGRESS)) {
+        if (fd >= 0)
+            close(fd);
+        freeaddrinfo(addr);
+        return -1;
+    }
+    freeaddrinfo(addr);
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    peer->fd = fd;
+    peer->state = PEER_CONNECTING;
+    peer->mask = EV_READ | EV_WRITE;
+    ev_register_event(peer->links->ctx, fd, peer->mask, on_peer, peer);
+    TTS_SET_REQUEST_HEADER(&hello, TTS_HELLO);
+    tts_codec_reset(&peer->codec, TTS_PROTOCOL_V1);
+    if (peer->capacity < TTS_HEADER_SIZE + 1) {
+        peer->capacity = EV_TCP_BUFSIZE;
+        peer->out = realloc(peer->out, peer->capacity);
+    }
+    peer->size = pack_tts_packet(&hello, peer->out);
+    peer->hello = 1;
+    tts_codec_reset(&peer->codec, TTS_PROTOCOL_V2);
+    return 0;
+}
+
+/*
+ * Pack the part of a forward owned by a peer, connecting to it if needed,
+ * and write it out as far as the socket takes it, the rest is written by
+ * the loop; failures are left to the loop as well, so the forwards already
+ * waiting are never answered from within the routing of another. Return -1
+ * if the node can't be reached at all
+ */
+static int peer_send(struct tts_cluster_peer *peer,
+                     const struct tts_packet *packet,
+                     struct tts_cluster_forward *forward) {
+    const struct tts_cluster_node *n = &peer->links->cluster->nodes[peer->node];
+    if (peer->state == PEER_DOWN && peer_connect(peer) < 0) {
+        log_error("Cluster node %s:%i unreachable", n->host, n->port);
+        return -1;
+    }
+    size_t size = tts_codec_packet_size(&peer->codec, packet);
+    if (peer->capacity < peer->size + size) {
+        while (peer->capacity < peer->size + size)
+            peer->capacity = peer->capacity ?
+                peer->capacity * 2 : EV_TCP_BUFSIZE;
+        peer->out = realloc(peer->out, peer->capacity);
+    }
+    peer->size += tts_codec_pack(&peer->codec, packet,
+                                 peer->out + peer->size);
+    if (peer->head == TTS_VECTOR_SIZE(peer->waits))
+        peer->since = tts_stats_clock();
+    TTS_VECTOR_APPEND(peer->waits, forward);
+    forward->pending++;
+    if (peer->state == PEER_CONNECTED && peer_write(peer) < 0)
+        peer_arm(peer, EV_READ | EV_WRITE);
+    return 0;
+}
+
+/*
+ * Give up the peers with requests waiting and no response for more than
+ * TTS_CLUSTER_TIMEOUT seconds, connecting ones included, but the paused
+ * ones, waiting on a client
+ */
+static void cluster_cron(ev_context *ctx, void *data) {
+    (void) ctx;
+    struct tts_cluster_links *links = data;
+    uint64_t now = tts_stats_clock();
+    for (unsigned i = 0; i < links->cluster->nodes_nr; ++i) {
+        struct tts_cluster_peer *peer = &links->peers[i];
+        if (peer->state != PEER_DOWN && !peer->paused &&
+            peer->head < TTS_VECTOR_SIZE(peer->waits) &&
+            now - peer->since > TTS_CLUSTER_TIMEOUT * (uint64_t) 1e9)
+            peer_fail(peer);
+    }
+}
+
+/*
+ * Handle the part of a request owned by this node into the scratch list of
+ * the links, streamed responses are run to their end, then decode the
+ * response back into the forward, its frames joined as
+ * `tts_client_recv_response` does
+ */
+static void local_handle(struct tts_cluster_forward *forward,
+                         const struct tts_payload *payload,
+                         struct tts_cluster_part *part) {
+    struct tts_cluster_links *links = forward->links;
+    struct tts_payload local = *payload;
+    union tts_header header;
+    int64_t len = 0;
+    uint8_t *ptr = NULL;
+    local.packet = part->request;
+    local.out = &links->out;
+    local.codec = NULL;
+    local.stream = &links->stream;
+    local.series = NULL;
+    ev_buf_list_reset(&links->out);
+    tts_handle_packet(&local);
+    while (links->stream.active == 1)
+        tts_handle_stream(&local);
+    links->size = 0;
+    for (size_t i = 0; i < links->out.len; ++i) {
+        const ev_buf *buf = &links->out.bufs[i];
+        for (size_t offset = 0; offset < buf->size;
+             offset += TTS_HEADER_SIZE + len) {
+            ptr = (uint8_t *) buf->buf + offset + 1;
+            unpack_integer(&ptr, 'I', &len);
+            /* Only the header of the first frame is kept */
+            size_t skip = links->size == 0 ? 0 : TTS_HEADER_SIZE;
+            size_t size = TTS_HEADER_SIZE + len - skip;
+            if (links->capacity < links->size + size) {
+                while (links->capacity < links->size + size)
+                    links->capacity = links->capacity ?
+                        links->capacity * 2 : TTS_HEADER_SIZE + 4096;
+                links->buf = realloc(links->buf, links->capacity);
+            }
+            memcpy(links->buf + links->size, buf->buf + offset + skip, size);
+            links->size += size;
+        }
+    }
+    header.byte = links->buf[0];
+    header.more = 0;
+    links->buf[0] = header.byte;
+    ptr = links->buf + 1;
+    pack_integer(&ptr, 'I', links->size - TTS_HEADER_SIZE);
+    part_store(forward, part, NULL, links->buf, links->size);
+}
+
+/* Name of the timeseries labelling a result, its first label */
+static inline int result_series(const struct tts_query_response *q,
+                                uint64_t i, const uint8_t **name) {
+    if (q->results[i].labels_len == 0)
+        return -1;
+    *name = q->results[i].labels[0].value;
+    return q->results[i].labels[0].value_len;
+}
+
+/* Order of names, results with no name coming first */
+static int name_cmp(const uint8_t *a, int alen, const uint8_t *b, int blen) {
+    if (alen < 0 || blen < 0)
+        return alen < 0 ? (blen < 0 ? 0 : -1) : 1;
+    int cmp = memcmp(a, b, alen < blen ? alen : blen);
+    return cmp != 0 ? cmp : alen - blen;
+}
+
+static inline int responded(const struct tts_cluster_part *part) {
+    return part->used && part->ok &&
+        part->response.header.opcode == TTS_QUERY_RESPONSE;
+}
+
+/*
+ * Status of results merged from the parts, not TTS_OK if one of the nodes
+ * asked didn't answer with its results, so the ones of the others come
+ * marked as incomplete
+ */
+static uint8_t merged_status(const struct tts_cluster_forward *forward) {
+    const struct tts_cluster_part *parts = forward->parts;
+    for (unsigned i = 0; i < forward->links->cluster->nodes_nr; ++i) {
+        if (!parts[i].used || responded(&parts[i]))
+            continue;
+        if (parts[i].ok && parts[i].response.header.status != TTS_OK)
+            return parts[i].response.header.status;
+        return TTS_EUNREACHABLE;
+    }
+    return TTS_OK;
+}
+
+/*
+ * Relay the frames the local part of a forward packed into the scratch list
+ * of the links
+ */
+static void relay_local(struct tts_cluster_forward *forward) {
+    struct tts_cluster_links *links = forward->links;
+    struct tts_cluster_part *part = &forward->parts[links->cluster->self];
+    int64_t len = 0;
+    uint8_t *ptr = NULL;
+    for (size_t i = 0; i < links->out.len; ++i) {
+        const ev_buf *buf = &links->out.bufs[i];
+        for (size_t offset = 0; offset < buf->size;
+             offset += TTS_HEADER_SIZE + len) {
+            ptr = (uint8_t *) buf->buf + offset + 1;
+            unpack_integer(&ptr, 'I', &len);
+            (void) relay_frame(forward, part, NULL,
+                               (uint8_t *) buf->buf + offset);
+        }
+    }
+    ev_buf_list_reset(&links->out);
+}
+
+/*
+ * Start the local part of a query relayed on the stream of the forward, the
+ * frames following the first ones are packed as the client takes them,
+ * counted as pending till the last
+ */
+static void local_relay(struct tts_cluster_forward *forward,
+                        const struct tts_payload *payload,
+                        struct tts_cluster_part *part) {
+    struct tts_payload local = *payload;
+    local.packet = part->request;
+    local.out = &forward->links->out;
+    local.codec = NULL;
+    local.stream = &forward->stream;
+    local.series = NULL;
+    ev_buf_list_reset(&forward->links->out);
+    tts_handle_packet(&local);
+    relay_local(forward);
+    if (forward->stream.active == 1)
+        forward->pending++;
+}
+
+/* Pack and relay the next frames of the local part of a forward */
+static void relay_pump(struct tts_cluster_forward *forward) {
+    struct tts_payload local = {
+        .out = &forward->links->out,
+        .tts_db = forward->db,
+        .stream = &forward->stream
+    };
+    tts_handle_stream(&local);
+    relay_local(forward);
+}
+
+/*
+ * End the results relayed by an empty frame carrying the status of the
+ * whole response, telling they're incomplete if some node didn't answer
+ */
+static void relay_end(struct tts_cluster_forward *forward) {
+    struct tts_payload client = {
+        .out = &forward->out,
+        .codec = forward->codec
+    };
+    TTS_SET_RESPONSE_HEADER(&forward->response, TTS_QUERY_RESPONSE,
+                            merged_status(forward));
+    if (forward->cb)
+        tts_handle_response(&client, &forward->response);
+}
+
+/* Go on reading the peers paused on the client of a forward */
+static void relay_resume(struct tts_cluster_forward *forward) {
+    struct tts_cluster_links *links = forward->links;
+    for (unsigned i = 0; i < links->cluster->nodes_nr; ++i) {
+        struct tts_cluster_peer *peer = &links->peers[i];
+        if (peer->paused && peer->head < TTS_VECTOR_SIZE(peer->waits) &&
+            TTS_VECTOR_AT(peer->waits, peer->head) == forward)
+            peer_resume(peer);
+    }
+}
+
+/*
+ * Give up relaying the results of a forward, its local part is over right
+ * away, the peers paused on it go on reading the rest of theirs
+ */
+static void relay_drop(struct tts_cluster_forward *forward) {
+    relay_resume(forward);
+    if (forward->stream.active == 0)
+        return;
+    tts_stream_close(&forward->stream);
+    forward->stream.active = 0;
+    forward_answered(forward);
+}
+
+/*
+ * Take the results relayed so far by a forward into `out`, packing the next
+ * frames of its local part first if the client took all the others, so a
+ * slow client never makes them pile up, and go on with the peers paused on
+ * it. Return 1 once it's done, its last frame taken
+ */
+int tts_cluster_forward_take(struct tts_cluster_forward *forward,
+                             ev_buf_list *out) {
+    while (forward->out.size == 0 && forward->stream.active == 1) {
+        relay_pump(forward);
+        if (forward->stream.active == 0 && --forward->pending == 0) {
+            forward_merge(forward);
+            forward->done = 1;
+        }
+    }
+    if (out->len == 0) {
+        ev_buf_list taken = *out;
+        *out = forward->out;
+        forward->out = taken;
+    } else {
+        for (size_t i = 0; i < forward->out.len; ++i) {
+            const ev_buf *from = &forward->out.bufs[i];
+            ev_buf *buf = ev_buf_list_reserve(out, from->size);
+            memcpy(buf->buf + buf->size, from->buf, from->size);
+            buf->size += from->size;
+            out->size += from->size;
+        }
+    }
+    ev_buf_list_reset(&forward->out);
+    relay_resume(forward);
+    return forward->done;
+}
+
+struct name_entry {
+    const uint8_t *name;
+    uint8_t name_len;
+    uint32_t index;
+};
+
+static int name_entry_cmp(const void *a, const void *b) {
+    const struct name_entry *x = a, *y = b;
+    int cmp = name_cmp(x->name, x->name_len, y->name, y->name_len);
+    if (cmp == 0)
+        cmp = x->index < y->index ? -1 : x->index > y->index;
+    return cmp;
+}
+
+/*
+ * Tell the names appearing for the first time among the `n` entries, by
+ * their index, sorting them in place
+ */
+static uint8_t *first_names(struct tts_arena *arena,
+                            struct name_entry *entries, uint32_t n) {
+    uint8_t *first = tts_arena_calloc(arena, n + 1, 1);
+    qsort(entries, n, sizeof(*entries), name_entry_cmp);
+    for (uint32_t i = 0; i < n; ++i)
+        first[entries[i].index] = i == 0 ||
+            name_cmp(entries[i].name, entries[i].name_len,
+                     entries[i - 1].name, entries[i - 1].name_len) != 0;
+    return first;
+}
+
+/*
+ * Put back the results of a MLAST in the order the timeseries are named,
+ * each node is asked once for each of its own, their runs of results are
+ * looked up by name, as timeseries not found have none
+ */
+static void merge_mlast(struct tts_cluster_forward *forward) {
+    unsigned nodes_nr = forward->links->cluster->nodes_nr;
+    const struct tts_mlast *m = &forward->request.mlast;
+    const unsigned *owners = forward->owners;
+    const struct tts_cluster_part *parts = forward->parts;
+    struct tts_packet *response = &forward->response;
+    struct tts_query_response *q = &response->query_r;
+    struct name_entry **runs = tts_arena_calloc(&forward->arena, nodes_nr,
+                                               sizeof(*runs));
+    uint32_t *runs_nr = tts_arena_calloc(&forward->arena, nodes_nr,
+                                         sizeof(*runs_nr));
+    uint64_t total = 0;
+    const uint8_t *name = NULL;
+    int len = 0;
+    for (unsigned i = 0; i < nodes_nr; ++i) {
+        if (!responded(&parts[i]))
+            continue;
+        const struct tts_query_response *r = &parts[i].response.query_r;
+        runs[i] = tts_arena_alloc(&forward->arena,
+                                  (r->len + 1) * sizeof(**runs));
+        for (uint64_t j = 0; j < r->len; ++j) {
+            if ((len = result_series(r, j, &name)) < 0)
+                continue;
+            if (runs_nr[i] > 0 &&
+                name_cmp(runs[i][runs_nr[i] - 1].name,
+                         runs[i][runs_nr[i] - 1].name_len, name, len) == 0)
+                continue;
+            runs[i][runs_nr[i]++] = (struct name_entry) { name, len, j };
+        }
+        qsort(runs[i], runs_nr[i], sizeof(**runs), name_entry_cmp);
+        total += r->len;
+    }
+    TTS_SET_RESPONSE_HEADER(response, TTS_QUERY_RESPONSE,
+                            merged_status(forward));
+    q->len = 0;
+    q->results = tts_arena_alloc(&forward->arena,
+                                 (total * 2 + 1) * sizeof(*q->results));
+    for (uint32_t i = 0; i < m->series_nr; ++i) {
+        unsigned node = owners[i];
+        const struct tts_query_response *r = &parts[node].response.query_r;
+        uint32_t lo = 0, hi = runs_nr[node];
+        if (!responded(&parts[node]))
+            continue;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (name_cmp(runs[node][mid].name, runs[node][mid].name_len,
+                         m->series[i].ts_name, m->series[i].ts_name_len) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo == runs_nr[node] ||
+            name_cmp(runs[node][lo].name, runs[node][lo].name_len,
+                     m->series[i].ts_name, m->series[i].ts_name_len) != 0)
+            continue;
+        for (uint64_t j = runs[node][lo].index; j < r->len &&
+             (len = result_series(r, j, &name)) >= 0 &&
+             name_cmp(name, len, m->series[i].ts_name,
+                      m->series[i].ts_name_len) == 0; ++j) {
+            if (q->len == total * 2) {
+                total *= 2;
+                void *grown = tts_arena_alloc(&forward->arena, (total * 2 + 1)
+                                              * sizeof(*q->results));
+                memcpy(grown, q->results, q->len * sizeof(*q->results));
+                q->results = grown;
+            }
+            q->results[q->len++] = r->results[j];
+        }
+    }
+}
+
+/*
+ * Put back the ACKs of the parts of a MADD in the order its timeseries first
+ * appear, each node acknowledges its own in the same order; the ones of a
+ * node that couldn't be reached carry its status, with no points stored
+ */
+static void merge_madd(struct tts_cluster_forward *forward) {
+    unsigned nodes_nr = forward->links->cluster->nodes_nr;
+    uint32_t points_len = forward->request.maddpoints.points_len;
+    const struct tts_cluster_part *parts = forward->parts;
+    struct tts_ack *ack = &forward->response.ack;
+    uint32_t *cursor = tts_arena_calloc(&forward->arena, nodes_nr,
+                                        sizeof(*cursor));
+    uint8_t status = TTS_OK;
+    ack->series_nr = 0;
+    ack->series = tts_arena_alloc(&forward->arena,
+                                  (points_len + 1) * sizeof(*ack->series));
+    for (uint32_t i = 0; i < points_len; ++i) {
+        unsigned owner = forward->owners[i];
+        if (!forward->first[i])
+            continue;
+        const struct tts_cluster_part *part = &parts[owner];
+        const struct tts_ack *a = &part->response.ack;
+        struct tts_ack_series *s = &ack->series[ack->series_nr++];
+        if (part->ok && part->response.header.opcode == TTS_ACK &&
+            cursor[owner] < a->series_nr) {
+            *s = a->series[cursor[owner]++];
+        } else {
+            s->status = part->ok ?
+                part->response.header.status : TTS_EUNREACHABLE;
+            s->points = 0;
+        }
+        if (status == TTS_OK)
+            status = s->status;
+    }
+    TTS_SET_RESPONSE_HEADER(&forward->response, TTS_ACK, status);
+}
+
+/*
+ * Put the responses of the parts of a forward together, the one of its
+ * single owner relayed as it is, or TTS_EUNREACHABLE in the body of an ACK
+ * if it couldn't be reached
+ */
+static void forward_merge(struct tts_cluster_forward *forward) {
+    const struct tts_cluster_part *parts = forward->parts;
+    memset(&forward->response, 0x00, sizeof(forward->response));
+    if (forward->owner < forward->links->cluster->nodes_nr) {
+        if (parts[forward->owner].ok) {
+            forward->response = parts[forward->owner].response;
+        } else {
+            TTS_SET_RESPONSE_HEADER(&forward->response, TTS_ACK,
+                                    TTS_EUNREACHABLE);
+            forward->response.ack.series_nr = 1;
+            forward->response.ack.series =
+                tts_arena_calloc(&forward->arena, 1,
+                                 sizeof(*forward->response.ack.series));
+            forward->response.ack.series[0].status = TTS_EUNREACHABLE;
+        }
+    } else if (forward->relay) {
+        relay_end(forward);
+    } else if (forward->request.header.opcode == TTS_MADDPOINTS) {
+        merge_madd(forward);
+    } else {
+        merge_mlast(forward);
+    }
+}
+
+/*
+ * Copy the names of a MLAST into the arena of a forward, to look up the
+ * results of each one once the responses come
+ */
+static void mlast_copy(struct tts_cluster_forward *forward,
+                       const struct tts_mlast *m) {
+    struct tts_mlast *copy = &forward->request.mlast;
+    copy->points = m->points;
+    copy->series_nr = m->series_nr;
+    copy->series = tts_arena_alloc(&forward->arena, (m->series_nr + 1) *
+                                   sizeof(*copy->series));
+    for (uint32_t i = 0; i < m->series_nr; ++i) {
+        copy->series[i].ts_name_len = m->series[i].ts_name_len;
+        copy->series[i].ts_name = tts_arena_alloc(&forward->arena,
+                                                  m->series[i].ts_name_len);
+        memcpy(copy->series[i].ts_name, m->series[i].ts_name,
+               m->series[i].ts_name_len);
+    }
+}
+
+/*
+ * Route a request to the nodes owning its timeseries, if it's not entirely
+ * owned by this node; requests on a single timeseries are forwarded to its
+ * owner and the response relayed as it is, MADD and MLAST are split among
+ * the owners of their timeseries and queries selecting by pattern are sent to
+ * every node, each part in a request of its own, their responses merged here,
+ * or relayed as they come for the latter, see `tts_cluster_forward_take`.
+ * The part owned by this node is handled right here as well.
+ * Nothing waits for the other nodes: the request is answered right away only
+ * if none of them could be reached, otherwise `forward` is set and `cb` is
+ * called from the loop once they all answered, the request can be released
+ * in the meanwhile, the connection is not to go on with the next ones.
+ * Return 1 if the request has been routed, 0 if it's to be handled locally,
+ * as a whole
+ */
+int tts_cluster_route(struct tts_cluster_links *links,
+                      struct tts_payload *payload,
+                      tts_cluster_cb cb, void *data,
+                      struct tts_cluster_forward **forward) {
+    const struct tts_cluster *cluster = links->cluster;
+    const struct tts_packet *packet = &payload->packet;
+    struct tts_cluster_forward *f = NULL;
+    struct tts_cluster_part *parts = NULL;
+    unsigned *owners = NULL, owner = cluster->self, spread = 0;
+    const uint8_t *name = NULL;
+    size_t name_len = 0;
+    uint32_t n = 0;
+    *forward = NULL;
+    switch (packet->header.opcode) {
+        case TTS_CREATE_TS:
+            name = packet->create.ts_name;
+            name_len = packet->create.ts_name_len;
+            break;
+        case TTS_DELETE_TS:
+            name = packet->drop.ts_name;
+            name_len = packet->drop.ts_name_len;
+            break;
+        case TTS_ADDPOINTS:
+            name = packet->addpoints.ts_name;
+            name_len = packet->addpoints.ts_name_len;
+            break;
+        case TTS_QUERY:
+            if (packet->query.bits.select == 1) {
+                spread = 1;
+                break;
+            }
+            name = packet->query.ts_name;
+            name_len = packet->query.ts_name_len;
+            break;
+        case TTS_MADDPOINTS:
+            n = packet->maddpoints.points_len;
+            owners = tts_arena_alloc(&links->arena, sizeof(*owners) * (n + 1));
+            for (uint32_t i = 0; i < n; ++i) {
+                owners[i] = tts_cluster_owner(
+                    cluster, (const char *) packet->maddpoints.pts[i].ts_name,
+                    packet->maddpoints.pts[i].ts_name_len);
+                spread |= owners[i] != cluster->self;
+            }
+            break;
+        case TTS_MLAST:
+            n = packet->mlast.series_nr;
+            owners = tts_arena_alloc(&links->arena, sizeof(*owners) * (n + 1));
+            for (uint32_t i = 0; i < n; ++i) {
+                owners[i] = tts_cluster_owner(
+                    cluster, (const char *) packet->mlast.series[i].ts_name,
+                    packet->mlast.series[i].ts_name_len);
+                spread |= owners[i] != cluster->self;
+            }
+            break;
+        default:
+            return 0;
+    }
+    if (name)
+        owner = tts_cluster_owner(cluster, (const char *) name, name_len);
+    if (owner == cluster->self && spread == 0) {
+        tts_arena_reset(&links->arena);
+        return 0;
+    }
+    f = forward_get(links, cb, data);
+    f->owner = name ? owner : cluster->nodes_nr;
+    f->owners = NULL;
+    f->first = NULL;
+    memset(&f->request, 0x00, sizeof(f->request));
+    f->request.header = packet->header;
+    parts = f->parts = tts_arena_calloc(&f->arena, cluster->nodes_nr,
+                                        sizeof(*parts));
+    if (owners) {
+        f->owners = tts_arena_alloc(&f->arena, sizeof(*owners) * (n + 1));
+        memcpy(f->owners, owners, sizeof(*owners) * n);
+    }
+    if (name) {
+        parts[owner].used = 1;
+        parts[owner].request = *packet;
+    } else if (packet->header.opcode == TTS_QUERY) {
+        f->relay = 1;
+        f->codec = payload->codec;
+        f->db = payload->tts_db;
+        for (unsigned i = 0; i < cluster->nodes_nr; ++i) {
+            parts[i].used = 1;
+            parts[i].request = *packet;
+        }
+    } else if (packet->header.opcode == TTS_MADDPOINTS) {
+        const struct tts_maddpoints *m = &packet->maddpoints;
+        struct name_entry *entries = tts_arena_alloc(&links->arena,
+                                                     (n + 1) *
+                                                     sizeof(*entries));
+        for (uint32_t i = 0; i < n; ++i)
+            entries[i] = (struct name_entry) {
+                m->pts[i].ts_name, m->pts[i].ts_name_len, i
+            };
+        f->first = first_names(&f->arena, entries, n);
+        f->request.maddpoints.points_len = n;
+        for (uint32_t i = 0; i < n; ++i)
+            parts[owners[i]].request.maddpoints.points_len++;
+        for (unsigned i = 0; i < cluster->nodes_nr; ++i) {
+            struct tts_maddpoints *sub = &parts[i].request.maddpoints;
+            parts[i].request.header = packet->header;
+            parts[i].used = sub->points_len > 0;
+            sub->pts = tts_arena_alloc(&f->arena,
+                                       (sub->points_len + 1) *
+                                       sizeof(*sub->pts));
+            sub->points_len = 0;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            struct tts_maddpoints *sub = &parts[owners[i]].request.maddpoints;
+            sub->pts[sub->points_len++] = m->pts[i];
+        }
+    } else {
+        const struct tts_mlast *m = &packet->mlast;
+        struct name_entry *entries = tts_arena_alloc(&links->arena,
+                                                     (n + 1) *
+                                                     sizeof(*entries));
+        for (uint32_t i = 0; i < n; ++i)
+            entries[i] = (struct name_entry) {
+                m->series[i].ts_name, m->series[i].ts_name_len, i
+            };
+        /* Each node is asked once for a timeseries named more than once */
+        uint8_t *first = first_names(&links->arena, entries, n);
+        mlast_copy(f, m);
+        for (uint32_t i = 0; i < n; ++i)
+            parts[owners[i]].request.mlast.series_nr += first[i];
+        for (unsigned i = 0; i < cluster->nodes_nr; ++i) {
+            struct tts_mlast *sub = &parts[i].request.mlast;
+            parts[i].request.header = packet->header;
+            parts[i].used = sub->series_nr > 0;
+            sub->points = m->points;
+            sub->series = tts_arena_alloc(&f->arena,
+                                          (sub->series_nr + 1) *
+                                          sizeof(*sub->series));
+            sub->series_nr = 0;
+        }
+        for (uint32_t i = 0; i < n; ++i) {
+            struct tts_mlast *sub = &parts[owners[i]].request.mlast;
+            if (first[i])
+                sub->series[sub->series_nr++] = m->series[i];
+        }
+    }
+    tts_arena_reset(&links->arena);
+    /*
+     * The other nodes are sent their parts first, so they work on them
+     * while the local one is handled
+     */
+    for (unsigned i = 0; i < cluster->nodes_nr; ++i)
+        if (parts[i].used && i != cluster->self)
+            peer_send(&links->peers[i], &parts[i].request, f);
+    if (parts[cluster->self].used && f->relay)
+        local_relay(f, payload, &parts[cluster->self]);
+    else if (parts[cluster->self].used)
+        local_handle(f, payload, &parts[cluster->self]);
+    if (f->pending > 0) {
+        *forward = f;
+        return 1;
+    }
+    forward_merge(f);
+    if (f->relay)
+        tts_cluster_forward_take(f, payload->out);
+    else
+        tts_handle_response(payload, &f->response);
+    forward_put(f);
+    return 1;
+}
@@ -0,0 +1,193 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TTS_CLUSTER_H
+#define TTS_CLUSTER_H
+
+#include <stdint.h>
+#include "ev_tcp.h"
+#include "tts_arena.h"
+#include "tts_vector.h"
+#include "tts_handlers.h"
+
+/* Points of each node on the ring */
+#define TTS_CLUSTER_VNODES 128
+
+/* Seconds to wait on a peer before giving it up */
+#define TTS_CLUSTER_TIMEOUT 5
+
+/* Forwarded requests done kept by the links of a worker, to be reused */
+#define TTS_CLUSTER_POOL_SIZE 64
+
+/*
+ * Bytes of results relayed a client can fall behind on before the nodes
+ * answering it are read no more
+ */
+#define TTS_CLUSTER_RELAY_MAX (64 * EV_TCP_BUFSIZE)
+
+struct tts_cluster_node {
+    char host[0xFF];
+    int port;
+};
+
+struct tts_cluster_vnode {
+    uint64_t hash;
+    unsigned node;
+};
+
+/*
+ * Nodes of the cluster, each one owning the arcs of the hash ring of the
+ * names of the timeseries preceding its points, TTS_CLUSTER_VNODES each, so
+ * adding or removing a node moves only the keys of its arcs. `self` is the
+ * index of this node
+ */
+struct tts_cluster {
+    unsigned nodes_nr;
+    unsigned self;
+    struct tts_cluster_node *nodes;
+    struct tts_cluster_vnode *ring;
+};
+
+struct tts_cluster_links;
+struct tts_cluster_forward;
+
+/*
+ * Called once all the nodes a request has been forwarded to answered, or
+ * were given up, with the response put together into the forward, and as
+ * results are relayed, for the ones streamed
+ */
+typedef void (*tts_cluster_cb)(struct tts_cluster_forward *, void *);
+
+/*
+ * Part of a request handled by a node, the whole request when a single node
+ * owns all its timeseries
+ */
+struct tts_cluster_part {
+    int used;
+    int ok;
+    struct tts_packet request;
+    struct tts_packet response;
+};
+
+/*
+ * A request forwarded to other nodes, waiting for `pending` of its parts to
+ * be answered, their responses decoded into the arena along with what's
+ * needed of the request to put them together into `response`, so the
+ * request itself can be released as soon as it's routed. Once `done`, the
+ * response is handed to `cb` along with `data`.
+ * A query selecting by pattern is `relay`ed instead: the frames of each node
+ * are packed into `out` by the `codec` of the client as they come, the
+ * local part is streamed by `stream` on the database `db` as the client
+ * takes them, and counted as pending till it's over; once `done`, `out`
+ * ends with an empty frame carrying the status of the whole response
+ */
+struct tts_cluster_forward {
+    struct tts_cluster_links *links;
+    struct tts_cluster_forward *next;
+    tts_cluster_cb cb;
+    void *data;
+    unsigned pending;
+    int done;
+    int relay;
+    struct tts_codec *codec;
+    struct tts_database *db;
+    struct tts_stream stream;
+    ev_buf_list out;
+    unsigned owner;
+    unsigned *owners;
+    uint8_t *first;
+    struct tts_packet request;
+    struct tts_cluster_part *parts;
+    struct tts_packet response;
+    struct tts_arena arena;
+};
+
+/*
+ * Connection of a worker to another node, driven by the loop of the worker
+ * without ever blocking it: requests are packed into `out` as they're
+ * routed, `sent` bytes of it already written, and the forwards waiting for
+ * the response of the node are queued in order into `waits`, from `head`
+ * on, as the node answers in the same order; bytes received are accumulated
+ * into `in` till a response is whole. `since` is the clock of the last
+ * response received, or of the first request sent after none was waiting.
+ * A peer is `paused` while the client of the results it relays has
+ * TTS_CLUSTER_RELAY_MAX bytes of them left to take, the bytes received
+ * since wait in `in`
+ */
+struct tts_cluster_peer {
+    struct tts_cluster_links *links;
+    unsigned node;
+    int fd;
+    int state;
+    int hello;
+    int mask;
+    int paused;
+    struct tts_codec codec;
+    size_t size;
+    size_t sent;
+    size_t capacity;
+    uint8_t *out;
+    size_t in_size;
+    size_t in_capacity;
+    uint8_t *in;
+    TTS_VECTOR(struct tts_cluster_forward *) waits;
+    size_t head;
+    uint64_t since;
+};
+
+/*
+ * Connections of a worker to the other nodes, each one opened on the first
+ * request that needs it, with a dedicated state to handle the local part of
+ * requests spanning several nodes, whose response is decoded back to be
+ * merged with the others, or relayed; forwards done are pooled into `pool`
+ */
+struct tts_cluster_links {
+    const struct tts_cluster *cluster;
+    ev_context *ctx;
+    struct tts_cluster_peer *peers;
+    ev_buf_list out;
+    struct tts_stream stream;
+    struct tts_arena arena;
+    size_t size;
+    size_t capacity;
+    uint8_t *buf;
+    struct tts_cluster_forward *pool;
+    size_t pool_len;
+};
+
+int tts_cluster_init(struct tts_cluster *, const char *, const char *);
+void tts_cluster_destroy(struct tts_cluster *);
+unsigned tts_cluster_owner(const struct tts_cluster *, const char *, size_t);
+void tts_cluster_links_init(struct tts_cluster_links *,
+                            const struct tts_cluster *, ev_context *);
+void tts_cluster_links_destroy(struct tts_cluster_links *);
+int tts_cluster_route(struct tts_cluster_links *, struct tts_payload *,
+                      tts_cluster_cb, void *, struct tts_cluster_forward **);
+int tts_cluster_forward_take(struct tts_cluster_forward *, ev_buf_list *);
+void tts_cluster_forward_release(struct tts_cluster_forward *);
+
+#endif
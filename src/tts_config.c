@@ -109,6 +109,37 @@ static void add_config_value(const char *key, const char *value) {
         strcpy(config.host, value);
     } else if (STREQ("ip_port", key, klen) == true) {
         config.port = atoi(value);
+    } else if (STREQ("workers", key, klen) == true) {
+        int workers = parse_int(value);
+        config.workers = workers > 0 ? workers : config.workers;
+    } else if (STREQ("snapshot_path", key, klen) == true) {
+        strcpy(config.snapshot_path, value);
+    } else if (STREQ("snapshot_interval", key, klen) == true) {
+        config.snapshot_interval = parse_int(value);
+    } else if (STREQ("wal_path", key, klen) == true) {
+        strcpy(config.wal_path, value);
+    } else if (STREQ("wal_fsync_interval", key, klen) == true) {
+        config.wal_fsync_interval = parse_int(value);
+    } else if (STREQ("rollup_1m_retention", key, klen) == true) {
+        config.rollup_retention[0] = parse_int(value);
+    } else if (STREQ("rollup_1h_retention", key, klen) == true) {
+        config.rollup_retention[1] = parse_int(value);
+    } else if (STREQ("rollup_1d_retention", key, klen) == true) {
+        config.rollup_retention[2] = parse_int(value);
+    } else if (STREQ("stats_port", key, klen) == true) {
+        config.stats_port = parse_int(value);
+    } else if (STREQ("cluster_nodes", key, klen) == true) {
+        strcpy(config.cluster_nodes, value);
+    } else if (STREQ("cluster_self", key, klen) == true) {
+        strcpy(config.cluster_self, value);
+    } else if (STREQ("replication_port", key, klen) == true) {
+        config.replication_port = parse_int(value);
+    } else if (STREQ("replication_backlog", key, klen) == true) {
+        config.replication_backlog = parse_int(value);
+    } else if (STREQ("replica_of", key, klen) == true) {
+        strcpy(config.replica_of, value);
+    } else if (STREQ("max_frame_size", key, klen) == true) {
+        config.max_frame_size = parse_int(value);
     }
 }
 
@@ -239,10 +270,27 @@ void tts_config_set_default(void) {
     config.loglevel = DEFAULT_LOG_LEVEL;
     strcpy(config.logpath, DEFAULT_LOG_PATH);
     config.tcp_backlog = SOMAXCONN;
+    config.workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (config.workers < 1)
+        config.workers = 1;
     config.pid = getpid();
     config.mode = DEFAULT_MODE;
     config.port = DEFAULT_PORT;
     strcpy(config.host, DEFAULT_HOSTNAME);
+    config.snapshot_path[0] = '\0';
+    config.snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL;
+    config.wal_path[0] = '\0';
+    config.wal_fsync_interval = DEFAULT_WAL_FSYNC_INTERVAL;
+    config.rollup_retention[0] = DEFAULT_ROLLUP_1M_RETENTION;
+    config.rollup_retention[1] = DEFAULT_ROLLUP_1H_RETENTION;
+    config.rollup_retention[2] = DEFAULT_ROLLUP_1D_RETENTION;
+    config.stats_port = DEFAULT_STATS_PORT;
+    config.cluster_nodes[0] = '\0';
+    config.cluster_self[0] = '\0';
+    config.replication_port = DEFAULT_REPLICATION_PORT;
+    config.replication_backlog = DEFAULT_REPLICATION_BACKLOG;
+    config.replica_of[0] = '\0';
+    config.max_frame_size = DEFAULT_MAX_FRAME_SIZE;
 }
 
 void tts_config_print(void) {
@@ -256,10 +304,43 @@ void tts_config_print(void) {
     log_info("\tSocket family: %s", config.mode == TTS_AF_INET ? "INET" : "UNIX");
     log_info("\tListening on: %s:%i", config.host, config.port);
     log_info("\tTcp backlog: %d", config.tcp_backlog);
+    log_info("\tWorkers: %d", config.workers);
+    if (config.stats_port > 0)
+        log_info("\tStats on: %s:%i", config.host, config.stats_port);
+    if (config.cluster_nodes[0]) {
+        log_info("\tCluster nodes: %s", config.cluster_nodes);
+        if (config.cluster_self[0])
+            log_info("\tCluster node: %s", config.cluster_self);
+    }
+    if (config.replica_of[0])
+        log_info("\tReplica of: %s", config.replica_of);
+    else if (config.replication_port > 0)
+        log_info("\tReplicas on: %s:%i, backlog %dMB", config.host,
+                 config.replication_port, config.replication_backlog);
+    if (config.max_frame_size > 0)
+        log_info("\tMax request size: %dMB", config.max_frame_size);
     log_info("\tFile handles soft limit: %li", get_fh_soft_limit());
     log_info("Logging:");
     log_info("\tlevel: %s", llevel);
     if (config.logpath[0])
         log_info("\tlogpath: %s", config.logpath);
+    log_info("Persistence:");
+    if (config.snapshot_path[0]) {
+        log_info("\tsnapshot path: %s", config.snapshot_path);
+        log_info("\tsnapshot interval: %ds", config.snapshot_interval);
+    } else {
+        log_info("\tsnapshots disabled");
+    }
+    if (config.wal_path[0]) {
+        log_info("\twrite-ahead log path: %s", config.wal_path);
+        log_info("\twrite-ahead log fsync interval: %dms",
+                 config.wal_fsync_interval);
+    } else {
+        log_info("\twrite-ahead log disabled");
+    }
+    log_info("Rollups retention:");
+    log_info("\t1m: %ds", config.rollup_retention[0]);
+    log_info("\t1h: %ds", config.rollup_retention[1]);
+    log_info("\t1d: %ds", config.rollup_retention[2]);
     log_info("Event loop backend: %s", EVENTLOOP_BACKEND);
 }
@@ -46,6 +46,15 @@
 #define DEFAULT_HOSTNAME  "127.0.0.1"
 #define DEFAULT_PORT      19191
 #define DEFAULT_MODE      TTS_AF_INET
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+#define DEFAULT_WAL_FSYNC_INTERVAL 1000
+#define DEFAULT_ROLLUP_1M_RETENTION 0
+#define DEFAULT_ROLLUP_1H_RETENTION 0
+#define DEFAULT_ROLLUP_1D_RETENTION 0
+#define DEFAULT_STATS_PORT 0
+#define DEFAULT_REPLICATION_PORT 0
+#define DEFAULT_REPLICATION_BACKLOG 64
+#define DEFAULT_MAX_FRAME_SIZE 4
 
 #define STREQ(s1, s2, len) strncasecmp(s1, s2, len) == 0 ? true : false
 
@@ -54,6 +63,8 @@ struct tts_config {
     int loglevel;
     /* TCP backlog size */
     int tcp_backlog;
+    /* Number of event loop workers, each one running on its own thread */
+    int workers;
     /* Application pid */
     pid_t pid;
     /*
@@ -69,6 +80,49 @@ struct tts_config {
     const char *version;
     /* Log file path */
     char logpath[0xFFF];
+    /* Snapshot file path, snapshots are disabled if empty */
+    char snapshot_path[0xFFF];
+    /* Seconds between background snapshots, 0 to save only on shutdown */
+    int snapshot_interval;
+    /* Write-ahead log file path, the log is disabled if empty */
+    char wal_path[0xFFF];
+    /* Milliseconds between group commits, 0 to sync on every write */
+    int wal_fsync_interval;
+    /*
+     * Seconds of retention of the 1 minute, 1 hour and 1 day rollup tiers,
+     * 0 disables the tier, as they all are by default. Each tier costs every
+     * timeseries a bucket of 80 bytes per width its points span within the
+     * retention, e.g. a series written continuously takes 1440 buckets,
+     * about 113KB, on the 1 minute tier kept for a day (86400), 56KB on the
+     * 1 hour one kept for 30 days (2592000) and 29KB on the 1 day one kept
+     * for a year (31536000); the raw day of points it summarizes, compressed,
+     * is usually smaller than the 1 minute tier alone. Points pay an update
+     * per tier enabled on ingest.
+     */
+    int rollup_retention[3];
+    /* HTTP port exposing the statistics to Prometheus, 0 to disable it */
+    int stats_port;
+    /*
+     * Comma separated `host:port` addresses of the nodes of the cluster, the
+     * same on every node, cluster mode is disabled if empty
+     */
+    char cluster_nodes[0xFFF];
+    /* Address of this node among the nodes, `host:port` of ip_port if empty */
+    char cluster_self[0xFFF];
+    /* Port serving the replicas, replication is disabled if 0 */
+    int replication_port;
+    /* Megabytes of changes kept for the replicas lagging behind */
+    int replication_backlog;
+    /*
+     * `host:port` replication address of the primary to replicate, the
+     * server is a read-only replica unless empty
+     */
+    char replica_of[0xFFF];
+    /*
+     * Megabytes a request can take, header excluded, the connections of the
+     * clients sending larger ones are closed, 0 for no limit
+     */
+    int max_frame_size;
 };
 
 extern struct tts_config *conf;
@@ -27,504 +27,1315 @@
 
 #define _POSIX_C_SOURCE 199309L
 #include <stdio.h>
+#include <limits.h>
 #include "tts_log.h"
 #include "tts_protocol.h"
 #include "tts_handlers.h"
+#include "tts_wal.h"
+#include "tts_replication.h"
+#include "tts_subscription.h"
+#include "tts_aggregate.h"
+#include "tts_kernel.h"
+#include "tts_stats.h"
+
+/*
+ * Responses to pipelined requests are batched into the same output list, each
+ * one is packed right after the previous, in the wire format of the
+ * connection; past a size the list moves to a new buffer instead of growing
+ * the last one, so large responses are never copied over
+ */
+static void pack_response(struct tts_payload *payload,
+                          const struct tts_packet *response) {
+    size_t len = tts_codec_packet_size(payload->codec, response);
+    ev_buf *buf = ev_buf_list_reserve(payload->out, len);
+    len = tts_codec_pack(payload->codec, response,
+                         (uint8_t *) buf->buf + buf->size);
+    buf->size += len;
+    payload->out->size += len;
+}
+
+/*
+ * Pack a response built elsewhere, like the one merged from the nodes of a
+ * cluster, as a handler would
+ */
+void tts_handle_response(struct tts_payload *payload,
+                         const struct tts_packet *response) {
+    pack_response(payload, response);
+}
+
+/*
+ * Log a change applied to the write-ahead log and to the replication stream,
+ * points added are fed to the subscriptions as well, must be called with the
+ * shard of the timeseries changed locked
+ */
+static void log_change(struct tts_payload *payload,
+                       const struct tts_packet *packet) {
+    if (payload->wal)
+        tts_wal_append(payload->wal, packet);
+    if (payload->repl)
+        tts_replication_append(payload->repl, packet);
+    if (payload->subs && packet->header.opcode == TTS_ADDPOINTS)
+        tts_subscriptions_notify(payload->subs, &packet->addpoints);
+}
+
+/*
+ * Changes aren't applied while the write-ahead log can't be written, as they
+ * couldn't be made durable, see `struct tts_wal`
+ */
+static inline int unlogged(const struct tts_payload *payload) {
+    return payload->wal && tts_wal_failed(payload->wal);
+}
+
+/* Refuse a change on a single timeseries, TTS_EIO in the body of the ACK */
+static int refuse_unlogged(struct tts_payload *payload) {
+    struct tts_packet response = {0};
+    struct tts_ack_series series = { .status = TTS_EIO, .points = 0 };
+    TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, TTS_EIO);
+    response.ack.series_nr = 1;
+    response.ack.series = &series;
+    pack_response(payload, &response);
+    return TTS_OK;
+}
 
 static int handle_tts_create(struct tts_payload *payload) {
-    ev_buf *buf = payload->buf;
     int rc = TTS_OK;
     struct tts_create_ts *c = &payload->packet.create;
     struct tts_packet response = {0};
     struct tts_timeseries *ts;
     char *key = (char *) c->ts_name;
+    if (unlogged(payload))
+        return refuse_unlogged(payload);
     /*
      * First check that the timeseries doesn't exists already, returning a
      * TTS_ENOTS status code in case
      */
-    HASH_FIND_STR(payload->tts_db->timeseries, key, ts);
+    struct tts_shard *shard =
+        tts_database_shard(payload->tts_db, key, c->ts_name_len);
+    pthread_mutex_lock(&shard->lock);
+    HASH_FIND(hh, shard->timeseries, key, c->ts_name_len, ts);
     if (ts) {
         rc = TTS_EEXIST;
-        log_debug("Timeseries \"%s\" exists already", c->ts_name);
+        log_debug("Timeseries \"%.*s\" exists already", c->ts_name_len, key);
     } else {
         /* If it does not exist we just create it and add to the global DB */
         ts = malloc(sizeof(*ts));
-        TTS_TIMESERIES_INIT(ts, c->ts_name, c->retention);
-        HASH_ADD_STR(payload->tts_db->timeseries, name, ts);
+        TTS_TIMESERIES_INIT(ts, key, c->ts_name_len, c->retention,
+                            &shard->labels);
+        HASH_ADD_STR(shard->timeseries, name, ts);
+        tts_names_add(&payload->tts_db->names, ts->name);
         log_debug("Created new timeseries \"%s\" (r=%li)",
                   ts->name, ts->retention);
+        log_change(payload, &payload->packet);
     }
+    pthread_mutex_unlock(&shard->lock);
     /* Set up the response to the client */
     TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, rc);
-    buf->size = pack_tts_packet(&response, (uint8_t *) buf->buf);
+    pack_response(payload, &response);
     return TTS_OK;
 }
 
 static int handle_tts_delete(struct tts_payload *payload) {
-    ev_buf *buf = payload->buf;
     struct tts_packet *packet = &payload->packet;
     struct tts_packet response = {0};
     struct tts_timeseries *ts = NULL;
     char *key = (char *) packet->drop.ts_name;
+    uint8_t key_len = packet->drop.ts_name_len;
+    if (unlogged(payload))
+        return refuse_unlogged(payload);
     /*
      * First check that the timeseries doesn't exists already, returning a
      * TTS_ENOTS status code in case
      */
-    HASH_FIND_STR(payload->tts_db->timeseries, key, ts);
+    struct tts_shard *shard = tts_database_shard(payload->tts_db, key, key_len);
+    pthread_mutex_lock(&shard->lock);
+    HASH_FIND(hh, shard->timeseries, key, key_len, ts);
     int rc = TTS_OK;
     if (!ts) {
-        log_debug("Timeseries \"%s\" not found", packet->drop.ts_name);
+        log_debug("Timeseries \"%.*s\" not found", key_len, key);
         rc = TTS_ENOTS;
     } else {
         /* Just remove the entry from the global timeseries DB and destroy it */
         log_debug("Deleted \"%s\" timeseries", ts->name);
-        HASH_DEL(payload->tts_db->timeseries, ts);
+        HASH_DEL(shard->timeseries, ts);
+        tts_names_del(&payload->tts_db->names, ts->name);
         TTS_TIMESERIES_DESTROY(ts);
+        log_change(payload, packet);
     }
+    pthread_mutex_unlock(&shard->lock);
     /* Set up the response to the client */
     TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, rc);
-    buf->size = pack_tts_packet(&response, (uint8_t *) buf->buf);
+    pack_response(payload, &response);
     return TTS_OK;
 }
 
-static int handle_tts_addpoints(struct tts_payload *payload) {
-    ev_buf *buf = payload->buf;
-    struct tts_addpoints *pa = &payload->packet.addpoints;
+/*
+ * Insert points into a timeseries, points without timestamp get the `tv` one,
+ * must be called with the shard owning the timeseries locked, return the
+ * status of the insertion, TTS_ELATE if some points reached too far back and
+ * were rejected. Timeseries created here are indexed into `names`
+ */
+static int addpoints(struct tts_names *names, struct tts_shard *shard,
+                     struct tts_addpoints *pa, const struct timespec *tv) {
     struct tts_timeseries *ts = NULL;
     char *key = (char *) pa->ts_name;
-    struct tts_packet response = {0};
-    tts_timestamp timestamp = 0ULL;
-    int rc = TTS_OK;
+    tts_timestamp timestamps[TTS_CHUNK_POINTS];
+    double values[TTS_CHUNK_POINTS];
+    struct tts_labelset *sets[TTS_CHUNK_POINTS];
+    struct tts_label pairs[TTS_LABELS_MAX];
+    tts_timestamp horizon = 0;
+    size_t n = 0, m = 0, kept = 0;
+    int labelled = 0, rc = TTS_OK;
     /*
      * Check if the target timeseries already exists, if it doesn't we want to
      * create it in place and track it by storing into the global timeseries
      * DB
      */
-    HASH_FIND_STR(payload->tts_db->timeseries, key, ts);
+    HASH_FIND(hh, shard->timeseries, key, pa->ts_name_len, ts);
     if (!ts) {
         ts = malloc(sizeof(*ts));
-        TTS_TIMESERIES_INIT(ts, key, 0);
-        HASH_ADD_STR(payload->tts_db->timeseries, name, ts);
+        TTS_TIMESERIES_INIT(ts, key, pa->ts_name_len, 0, &shard->labels);
+        HASH_ADD_STR(shard->timeseries, name, ts);
+        tts_names_add(names, ts->name);
         log_debug("Timeseries \"%s\" not found, created now (r=0)", ts->name);
     }
-    struct timespec tv;
-    struct tts_tag *dummy = NULL, *sub = NULL;
-    clock_gettime(CLOCK_REALTIME, &tv);
     /*
-     * Before inserting new points, we want to check if a retention is set and
-     * in case, trim timestamps and points vector according to the maximum age
-     * allowed
+     * As it's possible to insert multiple points with the same timestamp,
+     * points are appended in the order they come, in blocks of at most a
+     * chunk, the timestamps, values and labels sets of a block are gathered
+     * and appended to the columns in bulk; labels, if present, are stored
+     * apart into a record referencing the row index.
+     * Points older than the horizon of the timeseries are rejected, they're
+     * dropped from the request, so they're neither stored nor logged
      */
-    if (TTS_VECTOR_SIZE(ts->timestamps) > 0) {
-        tts_timestamp first = TTS_VECTOR_FIRST(ts->timestamps);
-        tts_timestamp last = TTS_VECTOR_LAST(ts->timestamps);
-        if (ts->retention != 0 && (int64_t) (last - first) > ts->retention) {
-            size_t idx = 0;
-            timestamp = last - ts->retention;
-            TTS_VECTOR_BINSEARCH(ts->timestamps, timestamp, &idx);
-            struct tts_record *r = TTS_VECTOR_AT(ts->columns, idx);
-            TTS_TIMESERIES_REMOVE_RECORD(ts, r);
-            TTS_VECTOR_RESIZE(ts->timestamps, idx);
-            TTS_VECTOR_RESIZE(ts->columns, idx);
-            free(r);
+    for (uint32_t b = 0; b < pa->points_len; b += n) {
+        n = pa->points_len - b < TTS_CHUNK_POINTS ?
+            pa->points_len - b : TTS_CHUNK_POINTS;
+        horizon = tts_timeseries_horizon(ts);
+        m = 0;
+        for (size_t k = 0; k < n; ++k) {
+            /*
+             * Timestamps are resolved in place, the points can be logged to
+             * the write-ahead log as they're stored
+             */
+            if (pa->points[b + k].bits.ts_sec_set == 0)
+                pa->points[b + k].ts_sec = tv->tv_sec;
+            if (pa->points[b + k].bits.ts_nsec_set == 0)
+                pa->points[b + k].ts_nsec = tv->tv_nsec;
+            pa->points[b + k].bits.ts_sec_set = 1;
+            pa->points[b + k].bits.ts_nsec_set = 1;
+            timestamps[m] = pa->points[b + k].ts_sec * (tts_timestamp) 1e9 +
+                pa->points[b + k].ts_nsec;
+            if (timestamps[m] < horizon) {
+                rc = TTS_ELATE;
+                continue;
+            }
+            values[m] = (double) pa->points[b + k].value;
+            sets[m] = NULL;
+            pa->points[kept + m++] = pa->points[b + k];
         }
-    }
-    /*
-     * As it's possible to insert multiple points with the same timestamp, we
-     * iterate point by point appending each one to the timestamps vector and
-     * fill the columns with values and/or labels if present
-     */
-    for (int i = 0; i < pa->points_len; i++) {
-        if (pa->points[i].bits.ts_sec_set == 0)
-            pa->points[i].ts_sec = tv.tv_sec;
-        if (pa->points[i].bits.ts_nsec_set == 0)
-            pa->points[i].ts_nsec = tv.tv_nsec;
-        timestamp = pa->points[i].ts_sec * 1e9 + pa->points[i].ts_nsec;
-        TTS_VECTOR_APPEND(ts->timestamps, timestamp);
-        struct tts_record *record = malloc(sizeof(*record));
-        record->index = TTS_VECTOR_SIZE(ts->timestamps);
-        record->value = pa->points[i].value;
-        record->labels_nr = pa->points[i].labels_len;
-        record->labels = calloc(pa->points[i].labels_len,
-                                sizeof(*record->labels));
-        /*
-         * Labels can be in arbitrary number, to simplify they're treated as
-         * strings which will act as keys on a multilevel hashmap.
-         * For each label we want to first check if it exists already on the
-         * timeseries `tags` pointer map, and if it doesn't we create it in
-         * place and fill it with the value key on the next level.
-         *
-         * The hierarchy is simply a map of maps:
-         *
-         * TS:tags : {
-         *      label_name: {
-         *          label_value: vector[tts_record],
-         *               .
-         *               .
-         *          label_valueN: vector[tts_record]
-         *      },
-         *           .
-         *           .
-         *      label_nameN: {..}
-         * }
-         *
-         * TS:tags[label_name][label_value] = vector[tts_record]
-         *
-         * This way we end up with lot of redundant data but we're really just
-         * using pointers all around, so not much of a deal on the memory
-         */
-        for (int j = 0; j < pa->points[i].labels_len; ++j) {
-            HASH_FIND_STR(ts->tags, (char *)
-                          pa->points[i].labels[j].label, dummy);
-            if (dummy) {
-                /*
-                 * Case 1, the label name is already in the outer map, we just
-                 * have to make sure the label value is tracked as well
-                 */
-                HASH_FIND_STR(dummy->tag, (char *)
-                              pa->points[i].labels[j].value, sub);
-                if (!sub) {
-                    struct tts_tag *tag = malloc(sizeof(*tag));
-                    tag->tag_name = (char *) pa->points[i].labels[j].value;
-                    TTS_VECTOR_NEW(tag->column);
-                    HASH_ADD_STR(dummy->tag, tag_name, tag);
-                    sub = tag;
-                }
-                TTS_VECTOR_APPEND(sub->column, record);
-            } else {
-                /*
-                 * Case 2, neither the label name nor the label value is stored
-                 * into the timeseries tag map, we just insert them
-                 */
-                struct tts_tag *tag = malloc(sizeof(*tag));
-                tag->tag = NULL;
-                tag->tag_name = (char *) pa->points[i].labels[j].label;
-                TTS_VECTOR_NEW(tag->column);
-                HASH_ADD_STR(ts->tags, tag_name, tag);
-                struct tts_tag *sub_tag = malloc(sizeof(*sub_tag));
-                sub_tag->tag_name = (char *) pa->points[i].labels[j].value;
-                TTS_VECTOR_NEW(sub_tag->column);
-                TTS_VECTOR_APPEND(sub_tag->column, record);
-                HASH_ADD_STR(tag->tag, tag_name, sub_tag);
+        for (size_t k = 0; k < m; ++k) {
+            uint32_t i = kept + k;
+            if (pa->points[i].labels_len == 0)
+                continue;
+            /*
+             * Labels are interned into the dictionary of the shard, points
+             * sharing the same labels end up referencing the same set, which
+             * is then indexed as tags of the timeseries
+             */
+            size_t labels_nr = pa->points[i].labels_len < TTS_LABELS_MAX ?
+                pa->points[i].labels_len : TTS_LABELS_MAX;
+            for (size_t j = 0; j < labels_nr; ++j) {
+                pairs[j].field = tts_labels_intern(
+                    &shard->labels, (char *) pa->points[i].labels[j].label,
+                    pa->points[i].labels[j].label_len);
+                pairs[j].value = tts_labels_intern(
+                    &shard->labels, (char *) pa->points[i].labels[j].value,
+                    pa->points[i].labels[j].value_len);
             }
-            record->labels[j].field =
-                (char *) pa->points[i].labels[j].label;
-            record->labels[j].value = pa->points[i].labels[j].value;
+            sets[k] = tts_labels_set(&shard->labels, pairs, labels_nr);
+            labelled = 1;
         }
-        // Update the columns vector with the latest record created
-        TTS_VECTOR_APPEND(ts->columns, record);
+        tts_timeseries_append_batch(ts, timestamps, values,
+                                    labelled ? sets : NULL, m);
+        kept += m;
     }
+    pa->points_len = kept;
     log_debug("Adding point to \"%s\" (r=%li)", ts->name, ts->retention);
+    return rc;
+}
+
+static int handle_tts_addpoints(struct tts_payload *payload) {
+    struct tts_addpoints *pa = &payload->packet.addpoints;
+    struct tts_shard *shard =
+        tts_database_shard(payload->tts_db, (char *) pa->ts_name,
+                           pa->ts_name_len);
+    struct tts_packet response = {0};
+    struct timespec tv;
+    if (unlogged(payload))
+        return refuse_unlogged(payload);
+    clock_gettime(CLOCK_REALTIME, &tv);
+    pthread_mutex_lock(&shard->lock);
+    int rc = addpoints(&payload->tts_db->names, shard, pa, &tv);
+    /* Points rejected are left out, the others are stored anyway */
+    if (rc == TTS_OK || rc == TTS_ELATE)
+        log_change(payload, &payload->packet);
+    pthread_mutex_unlock(&shard->lock);
     /* Set up the response to the client */
     TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, rc);
-    buf->size = pack_tts_packet(&response, (uint8_t *) buf->buf);
+    struct tts_ack_series series = { .status = rc, .points = pa->points_len };
+    if (rc == TTS_ELATE) {
+        response.ack.series_nr = 1;
+        response.ack.series = &series;
+    }
+    pack_response(payload, &response);
     return TTS_OK;
 }
 
+/*
+ * An entry of a request spanning multiple timeseries, MADD or MLAST, entries
+ * are sorted by shard, then by timeseries, then by their position into the
+ * request, to be handled in runs
+ */
+struct series_entry {
+    const uint8_t *name;
+    uint8_t name_len;
+    uint8_t shard;
+    uint32_t index;
+};
+
+static int series_entry_cmp(const void *a, const void *b) {
+    const struct series_entry *x = a, *y = b;
+    int cmp = 0;
+    if (x->shard != y->shard)
+        return x->shard < y->shard ? -1 : 1;
+    if (x->name_len != y->name_len)
+        return x->name_len < y->name_len ? -1 : 1;
+    if ((cmp = memcmp(x->name, y->name, x->name_len)) != 0)
+        return cmp;
+    return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static inline int series_entry_same(const struct series_entry *x,
+                                         const struct series_entry *y) {
+    return x->name_len == y->name_len &&
+        memcmp(x->name, y->name, x->name_len) == 0;
+}
+
+/*
+ * Insert points into multiple timeseries, they are grouped by shard, this way
+ * every shard touched is locked just once, leaving the other ones free for
+ * the concurrent workers, and by timeseries, each one is looked up once and
+ * gets all its points appended in bulk, as a single ADD. The ACK carries the
+ * status of each timeseries, in the order they first appear, all TTS_EIO if
+ * the changes are refused.
+ */
 static int handle_tts_maddpoints(struct tts_payload *payload) {
-    struct tts_payload p = {
-        .tts_db = payload->tts_db,
-        .buf = payload->buf
-    };
-    log_debug("Handling point %i", payload->packet.maddpoints.points_len);
-    for (int i = 0; i < payload->packet.maddpoints.points_len; ++i) {
-        p.packet.addpoints = payload->packet.maddpoints.pts[i];
-        handle_tts_addpoints(&p);
+    struct tts_maddpoints *m = &payload->packet.maddpoints;
+    struct tts_packet response = {0};
+    struct tts_shard *shard = NULL;
+    struct tts_addpoints run = {0};
+    struct timespec tv;
+    struct series_entry *entries = malloc(m->points_len * sizeof(*entries));
+    struct tts_ack_series *series = calloc(m->points_len, sizeof(*series));
+    unsigned char *heads = calloc(m->points_len, sizeof(*heads));
+    uint32_t points_nr = 0, series_nr = 0, i = 0, j = 0;
+    int rc = TTS_OK, refused = unlogged(payload);
+    log_debug("Handling point %u", m->points_len);
+    clock_gettime(CLOCK_REALTIME, &tv);
+    for (i = 0; i < m->points_len; ++i) {
+        entries[i] = (struct series_entry) {
+            .name = m->pts[i].ts_name,
+            .name_len = m->pts[i].ts_name_len,
+            .shard = tts_database_shard_index((char *) m->pts[i].ts_name,
+                                              m->pts[i].ts_name_len),
+            .index = i
+        };
+        points_nr += m->pts[i].points_len;
+    }
+    qsort(entries, m->points_len, sizeof(*entries), series_entry_cmp);
+    run.points = malloc(points_nr * sizeof(*run.points));
+    for (i = 0; i < m->points_len; i = j) {
+        if (i == 0 || entries[i].shard != entries[i - 1].shard) {
+            if (shard)
+                pthread_mutex_unlock(&shard->lock);
+            shard = &payload->tts_db->shards[entries[i].shard];
+            pthread_mutex_lock(&shard->lock);
+        }
+        /* Gather the points of the timeseries and store them at once */
+        run.ts_name = (uint8_t *) entries[i].name;
+        run.ts_name_len = entries[i].name_len;
+        run.points_len = 0;
+        for (j = i; j < m->points_len &&
+             series_entry_same(&entries[i], &entries[j]); ++j) {
+            struct tts_addpoints *pa = &m->pts[entries[j].index];
+            for (uint32_t k = 0; k < pa->points_len; ++k)
+                run.points[run.points_len++] = pa->points[k];
+        }
+        series[entries[i].index].status = refused ? TTS_EIO :
+            addpoints(&payload->tts_db->names, shard, &run, &tv);
+        series[entries[i].index].points = refused ? 0 : run.points_len;
+        heads[entries[i].index] = 1;
+        if (rc == TTS_OK)
+            rc = series[entries[i].index].status;
+        /*
+         * The points of a timeseries are logged as a single ADD while the
+         * shard is locked, this way the log follows the order points are
+         * stored in each timeseries
+         */
+        if ((payload->wal || payload->repl || payload->subs) &&
+            (series[entries[i].index].status == TTS_OK ||
+             series[entries[i].index].status == TTS_ELATE)) {
+            struct tts_packet add = { .addpoints = run };
+            TTS_SET_REQUEST_HEADER(&add, TTS_ADDPOINTS);
+            log_change(payload, &add);
+        }
     }
+    if (shard)
+        pthread_mutex_unlock(&shard->lock);
+    for (i = 0; i < m->points_len; ++i)
+        if (heads[i] == 1)
+            series[series_nr++] = series[i];
+    TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, rc);
+    response.ack.series_nr = series_nr;
+    response.ack.series = series;
+    pack_response(payload, &response);
+    free(run.points);
+    free(heads);
+    free(series);
+    free(entries);
     return TTS_OK;
 }
 
 /*
- * Auxiliary function used to fill query_responses fields reading data from a
- * single column index on a timeseries
+ * Auxiliary function used to fill query_responses fields with a single point
+ * of a timeseries, labelled by `set`, if any, see `tts_span_labels`
  */
-static void handle_tts_query_single(const struct tts_timeseries *ts,
-                                    struct tts_query_response *q,
-                                    size_t r_idx, size_t t_idx) {
-    tts_timestamp t = TTS_VECTOR_AT(ts->timestamps, t_idx);
-    struct tts_record *record = TTS_VECTOR_AT(ts->columns, t_idx);
+static void handle_tts_query_single(struct tts_query_response *q,
+                                    tts_timestamp t, double value,
+                                    const struct tts_labelset *set) {
+    size_t r_idx = q->len++;
     q->results[r_idx].rc = TTS_OK;
     q->results[r_idx].ts_sec = t / (tts_timestamp) 1e9;
     q->results[r_idx].ts_nsec = t % (tts_timestamp) 1e9;
-    q->results[r_idx].value = record->value;
-    q->results[r_idx].labels_len = record->labels_nr;
+    q->results[r_idx].value = value;
+    q->results[r_idx].labels_len = 0;
+    q->results[r_idx].labels = NULL;
+    if (!set)
+        return;
+    q->results[r_idx].labels_len = set->labels_nr;
     q->results[r_idx].labels =
-        calloc(record->labels_nr, sizeof(*q->results[r_idx].labels));
-    for (size_t j = 0; j < record->labels_nr; ++j) {
-        q->results[r_idx].labels[j].label_len = strlen(record->labels[j].field);
-        q->results[r_idx].labels[j].label = (uint8_t *) record->labels[j].field;
-        q->results[r_idx].labels[j].value_len = strlen(record->labels[j].value);
-        q->results[r_idx].labels[j].value = record->labels[j].value;
+        calloc(set->labels_nr, sizeof(*q->results[r_idx].labels));
+    for (size_t j = 0; j < set->labels_nr; ++j) {
+        q->results[r_idx].labels[j].label_len = set->labels[j].field->len;
+        q->results[r_idx].labels[j].label =
+            (uint8_t *) set->labels[j].field->str;
+        q->results[r_idx].labels[j].value_len = set->labels[j].value->len;
+        q->results[r_idx].labels[j].value =
+            (uint8_t *) set->labels[j].value->str;
     }
 }
 
 /*
- * Fill a query_response with all columns present in a timeseries, uses
- * basically call `handle_tts_query_single` in a loop, producing a *very large*
- * packet
+ * Pack the response to a query, the results of a selector query are
+ * labelled by the name of their timeseries first, on a copy of the labels
+ * arrays, and marked with the `more` bit, the empty ones are left out as the
+ * response is closed at last by an empty frame anyway
  */
-static void handle_tts_query_all(const struct tts_timeseries *ts,
-                                 struct tts_packet *p,
-                                 ev_buf *buf) {
+static void pack_query_response(struct tts_payload *payload,
+                                struct tts_packet *p) {
+    struct tts_query_response *q = &p->query_r;
+    size_t labels_nr = 0;
+    if (!payload->series) {
+        pack_response(payload, p);
+        return;
+    }
+    if (q->len == 0)
+        return;
+    for (size_t i = 0; i < q->len; ++i)
+        labels_nr += q->results[i].labels_len + 1;
+    struct tts_query_label *labels = malloc(labels_nr * sizeof(*labels));
+    struct tts_query_label **owned = malloc(q->len * sizeof(*owned));
+    struct tts_query_label *next = labels;
+    for (size_t i = 0; i < q->len; ++i) {
+        next[0] = (struct tts_query_label) {
+            .label_len = sizeof("timeseries") - 1,
+            .label = (uint8_t *) "timeseries",
+            .value_len = strlen(payload->series),
+            .value = (uint8_t *) payload->series
+        };
+        if (q->results[i].labels_len > 0)
+            memcpy(next + 1, q->results[i].labels,
+                   q->results[i].labels_len * sizeof(*next));
+        owned[i] = q->results[i].labels;
+        q->results[i].labels = next;
+        next += ++q->results[i].labels_len;
+    }
+    p->header.more = 1;
+    pack_response(payload, p);
+    for (size_t i = 0; i < q->len; ++i) {
+        q->results[i].labels = owned[i];
+        --q->results[i].labels_len;
+    }
+    free(owned);
+    free(labels);
+}
+
+/*
+ * Pack the query_response and release all the results, labels are just
+ * references to the records, only the arrays are owned by the response
+ */
+static void handle_tts_query_pack(struct tts_packet *p,
+                                  struct tts_payload *payload) {
     struct tts_query_response *q = &p->query_r;
-    size_t colsize = TTS_VECTOR_SIZE(ts->timestamps);
-    q->results = calloc(colsize, sizeof(*q->results));
-    q->len = colsize;
-    for (size_t i = 0; i < colsize; ++i)
-        handle_tts_query_single(ts, q, i, i);
-    buf->size = pack_tts_packet(p, (uint8_t *) buf->buf);
-    for (size_t i = 0; i < colsize; ++i)
+    pack_query_response(payload, p);
+    for (size_t i = 0; i < q->len; ++i)
         free(q->results[i].labels);
     free(q->results);
 }
 
 /*
- * Ausxiliary function used to retrieve the indexes inside the timeseries
- * vectors, use binary search to find higher and lower indexes representing
- * a range of points
+ * Init a selection of the points of a timeseries from `from` onward, carrying
+ * the labels requested by the filters of a query, if any
  */
-static void get_range_indexes(const struct tts_timeseries *ts,
-                              size_t minor_of, size_t major_of,
-                              size_t *lo_idx, size_t *hi_idx) {
-    TTS_VECTOR_BINSEARCH(ts->timestamps, major_of, lo_idx);
-    TTS_VECTOR_BINSEARCH(ts->timestamps, minor_of, hi_idx);
-    --*hi_idx;
-    if (*lo_idx > 0 && *hi_idx < TTS_VECTOR_SIZE(ts->timestamps)) {
-        // Update range to include neighbour values
-        for (size_t i = *lo_idx - 1; i > 0 &&
-             TTS_VECTOR_AT(ts->timestamps, i) >= major_of; --i) {
-            --*lo_idx;
-        }
-        for (size_t i = *hi_idx + 1; i < TTS_VECTOR_SIZE(ts->timestamps) &&
-             TTS_VECTOR_AT(ts->timestamps, i) <= minor_of; ++i) {
-            ++*hi_idx;
+static void query_select_init(struct tts_timeseries_select *sel,
+                              const struct tts_timeseries *ts,
+                              tts_timestamp from,
+                              const struct tts_query_filter *filters,
+                              size_t filters_nr) {
+    tts_timeseries_select_init(sel, ts, from);
+    for (size_t i = 0; i < filters_nr; ++i)
+        tts_timeseries_select_label(sel, (const char *) filters[i].label,
+                                    filters[i].label_len,
+                                    (const char *) filters[i].value,
+                                    filters[i].value_len);
+}
+
+/*
+ * Pack the next frame of a range query streamed response, carrying up to
+ * TTS_STREAM_POINTS points read straight from the timeseries, the `more` bit
+ * of the header tells the client if other frames will follow
+ */
+static void handle_tts_stream_frame(const struct tts_timeseries *ts,
+                                    struct tts_payload *payload) {
+    struct tts_stream *stream = payload->stream;
+    struct tts_packet response = {0};
+    struct tts_query_response *q = &response.query_r;
+    struct tts_timeseries_select sel;
+    struct tts_span span;
+    tts_timestamp last = stream->major_of;
+    size_t rec = 0, skip = stream->skip, same = stream->skip;
+    int done = 0;
+    TTS_SET_RESPONSE_HEADER(&response, TTS_QUERY_RESPONSE, TTS_OK);
+    q->results = calloc(TTS_STREAM_POINTS, sizeof(*q->results));
+    stream->active = 0;
+    query_select_init(&sel, ts, stream->major_of,
+                      stream->filters, stream->filters_nr);
+    while (done == 0 && tts_timeseries_select_next(&sel, &span) == 1) {
+        /* Points past the upper bound end the range */
+        size_t len = tts_kernel_upper_bound(span.timestamps, span.len,
+                                            stream->minor_of);
+        done = len < span.len;
+        for (size_t i = 0; i < len; ++i) {
+            if (skip > 0) {
+                --skip;
+                continue;
+            }
+            if (q->len == TTS_STREAM_POINTS) {
+                stream->active = 1;
+                stream->major_of = span.timestamps[i];
+                stream->skip = span.timestamps[i] == last ? same : 0;
+                done = 1;
+                break;
+            }
+            if (q->len == 0)
+                rec = tts_timeseries_record_lower_bound(
+                    ts, tts_span_index(&span, i));
+            handle_tts_query_single(q, span.timestamps[i], span.values[i],
+                                    tts_span_labels(ts, &span, i, &rec));
+            if (span.timestamps[i] == last) {
+                ++same;
+            } else {
+                last = span.timestamps[i];
+                same = 1;
+            }
         }
     }
+    tts_timeseries_select_destroy(&sel);
+    response.header.more = stream->active;
+    handle_tts_query_pack(&response, payload);
 }
 
 /*
- * Query a range of points based on timestamps received. Timestamps are assumed
- * to be in nanoseconds
+ * Query a range of points based on timestamps received, bounds are both
+ * inclusive. Timestamps are assumed to be in nanoseconds, chunks older than
+ * the lower bound are skipped entirely, the iteration stops at the first
+ * point past the upper bound.
+ * Large ranges are streamed in multiple frames, the first one is packed right
+ * away, the others once the previous has been written out, see
+ * `tts_handle_stream`, the stream copies the label filters of the query
+ * only if the response doesn't fit a single frame
  */
 static void handle_tts_query_range(const struct tts_timeseries *ts,
-                                   struct tts_packet *p,
-                                   size_t minor_of,
-                                   size_t major_of,
-                                   ev_buf *buf) {
-    size_t lo_idx = 0UL, hi_idx = 0UL;
-    struct tts_query_response *q = &p->query_r;
-    get_range_indexes(ts, minor_of, major_of, &lo_idx, &hi_idx);
-    tts_timestamp range = hi_idx - lo_idx + 1;
-    q->results = calloc(range, sizeof(*q->results));
-    q->len = range;
-    for (size_t i = 0; i < range; ++i)
-        handle_tts_query_single(ts, q, i, i + lo_idx);
-    buf->size = pack_tts_packet(p, (uint8_t *) buf->buf);
-    for (size_t i = 0; i < range; ++i)
-        free(q->results[i].labels);
-    free(q->results);
+                                   const struct tts_query *query,
+                                   tts_timestamp minor_of,
+                                   tts_timestamp major_of,
+                                   struct tts_payload *payload) {
+    struct tts_stream *stream = payload->stream;
+    stream->skip = 0;
+    stream->major_of = major_of;
+    stream->minor_of = minor_of;
+    stream->filters_nr = query->filters_nr;
+    stream->filters = query->filters;
+    handle_tts_stream_frame(ts, payload);
+    /* The request is released once handled, the stream keeps a copy */
+    if (stream->active == 1) {
+        stream->ts_name = strdup(ts->name);
+        stream->filters = tts_query_filters_copy(query->filters,
+                                                 query->filters_nr);
+    } else {
+        stream->filters_nr = 0;
+        stream->filters = NULL;
+    }
 }
 
 /*
- * Just fill the query_response packet with a single point from the timeseries
- * usually needed for FIRST/LAST query results
+ * Just fill the query_response packet with the first point of a span from the
+ * timeseries, usually needed for FIRST/LAST query results
  */
 static void handle_tts_query_one(const struct tts_timeseries *ts,
                                  struct tts_packet *p,
-                                 size_t idx,
-                                 ev_buf *buf) {
+                                 const struct tts_span *span,
+                                 struct tts_payload *payload) {
     struct tts_query_response *q = &p->query_r;
-    size_t colsize = 1;
-    q->results = calloc(colsize, sizeof(*q->results));
-    q->len = colsize;
-    handle_tts_query_single(ts, q, 0, idx);
-    buf->size = pack_tts_packet(p, (uint8_t *) buf->buf);
-    for (size_t i = 0; i < colsize; ++i)
-        free(q->results[i].labels);
-    free(q->results);
+    size_t rec = tts_timeseries_record_lower_bound(ts,
+                                                   tts_span_index(span, 0));
+    q->results = calloc(1, sizeof(*q->results));
+    q->len = 0;
+    handle_tts_query_single(q, span->timestamps[0], span->values[0],
+                            tts_span_labels(ts, span, 0, &rec));
+    handle_tts_query_pack(p, payload);
 }
 
 /*
- * Aggregate results into a query_response packet by applying a time-window
- * average, from the starting timestamp to the last covered into the mean
- * bounds
+ * Retrieve the latest points of multiple timeseries in a single response, the
+ * shards spanned are locked in ascending order, like the snapshot does, and
+ * held till the response is packed, as labels reference the strings interned
+ * by them. Without filters the points are usually read from the ring of the
+ * latest ones, each labelled by the name of its timeseries first, timeseries
+ * not found are just left out.
  */
-static void handle_tts_query_mean(const struct tts_timeseries *ts,
-                                  struct tts_packet *p,
-                                  size_t lo, size_t hi,
-                                  unsigned long long window,
-                                  ev_buf *buf) {
-    struct tts_query_response *q = &p->query_r;
-    long double avg = 0.0;
-    tts_timestamp t = 0ULL, step = 0LL;
-    struct tts_record *record = NULL;
-    q->results = NULL;
-    size_t i = lo, j = 0, k = 0;
-    while (i < hi) {
-        q->results = realloc(q->results, (k + 1) * sizeof(*q->results));
-        j = 0;
-        step = TTS_VECTOR_AT(ts->timestamps, i) + window * 1e6;
-        avg = 0;
-        /*
-         * We want to "squash" all points in the window range into a single
-         * average one
-         */
-        for (;TTS_VECTOR_AT(ts->timestamps, i) <= step; ++i) {
-            t = TTS_VECTOR_AT(ts->timestamps, i);
-            record = TTS_VECTOR_AT(ts->columns, i);
-            avg += record->value;
-            ++j;
+static int handle_tts_mlast(struct tts_payload *payload) {
+    struct tts_mlast *m = &payload->packet.mlast;
+    struct tts_packet response = {0};
+    struct tts_query_response *q = &response.query_r;
+    struct tts_shard *shard = NULL;
+    tts_timestamp timestamps[TTS_STREAM_POINTS];
+    double values[TTS_STREAM_POINTS];
+    struct tts_labelset *sets[TTS_STREAM_POINTS];
+    struct series_entry *entries = malloc(m->series_nr * sizeof(*entries));
+    struct tts_timeseries **series = calloc(m->series_nr, sizeof(*series));
+    size_t points = m->points == 0 ? 1 : m->points;
+    size_t n = 0;
+    uint32_t i = 0;
+    if (points > TTS_STREAM_POINTS)
+        points = TTS_STREAM_POINTS;
+    for (i = 0; i < m->series_nr; ++i)
+        entries[i] = (struct series_entry) {
+            .name = m->series[i].ts_name,
+            .name_len = m->series[i].ts_name_len,
+            .shard = tts_database_shard_index((char *) m->series[i].ts_name,
+                                              m->series[i].ts_name_len),
+            .index = i
+        };
+    qsort(entries, m->series_nr, sizeof(*entries), series_entry_cmp);
+    for (i = 0; i < m->series_nr; ++i) {
+        if (i == 0 || entries[i].shard != entries[i - 1].shard) {
+            shard = &payload->tts_db->shards[entries[i].shard];
+            pthread_mutex_lock(&shard->lock);
         }
-        avg /= j;
-        q->results[k].labels_len = 0;
-        q->results[k].rc = TTS_OK;
-        q->results[k].ts_sec = t / (tts_timestamp) 1e9;
-        q->results[k].ts_nsec = t % (tts_timestamp) 1e9;
-        q->results[k].value = avg;
-        ++k;
-        ++q->len;
-    }
-    buf->size = pack_tts_packet(p, (uint8_t *) buf->buf);
-    free(q->results);
+        HASH_FIND(hh, shard->timeseries, entries[i].name,
+                  entries[i].name_len, series[entries[i].index]);
+    }
+    TTS_SET_RESPONSE_HEADER(&response, TTS_QUERY_RESPONSE, TTS_OK);
+    for (i = 0; i < m->series_nr; ++i) {
+        const struct tts_timeseries *ts = series[i];
+        if (!ts)
+            continue;
+        n = tts_timeseries_latest(ts, points, timestamps, values, sets);
+        if (n == 0)
+            continue;
+        q->results = realloc(q->results, (q->len + n) * sizeof(*q->results));
+        for (size_t j = 0; j < n; ++j) {
+            handle_tts_query_single(q, timestamps[j], values[j], sets[j]);
+            /* The name of the timeseries goes ahead of the labels */
+            size_t r_idx = q->len - 1;
+            uint16_t labels_len = q->results[r_idx].labels_len;
+            struct tts_query_label *labels =
+                malloc((labels_len + 1) * sizeof(*labels));
+            if (labels_len > 0)
+                memcpy(labels + 1, q->results[r_idx].labels,
+                       labels_len * sizeof(*labels));
+            labels[0] = (struct tts_query_label) {
+                .label_len = sizeof("timeseries") - 1,
+                .label = (uint8_t *) "timeseries",
+                .value_len = strlen(ts->name),
+                .value = (uint8_t *) ts->name
+            };
+            free(q->results[r_idx].labels);
+            q->results[r_idx].labels = labels;
+            q->results[r_idx].labels_len = labels_len + 1;
+        }
+    }
+    handle_tts_query_pack(&response, payload);
+    for (i = 0; i < m->series_nr; ++i) {
+        if (i == 0 || entries[i].shard != entries[i - 1].shard) {
+            shard = &payload->tts_db->shards[entries[i].shard];
+            pthread_mutex_unlock(&shard->lock);
+        }
+    }
+    free(series);
+    free(entries);
+    return TTS_OK;
+}
+
+/* Saturating sum of timestamps, windows can extend up to the last possible */
+static inline tts_timestamp timestamp_add(tts_timestamp t, tts_timestamp d) {
+    return t > ULLONG_MAX - d ? ULLONG_MAX : t + d;
 }
 
 /*
- * As `handle_tts_query_mean` it aggregate points into a series of mean values
- * but this time respecting range boundaries specified by the client request,
- * collecting all inner points on every range-block
+ * Return an upper bound on the windows of `window` nanoseconds a query can
+ * yield, from the time bounds of the points in range and their number, so
+ * the results can be allocated up front. Windows starting at their first
+ * point are at least `window` + 1 nanoseconds apart, the aligned ones can
+ * include an extra window at each end of the range
  */
-static void handle_tts_query_mean_r(const struct tts_timeseries *ts,
-                                    struct tts_packet *p,
-                                    size_t lo, size_t hi,
-                                    tts_timestamp start,
-                                    unsigned long long window,
-                                    ev_buf *buf) {
-    struct tts_query_response *q = &p->query_r;
-    long double avg = 0.0;
-    unsigned long long step = 0LL;
-    struct tts_record *record = NULL;
-    q->results = NULL;
-    size_t i = lo, j = 0, k = 0;
-    window *= 1e6;
+static size_t query_windows(const struct tts_timeseries *ts,
+                            tts_timestamp minor_of, tts_timestamp major_of,
+                            tts_timestamp window, int aligned) {
+    struct tts_timeseries_iter it;
+    struct tts_span span;
+    tts_timestamp first = 0, last = 0, upper = minor_of;
+    double value = 0.0;
+    size_t index = 0, windows = 0;
+    size_t rows = tts_timeseries_end_index(ts) - tts_timeseries_first_index(ts);
+    tts_timeseries_iter_init(&it, ts, major_of);
+    if (tts_timeseries_iter_next(&it, &span) != 1 ||
+        tts_timeseries_last(ts, &last, &value, &index) != 1)
+        return 0;
+    first = span.timestamps[0];
+    if (last < upper)
+        upper = last;
+    if (upper < first)
+        return 0;
+    if (aligned == 1)
+        windows = (upper - first) / window + 2;
+    else if (window == ULLONG_MAX)
+        windows = 1;
+    else
+        windows = (upper - first) / (window + 1) + 1;
+    return windows < rows ? windows : rows;
+}
+
+static void aggregate_result(struct tts_query_response *q, tts_timestamp t,
+                             double value, struct tts_query_label *label) {
+    size_t k = q->len++;
+    q->results[k].rc = TTS_OK;
+    q->results[k].ts_sec = t / (tts_timestamp) 1e9;
+    q->results[k].ts_nsec = t % (tts_timestamp) 1e9;
+    q->results[k].value = value;
+    q->results[k].labels_len = label ? 1 : 0;
+    q->results[k].labels = label;
+}
+
+/*
+ * Append the results of a window, one for each aggregate requested, in the
+ * order of their bits, quantiles last. `labels` are the names of the
+ * aggregates in the same order, NULL for the plain average query
+ */
+static void aggregate_results(struct tts_query_response *q,
+                              const struct tts_aggregate *agg,
+                              const struct tts_query *query,
+                              struct tts_query_label *labels,
+                              tts_timestamp t) {
+    size_t l = 0;
+    for (size_t i = 0; i < TTS_AGGREGATE_NAMES_NR; ++i)
+        if (agg->aggregates & (1 << i))
+            aggregate_result(q, t, tts_aggregate_value(agg, 1 << i),
+                             labels ? &labels[l++] : NULL);
+    if ((agg->aggregates & TTS_AGG_QUANTILE) == 0)
+        return;
+    for (size_t i = 0; i < query->quantiles_nr; ++i)
+        aggregate_result(q, t, tts_aggregate_quantile(agg, query->quantiles[i]),
+                         labels ? &labels[l++] : NULL);
+}
+
+/*
+ * State of a windowed aggregation, the window being aggregated ends at
+ * `step`, `t` is the timestamp of the latest point fed
+ */
+struct query_window {
+    struct tts_query_response *q;
+    const struct tts_query *query;
+    struct tts_query_label *labels;
+    struct tts_aggregate agg;
+    tts_timestamp window;
+    tts_timestamp step;
+    tts_timestamp t;
+    int aligned;
+};
+
+/*
+ * Move to the window of a point at `t`, closing the current one if it falls
+ * past it
+ */
+static void query_window_advance(struct query_window *w, tts_timestamp t) {
+    if (t > w->step && w->agg.count > 0) {
+        aggregate_results(w->q, &w->agg, w->query, w->labels,
+                          w->aligned == 1 ? w->step : w->t);
+        tts_aggregate_reset(&w->agg);
+    }
     /*
-     * We want to move as close as possible to the first point, just in case
-     * the lower bound of the range is much lower than the first point of the
-     * timeseries
+     * We want to move straight to the window of the current point, there may
+     * be large gaps without any point
      */
-    while (TTS_VECTOR_AT(ts->timestamps, lo) > start) {
-        if (start + window > TTS_VECTOR_AT(ts->timestamps, lo))
-            break;
-        start += window;
-    }
-    step = start;
-    while (i < hi) {
-        q->results = realloc(q->results, (k + 1) * sizeof(*q->results));
-        j = 0;
-        step += window;
-        avg = 0;
-        /*
-         * We want to "squash" all points in the window range into a single
-         * average one
-         */
-        for (;TTS_VECTOR_AT(ts->timestamps, i) <= step; ++i) {
-            record = TTS_VECTOR_AT(ts->columns, i);
-            avg += record->value;
-            ++j;
-        }
-        avg /= j;
-        q->results[k].labels_len = 0;
-        q->results[k].rc = TTS_OK;
-        q->results[k].ts_sec = step / (tts_timestamp) 1e9;
-        q->results[k].ts_nsec = step % (tts_timestamp) 1e9;
-        q->results[k].value = avg;
-        ++k;
-        ++q->len;
-    }
-    buf->size = pack_tts_packet(p, (uint8_t *) buf->buf);
+    if (w->aligned == 1 && t > w->step)
+        w->step += ((t - w->step + w->window - 1) / w->window) * w->window;
+    else if (w->aligned == 0 && w->agg.count == 0)
+        w->step = timestamp_add(t, w->window);
+}
+
+/*
+ * Feed the points of a span into their windows, in runs, each one as much of
+ * the span as falls into a window; return 0 once a point past `minor_of` is
+ * met, 1 otherwise
+ */
+static int query_window_feed(struct query_window *w,
+                             const struct tts_span *span,
+                             tts_timestamp minor_of) {
+    size_t i = 0, j = 0;
+    while (i < span->len) {
+        if (span->timestamps[i] > minor_of)
+            return 0;
+        query_window_advance(w, span->timestamps[i]);
+        tts_timestamp bound = w->step < minor_of ? w->step : minor_of;
+        j = i + tts_kernel_upper_bound(span->timestamps + i,
+                                       span->len - i, bound);
+        tts_aggregate_update(&w->agg, span->values + i, j - i);
+        w->t = span->timestamps[j - 1];
+        i = j;
+    }
+    return 1;
+}
+
+/*
+ * Feed the raw points from `major_of` to `minor_of`, both inclusive
+ */
+static void query_window_feed_range(struct query_window *w,
+                                    const struct tts_timeseries *ts,
+                                    tts_timestamp minor_of,
+                                    tts_timestamp major_of) {
+    struct tts_timeseries_iter it;
+    struct tts_span span;
+    tts_timeseries_iter_init(&it, ts, major_of);
+    while (tts_timeseries_iter_next(&it, &span) == 1 &&
+           query_window_feed(w, &span, minor_of) == 1)
+        ;
+}
+
+/*
+ * Serve aligned windows from a rollup tier whose buckets tile them. Buckets
+ * cover whole multiples of their width, left-open, while the first window
+ * includes `major_of` as well, so the points at `major_of` are read raw, as
+ * the ones following the last bucket entirely within `minor_of`
+ */
+static void query_window_feed_rollup(struct query_window *w,
+                                     const struct tts_timeseries *ts,
+                                     int tier, tts_timestamp minor_of,
+                                     tts_timestamp major_of) {
+    const struct tts_rollup *rollup = &ts->rollups[tier];
+    tts_timestamp width = tts_rollup_tiers[tier].width, last = 0;
+    tts_timestamp end = minor_of / width * width;
+    double value = 0.0;
+    size_t index = 0, i = 0;
+    query_window_feed_range(w, ts, minor_of < major_of ? minor_of : major_of,
+                            major_of);
+    /* The latest bucket is complete if no point can follow within the range */
+    if (tts_timeseries_last(ts, &last, &value, &index) == 1 && last <= minor_of)
+        end = ULLONG_MAX;
+    for (i = tts_rollup_lower_bound(rollup, major_of + 1);
+         i < TTS_VECTOR_SIZE(rollup->buckets) &&
+         TTS_VECTOR_AT(rollup->buckets, i).end <= end; ++i) {
+        const struct tts_bucket *bucket = &TTS_VECTOR_AT(rollup->buckets, i);
+        query_window_advance(w, bucket->end);
+        tts_aggregate_merge(&w->agg, bucket);
+        w->t = bucket->end;
+    }
+    if (end < ULLONG_MAX && end < minor_of)
+        query_window_feed_range(w, ts, minor_of,
+                                end > major_of ? end + 1 : major_of + 1);
+}
+
+/*
+ * Aggregate the points of a query into a series of time-windows of
+ * `mean_val` milliseconds, computing all the aggregates requested in a single
+ * pass, a plain average if none is. Windows can be:
+ *
+ * - aligned to `major_of`, stepping by the window size, stamped with their
+ *   upper bound, windows without points are skipped
+ * - starting at their first point, stamped with their last one, if `aligned`
+ *   is 0
+ *
+ * Without the mean flag, a single window covers the whole range. Aligned
+ * windows are read from the coarsest rollup tier tiling them, if any, unless
+ * quantiles or label filters are requested, which need the raw points;
+ * results are allocated once, on the maximum number of windows.
+ */
+static void handle_tts_query_aggregate(const struct tts_timeseries *ts,
+                                       struct tts_packet *p,
+                                       const struct tts_query *query,
+                                       tts_timestamp minor_of,
+                                       tts_timestamp major_of,
+                                       int aligned, struct tts_payload *payload) {
+    struct tts_query_response *q = &p->query_r;
+    struct tts_timeseries_select sel;
+    struct tts_span span;
+    struct tts_query_label
+        labels[TTS_AGGREGATE_NAMES_NR + TTS_QUERY_QUANTILES_MAX];
+    char quantiles[TTS_QUERY_QUANTILES_MAX][12];
+    unsigned aggregates = TTS_AGG_AVG;
+    struct query_window w = {
+        .q = q, .query = query, .window = ULLONG_MAX, .aligned = aligned
+    };
+    size_t aggregates_nr = 0, windows = 0;
+    int tier = -1;
+    if (query->bits.aggregate == 1)
+        aggregates = query->aggregates & ((TTS_AGG_QUANTILE << 1) - 1);
+    for (size_t i = 0; i < TTS_AGGREGATE_NAMES_NR; ++i) {
+        if ((aggregates & (1 << i)) == 0)
+            continue;
+        labels[aggregates_nr].label_len = strlen("aggregate");
+        labels[aggregates_nr].label = (uint8_t *) "aggregate";
+        labels[aggregates_nr].value_len = strlen(tts_aggregate_names[i]);
+        labels[aggregates_nr++].value = (uint8_t *) tts_aggregate_names[i];
+    }
+    for (size_t i = 0; (aggregates & TTS_AGG_QUANTILE) &&
+         i < query->quantiles_nr; ++i) {
+        tts_aggregate_quantile_name(quantiles[i], sizeof(quantiles[i]),
+                                    query->quantiles[i]);
+        labels[aggregates_nr].label_len = strlen("aggregate");
+        labels[aggregates_nr].label = (uint8_t *) "aggregate";
+        labels[aggregates_nr].value_len = strlen(quantiles[i]);
+        labels[aggregates_nr++].value = (uint8_t *) quantiles[i];
+    }
+    w.labels = query->bits.aggregate ? labels : NULL;
+    if (query->bits.mean == 1)
+        w.window = query->mean_val * 1000000ULL;
+    if (aligned == 1 && w.window == 0)
+        w.window = 1;
+    if (aligned == 1 && query->bits.mean == 1 && query->filters_nr == 0 &&
+        (aggregates & TTS_AGG_QUANTILE) == 0)
+        tier = tts_timeseries_rollup(ts, w.window, major_of);
+    windows = query_windows(ts, minor_of, major_of, w.window, aligned);
+    if (tier >= 0) {
+        /* Windows hold at least a bucket, or the raw points at the edges */
+        const struct tts_rollup *rollup = &ts->rollups[tier];
+        size_t buckets = TTS_VECTOR_SIZE(rollup->buckets) -
+            tts_rollup_lower_bound(rollup, major_of + 1) + 2;
+        if (buckets > windows)
+            windows = buckets;
+    }
+    q->len = 0;
+    q->results = calloc(windows * aggregates_nr, sizeof(*q->results));
+    tts_aggregate_init(&w.agg, aggregates);
+    if (aligned == 1)
+        w.step = timestamp_add(major_of, w.window);
+    if (aggregates_nr > 0 && tier >= 0) {
+        query_window_feed_rollup(&w, ts, tier, minor_of, major_of);
+    } else if (aggregates_nr > 0) {
+        query_select_init(&sel, ts, major_of, query->filters,
+                          query->filters_nr);
+        while (tts_timeseries_select_next(&sel, &span) == 1 &&
+               query_window_feed(&w, &span, minor_of) == 1)
+            ;
+        tts_timeseries_select_destroy(&sel);
+    }
+    if (w.agg.count > 0)
+        aggregate_results(q, &w.agg, query, w.labels,
+                          aligned == 1 ? w.step : w.t);
+    tts_aggregate_destroy(&w.agg);
+    pack_query_response(payload, p);
     free(q->results);
 }
 
-static int handle_tts_query(struct tts_payload *payload) {
-    ev_buf *buf = payload->buf;
-    struct tts_packet *packet = &payload->packet;
+/*
+ * Answer a query on a single timeseries, its shard locked, the points staged
+ * out of order are merged by the iterators as they read
+ */
+static void query_timeseries(const struct tts_timeseries *ts,
+                             const struct tts_query *query,
+                             struct tts_payload *payload) {
     struct tts_packet response = {0};
-    struct tts_timeseries *ts = NULL;
-    char *key = (char *) packet->query.ts_name;
-    /*
-     * First check that the timeseries doesn't exists already, returning a
-     * TTS_ENOTS status code in case, as we end having no points to return
-     */
-    HASH_FIND_STR(payload->tts_db->timeseries, key, ts);
-    if (!ts) {
-        TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, TTS_ENOTS);
-        buf->size = pack_tts_packet(&response, (uint8_t *) buf->buf);
-        return TTS_OK;
-    }
+    /* Label filters apply the same way to every kind of query */
+    uint8_t flags = query->byte &
+        ~(TTS_QUERY_FILTER | TTS_QUERY_AGGREGATE | TTS_QUERY_SELECT);
     /*
-     * Before inserting new points, we want to check if a retention is set and
-     * in case, trim timestamps and points vector according to the maximum age
-     * allowed
+     * Points expired by the retention are ignored by the iterators, no need
+     * to trim them here, the retention sweeper will release them.
      */
-    if (TTS_VECTOR_SIZE(ts->timestamps) > 0) {
-        tts_timestamp first = TTS_VECTOR_FIRST(ts->timestamps);
-        tts_timestamp last = TTS_VECTOR_LAST(ts->timestamps);
-        if (ts->retention != 0 && (int64_t) (last - first) > ts->retention) {
-            size_t idx = 0;
-            tts_timestamp timestamp = last - ts->retention;
-            TTS_VECTOR_BINSEARCH(ts->timestamps, timestamp, &idx);
-            struct tts_record *r = TTS_VECTOR_AT(ts->columns, idx);
-            TTS_TIMESERIES_REMOVE_RECORD(ts, r);
-            TTS_VECTOR_RESIZE(ts->timestamps, idx);
-            TTS_VECTOR_RESIZE(ts->columns, idx);
-            free(r);
-        }
-    }
     TTS_SET_RESPONSE_HEADER(&response, TTS_QUERY_RESPONSE, TTS_OK);
-    if (packet->query.byte == TTS_QUERY_ALL_TIMESERIES ||
-        packet->query.byte == TTS_QUERY_ALL_TIMESERIES_AVG) {
+    if (tts_timeseries_empty(ts)) {
+        pack_query_response(payload, &response);
+        return;
+    }
+    if (flags == TTS_QUERY_ALL_TIMESERIES ||
+        flags == TTS_QUERY_ALL_TIMESERIES_AVG) {
         /*
          * In this case we want to return all the keyspace (the points of the
          * timeseries), we just need to check if there's some aggregations
          * requested (like avg or filters)
          */
-        if (packet->query.bits.mean == 0) {
-            handle_tts_query_all(ts, &response, buf);
-        } else {
-            size_t hi = TTS_VECTOR_SIZE(ts->timestamps);
-            handle_tts_query_mean(ts, &response, 0, hi,
-                                  packet->query.mean_val, buf);
-        }
+        if (query->bits.mean == 0 && query->bits.aggregate == 0)
+            handle_tts_query_range(ts, query, ULLONG_MAX, 0, payload);
+        else
+            handle_tts_query_aggregate(ts, &response, query,
+                                       ULLONG_MAX, 0, 0, payload);
     } else {
         /*
          * This branch handle the FIRST LAST and RANGE queries, here as well
          * we want to check for filters or aggregations requested
          */
-        size_t ts_size = TTS_VECTOR_SIZE(ts->timestamps) - 1;
-        tts_timestamp major_of = TTS_VECTOR_AT(ts->timestamps, 0);
-        tts_timestamp minor_of = TTS_VECTOR_AT(ts->timestamps, ts_size);
-        if (packet->query.bits.first == 1) {
-            handle_tts_query_one(ts, &response, 0, buf);
-        } else if (packet->query.bits.last == 1) {
-            size_t idx = TTS_VECTOR_SIZE(ts->timestamps) - 1;
-            handle_tts_query_one(ts, &response, idx, buf);
-        } else {
-            if (packet->query.bits.major_of == 1)
-                major_of = packet->query.major_of;
-            if (packet->query.bits.minor_of == 1)
-                minor_of = packet->query.minor_of;
-            if (packet->query.bits.mean == 0) {
-                handle_tts_query_range(ts, &response, minor_of, major_of, buf);
+        struct tts_timeseries_iter it;
+        struct tts_timeseries_select sel;
+        struct tts_span span;
+        tts_timestamp major_of = 0ULL, minor_of = ULLONG_MAX, t = 0ULL;
+        double value = 0.0;
+        size_t index = 0;
+        int found = 0;
+        if (query->bits.first == 1 || query->bits.last == 1) {
+            query_select_init(&sel, ts, 0, query->filters, query->filters_nr);
+            if (query->bits.first == 1) {
+                found = tts_timeseries_select_next(&sel, &span);
+            } else if (query->filters_nr > 0) {
+                found = tts_timeseries_select_last(&sel, &span);
             } else {
-                size_t lo_idx = 0UL, hi_idx = 0UL;
-                get_range_indexes(ts, minor_of, major_of, &lo_idx, &hi_idx);
-                handle_tts_query_mean_r(ts, &response, lo_idx, hi_idx,
-                                        major_of, packet->query.mean_val, buf);
+                /* Without filters the last point is read from the head */
+                found = tts_timeseries_last(ts, &t, &value, &index);
+                span = (struct tts_span) {
+                    .index = index, .len = 1, .rows = NULL,
+                    .timestamps = &t, .values = &value, .sets = NULL
+                };
+            }
+            if (found == 1)
+                handle_tts_query_one(ts, &response, &span, payload);
+            else
+                pack_query_response(payload, &response);
+            tts_timeseries_select_destroy(&sel);
+        } else {
+            /*
+             * Without a lower bound, mean windows are aligned to the first
+             * point of the timeseries
+             */
+            if (query->bits.major_of == 1) {
+                major_of = query->major_of;
+            } else if (query->bits.mean == 1) {
+                tts_timeseries_iter_init(&it, ts, 0);
+                if (tts_timeseries_iter_next(&it, &span) == 1)
+                    major_of = span.timestamps[0];
             }
+            if (query->bits.minor_of == 1)
+                minor_of = query->minor_of;
+            if (query->bits.mean == 0 && query->bits.aggregate == 0)
+                handle_tts_query_range(ts, query, minor_of, major_of,
+                                       payload);
+            else
+                handle_tts_query_aggregate(ts, &response, query, minor_of,
+                                           major_of, query->bits.mean,
+                                           payload);
+        }
+    }
+}
+
+/* Raw points of a range are streamed, every other query is answered at once */
+static inline int query_streamed(const struct tts_query *query) {
+    return query->bits.mean == 0 && query->bits.aggregate == 0 &&
+        query->bits.first == 0 && query->bits.last == 0;
+}
+
+/*
+ * Answer a query on every timeseries whose name matches a pattern, one after
+ * the other, each one with its shard locked; names are taken from the index
+ * of the database, so shards are never locked at the same time. Ranges of
+ * raw points are handed over to the stream, which moves from a timeseries
+ * to the next as each one is done.
+ */
+static int handle_tts_query_select(struct tts_payload *payload) {
+    const struct tts_query *query = &payload->packet.query;
+    struct tts_stream *stream = payload->stream;
+    struct tts_packet response = {0};
+    struct tts_timeseries *ts = NULL;
+    char pattern[TTS_TS_NAME_MAX_LENGTH];
+    char name[TTS_TS_NAME_MAX_LENGTH];
+    snprintf(pattern, sizeof(pattern), "%.*s",
+             query->ts_name_len, (const char *) query->ts_name);
+    int found = tts_names_next(&payload->tts_db->names, pattern, NULL, name);
+    if (found == 1 && query_streamed(query)) {
+        stream->active = 1;
+        stream->ts_name = strdup(name);
+        stream->pattern = strdup(pattern);
+        stream->skip = 0;
+        stream->from = stream->major_of =
+            query->bits.major_of == 1 ? query->major_of : 0;
+        stream->minor_of =
+            query->bits.minor_of == 1 ? query->minor_of : ULLONG_MAX;
+        stream->filters_nr = query->filters_nr;
+        stream->filters = tts_query_filters_copy(query->filters,
+                                                 query->filters_nr);
+        return tts_handle_stream(payload);
+    }
+    for (; found == 1;
+         found = tts_names_next(&payload->tts_db->names, pattern, name, name)) {
+        struct tts_shard *shard =
+            tts_database_shard(payload->tts_db, name, strlen(name));
+        pthread_mutex_lock(&shard->lock);
+        HASH_FIND_STR(shard->timeseries, name, ts);
+        if (ts) {
+            payload->series = ts->name;
+            query_timeseries(ts, query, payload);
+            payload->series = NULL;
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    TTS_SET_RESPONSE_HEADER(&response, TTS_QUERY_RESPONSE, TTS_OK);
+    pack_response(payload, &response);
+    return TTS_OK;
+}
+
+static int handle_tts_query(struct tts_payload *payload) {
+    struct tts_query *query = &payload->packet.query;
+    struct tts_packet response = {0};
+    struct tts_timeseries *ts = NULL;
+    char *key = (char *) query->ts_name;
+    if (query->bits.select == 1)
+        return handle_tts_query_select(payload);
+    /*
+     * First check that the timeseries doesn't exists already, returning a
+     * TTS_ENOTS status code in case, as we end having no points to return
+     */
+    struct tts_shard *shard =
+        tts_database_shard(payload->tts_db, key, query->ts_name_len);
+    pthread_mutex_lock(&shard->lock);
+    HASH_FIND(hh, shard->timeseries, key, query->ts_name_len, ts);
+    if (ts) {
+        query_timeseries(ts, query, payload);
+    } else {
+        TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, TTS_ENOTS);
+        pack_response(payload, &response);
+    }
+    pthread_mutex_unlock(&shard->lock);
+    return TTS_OK;
+}
+
+/*
+ * Subscribe the connection to the points added from now on to a timeseries,
+ * which must exist, or to the ones matching a pattern; connections can't
+ * subscribe past TTS_SUBSCRIPTIONS_MAX, they're answered as by a server not
+ * supporting subscriptions then
+ */
+static int handle_tts_subscribe(struct tts_payload *payload) {
+    const struct tts_query *query = &payload->packet.query;
+    struct tts_packet response = {0};
+    struct tts_timeseries *ts = NULL;
+    int rc = TTS_OK;
+    if (query->bits.select == 0) {
+        struct tts_shard *shard =
+            tts_database_shard(payload->tts_db, (char *) query->ts_name,
+                               query->ts_name_len);
+        pthread_mutex_lock(&shard->lock);
+        HASH_FIND(hh, shard->timeseries, query->ts_name,
+                  query->ts_name_len, ts);
+        pthread_mutex_unlock(&shard->lock);
+        rc = ts ? TTS_OK : TTS_ENOTS;
+    }
+    if (!payload->subs || !payload->subscriber)
+        rc = TTS_UNKNOWN_CMD;
+    else if (rc == TTS_OK &&
+             tts_subscribe(payload->subs, payload->subscriber, query) < 0)
+        rc = TTS_UNKNOWN_CMD;
+    TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, rc);
+    pack_response(payload, &response);
+    return TTS_OK;
+}
+
+static int handle_tts_unknown(struct tts_payload *payload) {
+    struct tts_packet response = {0};
+    log_debug("Unknown command %i", payload->packet.header.opcode);
+    TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, TTS_UNKNOWN_CMD);
+    pack_response(payload, &response);
+    return TTS_OK;
+}
+
+/*
+ * Negotiate the version of the wire format, the highest both sides speak, it
+ * applies from the next packet on, dictionaries start over
+ */
+static int handle_tts_hello(struct tts_payload *payload) {
+    struct tts_packet response = {0};
+    uint8_t version = payload->packet.hello.version;
+    if (version > TTS_PROTOCOL_V2)
+        version = TTS_PROTOCOL_V2;
+    if (version < TTS_PROTOCOL_V1)
+        version = TTS_PROTOCOL_V1;
+    TTS_SET_RESPONSE_HEADER(&response, TTS_HELLO, TTS_OK);
+    response.hello.version = version;
+    pack_response(payload, &response);
+    if (payload->codec)
+        tts_codec_reset(payload->codec, version);
+    log_debug("Wire format version %u", version);
+    return TTS_OK;
+}
+
+/*
+ * Report the counters of the workers and of the database, the timeseries
+ * matching the pattern requested are reported one by one, every one without
+ * a pattern
+ */
+static int handle_tts_info(struct tts_payload *payload) {
+    const struct tts_info *info = &payload->packet.info;
+    struct tts_packet response = {0};
+    struct tts_report report;
+    char pattern[TTS_TS_NAME_MAX_LENGTH];
+    snprintf(pattern, sizeof(pattern), "%.*s",
+             (int) info->len, (const char *) info->data);
+    tts_report_init(&report);
+    tts_stats_report(&report, payload->stats, payload->stats_nr,
+                     payload->tts_db, info->len > 0 ? pattern : NULL);
+    TTS_SET_RESPONSE_HEADER(&response, TTS_INFO, TTS_OK);
+    response.info.len = report.size;
+    response.info.data = (uint8_t *) report.text;
+    pack_response(payload, &response);
+    tts_report_destroy(&report);
+    return TTS_OK;
+}
+
+/*
+ * Continue streaming the range query response in progress, packing its next
+ * frame, the timeseries could have been deleted in the meanwhile, in that case
+ * the response is just closed by an empty frame. Selector queries move to the
+ * next timeseries matching once one is done, packing the frames of the
+ * following ones into the same write till it's filled, and are always closed
+ * by an empty frame.
+ */
+int tts_handle_stream(struct tts_payload *payload) {
+    struct tts_stream *stream = payload->stream;
+    struct tts_timeseries *ts = NULL;
+    struct tts_packet response = {0};
+    char name[TTS_TS_NAME_MAX_LENGTH];
+    if (stream->active == 0)
+        return TTS_OK;
+    while (stream->active == 1) {
+        struct tts_shard *shard =
+            tts_database_shard(payload->tts_db, stream->ts_name,
+                               strlen(stream->ts_name));
+        pthread_mutex_lock(&shard->lock);
+        HASH_FIND_STR(shard->timeseries, stream->ts_name, ts);
+        if (ts) {
+            payload->series = stream->pattern ? ts->name : NULL;
+            handle_tts_stream_frame(ts, payload);
+            payload->series = NULL;
+        } else {
+            stream->active = 0;
+        }
+        pthread_mutex_unlock(&shard->lock);
+        if (stream->active == 1 || !stream->pattern ||
+            tts_names_next(&payload->tts_db->names, stream->pattern,
+                           stream->ts_name, name) == 0)
+            break;
+        free(stream->ts_name);
+        stream->ts_name = strdup(name);
+        stream->major_of = stream->from;
+        stream->skip = 0;
+        stream->active = 1;
+        if (payload->out->size >= EV_TCP_BUFSIZE)
+            return TTS_OK;
+    }
+    if (stream->active == 0) {
+        if (!ts || stream->pattern) {
+            TTS_SET_RESPONSE_HEADER(&response, TTS_QUERY_RESPONSE, TTS_OK);
+            pack_response(payload, &response);
+        }
+        tts_stream_close(stream);
+    }
+    return TTS_OK;
+}
+
+/*
+ * Pack the results queued to the subscriber of the connection, in frames of
+ * at most TTS_STREAM_POINTS results, each one labelled by "timeseries" and
+ * the name of its timeseries ahead of its own labels. Return -1 if the
+ * subscriber has fallen behind, its connection is to be closed.
+ */
+int tts_handle_subscriber(struct tts_payload *payload) {
+    struct tts_packet response = {0};
+    struct tts_query_response *q = &response.query_r;
+    struct tts_push *pushes = NULL;
+    size_t n = 0, len = 0, labels_nr = 0;
+    if (tts_subscriber_take(payload->subscriber, &pushes, &n) < 0) {
+        tts_subscriber_done(payload->subscriber);
+        return -1;
+    }
+    TTS_SET_RESPONSE_HEADER(&response, TTS_SUBSCRIBE, TTS_OK);
+    if (n > 0)
+        q->results = malloc((n < TTS_STREAM_POINTS ? n : TTS_STREAM_POINTS) *
+                            sizeof(*q->results));
+    for (size_t i = 0; i < n; i += len) {
+        len = n - i < TTS_STREAM_POINTS ? n - i : TTS_STREAM_POINTS;
+        labels_nr = 0;
+        for (size_t j = 0; j < len; ++j)
+            labels_nr += pushes[i + j].labels_nr + 1;
+        struct tts_query_label *labels = malloc(labels_nr * sizeof(*labels));
+        struct tts_query_label *next = labels;
+        for (size_t j = 0; j < len; ++j) {
+            const struct tts_push *push = &pushes[i + j];
+            next[0] = (struct tts_query_label) {
+                .label_len = sizeof("timeseries") - 1,
+                .label = (uint8_t *) "timeseries",
+                .value_len = strlen(push->series),
+                .value = (uint8_t *) push->series
+            };
+            if (push->labels_nr > 0)
+                memcpy(next + 1, push->labels,
+                       push->labels_nr * sizeof(*next));
+            q->results[j].rc = TTS_OK;
+            q->results[j].ts_sec = push->t / (tts_timestamp) 1e9;
+            q->results[j].ts_nsec = push->t % (tts_timestamp) 1e9;
+            q->results[j].value = push->value;
+            q->results[j].labels_len = push->labels_nr + 1;
+            q->results[j].labels = next;
+            next += push->labels_nr + 1;
         }
+        q->len = len;
+        pack_response(payload, &response);
+        free(labels);
     }
+    free(q->results);
+    tts_subscriber_done(payload->subscriber);
     return TTS_OK;
 }
 
+/*
+ * Release the state of a stream, done or interrupted by the client leaving
+ */
+void tts_stream_close(struct tts_stream *stream) {
+    free(stream->ts_name);
+    stream->ts_name = NULL;
+    free(stream->pattern);
+    stream->pattern = NULL;
+    tts_query_filters_destroy(stream->filters, stream->filters_nr);
+    stream->filters_nr = 0;
+    stream->filters = NULL;
+}
+
 /*
  * Main entry-point of the module, just dispatch the payload to the correct
  * handler, based on the opcode of the request
@@ -547,6 +1358,25 @@ int tts_handle_packet(struct tts_payload *payload) {
         case TTS_QUERY:
             rc = handle_tts_query(payload);
             break;
+        case TTS_HELLO:
+            rc = handle_tts_hello(payload);
+            break;
+        case TTS_MLAST:
+            rc = handle_tts_mlast(payload);
+            break;
+        case TTS_INFO:
+            rc = handle_tts_info(payload);
+            break;
+        case TTS_SUBSCRIBE:
+            rc = handle_tts_subscribe(payload);
+            break;
+        default:
+            /*
+             * Every request must be answered, or pipelined responses would
+             * get out of sync with the requests
+             */
+            rc = handle_tts_unknown(payload);
+            break;
     }
     return rc;
 }
@@ -32,18 +32,71 @@
 #include "tts_protocol.h"
 
 struct tts_server;
+struct tts_wal;
+struct tts_replication;
+struct tts_subscriptions;
+struct tts_subscriber;
+struct tts_stats;
+
+/*
+ * Maximum number of points carried by a single frame of a streamed query
+ * response
+ */
+#define TTS_STREAM_POINTS 256
+
+/*
+ * State of a range query response being streamed out in multiple frames, one
+ * per connection, the range is read straight from the timeseries on every
+ * frame, resuming from the timestamp of the next point to send, `major_of`,
+ * skipping the `skip` points with the same timestamp already sent; rows can
+ * be laid out again in the meanwhile, as points out of order are merged. The
+ * label filters of the query, if any, are owned by the stream till it's done.
+ * Queries selecting timeseries by `pattern` move to the next timeseries
+ * matching it once one is done, reading it again from `from`.
+ */
+struct tts_stream {
+    int active;
+    char *ts_name;
+    char *pattern;
+    tts_timestamp from;
+    size_t skip;
+    tts_timestamp major_of;
+    tts_timestamp minor_of;
+    uint16_t filters_nr;
+    struct tts_query_filter *filters;
+};
 
 /*
  * Just a "carrier" structure, it should contains the current
- * received/in-process tts_packet, an ev_tcp_handle pointer and a global
- * tts_server pointer
+ * received/in-process tts_packet, an ev_tcp_handle pointer, a global
+ * tts_server pointer, the connection stream state, the write-ahead log
+ * and the replication stream where to append the changes applied, the
+ * subscriptions to feed the points added and the subscriber state of the
+ * connection, NULL if there's none, the wire
+ * format state of the connection, NULL meaning the first version, the
+ * name of the timeseries labelling the results of a selector query being
+ * answered, NULL otherwise, and the counters of all the `stats_nr` workers,
+ * to be reported
  */
 struct tts_payload {
     struct tts_packet packet;
-    ev_buf *buf;
+    ev_buf_list *out;
     struct tts_database *tts_db;
+    struct tts_stream *stream;
+    struct tts_wal *wal;
+    struct tts_replication *repl;
+    struct tts_subscriptions *subs;
+    struct tts_subscriber *subscriber;
+    struct tts_codec *codec;
+    const char *series;
+    const struct tts_stats *stats;
+    size_t stats_nr;
 };
 
 int tts_handle_packet(struct tts_payload *);
+void tts_handle_response(struct tts_payload *, const struct tts_packet *);
+int tts_handle_stream(struct tts_payload *);
+int tts_handle_subscriber(struct tts_payload *);
+void tts_stream_close(struct tts_stream *);
 
 #endif
@@ -0,0 +1,235 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "tts_log.h"
+#include "tts_kernel.h"
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/*
+ * ================
+ *  Scalar kernels
+ * ================
+ */
+
+static size_t upper_bound_scalar(const tts_timestamp *timestamps,
+                                 size_t len, tts_timestamp t) {
+    size_t i = 0;
+    while (i < len && timestamps[i] <= t)
+        ++i;
+    return i;
+}
+
+static void reduce_scalar(const double *values, size_t len,
+                          double *sum, double *min, double *max) {
+    double s = 0.0, lo = values[0], hi = values[0];
+    for (size_t i = 0; i < len; ++i) {
+        s += values[i];
+        lo = values[i] < lo ? values[i] : lo;
+        hi = values[i] > hi ? values[i] : hi;
+    }
+    *sum = s;
+    *min = lo;
+    *max = hi;
+}
+
+static double m2_scalar(const double *values, size_t len, double mean) {
+    double m2 = 0.0;
+    for (size_t i = 0; i < len; ++i)
+        m2 += (values[i] - mean) * (values[i] - mean);
+    return m2;
+}
+
+struct tts_kernels tts_kernels = {
+    .name = "scalar",
+    .upper_bound = upper_bound_scalar,
+    .reduce = reduce_scalar,
+    .m2 = m2_scalar
+};
+
+#if defined(__x86_64__)
+
+/*
+ * ==============
+ *  AVX2 kernels
+ * ==============
+ *
+ * Four lanes at a time, tails are left to the scalar kernels. AVX2 only
+ * compares signed 64 bits integers, timestamps are biased by flipping their
+ * sign bit to compare them unsigned.
+ */
+
+__attribute__((target("avx2")))
+static size_t upper_bound_avx2(const tts_timestamp *timestamps,
+                               size_t len, tts_timestamp t) {
+    const __m256i bias = _mm256_set1_epi64x((long long) (1ULL << 63));
+    const __m256i bound = _mm256_xor_si256(_mm256_set1_epi64x(t), bias);
+    size_t i = 0;
+    for (; i + 4 <= len; i += 4) {
+        __m256i ts = _mm256_loadu_si256((const __m256i *) (timestamps + i));
+        __m256i gt = _mm256_cmpgt_epi64(_mm256_xor_si256(ts, bias), bound);
+        int mask = _mm256_movemask_pd(_mm256_castsi256_pd(gt));
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return i + upper_bound_scalar(timestamps + i, len - i, t);
+}
+
+__attribute__((target("avx2")))
+static void reduce_avx2(const double *values, size_t len,
+                        double *sum, double *min, double *max) {
+    double lanes[4], s = 0.0, lo = values[0], hi = values[0];
+    size_t i = 0;
+    if (len >= 4) {
+        __m256d vs = _mm256_setzero_pd();
+        __m256d vlo = _mm256_loadu_pd(values), vhi = vlo;
+        for (; i + 4 <= len; i += 4) {
+            __m256d v = _mm256_loadu_pd(values + i);
+            vs = _mm256_add_pd(vs, v);
+            vlo = _mm256_min_pd(vlo, v);
+            vhi = _mm256_max_pd(vhi, v);
+        }
+        _mm256_storeu_pd(lanes, vs);
+        s = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+        _mm256_storeu_pd(lanes, vlo);
+        for (int k = 0; k < 4; ++k)
+            lo = lanes[k] < lo ? lanes[k] : lo;
+        _mm256_storeu_pd(lanes, vhi);
+        for (int k = 0; k < 4; ++k)
+            hi = lanes[k] > hi ? lanes[k] : hi;
+    }
+    for (; i < len; ++i) {
+        s += values[i];
+        lo = values[i] < lo ? values[i] : lo;
+        hi = values[i] > hi ? values[i] : hi;
+    }
+    *sum = s;
+    *min = lo;
+    *max = hi;
+}
+
+__attribute__((target("avx2")))
+static double m2_avx2(const double *values, size_t len, double mean) {
+    double lanes[4], m2 = 0.0;
+    size_t i = 0;
+    __m256d vm2 = _mm256_setzero_pd(), vmean = _mm256_set1_pd(mean);
+    for (; i + 4 <= len; i += 4) {
+        __m256d d = _mm256_sub_pd(_mm256_loadu_pd(values + i), vmean);
+        vm2 = _mm256_add_pd(vm2, _mm256_mul_pd(d, d));
+    }
+    _mm256_storeu_pd(lanes, vm2);
+    m2 = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+    return m2 + m2_scalar(values + i, len - i, mean);
+}
+
+#elif defined(__aarch64__)
+
+/*
+ * ==============
+ *  NEON kernels
+ * ==============
+ *
+ * Two lanes at a time, tails are left to the scalar kernels.
+ */
+
+static size_t upper_bound_neon(const tts_timestamp *timestamps,
+                               size_t len, tts_timestamp t) {
+    const uint64x2_t bound = vdupq_n_u64(t);
+    size_t i = 0;
+    for (; i + 2 <= len; i += 2) {
+        uint64x2_t gt = vcgtq_u64(vld1q_u64(timestamps + i), bound);
+        if (vgetq_lane_u64(gt, 0) != 0)
+            return i;
+        if (vgetq_lane_u64(gt, 1) != 0)
+            return i + 1;
+    }
+    return i + upper_bound_scalar(timestamps + i, len - i, t);
+}
+
+static void reduce_neon(const double *values, size_t len,
+                        double *sum, double *min, double *max) {
+    double s = 0.0, lo = values[0], hi = values[0];
+    size_t i = 0;
+    if (len >= 2) {
+        float64x2_t vs = vdupq_n_f64(0.0);
+        float64x2_t vlo = vld1q_f64(values), vhi = vlo;
+        for (; i + 2 <= len; i += 2) {
+            float64x2_t v = vld1q_f64(values + i);
+            vs = vaddq_f64(vs, v);
+            vlo = vminq_f64(vlo, v);
+            vhi = vmaxq_f64(vhi, v);
+        }
+        s = vaddvq_f64(vs);
+        lo = vminvq_f64(vlo);
+        hi = vmaxvq_f64(vhi);
+    }
+    for (; i < len; ++i) {
+        s += values[i];
+        lo = values[i] < lo ? values[i] : lo;
+        hi = values[i] > hi ? values[i] : hi;
+    }
+    *sum = s;
+    *min = lo;
+    *max = hi;
+}
+
+static double m2_neon(const double *values, size_t len, double mean) {
+    float64x2_t vm2 = vdupq_n_f64(0.0), vmean = vdupq_n_f64(mean);
+    size_t i = 0;
+    for (; i + 2 <= len; i += 2) {
+        float64x2_t d = vsubq_f64(vld1q_f64(values + i), vmean);
+        vm2 = vfmaq_f64(vm2, d, d);
+    }
+    return vaddvq_f64(vm2) + m2_scalar(values + i, len - i, mean);
+}
+
+#endif
+
+/*
+ * Pick the best kernels supported by the CPU, to be called once at startup
+ */
+void tts_kernel_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        tts_kernels.name = "avx2";
+        tts_kernels.upper_bound = upper_bound_avx2;
+        tts_kernels.reduce = reduce_avx2;
+        tts_kernels.m2 = m2_avx2;
+    }
+#elif defined(__aarch64__)
+    tts_kernels.name = "neon";
+    tts_kernels.upper_bound = upper_bound_neon;
+    tts_kernels.reduce = reduce_neon;
+    tts_kernels.m2 = m2_neon;
+#endif
+    log_info("Using %s scan and reduction kernels", tts_kernels.name);
+}
@@ -0,0 +1,74 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TTS_KERNEL_H
+#define TTS_KERNEL_H
+
+#include <stddef.h>
+#include "tts.h"
+
+/*
+ * Scan and reduction kernels over the columns of a timeseries, vectorized
+ * where the CPU allows it: AVX2 on x86-64, picked at runtime, NEON on
+ * AArch64, where it's always available, a portable scalar version
+ * otherwise. `tts_kernel_init` must be called once, before any other
+ * thread starts using them, it's harmless to skip it, the scalar kernels
+ * are used then.
+ *
+ * - upper_bound, position of the first timestamp greater than a bound in a
+ *   sorted column, the end of a window or of a range
+ * - reduce, sum, min and max of a run of values, at least one
+ * - m2, sum of the squared deviations of a run of values from a mean
+ */
+struct tts_kernels {
+    const char *name;
+    size_t (*upper_bound)(const tts_timestamp *, size_t, tts_timestamp);
+    void (*reduce)(const double *, size_t, double *, double *, double *);
+    double (*m2)(const double *, size_t, double);
+};
+
+extern struct tts_kernels tts_kernels;
+
+void tts_kernel_init(void);
+
+static inline size_t tts_kernel_upper_bound(const tts_timestamp *timestamps,
+                                            size_t len, tts_timestamp t) {
+    return tts_kernels.upper_bound(timestamps, len, t);
+}
+
+static inline void tts_kernel_reduce(const double *values, size_t len,
+                                     double *sum, double *min, double *max) {
+    tts_kernels.reduce(values, len, sum, min, max);
+}
+
+static inline double tts_kernel_m2(const double *values, size_t len,
+                                   double mean) {
+    return tts_kernels.m2(values, len, mean);
+}
+
+#endif
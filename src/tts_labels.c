@@ -0,0 +1,144 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <string.h>
+#include "tts.h"
+
+/*
+ * Labels dictionary, label names and values are interned at insertion, then
+ * the points carrying labels just reference an interned set of pairs of
+ * them. Strings and sets are reference counted, they're released once the
+ * last point or tag referencing them is gone, dropped by the retention or
+ * by the deletion of the timeseries.
+ */
+
+void tts_labels_init(struct tts_labels *labels) {
+    labels->strings = NULL;
+    labels->sets = NULL;
+}
+
+/*
+ * Release everything left in the dictionary, usually nothing as the
+ * timeseries are destroyed first
+ */
+void tts_labels_destroy(struct tts_labels *labels) {
+    struct tts_labelset *set, *set_tmp;
+    struct tts_string *str, *str_tmp;
+    HASH_ITER(hh, labels->sets, set, set_tmp) {
+        HASH_DEL(labels->sets, set);
+        free(set->labels);
+        free(set);
+    }
+    HASH_ITER(hh, labels->strings, str, str_tmp) {
+        HASH_DEL(labels->strings, str);
+        free(str->str);
+        free(str);
+    }
+}
+
+/*
+ * Return the interned copy of the `len` bytes at `s`, interning it if it's not
+ * there yet, the caller holds a reference to it. `s` needs not to be
+ * nul-terminated, the interned copy is
+ */
+struct tts_string *tts_labels_intern(struct tts_labels *labels,
+                                     const char *s, size_t len) {
+    struct tts_string *str = NULL;
+    HASH_FIND(hh, labels->strings, s, len, str);
+    if (str)
+        return tts_labels_retain(str);
+    str = malloc(sizeof(*str));
+    str->refs = 1;
+    str->len = len;
+    str->str = malloc(len + 1);
+    memcpy(str->str, s, len);
+    str->str[len] = '\0';
+    HASH_ADD_KEYPTR(hh, labels->strings, str->str, str->len, str);
+    return str;
+}
+
+/*
+ * Return the interned copy of the `len` bytes at `s` without taking any
+ * reference, NULL if it has never been interned, so no label can match it
+ */
+struct tts_string *tts_labels_lookup(const struct tts_labels *labels,
+                                     const char *s, size_t len) {
+    struct tts_string *str = NULL;
+    HASH_FIND(hh, labels->strings, s, len, str);
+    return str;
+}
+
+void tts_labels_release(struct tts_labels *labels, struct tts_string *str) {
+    if (--str->refs > 0)
+        return;
+    HASH_DEL(labels->strings, str);
+    free(str->str);
+    free(str);
+}
+
+/*
+ * Return the interned set made of the `len` labels pairs, interning it if
+ * it's not there yet, the caller holds a reference to it. The references to
+ * the strings held by the pairs pass to the set.
+ */
+struct tts_labelset *tts_labels_set(struct tts_labels *labels,
+                                    const struct tts_label *pairs,
+                                    size_t len) {
+    struct tts_labelset *set = NULL;
+    HASH_FIND(hh, labels->sets, pairs, len * sizeof(*pairs), set);
+    if (set) {
+        /* The set owns a reference to its strings already */
+        for (size_t i = 0; i < len; ++i) {
+            tts_labels_release(labels, pairs[i].field);
+            tts_labels_release(labels, pairs[i].value);
+        }
+        ++set->refs;
+        return set;
+    }
+    set = malloc(sizeof(*set));
+    set->refs = 1;
+    set->labels_nr = len;
+    set->labels = malloc(len * sizeof(*set->labels));
+    memcpy(set->labels, pairs, len * sizeof(*pairs));
+    HASH_ADD_KEYPTR(hh, labels->sets, set->labels,
+                    len * sizeof(*set->labels), set);
+    return set;
+}
+
+void tts_labels_set_release(struct tts_labels *labels,
+                            struct tts_labelset *set) {
+    if (--set->refs > 0)
+        return;
+    HASH_DEL(labels->sets, set);
+    for (size_t i = 0; i < set->labels_nr; ++i) {
+        tts_labels_release(labels, set->labels[i].field);
+        tts_labels_release(labels, set->labels[i].value);
+    }
+    free(set->labels);
+    free(set);
+}
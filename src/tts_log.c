@@ -27,41 +27,268 @@
 
 #include <time.h>
 #include <errno.h>
-#include <sys/time.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include "tts_log.h"
 #include "tts_config.h"
 
+/* Records the ring can hold, a power of 2 */
+#define LOG_RING_SIZE 4096
+
+/* Time the writer sleeps for when there's nothing to write, in nanoseconds */
+#define LOG_IDLE_NS 10000000L
+
+/*
+ * Messages sharing the same format that are written in a second, past that
+ * they're counted and reported with a single line once the second is over
+ */
+#define LOG_BURST 64
+#define LOG_SOURCES 256
+
+/*
+ * A message formatted by the thread logging it, the time is rendered by the
+ * writer only. `seq` sequences the slot among producers and the writer, as in
+ * Vyukov's bounded queue: it's equal to the position when the slot is free to
+ * be taken, to the position plus one once the message has been stored
+ */
+struct log_record {
+    _Atomic size_t seq;
+    int level;
+    const char *fmt;
+    struct timespec time;
+    char msg[MAX_LOG_SIZE + 4];
+};
+
+/* A format seen in the current second, and how many times */
+struct log_source {
+    const char *fmt;
+    unsigned long count;
+};
+
+/*
+ * Producers claim a slot by moving `head` forward, the writer thread is the
+ * only consumer, a full ring drops the message instead of waiting, so a slow
+ * disk never stalls the event loops
+ */
+static struct {
+    struct log_record *records;
+    _Atomic size_t head;
+    size_t tail;
+    _Atomic unsigned long dropped;
+    _Atomic int running;
+    pthread_t writer;
+    time_t second;
+    struct log_source sources[LOG_SOURCES];
+} ring;
+
 /* Global file handle for logging on disk */
 static FILE *fh = NULL;
 
+static void log_write(int pid, const struct timespec *time, const char *msg) {
+    char timestr[32];
+    struct tm utcnow;
+    gmtime_r(&time->tv_sec, &utcnow);
+    int pos = strftime(timestr, sizeof(timestr), "%F %T.", &utcnow);
+    snprintf(timestr + pos, sizeof(timestr) - pos, "%03d",
+             (int) (time->tv_nsec / 1000000));
+    fprintf(stdout, "[%i %s] %s\n", pid, timestr, msg);
+    if (fh)
+        fprintf(fh, "[%i %s] %s\n", pid, timestr, msg);
+}
+
+static void log_flush(void) {
+    fflush(stdout);
+    if (fh)
+        fflush(fh);
+}
+
+/*
+ * Report the messages suppressed in the second gone by and start counting
+ * again
+ */
+static void log_sources_reset(const struct timespec *now) {
+    char msg[MAX_LOG_SIZE + 4];
+    for (int i = 0; i < LOG_SOURCES; ++i) {
+        struct log_source *src = &ring.sources[i];
+        if (src->count > LOG_BURST) {
+            snprintf(msg, sizeof(msg), "%lu more messages like \"%s\"",
+                     src->count - LOG_BURST, src->fmt);
+            log_write(conf->pid, now, msg);
+        }
+        src->fmt = NULL;
+        src->count = 0;
+    }
+    ring.second = now->tv_sec;
+}
+
+/*
+ * Count a message against the budget of its format, open addressing on the
+ * address of the format, the same for every message logged at that line.
+ * Return 1 if the message is to be written, 0 otherwise
+ */
+static int log_source_allow(const struct log_record *record) {
+    if (record->level == FATAL)
+        return 1;
+    if (record->time.tv_sec != ring.second)
+        log_sources_reset(&record->time);
+    size_t i = ((uintptr_t) record->fmt >> 3) & (LOG_SOURCES - 1);
+    for (int probes = 0; probes < LOG_SOURCES; ++probes) {
+        struct log_source *src = &ring.sources[i];
+        if (!src->fmt)
+            src->fmt = record->fmt;
+        if (src->fmt == record->fmt)
+            return ++src->count <= LOG_BURST;
+        i = (i + 1) & (LOG_SOURCES - 1);
+    }
+    return 1;
+}
+
+/*
+ * Write out every message stored so far, return the number of messages
+ * written
+ */
+static size_t log_drain(void) {
+    size_t n = 0;
+    for (;;) {
+        struct log_record *record =
+            &ring.records[ring.tail & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        if (seq != ring.tail + 1)
+            break;
+        if (log_source_allow(record) == 1)
+            log_write(conf->pid, &record->time, record->msg);
+        atomic_store_explicit(&record->seq, ring.tail + LOG_RING_SIZE,
+                              memory_order_release);
+        ++ring.tail;
+        ++n;
+    }
+    unsigned long dropped =
+        atomic_exchange_explicit(&ring.dropped, 0, memory_order_relaxed);
+    if (dropped > 0) {
+        char msg[64];
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        snprintf(msg, sizeof(msg), "%lu messages dropped", dropped);
+        log_write(conf->pid, &now, msg);
+        ++n;
+    }
+    return n;
+}
+
+/*
+ * Writer thread, drains the ring and flushes once it's been emptied, sleeps
+ * while there's nothing to write; stopped by `tts_log_close`, it drains the
+ * ring one last time before leaving
+ */
+static void *log_writer(void *arg) {
+    (void) arg;
+    struct timespec idle = { 0, LOG_IDLE_NS }, now;
+    while (atomic_load_explicit(&ring.running, memory_order_acquire) == 1) {
+        if (log_drain() > 0) {
+            log_flush();
+            continue;
+        }
+        /* Nothing new, report what's been suppressed once the second is over */
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (now.tv_sec != ring.second) {
+            log_sources_reset(&now);
+            log_flush();
+        }
+        nanosleep(&idle, NULL);
+    }
+    log_drain();
+    clock_gettime(CLOCK_REALTIME, &now);
+    log_sources_reset(&now);
+    log_flush();
+    return NULL;
+}
+
+/*
+ * A forked child doesn't carry the writer thread along, it writes its
+ * messages itself
+ */
+static void log_atfork_child(void) {
+    atomic_store_explicit(&ring.running, 0, memory_order_relaxed);
+}
+
 /*
- * Tries to open in append mode a file on disk, to be called only if logging to
- * disk is active
+ * Tries to open in append mode a file on disk if one is given, then starts
+ * the writer thread, messages logged before are written straight away
  */
 void tts_log_init(const char *file) {
-    if (!file) return;
-    fh = fopen(file, "a+");
-    if (!fh)
-        log_warning("WARNING: Unable to open file %s: %s",
-                    file, strerror(errno));
+    if (file && file[0]) {
+        fh = fopen(file, "a+");
+        if (!fh)
+            log_warning("WARNING: Unable to open file %s: %s",
+                        file, strerror(errno));
+    }
+    ring.records = calloc(LOG_RING_SIZE, sizeof(*ring.records));
+    if (!ring.records)
+        return;
+    for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+        atomic_init(&ring.records[i].seq, i);
+    atomic_store(&ring.running, 1);
+    if (pthread_create(&ring.writer, NULL, log_writer, NULL) != 0) {
+        atomic_store(&ring.running, 0);
+        free(ring.records);
+        ring.records = NULL;
+        return;
+    }
+    pthread_atfork(NULL, NULL, log_atfork_child);
 }
 
 /*
- * Close the previously opened file handler, to be called only after
- * tts_log_init has been called
+ * Stop the writer thread, once every message logged has been written out,
+ * and close the log file if any, to be called only after tts_log_init has
+ * been called. The ring is left allocated, threads still logging may have
+ * claimed a slot just before
  */
 void tts_log_close(void) {
+    if (atomic_exchange(&ring.running, 0) == 1)
+        pthread_join(ring.writer, NULL);
     if (fh) {
         fflush(fh);
         fclose(fh);
+        fh = NULL;
     }
 }
 
+/*
+ * Claim the next free slot of the ring, NULL if it's full
+ */
+static struct log_record *log_claim(size_t *pos) {
+    size_t head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+    for (;;) {
+        struct log_record *record = &ring.records[head & (LOG_RING_SIZE - 1)];
+        size_t seq = atomic_load_explicit(&record->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) head;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring.head, &head,
+                                                      head + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed)) {
+                *pos = head;
+                return record;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            head = atomic_load_explicit(&ring.head, memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Format a message into the ring, the writer thread takes care of the rest;
+ * without one running, before tts_log_init, after tts_log_close or in a
+ * forked child, the message is written straight away
+ */
 void tts_log(int level, const char *fmt, ...) {
 
     if (level < conf->loglevel)
@@ -70,34 +297,38 @@ void tts_log(int level, const char *fmt, ...) {
     assert(fmt);
 
     va_list ap;
-    char msg[MAX_LOG_SIZE + 4];
-    char timestr[32];
-    time_t now = time(NULL);
-    struct tm *utcnow = gmtime(&now);
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    int pos = strftime(timestr, sizeof(timestr), "%F %T.", utcnow);
-    snprintf(timestr + pos,sizeof(timestr) - pos, "%03d", (int) tv.tv_usec/1000);
+    struct log_record *record = NULL, local;
+    size_t pos = 0;
+    int async = atomic_load_explicit(&ring.running, memory_order_relaxed);
+
+    if (async == 1 && !(record = log_claim(&pos))) {
+        atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+        return;
+    }
+    if (!record)
+        record = &local;
+
+    record->level = level;
+    record->fmt = fmt;
+    clock_gettime(CLOCK_REALTIME, &record->time);
 
     va_start(ap, fmt);
-    vsnprintf(msg, sizeof(msg), fmt, ap);
+    vsnprintf(record->msg, sizeof(record->msg), fmt, ap);
     va_end(ap);
 
     /* Truncate message too long and copy 3 bytes to make space for 3 dots */
-    memcpy(msg + MAX_LOG_SIZE, "...", 3);
-    msg[MAX_LOG_SIZE + 3] = '\0';
-
-    // Open two handler, one for standard output and a second for the
-    // persistent log file
-    FILE *fp = stdout;
-
-    if (!fp)
-        return;
+    memcpy(record->msg + MAX_LOG_SIZE, "...", 3);
+    record->msg[MAX_LOG_SIZE + 3] = '\0';
 
-    fprintf(fp, "[%i %s] %s\n", conf->pid, timestr, msg);
-    if (fh)
-        fprintf(fh, "[%i %s] %s\n", conf->pid, timestr, msg);
+    if (record != &local) {
+        atomic_store_explicit(&record->seq, pos + 1, memory_order_release);
+    } else {
+        log_write(conf->pid, &record->time, record->msg);
+        log_flush();
+    }
 
-    if (level == FATAL)
+    if (level == FATAL) {
+        tts_log_close();
         exit(EXIT_FAILURE);
+    }
 }
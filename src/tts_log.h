@@ -28,6 +28,8 @@
 #ifndef TTS_LOG_H
 #define TTS_LOG_H
 
+#include "tts_config.h"
+
 #define MAX_LOG_SIZE 0xFF
 
 enum log_level { DEBUG, INFORMATION, WARNING, ERROR, FATAL };
@@ -36,10 +38,19 @@ void tts_log_init(const char *);
 void tts_log_close(void);
 void tts_log(int, const char *, ...);
 
-#define log_debug(...) tts_log(DEBUG, __VA_ARGS__)
-#define log_warning(...) tts_log(WARNING, __VA_ARGS__)
-#define log_error(...) tts_log(ERROR, __VA_ARGS__)
-#define log_info(...) tts_log(INFORMATION, __VA_ARGS__)
+/*
+ * The level is checked before calling into the logger, so arguments of
+ * disabled messages are neither evaluated nor formatted
+ */
+#define TTS_LOG(level, ...) do {            \
+    if ((level) >= conf->loglevel)          \
+        tts_log((level), __VA_ARGS__);      \
+} while (0)
+
+#define log_debug(...) TTS_LOG(DEBUG, __VA_ARGS__)
+#define log_warning(...) TTS_LOG(WARNING, __VA_ARGS__)
+#define log_error(...) TTS_LOG(ERROR, __VA_ARGS__)
+#define log_info(...) TTS_LOG(INFORMATION, __VA_ARGS__)
 #define log_fatal(...) tts_log(FATAL, __VA_ARGS__)
 
 #endif
@@ -0,0 +1,127 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+
+#include <string.h>
+#include <fnmatch.h>
+#include "tts.h"
+
+/*
+ * Index of the names of the timeseries, a sorted vector of copies of them,
+ * selections by pattern binary search the literal prefix of the pattern and
+ * then match the names sharing it, in order.
+ */
+
+void tts_names_init(struct tts_names *names) {
+    pthread_mutex_init(&names->lock, NULL);
+    TTS_VECTOR_NEW(names->names);
+}
+
+void tts_names_destroy(struct tts_names *names) {
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(names->names); ++i)
+        free(TTS_VECTOR_AT(names->names, i));
+    TTS_VECTOR_DESTROY(names->names);
+    pthread_mutex_destroy(&names->lock);
+}
+
+/* Position of the first name not less than the first `len` bytes of `name` */
+static size_t names_lower_bound(const struct tts_names *names,
+                                const char *name, size_t len) {
+    size_t left = 0, right = TTS_VECTOR_SIZE(names->names), middle = 0;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        const char *other = TTS_VECTOR_AT(names->names, middle);
+        int cmp = strncmp(other, name, len);
+        if (cmp < 0 || (cmp == 0 && strlen(other) < len))
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    return left;
+}
+
+void tts_names_add(struct tts_names *names, const char *name) {
+    size_t len = strlen(name), size = 0, i = 0;
+    pthread_mutex_lock(&names->lock);
+    i = names_lower_bound(names, name, len);
+    size = TTS_VECTOR_SIZE(names->names);
+    if (i == size || strcmp(TTS_VECTOR_AT(names->names, i), name) != 0) {
+        TTS_VECTOR_RESERVE(names->names, size + 1);
+        memmove(names->names.data + i + 1, names->names.data + i,
+                (size - i) * sizeof(*names->names.data));
+        names->names.data[i] = strdup(name);
+        names->names.size = size + 1;
+    }
+    pthread_mutex_unlock(&names->lock);
+}
+
+void tts_names_del(struct tts_names *names, const char *name) {
+    size_t len = strlen(name), size = 0, i = 0;
+    pthread_mutex_lock(&names->lock);
+    i = names_lower_bound(names, name, len);
+    size = TTS_VECTOR_SIZE(names->names);
+    if (i < size && strcmp(TTS_VECTOR_AT(names->names, i), name) == 0) {
+        free(TTS_VECTOR_AT(names->names, i));
+        memmove(names->names.data + i, names->names.data + i + 1,
+                (size - i - 1) * sizeof(*names->names.data));
+        names->names.size = size - 1;
+    }
+    pthread_mutex_unlock(&names->lock);
+}
+
+/*
+ * Copy into `name` the first name following `after`, or the first at all if
+ * NULL, matching the glob `pattern`, as by fnmatch(3); return 0 if there's
+ * none. `name` must hold TTS_TS_NAME_MAX_LENGTH bytes, it can be `after`
+ * itself, to walk all the names matching.
+ */
+int tts_names_next(struct tts_names *names, const char *pattern,
+                   const char *after, char *name) {
+    size_t prefix = strcspn(pattern, "*?[\\"), i = 0;
+    int found = 0;
+    pthread_mutex_lock(&names->lock);
+    if (after && strncmp(after, pattern, prefix) >= 0) {
+        i = names_lower_bound(names, after, strlen(after));
+        if (i < TTS_VECTOR_SIZE(names->names) &&
+            strcmp(TTS_VECTOR_AT(names->names, i), after) == 0)
+            ++i;
+    } else {
+        i = names_lower_bound(names, pattern, prefix);
+    }
+    for (; found == 0 && i < TTS_VECTOR_SIZE(names->names); ++i) {
+        const char *other = TTS_VECTOR_AT(names->names, i);
+        if (strncmp(other, pattern, prefix) != 0)
+            break;
+        if (fnmatch(pattern, other, 0) == 0) {
+            snprintf(name, TTS_TS_NAME_MAX_LENGTH, "%s", other);
+            found = 1;
+        }
+    }
+    pthread_mutex_unlock(&names->lock);
+    return found;
+}
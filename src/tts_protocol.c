@@ -29,24 +29,91 @@
 #include <string.h>
 #include <sys/types.h>
 #include "pack.h"
+#include "tts_arena.h"
 #include "tts_protocol.h"
 
 /*
  * ========================
  *   UNPACKING FUNCTONS
  * ========================
+ *
+ * Everything unpacked is allocated from the arena passed in, valid till it's
+ * reset. Arrays of variable length are allocated once, on the maximum number
+ * of elements the packet could carry, given the minimum size of each one.
+ *
+ * Requests don't copy their strings, names, labels and filters are views
+ * borrowed from the buffer they're unpacked from, not nul-terminated, valid
+ * as long as the buffer is, that is while the request is handled; whatever
+ * must be kept is copied by the handlers. Responses, read by clients, copy
+ * them into the arena instead, as nul-terminated strings.
+ *
+ * Packets are framed by the length in their header, nothing is read past
+ * it: every field is checked to fit in what's left of the packet before it's
+ * read, a packet that doesn't carry what it announces is malformed and its
+ * unpacking fails with -1.
  */
 
+/* Flags, value and labels len of a point, a result adds the timestamp */
+#define POINT_MIN_SIZE  (1 + 16 + 2)
+#define ENTRY_MIN_SIZE  (1 + POINT_MIN_SIZE)
+#define FILTER_MIN_SIZE (2 + 2)
+#define RESULT_MIN_SIZE (1 + 16 + 16 + 2)
+#define ACK_SERIES_SIZE (1 + 4)
+
+/* Fail the unpacking if less than `n` bytes are left of the packet */
+#define UNPACK_NEED(len, n) do {                \
+    if ((ssize_t) (len) < (ssize_t) (n))       \
+        return -1;                              \
+} while (0)
+
+static inline size_t max_elements(ssize_t len, size_t size) {
+    return len > 0 ? (len + size - 1) / size : 0;
+}
+
+/* Bytes taken by a name, its length byte included, at least the byte */
+static inline ssize_t name_size(const uint8_t *buf, ssize_t len) {
+    return len > 0 ? 1 + *buf : 1;
+}
+
+/* Borrow a view of `len` bytes from the buffer */
+static inline size_t unpack_view(uint8_t **buf, size_t len, uint8_t **view) {
+    *view = *buf;
+    *buf += len;
+    return len;
+}
+
+/* Unpack a name, whose size must have been checked to fit with name_size */
 static size_t unpack_ts_name(uint8_t **buf, uint8_t *namelen, uint8_t **name) {
     size_t len = 0;
     int64_t val = 0;
     len += unpack_integer(buf, 'B', &val);
     *namelen = val;
-    *name = malloc(val + 1);
-    len += unpack_bytes(buf, val, *name);
+    len += unpack_view(buf, val, name);
     return len;
 }
 
+/*
+ * Unpack a label and its value, both borrowed from the buffer, each one
+ * prefixed by its 2 bytes length, return the bytes taken or -1 if they
+ * don't fit in the `len` bytes left
+ */
+static ssize_t unpack_label(uint8_t **buf, ssize_t len,
+                            uint16_t *label_len, uint8_t **label,
+                            uint16_t *value_len, uint8_t **value) {
+    ssize_t packed = 0;
+    int64_t val = 0;
+    UNPACK_NEED(len, sizeof(uint16_t));
+    packed += unpack_integer(buf, 'H', &val);
+    UNPACK_NEED(len - packed, val + sizeof(uint16_t));
+    *label_len = val;
+    packed += unpack_view(buf, val, label);
+    packed += unpack_integer(buf, 'H', &val);
+    UNPACK_NEED(len - packed, val);
+    *value_len = val;
+    packed += unpack_view(buf, val, value);
+    return packed;
+}
+
 /*
  * Unpack from binary to struct tts_create packet, the form of the packet is
  * pretty simple, we just proceed populating each member with its value from
@@ -72,10 +139,11 @@ static size_t unpack_ts_name(uint8_t **buf, uint8_t *namelen, uint8_t **name) {
  * The last two steps, will be repeated until the expected length of the packet
  * is exhausted.
  */
-static size_t unpack_tts_create(uint8_t *buf, size_t len,
-                                struct tts_create_ts *c) {
+static ssize_t unpack_tts_create(uint8_t *buf, ssize_t len,
+                                 struct tts_create_ts *c) {
     // zero'ing tts_create struct
     memset(c, 0x00, sizeof(*c));
+    UNPACK_NEED(len, name_size(buf, len) + sizeof(int64_t));
     len -= unpack_ts_name(&buf, &c->ts_name_len, &c->ts_name);
     len -= unpack_integer(&buf, 'q', &c->retention);
     return len;
@@ -96,10 +164,11 @@ static size_t unpack_tts_create(uint8_t *buf, size_t len,
  * | Byte N     |                                               |
  * |____________|_______________________________________________|
  */
-static size_t unpack_tts_delete(uint8_t *buf, size_t len,
-                                struct tts_delete_ts *d) {
+static ssize_t unpack_tts_delete(uint8_t *buf, ssize_t len,
+                                 struct tts_delete_ts *d) {
     // zero'ing tts_delete struct
     memset(d, 0x00, sizeof(*d));
+    UNPACK_NEED(len, name_size(buf, len));
     len -= unpack_ts_name(&buf, &d->ts_name_len, &d->ts_name);
     return len;
 }
@@ -152,18 +221,25 @@ static size_t unpack_tts_delete(uint8_t *buf, size_t len,
  * The steps starting at [Array start] will be repeated until the expected
  * length of the packet is exhausted.
  */
-static size_t unpack_tts_addpoints(uint8_t *buf, ssize_t len,
-                                 struct tts_addpoints *a) {
+static ssize_t unpack_tts_addpoints(uint8_t *buf, ssize_t len,
+                                    struct tts_addpoints *a,
+                                    struct tts_arena *arena) {
     int64_t val = 0;
+    ssize_t packed = 0;
     // zero'ing tts_addpoints struct
     memset(a, 0x00, sizeof(*a));
+    UNPACK_NEED(len, name_size(buf, len));
     len -= unpack_ts_name(&buf, &a->ts_name_len, &a->ts_name);
+    a->points = tts_arena_alloc(arena, max_elements(len, POINT_MIN_SIZE) *
+                                sizeof(*a->points));
     for (int i = 0; len > 0; ++i) {
-        printf("%i\n", i);
-        a->points = realloc(a->points, (i + 1) * sizeof(*a->points));
+        UNPACK_NEED(len, POINT_MIN_SIZE);
         len -= unpack_integer(&buf, 'B', &val);
         a->points[i].byte = val;
         len -= unpack_real(&buf, 'g', &a->points[i].value);
+        UNPACK_NEED(len, (a->points[i].bits.ts_sec_set +
+                          a->points[i].bits.ts_nsec_set) * sizeof(uint64_t) +
+                    sizeof(uint16_t));
         // Unpack the seconds and nanoseconds component of the timestamp if
         // present
         if (a->points[i].bits.ts_sec_set == 1) {
@@ -177,35 +253,40 @@ static size_t unpack_tts_addpoints(uint8_t *buf, ssize_t len,
         len -= unpack_integer(&buf, 'H', &val);
         a->points[i].labels_len = val;
         a->points[i].labels =
-            calloc(a->points[i].labels_len, sizeof(*a->points[i].labels));
+            tts_arena_alloc(arena, a->points[i].labels_len *
+                            sizeof(*a->points[i].labels));
         for (int j = 0; j < a->points[i].labels_len; ++j) {
-            len -= unpack_integer(&buf, 'H', &val);
-            a->points[i].labels[j].label_len = val;
-            a->points[i].labels[j].label = malloc(val + 1);
-            len -= unpack_bytes(&buf, a->points[i].labels[j].label_len,
-                                a->points[i].labels[j].label);
-            len -= unpack_integer(&buf, 'H', &val);
-            a->points[i].labels[j].value_len = val;
-            a->points[i].labels[j].value = malloc(val + 1);
-            len -= unpack_bytes(&buf, a->points[i].labels[j].value_len,
-                                a->points[i].labels[j].value);
+            packed = unpack_label(&buf, len,
+                                  &a->points[i].labels[j].label_len,
+                                  &a->points[i].labels[j].label,
+                                  &a->points[i].labels[j].value_len,
+                                  &a->points[i].labels[j].value);
+            if (packed < 0)
+                return -1;
+            len -= packed;
         }
         ++a->points_len;
     }
     return len;
 }
 
-static size_t unpack_tts_addpoints_single(uint8_t *buf,
-                                          struct tts_addpoints *a) {
-    size_t len = 0;
+/* Return the bytes taken by the point, or -1 if they exceed `size` */
+static ssize_t unpack_tts_addpoints_single(uint8_t *buf, ssize_t size,
+                                           struct tts_addpoints *a,
+                                           struct tts_arena *arena) {
+    ssize_t len = 0, packed = 0;
     int64_t val = 0;
     // zero'ing tts_addpoints struct
     memset(a, 0x00, sizeof(*a));
+    UNPACK_NEED(size, name_size(buf, size) + POINT_MIN_SIZE);
     len += unpack_ts_name(&buf, &a->ts_name_len, &a->ts_name);
-    a->points = calloc(1, sizeof(*a->points));
+    a->points = tts_arena_calloc(arena, 1, sizeof(*a->points));
     len += unpack_integer(&buf, 'B', &val);
     a->points[0].byte = val;
     len += unpack_real(&buf, 'g', &a->points[0].value);
+    UNPACK_NEED(size - len, (a->points[0].bits.ts_sec_set +
+                             a->points[0].bits.ts_nsec_set) *
+                sizeof(uint64_t) + sizeof(uint16_t));
     // Unpack the seconds and nanoseconds component of the timestamp if
     // present
     if (a->points[0].bits.ts_sec_set == 1) {
@@ -219,17 +300,33 @@ static size_t unpack_tts_addpoints_single(uint8_t *buf,
     len += unpack_integer(&buf, 'H', &val);
     a->points[0].labels_len = val;
     a->points[0].labels =
-        calloc(a->points[0].labels_len, sizeof(*a->points[0].labels));
+        tts_arena_calloc(arena, a->points[0].labels_len,
+                         sizeof(*a->points[0].labels));
+    for (int j = 0; j < a->points[0].labels_len; ++j) {
+        packed = unpack_label(&buf, size - len,
+                              &a->points[0].labels[j].label_len,
+                              &a->points[0].labels[j].label,
+                              &a->points[0].labels[j].value_len,
+                              &a->points[0].labels[j].value);
+        if (packed < 0)
+            return -1;
+        len += packed;
+    }
     ++a->points_len;
     return len;
 }
 
-static size_t unpack_tts_maddpoints(uint8_t *buf, size_t len,
-                                    struct tts_maddpoints *m) {
-    size_t packed = 0;
+static ssize_t unpack_tts_maddpoints(uint8_t *buf, ssize_t len,
+                                     struct tts_maddpoints *m,
+                                     struct tts_arena *arena) {
+    ssize_t packed = 0;
+    memset(m, 0x00, sizeof(*m));
+    m->pts = tts_arena_alloc(arena, max_elements(len, ENTRY_MIN_SIZE) *
+                             sizeof(*m->pts));
     for (int i = 0; len > 0; ++i) {
-        m->pts = realloc(m->pts, (i + 1) * sizeof(*m->pts));
-        packed = unpack_tts_addpoints_single(buf, &m->pts[i]);
+        packed = unpack_tts_addpoints_single(buf, len, &m->pts[i], arena);
+        if (packed < 0)
+            return -1;
         len -= packed;
         buf += packed;
         m->points_len++;
@@ -245,7 +342,7 @@ static size_t unpack_tts_maddpoints(uint8_t *buf, size_t len,
  * | Byte 5     |          Time series name len MSB             |
  * | Byte 6     |          Time series name len LSB             |
  * |------------|-----------------------------------------------|
- * | Byte 7     | avg |first| last|  gt |  lt |    reserved     |
+ * | Byte 7     | avg |first| last|  gt |  lt |filt |aggr | sel |
  * |------------|-----------------------------------------------|
  * | Byte 8     |                                               |
  * |   .        |              Time series name                 |
@@ -266,17 +363,36 @@ static size_t unpack_tts_maddpoints(uint8_t *buf, size_t len,
  * | Byte N+24  |                                               |
  * |   .        |        Minor-of value (if minor_of == 1)      |
  * | Byte N+31  |                                               |
+ * |------------|-----------------------------------------------|
+ * | Byte N+32  |      Aggregates bitmask MSB (if aggr == 1)    |
+ * | Byte N+33  |      Aggregates bitmask LSB (if aggr == 1)    |
+ * |------------|-----------------------------------------------|
+ * | Byte N+34  |   Quantiles nr (if quantile aggregate set)    |
+ * |------------|-----------------------------------------------|
+ * | Byte N+35  |                                               |
+ * |   .        |   Quantiles, 2 bytes each, in hundredths of   |
+ * |   .        |   percent                                     |
+ * |------------|-----------------------------------------------|
+ * | Byte M     |                                               |
+ * |   .        |   Label filters (if filter == 1), label and   |
+ * |   .        |   value pairs till the end of the packet,     |
+ * |   .        |   each one a 2 bytes length and the string    |
  * |____________|_______________________________________________|
  */
-static size_t unpack_tts_query(uint8_t *buf, size_t len, struct tts_query *q) {
+static ssize_t unpack_tts_query(uint8_t *buf, ssize_t len,
+                                struct tts_query *q, struct tts_arena *arena) {
     int64_t val = 0;
+    ssize_t packed = 0;
     // zero'ing tts_query struct
     memset(q, 0x00, sizeof(*q));
+    UNPACK_NEED(len, name_size(buf, len) + sizeof(uint8_t));
     len -= unpack_ts_name(&buf, &q->ts_name_len, &q->ts_name);
     // We unpack the query header here, carrying the flags and filter to apply
     // to the requested query
     len -= unpack_integer(&buf, 'B', &val);
     q->byte = val;
+    UNPACK_NEED(len, (q->bits.mean + q->bits.major_of + q->bits.minor_of) *
+                sizeof(uint64_t) + q->bits.aggregate * sizeof(uint16_t));
     // Next fields are optional, we unpack them only after their flags
     if (q->bits.mean == 1)
         len -= unpack_integer(&buf, 'Q', (int64_t *) &q->mean_val);
@@ -284,15 +400,33 @@ static size_t unpack_tts_query(uint8_t *buf, size_t len, struct tts_query *q) {
         len -= unpack_integer(&buf, 'Q', (int64_t *) &q->major_of);
     if (q->bits.minor_of == 1)
         len -= unpack_integer(&buf, 'Q', (int64_t *) &q->minor_of);
+    if (q->bits.aggregate == 1) {
+        len -= unpack_integer(&buf, 'H', &val);
+        q->aggregates = val;
+    }
+    if (q->aggregates & TTS_AGG_QUANTILE) {
+        UNPACK_NEED(len, sizeof(uint8_t));
+        len -= unpack_integer(&buf, 'B', &val);
+        UNPACK_NEED(len, val * sizeof(uint16_t));
+        // Quantiles exceeding the maximum are read but ignored
+        for (int64_t i = 0, nr = val; i < nr; ++i) {
+            len -= unpack_integer(&buf, 'H', &val);
+            if (q->quantiles_nr < TTS_QUERY_QUANTILES_MAX)
+                q->quantiles[q->quantiles_nr++] = val;
+        }
+    }
     if (q->bits.filter == 1) {
+        q->filters = tts_arena_alloc(arena, max_elements(len, FILTER_MIN_SIZE) *
+                                     sizeof(*q->filters));
         for (int i = 0; len > 0; ++i) {
-            q->filters = realloc(q->filters, (i + 1) * sizeof(*q->filters));
-            len -= unpack_integer(&buf, 'H', &val);
-            q->filters[i].label_len = val;
-            len -= unpack_bytes(&buf, val, q->filters[i].label);
-            len -= unpack_integer(&buf, 'H', &val);
-            q->filters[i].value_len = val;
-            len -= unpack_bytes(&buf, val, q->filters[i].value);
+            packed = unpack_label(&buf, len, &q->filters[i].label_len,
+                                  &q->filters[i].label,
+                                  &q->filters[i].value_len,
+                                  &q->filters[i].value);
+            if (packed < 0)
+                return -1;
+            len -= packed;
+            ++q->filters_nr;
         }
     }
     return len;
@@ -301,30 +435,38 @@ static size_t unpack_tts_query(uint8_t *buf, size_t len, struct tts_query *q) {
 /*
  * Unpack the binary buffer to a tts_query_response
  */
-static size_t unpack_tts_query_response(uint8_t *buf, size_t len,
-                                        struct tts_query_response *qa) {
+static ssize_t unpack_tts_query_response(uint8_t *buf, ssize_t len,
+                                         struct tts_query_response *qa,
+                                         struct tts_arena *arena) {
     int64_t val = 0LL;
+    ssize_t packed = 0;
     memset(qa, 0x00, sizeof(*qa));
+    qa->results = tts_arena_alloc(arena, max_elements(len, RESULT_MIN_SIZE) *
+                                  sizeof(*qa->results));
     for (size_t i = 0; len > 0; ++i) {
-        qa->results = realloc(qa->results, (i + 1) * sizeof(*qa->results));
-        len -= unpack(buf, "BQQgH", &qa->results[i].rc, &qa->results[i].ts_sec,
-                      &qa->results[i].ts_nsec, &qa->results[i].value,
-                      &qa->results[i].labels_len);
-        buf += sizeof(uint8_t) + sizeof(uint16_t) +
-            sizeof(long double) + sizeof(uint64_t) * 2;
+        UNPACK_NEED(len, RESULT_MIN_SIZE);
+        packed = unpack_bqqgh(buf, &qa->results[i].rc, &qa->results[i].ts_sec,
+                              &qa->results[i].ts_nsec, &qa->results[i].value,
+                              &qa->results[i].labels_len);
+        buf += packed;
+        len -= packed;
         qa->results[i].labels =
-            calloc(qa->results[i].labels_len, sizeof(*qa->results[i].labels));
+            tts_arena_alloc(arena, qa->results[i].labels_len *
+                            sizeof(*qa->results[i].labels));
         for (size_t j = 0; j < qa->results[i].labels_len; ++j) {
+            UNPACK_NEED(len, sizeof(uint16_t));
             len -= unpack_integer(&buf, 'H', &val);
+            UNPACK_NEED(len, val + sizeof(uint16_t));
             qa->results[i].labels[j].label_len = val;
             qa->results[i].labels[j].label =
-                malloc(qa->results[i].labels[j].label_len + 1);
+                tts_arena_alloc(arena, qa->results[i].labels[j].label_len + 1);
             len -= unpack_bytes(&buf, qa->results[i].labels[j].label_len,
                                 qa->results[i].labels[j].label);
             len -= unpack_integer(&buf, 'H', &val);
+            UNPACK_NEED(len, val);
             qa->results[i].labels[j].value_len = val;
             qa->results[i].labels[j].value =
-                malloc(qa->results[i].labels[j].value_len + 1);
+                tts_arena_alloc(arena, qa->results[i].labels[j].value_len + 1);
             len -= unpack_bytes(&buf, qa->results[i].labels[j].value_len,
                                 qa->results[i].labels[j].value);
         }
@@ -333,37 +475,116 @@ static size_t unpack_tts_query_response(uint8_t *buf, size_t len,
     return len;
 }
 
+static void unpack_tts_ack(uint8_t *buf, size_t len, struct tts_ack *ack,
+                           struct tts_arena *arena) {
+    int64_t val = 0;
+    ack->series_nr = len / ACK_SERIES_SIZE;
+    ack->series = NULL;
+    if (ack->series_nr == 0)
+        return;
+    ack->series = tts_arena_alloc(arena, ack->series_nr * sizeof(*ack->series));
+    for (uint32_t i = 0; i < ack->series_nr; ++i) {
+        unpack_integer(&buf, 'B', &val);
+        ack->series[i].status = val;
+        unpack_integer(&buf, 'I', &val);
+        ack->series[i].points = val;
+    }
+}
+
+/* Names are at least their length byte, an empty one ends the packet */
+static void unpack_tts_mlast(uint8_t *buf, size_t len, struct tts_mlast *m,
+                             struct tts_arena *arena) {
+    int64_t val = 0;
+    memset(m, 0x00, sizeof(*m));
+    if (len < sizeof(uint16_t))
+        return;
+    len -= unpack_integer(&buf, 'H', &val);
+    m->points = val;
+    m->series = tts_arena_alloc(arena, len * sizeof(*m->series));
+    while (len > 0 && (size_t) *buf + 1 <= len) {
+        struct tts_mlast_series *series = &m->series[m->series_nr++];
+        len -= unpack_ts_name(&buf, &series->ts_name_len, &series->ts_name);
+    }
+}
+
 /*
  * Unpack a tts_packet, after reading the header opcode and the length of the
- * entire packet, calls the right unpack function based on the command type
+ * entire packet, calls the right unpack function based on the command type.
+ * The packet is allocated from `arena`, it's released by resetting it.
+ * Return 0 on success, -1 if the packet is malformed, its content is then
+ * not to be used
  */
-void unpack_tts_packet(uint8_t *buf, struct tts_packet *tts_p) {
+int unpack_tts_packet(uint8_t *buf, struct tts_packet *tts_p,
+                      struct tts_arena *arena) {
     int64_t val = 0;
+    ssize_t rc = 0;
     tts_p->header.byte = *buf++;
     unpack_integer(&buf, 'I', &val);
     tts_p->len = val;
-    if (tts_p->header.opcode == TTS_ACK)
-        return;
     switch(tts_p->header.opcode) {
+        case TTS_ACK:
+            unpack_tts_ack(buf, tts_p->len, &tts_p->ack, arena);
+            break;
         case TTS_CREATE_TS:
-            unpack_tts_create(buf, tts_p->len, &tts_p->create);
+            rc = unpack_tts_create(buf, tts_p->len, &tts_p->create);
             break;
         case TTS_DELETE_TS:
-            unpack_tts_delete(buf, tts_p->len, &tts_p->drop);
+            rc = unpack_tts_delete(buf, tts_p->len, &tts_p->drop);
             break;
         case TTS_ADDPOINTS:
-            unpack_tts_addpoints(buf, tts_p->len, &tts_p->addpoints);
+            rc = unpack_tts_addpoints(buf, tts_p->len, &tts_p->addpoints,
+                                      arena);
             break;
         case TTS_MADDPOINTS:
-            unpack_tts_maddpoints(buf, tts_p->len, &tts_p->maddpoints);
+            rc = unpack_tts_maddpoints(buf, tts_p->len, &tts_p->maddpoints,
+                                       arena);
             break;
         case TTS_QUERY:
-            unpack_tts_query(buf, tts_p->len, &tts_p->query);
+            rc = unpack_tts_query(buf, tts_p->len, &tts_p->query, arena);
             break;
         case TTS_QUERY_RESPONSE:
-            unpack_tts_query_response(buf, tts_p->len, &tts_p->query_r);
+            rc = unpack_tts_query_response(buf, tts_p->len, &tts_p->query_r,
+                                           arena);
+            break;
+        case TTS_HELLO:
+            tts_p->hello.version = tts_p->len > 0 ? *buf : TTS_PROTOCOL_V1;
+            break;
+        case TTS_MLAST:
+            unpack_tts_mlast(buf, tts_p->len, &tts_p->mlast, arena);
+            break;
+        case TTS_INFO:
+            tts_p->info.len = tts_p->len;
+            tts_p->info.data = buf;
+            break;
+        case TTS_SUBSCRIBE:
+            if (tts_p->header.type == TTS_RESPONSE)
+                rc = unpack_tts_query_response(buf, tts_p->len,
+                                               &tts_p->query_r, arena);
+            else
+                rc = unpack_tts_query(buf, tts_p->len, &tts_p->query, arena);
             break;
     }
+    return rc < 0 ? -1 : 0;
+}
+
+/*
+ * Frame a packet out of a stream of bytes, return the total length of the
+ * packet at the start of the buffer, header included, or 0 if the buffer
+ * doesn't hold a complete one yet. A packet announcing more than `max` bytes
+ * after the header is refused with -1 as soon as the header is in, before
+ * any of it is buffered, 0 means no limit
+ */
+ssize_t tts_packet_frame_len(uint8_t *buf, size_t len, size_t max) {
+    int64_t val = 0;
+    if (len < TTS_HEADER_SIZE)
+        return 0;
+    ++buf;
+    unpack_integer(&buf, 'I', &val);
+    if (max > 0 && (uint64_t) val > max)
+        return -1;
+    if (len - TTS_HEADER_SIZE < (uint64_t) val)
+        return 0;
+    return TTS_HEADER_SIZE + val;
 }
 
 /*
@@ -372,33 +593,54 @@ void unpack_tts_packet(uint8_t *buf, struct tts_packet *tts_p) {
  * ========================
  */
 
+/*
+ * Strings are packed by their length, they're not necessarily nul-terminated,
+ * like the views of a request being logged to the write-ahead log
+ */
+static inline size_t pack_string(uint8_t **buf, int8_t type,
+                                 const uint8_t *str, size_t len) {
+    size_t packed = pack_integer(buf, type, len);
+    return packed + pack_bytes(buf, str, len);
+}
+
 static ssize_t pack_tts_create(const struct tts_create_ts *create,
                                uint8_t *buf) {
-    return pack(buf, "Bsq", create->ts_name_len,
-                create->ts_name, create->retention);
+    ssize_t len = pack_string(&buf, 'B', create->ts_name, create->ts_name_len);
+    return len + pack_integer(&buf, 'q', create->retention);
 }
 
 static ssize_t pack_tts_delete(const struct tts_delete_ts *drop, uint8_t *buf) {
-    return pack(buf, "Bs", drop->ts_name_len, drop->ts_name);
+    return pack_string(&buf, 'B', drop->ts_name, drop->ts_name_len);
 }
 
 static ssize_t pack_tts_query(const struct tts_query *query, uint8_t *buf) {
-    ssize_t len = pack(buf, "BsB", query->ts_name_len,
-                       query->ts_name, query->byte);
-    buf += len;
+    ssize_t len = pack_string(&buf, 'B', query->ts_name, query->ts_name_len);
+    len += pack_integer(&buf, 'B', query->byte);
     if (query->bits.mean == 1)
         len += pack_integer(&buf, 'Q', query->mean_val);
     if (query->bits.major_of == 1)
         len += pack_integer(&buf, 'Q', query->major_of);
     if (query->bits.minor_of == 1)
         len += pack_integer(&buf, 'Q', query->minor_of);
+    if (query->bits.aggregate == 1)
+        len += pack_integer(&buf, 'H', query->aggregates);
+    if (query->bits.aggregate == 1 && (query->aggregates & TTS_AGG_QUANTILE)) {
+        len += pack_integer(&buf, 'B', query->quantiles_nr);
+        for (int i = 0; i < query->quantiles_nr; ++i)
+            len += pack_integer(&buf, 'H', query->quantiles[i]);
+    }
+    for (int i = 0; query->bits.filter == 1 && i < query->filters_nr; ++i) {
+        len += pack_string(&buf, 'H', query->filters[i].label,
+                           query->filters[i].label_len);
+        len += pack_string(&buf, 'H', query->filters[i].value,
+                           query->filters[i].value_len);
+    }
     return len;
 }
 
 static ssize_t pack_tts_addpoints(const struct tts_addpoints *a, uint8_t *buf) {
-    size_t len = pack(buf, "Bs", a->ts_name_len, a->ts_name);
-    buf += len;
-    for (int i = 0; i < a->points_len; ++i) {
+    size_t len = pack_string(&buf, 'B', a->ts_name, a->ts_name_len);
+    for (uint32_t i = 0; i < a->points_len; ++i) {
         len += pack_integer(&buf, 'B', a->points[i].byte);
         len += pack_real(&buf, 'g', a->points[i].value);
         if (a->points[i].bits.ts_sec_set == 1)
@@ -407,12 +649,10 @@ static ssize_t pack_tts_addpoints(const struct tts_addpoints *a, uint8_t *buf) {
             len += pack_integer(&buf, 'Q', a->points[i].ts_nsec);
         len += pack_integer(&buf, 'H', a->points[i].labels_len);
         for (int j = 0; j < a->points[i].labels_len; ++j) {
-            len += pack(buf, "HsHs", a->points[i].labels[j].label_len,
-                        a->points[i].labels[j].label,
-                        a->points[i].labels[j].value_len,
-                        a->points[i].labels[j].value);
-            buf += sizeof(uint16_t) * 2 + a->points[i].labels[j].label_len +
-                a->points[i].labels[j].value_len;
+            len += pack_string(&buf, 'H', a->points[i].labels[j].label,
+                               a->points[i].labels[j].label_len);
+            len += pack_string(&buf, 'H', a->points[i].labels[j].value,
+                               a->points[i].labels[j].value_len);
         }
     }
     return len;
@@ -420,7 +660,7 @@ static ssize_t pack_tts_addpoints(const struct tts_addpoints *a, uint8_t *buf) {
 
 static ssize_t pack_tts_maddpoints(const struct tts_maddpoints *m, uint8_t *buf) {
     ssize_t len = 0, packed = 0;
-    for (int i = 0; i < m->points_len; ++i) {
+    for (uint32_t i = 0; i < m->points_len; ++i) {
         packed = pack_tts_addpoints(&m->pts[i], buf);
         buf += packed;
         len += packed;
@@ -428,6 +668,23 @@ static ssize_t pack_tts_maddpoints(const struct tts_maddpoints *m, uint8_t *buf)
     return len;
 }
 
+static ssize_t pack_tts_mlast(const struct tts_mlast *m, uint8_t *buf) {
+    ssize_t len = pack_integer(&buf, 'H', m->points);
+    for (uint32_t i = 0; i < m->series_nr; ++i)
+        len += pack_string(&buf, 'B', m->series[i].ts_name,
+                           m->series[i].ts_name_len);
+    return len;
+}
+
+static ssize_t pack_tts_ack(const struct tts_ack *ack, uint8_t *buf) {
+    ssize_t len = 0;
+    for (uint32_t i = 0; i < ack->series_nr; ++i) {
+        len += pack_integer(&buf, 'B', ack->series[i].status);
+        len += pack_integer(&buf, 'I', ack->series[i].points);
+    }
+    return len;
+}
+
 ssize_t pack_tts_query_response(const struct tts_query_response *qr,
                                 uint8_t *buf) {
     size_t len = 0LL;
@@ -439,25 +696,93 @@ ssize_t pack_tts_query_response(const struct tts_query_response *qr,
         buf += packed;
         len += packed;
         for (size_t j = 0; j < qr->results[i].labels_len; ++j) {
-            packed = pack(buf, "HsHs",
-                          qr->results[i].labels[j].label_len,
-                          qr->results[i].labels[j].label,
-                          qr->results[i].labels[j].value_len,
-                          qr->results[i].labels[j].value);
-            buf += packed;
-            len += packed;
+            len += pack_string(&buf, 'H', qr->results[i].labels[j].label,
+                               qr->results[i].labels[j].label_len);
+            len += pack_string(&buf, 'H', qr->results[i].labels[j].value,
+                               qr->results[i].labels[j].value_len);
         }
     }
     return len;
 }
 
+/*
+ * Return the number of bytes a query_response payload takes once packed, real
+ * values occupy 16 bytes on the wire
+ */
+size_t tts_query_response_size(const struct tts_query_response *qr) {
+    size_t len = 0LL;
+    for (uint64_t i = 0; i < qr->len; ++i) {
+        len += sizeof(uint8_t) + sizeof(uint64_t) * 4 + sizeof(uint16_t);
+        for (size_t j = 0; j < qr->results[i].labels_len; ++j)
+            len += sizeof(uint16_t) * 2 + qr->results[i].labels[j].label_len +
+                qr->results[i].labels[j].value_len;
+    }
+    return len;
+}
+
+/*
+ * Return the number of bytes a packet takes once packed, header included
+ */
+size_t tts_packet_size(const struct tts_packet *tts_p) {
+    size_t len = TTS_HEADER_SIZE;
+    const struct tts_addpoints *a = NULL;
+    switch (tts_p->header.opcode) {
+        case TTS_CREATE_TS:
+            len += sizeof(uint8_t) + tts_p->create.ts_name_len +
+                sizeof(int64_t);
+            break;
+        case TTS_DELETE_TS:
+            len += sizeof(uint8_t) + tts_p->drop.ts_name_len;
+            break;
+        case TTS_ADDPOINTS:
+            a = &tts_p->addpoints;
+            len += sizeof(uint8_t) + a->ts_name_len;
+            for (uint32_t i = 0; i < a->points_len; ++i) {
+                len += sizeof(uint8_t) + sizeof(uint64_t) * 2 +
+                    sizeof(uint16_t);
+                if (a->points[i].bits.ts_sec_set == 1)
+                    len += sizeof(uint64_t);
+                if (a->points[i].bits.ts_nsec_set == 1)
+                    len += sizeof(uint64_t);
+                for (int j = 0; j < a->points[i].labels_len; ++j)
+                    len += sizeof(uint16_t) * 2 +
+                        a->points[i].labels[j].label_len +
+                        a->points[i].labels[j].value_len;
+            }
+            break;
+        case TTS_QUERY_RESPONSE:
+            len += tts_query_response_size(&tts_p->query_r);
+            break;
+        case TTS_SUBSCRIBE:
+            if (tts_p->header.type == TTS_RESPONSE)
+                len += tts_query_response_size(&tts_p->query_r);
+            break;
+        case TTS_HELLO:
+            len += sizeof(uint8_t);
+            break;
+        case TTS_ACK:
+            len += tts_p->ack.series_nr * ACK_SERIES_SIZE;
+            break;
+        case TTS_MLAST:
+            len += sizeof(uint16_t);
+            for (uint32_t i = 0; i < tts_p->mlast.series_nr; ++i)
+                len += sizeof(uint8_t) + tts_p->mlast.series[i].ts_name_len;
+            break;
+        case TTS_INFO:
+            len += tts_p->info.len;
+            break;
+    }
+    return len;
+}
+
 ssize_t pack_tts_packet(const struct tts_packet *tts_p, uint8_t *buf) {
     int len_offset = sizeof(uint32_t);
     ssize_t len = pack_integer(&buf, 'B', tts_p->header.byte);
     ssize_t plen = 0;
-    if (tts_p->header.opcode == TTS_ACK)
-        goto encode_len;
     switch(tts_p->header.opcode) {
+        case TTS_ACK:
+            plen = pack_tts_ack(&tts_p->ack, buf + len_offset);
+            break;
         case TTS_CREATE_TS:
             plen = pack_tts_create(&tts_p->create, buf + len_offset);
             break;
@@ -476,29 +801,723 @@ ssize_t pack_tts_packet(const struct tts_packet *tts_p, uint8_t *buf) {
         case TTS_QUERY_RESPONSE:
             plen = pack_tts_query_response(&tts_p->query_r, buf + len_offset);
             break;
+        case TTS_HELLO:
+            buf[len_offset] = tts_p->hello.version;
+            plen = sizeof(uint8_t);
+            break;
+        case TTS_MLAST:
+            plen = pack_tts_mlast(&tts_p->mlast, buf + len_offset);
+            break;
+        case TTS_INFO:
+            if (tts_p->info.len > 0)
+                memcpy(buf + len_offset, tts_p->info.data, tts_p->info.len);
+            plen = tts_p->info.len;
+            break;
+        case TTS_SUBSCRIBE:
+            if (tts_p->header.type == TTS_RESPONSE)
+                plen = pack_tts_query_response(&tts_p->query_r,
+                                               buf + len_offset);
+            else
+                plen = pack_tts_query(&tts_p->query, buf + len_offset);
+            break;
     }
-encode_len:
     len += plen;
     len += pack_integer(&buf, 'I', plen);
     return len;
 }
 
-void tts_packet_destroy(struct tts_packet *packet) {
-    switch (packet->header.opcode) {
-        case TTS_CREATE_TS:
-            free(packet->create.ts_name);
+/*
+ * Copy label filters out of a packet into memory of their own, to keep them
+ * past the request, as a streamed response does, as nul-terminated strings;
+ * to be released with
+ * `tts_query_filters_destroy`
+ */
+struct tts_query_filter *tts_query_filters_copy(
+    const struct tts_query_filter *filters, size_t len) {
+    struct tts_query_filter *copy = calloc(len, sizeof(*copy));
+    for (size_t i = 0; i < len; ++i) {
+        copy[i].label_len = filters[i].label_len;
+        copy[i].label = malloc(filters[i].label_len + 1);
+        memcpy(copy[i].label, filters[i].label, filters[i].label_len);
+        copy[i].label[filters[i].label_len] = '\0';
+        copy[i].value_len = filters[i].value_len;
+        copy[i].value = malloc(filters[i].value_len + 1);
+        memcpy(copy[i].value, filters[i].value, filters[i].value_len);
+        copy[i].value[filters[i].value_len] = '\0';
+    }
+    return copy;
+}
+
+void tts_query_filters_destroy(struct tts_query_filter *filters, size_t len) {
+    for (size_t i = 0; i < len; ++i) {
+        free(filters[i].label);
+        free(filters[i].value);
+    }
+    free(filters);
+}
+
+/*
+ * ========================
+ *   WIRE FORMAT VERSION 2
+ * ========================
+ *
+ * Packets but TTS_ADDPOINTS, TTS_MADDPOINTS, TTS_QUERY_RESPONSE and TTS_MLAST
+ * are the same on both versions, refer to `struct tts_hello` for the encoding
+ * of those.
+ */
+
+/* Batch flags, values are XOR'ed against the previous one if not set */
+#define V2_RAW_VALUES 0x01
+
+/* Minimum size of a point, the timestamp, the value and the labels count */
+#define V2_POINT_MIN_SIZE 3
+
+/* Minimum size of a label, two string references */
+#define V2_LABEL_MIN_SIZE 2
+
+/* Maximum size of a point but its labels */
+#define V2_POINT_MAX_SIZE (10 + 9 + 3)
+
+/* Maximum size of a string reference, a new string of `len` bytes */
+#define V2_STRING_MAX_SIZE(len) (1 + 3 + (len))
+
+/* Maximum size of the header of a batch, the count and the flags */
+#define V2_BATCH_MAX_SIZE (5 + 1)
+
+/* References to strings never received decode to it */
+static uint8_t empty_string[1];
+
+static inline uint64_t zigzag(int64_t n) {
+    return ((uint64_t) n << 1) ^ -((uint64_t) n >> 63);
+}
+
+static inline int64_t unzigzag(uint64_t n) {
+    return (int64_t) ((n >> 1) ^ -(n & 1));
+}
+
+static inline uint64_t double_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline double bits_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+/* Bytes taken by a value XOR'ed against the previous one, control included */
+static inline size_t xor_size(uint64_t xor) {
+    if (xor == 0)
+        return 1;
+    return 1 + 8 - __builtin_clzll(xor) / 8 - __builtin_ctzll(xor) / 8;
+}
+
+/*
+ * Account a value of a batch being packed, `size` sums the bytes taken by the
+ * values XOR'ed so far, to pick the encoding of the batch once all are
+ */
+static inline void v2_account(size_t *size, uint64_t *prev, double value) {
+    uint64_t bits = double_bits(value);
+    *size += xor_size(bits ^ *prev);
+    *prev = bits;
+}
+
+static inline uint8_t v2_flags(size_t size, size_t values_nr) {
+    return size > values_nr * sizeof(uint64_t) ? V2_RAW_VALUES : 0;
+}
+
+static inline int dict_admits(size_t nr, size_t bytes, size_t len) {
+    return nr < TTS_DICT_MAX_STRINGS && bytes + len <= TTS_DICT_MAX_BYTES;
+}
+
+static size_t pack_v2_timestamp(uint8_t **buf, uint64_t *prev, uint64_t t) {
+    uint64_t delta = zigzag((int64_t) (t - *prev));
+    *prev = t;
+    return pack_varint(buf, delta + 1);
+}
+
+/*
+ * Unpack a varint, failing with -1 if it doesn't end before `end`, the
+ * unpacking functions of the second version check every field fits in what
+ * is left of the packet as the first ones do, returning -1 if it doesn't
+ */
+static int unpack_v2_varint(uint8_t **buf, const uint8_t *end,
+                            uint64_t *val) {
+    ssize_t left = end - *buf;
+    for (ssize_t i = 0; i < left && i < 10; ++i) {
+        if (((*buf)[i] & 0x80) == 0 || i == 9) {
+            unpack_varint(buf, val);
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/* `set` is 0 if the point carries no timestamp */
+static int unpack_v2_timestamp(uint8_t **buf, const uint8_t *end,
+                               uint64_t *prev, uint64_t *t, int *set) {
+    uint64_t delta = 0;
+    if (unpack_v2_varint(buf, end, &delta) < 0)
+        return -1;
+    *set = delta > 0;
+    if (*set == 0)
+        return 0;
+    *prev += unzigzag(delta - 1);
+    *t = *prev;
+    return 0;
+}
+
+static size_t pack_v2_value(uint8_t **buf, uint8_t flags,
+                            uint64_t *prev, double value) {
+    uint64_t bits = double_bits(value), xor = bits ^ *prev;
+    *prev = bits;
+    if (flags & V2_RAW_VALUES)
+        return pack_integer(buf, 'Q', (int64_t) bits);
+    if (xor == 0) {
+        *(*buf)++ = 0x80;
+        return 1;
+    }
+    unsigned lead = __builtin_clzll(xor) / 8, trail = __builtin_ctzll(xor) / 8;
+    unsigned n = 8 - lead - trail;
+    (*buf)[0] = lead << 4 | trail;
+    for (unsigned i = 0; i < n; ++i)
+        (*buf)[1 + i] = (uint8_t) (xor >> ((n - 1 - i + trail) * 8));
+    *buf += n + 1;
+    return n + 1;
+}
+
+static int unpack_v2_value(uint8_t **buf, const uint8_t *end, uint8_t flags,
+                           uint64_t *prev, long double *value) {
+    if (flags & V2_RAW_VALUES) {
+        int64_t bits = 0;
+        UNPACK_NEED(end - *buf, sizeof(uint64_t));
+        unpack_integer(buf, 'Q', &bits);
+        *prev = (uint64_t) bits;
+    } else {
+        UNPACK_NEED(end - *buf, 1);
+        unsigned lead = **buf >> 4, trail = **buf & 0x0F;
+        unsigned n = lead + trail < 8 ? 8 - lead - trail : 0;
+        uint64_t xor = 0;
+        UNPACK_NEED(end - *buf, n + 1);
+        for (unsigned i = 0; i < n; ++i)
+            xor = xor << 8 | (*buf)[1 + i];
+        if (n > 0)
+            xor <<= trail * 8;
+        *prev ^= xor;
+        *buf += n + 1;
+    }
+    *value = bits_double(*prev);
+    return 0;
+}
+
+/*
+ * Pack a reference to a string, sending it as a new one if it's not in the
+ * dictionary of the strings sent yet, adding it if there's still room
+ */
+static size_t pack_v2_string(uint8_t **buf, struct tts_codec *codec,
+                             const uint8_t *str, size_t len) {
+    struct tts_dict_entry *entry = NULL;
+    HASH_FIND(hh, codec->out, str, len, entry);
+    if (entry)
+        return pack_varint(buf, (uint64_t) entry->id + 1);
+    size_t packed = pack_varint(buf, 0);
+    packed += pack_varint(buf, len);
+    packed += pack_bytes(buf, str, len);
+    if (dict_admits(codec->out_nr, codec->out_bytes, len)) {
+        entry = malloc(sizeof(*entry));
+        entry->id = codec->out_nr++;
+        entry->len = len;
+        entry->str = malloc(len + 1);
+        memcpy(entry->str, str, len);
+        entry->str[len] = '\0';
+        codec->out_bytes += len;
+        HASH_ADD_KEYPTR(hh, codec->out, entry->str, entry->len, entry);
+    }
+    return packed;
+}
+
+/*
+ * Unpack a reference to a string, new strings are copied into the dictionary
+ * of the strings received, or into the arena if it's full, both
+ * nul-terminated, so the string is valid at least as long as the packet.
+ * Strings are at most 65535 bytes long, as they are in the first version
+ */
+static int unpack_v2_string(uint8_t **buf, const uint8_t *end,
+                            struct tts_codec *codec, struct tts_arena *arena,
+                            uint16_t *len, uint8_t **str) {
+    uint64_t ref = 0, n = 0;
+    if (unpack_v2_varint(buf, end, &ref) < 0)
+        return -1;
+    if (ref > 0) {
+        if (ref > TTS_VECTOR_SIZE(codec->in)) {
+            *len = 0;
+            *str = empty_string;
+        } else {
+            *len = TTS_VECTOR_AT(codec->in, ref - 1).len;
+            *str = TTS_VECTOR_AT(codec->in, ref - 1).str;
+        }
+        return 0;
+    }
+    if (unpack_v2_varint(buf, end, &n) < 0 || n > UINT16_MAX)
+        return -1;
+    UNPACK_NEED(end - *buf, n);
+    int admitted = dict_admits(TTS_VECTOR_SIZE(codec->in), codec->in_bytes, n);
+    uint8_t *copy = admitted ? malloc(n + 1) : tts_arena_alloc(arena, n + 1);
+    memcpy(copy, *buf, n);
+    copy[n] = '\0';
+    if (admitted) {
+        struct tts_dict_string string = { .len = n, .str = copy };
+        TTS_VECTOR_APPEND(codec->in, string);
+        codec->in_bytes += n;
+    }
+    *buf += n;
+    *len = n;
+    *str = copy;
+    return 0;
+}
+
+/* Timeseries names are at most 255 bytes long */
+static int unpack_v2_name(uint8_t **buf, const uint8_t *end,
+                          struct tts_codec *codec, struct tts_arena *arena,
+                          uint8_t *len, uint8_t **str) {
+    uint16_t name_len = 0;
+    if (unpack_v2_string(buf, end, codec, arena, &name_len, str) < 0)
+        return -1;
+    *len = name_len > UINT8_MAX ? UINT8_MAX : name_len;
+    return 0;
+}
+
+/*
+ * Unpack a varint count, a packet can't carry more elements than fit in its
+ * `len` bytes, given their minimum `size`, a larger count is malformed
+ */
+static int unpack_v2_count(uint8_t **buf, const uint8_t *end, size_t len,
+                           size_t size, size_t *count) {
+    uint64_t val = 0;
+    if (unpack_v2_varint(buf, end, &val) < 0 ||
+        val > max_elements(len, size))
+        return -1;
+    *count = val;
+    return 0;
+}
+
+/*
+ * Pack a single point of TTS_ADDPOINTS or TTS_MADDPOINTS, points without
+ * seconds carry no timestamp, the server stamps them
+ */
+static size_t pack_v2_point(uint8_t **buf, struct tts_codec *codec,
+                            uint8_t flags, uint64_t prev[2],
+                            const struct tts_addpoints *a, size_t i) {
+    size_t len = 0;
+    if (a->points[i].bits.ts_sec_set == 1) {
+        uint64_t t = a->points[i].ts_sec * (uint64_t) 1e9;
+        if (a->points[i].bits.ts_nsec_set == 1)
+            t += a->points[i].ts_nsec;
+        len += pack_v2_timestamp(buf, &prev[0], t);
+    } else {
+        len += pack_varint(buf, 0);
+    }
+    len += pack_v2_value(buf, flags, &prev[1], (double) a->points[i].value);
+    len += pack_varint(buf, a->points[i].labels_len);
+    for (int j = 0; j < a->points[i].labels_len; ++j) {
+        len += pack_v2_string(buf, codec, a->points[i].labels[j].label,
+                              a->points[i].labels[j].label_len);
+        len += pack_v2_string(buf, codec, a->points[i].labels[j].value,
+                              a->points[i].labels[j].value_len);
+    }
+    return len;
+}
+
+static int unpack_v2_point(uint8_t **buf, const uint8_t *end, size_t len,
+                           struct tts_codec *codec, struct tts_arena *arena,
+                           uint8_t flags, uint64_t prev[2],
+                           struct tts_addpoints *a, size_t i) {
+    size_t labels_nr = 0;
+    uint64_t t = 0;
+    int set = 0;
+    if (unpack_v2_timestamp(buf, end, &prev[0], &t, &set) < 0)
+        return -1;
+    a->points[i].byte = 0;
+    a->points[i].bits.ts_sec_set = a->points[i].bits.ts_nsec_set = set;
+    a->points[i].ts_sec = t / (uint64_t) 1e9;
+    a->points[i].ts_nsec = t % (uint64_t) 1e9;
+    if (unpack_v2_value(buf, end, flags, &prev[1], &a->points[i].value) < 0 ||
+        unpack_v2_count(buf, end, len, V2_LABEL_MIN_SIZE, &labels_nr) < 0 ||
+        labels_nr > UINT16_MAX)
+        return -1;
+    a->points[i].labels_len = labels_nr;
+    a->points[i].labels =
+        tts_arena_alloc(arena, labels_nr * sizeof(*a->points[i].labels));
+    for (size_t j = 0; j < labels_nr; ++j) {
+        if (unpack_v2_string(buf, end, codec, arena,
+                             &a->points[i].labels[j].label_len,
+                             &a->points[i].labels[j].label) < 0 ||
+            unpack_v2_string(buf, end, codec, arena,
+                             &a->points[i].labels[j].value_len,
+                             &a->points[i].labels[j].value) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static ssize_t pack_v2_addpoints(struct tts_codec *codec,
+                                 const struct tts_addpoints *a, uint8_t *buf) {
+    size_t xor = 0;
+    uint64_t prev[2] = { 0, 0 };
+    for (uint32_t i = 0; i < a->points_len; ++i)
+        v2_account(&xor, &prev[1], (double) a->points[i].value);
+    uint8_t flags = v2_flags(xor, a->points_len);
+    size_t len = pack_v2_string(&buf, codec, a->ts_name, a->ts_name_len);
+    len += pack_varint(&buf, a->points_len);
+    len += pack_integer(&buf, 'B', flags);
+    prev[1] = 0;
+    for (uint32_t i = 0; i < a->points_len; ++i)
+        len += pack_v2_point(&buf, codec, flags, prev, a, i);
+    return len;
+}
+
+static int unpack_v2_addpoints(struct tts_codec *codec, uint8_t *buf,
+                               size_t len, struct tts_addpoints *a,
+                               struct tts_arena *arena) {
+    uint64_t prev[2] = { 0, 0 };
+    size_t count = 0;
+    const uint8_t *end = buf + len;
+    memset(a, 0x00, sizeof(*a));
+    if (unpack_v2_name(&buf, end, codec, arena,
+                       &a->ts_name_len, &a->ts_name) < 0 ||
+        unpack_v2_count(&buf, end, len, V2_POINT_MIN_SIZE, &count) < 0)
+        return -1;
+    UNPACK_NEED(end - buf, sizeof(uint8_t));
+    uint8_t flags = *buf++;
+    a->points = tts_arena_alloc(arena, count * sizeof(*a->points));
+    for (size_t i = 0; i < count; ++i)
+        if (unpack_v2_point(&buf, end, len, codec,
+                            arena, flags, prev, a, i) < 0)
+            return -1;
+    a->points_len = count;
+    return 0;
+}
+
+static ssize_t pack_v2_maddpoints(struct tts_codec *codec,
+                                  const struct tts_maddpoints *m,
+                                  uint8_t *buf) {
+    size_t xor = 0;
+    uint64_t prev[2] = { 0, 0 };
+    for (uint32_t i = 0; i < m->points_len; ++i)
+        v2_account(&xor, &prev[1], (double) m->pts[i].points[0].value);
+    uint8_t flags = v2_flags(xor, m->points_len);
+    size_t len = pack_varint(&buf, m->points_len);
+    len += pack_integer(&buf, 'B', flags);
+    prev[1] = 0;
+    for (uint32_t i = 0; i < m->points_len; ++i) {
+        len += pack_v2_string(&buf, codec, m->pts[i].ts_name,
+                              m->pts[i].ts_name_len);
+        len += pack_v2_point(&buf, codec, flags, prev, &m->pts[i], 0);
+    }
+    return len;
+}
+
+static int unpack_v2_maddpoints(struct tts_codec *codec, uint8_t *buf,
+                                size_t len, struct tts_maddpoints *m,
+                                struct tts_arena *arena) {
+    uint64_t prev[2] = { 0, 0 };
+    size_t count = 0;
+    const uint8_t *end = buf + len;
+    memset(m, 0x00, sizeof(*m));
+    if (unpack_v2_count(&buf, end, len, 1 + V2_POINT_MIN_SIZE, &count) < 0)
+        return -1;
+    UNPACK_NEED(end - buf, sizeof(uint8_t));
+    uint8_t flags = *buf++;
+    m->pts = tts_arena_calloc(arena, count, sizeof(*m->pts));
+    for (size_t i = 0; i < count; ++i) {
+        struct tts_addpoints *a = &m->pts[i];
+        if (unpack_v2_name(&buf, end, codec, arena,
+                           &a->ts_name_len, &a->ts_name) < 0)
+            return -1;
+        a->points = tts_arena_alloc(arena, sizeof(*a->points));
+        a->points_len = 1;
+        if (unpack_v2_point(&buf, end, len, codec,
+                            arena, flags, prev, a, 0) < 0)
+            return -1;
+    }
+    m->points_len = count;
+    return 0;
+}
+
+/* Results are packed in a single batch, an empty response carries none */
+static ssize_t pack_v2_query_response(struct tts_codec *codec,
+                                      const struct tts_query_response *qr,
+                                      uint8_t *buf) {
+    size_t xor = 0, len = 0;
+    uint64_t prev[2] = { 0, 0 };
+    if (qr->len == 0)
+        return 0;
+    for (uint64_t i = 0; i < qr->len; ++i)
+        v2_account(&xor, &prev[1], (double) qr->results[i].value);
+    uint8_t flags = v2_flags(xor, qr->len);
+    len += pack_varint(&buf, qr->len);
+    len += pack_integer(&buf, 'B', flags);
+    prev[1] = 0;
+    for (uint64_t i = 0; i < qr->len; ++i) {
+        len += pack_v2_timestamp(&buf, &prev[0],
+                                 qr->results[i].ts_sec * (uint64_t) 1e9 +
+                                 qr->results[i].ts_nsec);
+        len += pack_v2_value(&buf, flags, &prev[1],
+                             (double) qr->results[i].value);
+        len += pack_varint(&buf, qr->results[i].labels_len);
+        for (size_t j = 0; j < qr->results[i].labels_len; ++j) {
+            len += pack_v2_string(&buf, codec, qr->results[i].labels[j].label,
+                                  qr->results[i].labels[j].label_len);
+            len += pack_v2_string(&buf, codec, qr->results[i].labels[j].value,
+                                  qr->results[i].labels[j].value_len);
+        }
+    }
+    return len;
+}
+
+/*
+ * Results of all the batches are unpacked into a single array, allocated on
+ * the maximum number of results the payload could carry
+ */
+static int unpack_v2_query_response(struct tts_codec *codec, uint8_t *buf,
+                                    size_t len, struct tts_query_response *qa,
+                                    struct tts_arena *arena) {
+    const uint8_t *end = buf + len;
+    size_t count = 0, labels_nr = 0;
+    memset(qa, 0x00, sizeof(*qa));
+    qa->results = tts_arena_alloc(arena, max_elements(len, V2_POINT_MIN_SIZE) *
+                                  sizeof(*qa->results));
+    while (buf < end) {
+        uint64_t prev[2] = { 0, 0 }, t = 0;
+        int set = 0;
+        if (unpack_v2_count(&buf, end, len, V2_POINT_MIN_SIZE, &count) < 0 ||
+            count > max_elements(len, V2_POINT_MIN_SIZE) - qa->len)
+            return -1;
+        UNPACK_NEED(end - buf, sizeof(uint8_t));
+        uint8_t flags = *buf++;
+        for (size_t i = qa->len; i < qa->len + count; ++i) {
+            if (unpack_v2_timestamp(&buf, end, &prev[0], &t, &set) < 0)
+                return -1;
+            qa->results[i].rc = TTS_OK;
+            qa->results[i].ts_sec = t / (uint64_t) 1e9;
+            qa->results[i].ts_nsec = t % (uint64_t) 1e9;
+            if (unpack_v2_value(&buf, end, flags, &prev[1],
+                                &qa->results[i].value) < 0 ||
+                unpack_v2_count(&buf, end, len,
+                                V2_LABEL_MIN_SIZE, &labels_nr) < 0 ||
+                labels_nr > UINT16_MAX)
+                return -1;
+            qa->results[i].labels_len = labels_nr;
+            qa->results[i].labels =
+                tts_arena_alloc(arena, labels_nr *
+                                sizeof(*qa->results[i].labels));
+            for (size_t j = 0; j < labels_nr; ++j) {
+                if (unpack_v2_string(&buf, end, codec, arena,
+                                     &qa->results[i].labels[j].label_len,
+                                     &qa->results[i].labels[j].label) < 0 ||
+                    unpack_v2_string(&buf, end, codec, arena,
+                                     &qa->results[i].labels[j].value_len,
+                                     &qa->results[i].labels[j].value) < 0)
+                    return -1;
+            }
+        }
+        qa->len += count;
+        if (count == 0)
             break;
-        case TTS_DELETE_TS:
-            free(packet->drop.ts_name);
+    }
+    return 0;
+}
+
+static ssize_t pack_v2_mlast(struct tts_codec *codec,
+                             const struct tts_mlast *m, uint8_t *buf) {
+    size_t len = pack_varint(&buf, m->points);
+    len += pack_varint(&buf, m->series_nr);
+    for (uint32_t i = 0; i < m->series_nr; ++i)
+        len += pack_v2_string(&buf, codec, m->series[i].ts_name,
+                              m->series[i].ts_name_len);
+    return len;
+}
+
+static int unpack_v2_mlast(struct tts_codec *codec, uint8_t *buf,
+                           size_t len, struct tts_mlast *m,
+                           struct tts_arena *arena) {
+    uint64_t points = 0;
+    size_t count = 0;
+    const uint8_t *end = buf + len;
+    memset(m, 0x00, sizeof(*m));
+    if (unpack_v2_varint(&buf, end, &points) < 0)
+        return -1;
+    m->points = points > UINT16_MAX ? UINT16_MAX : points;
+    if (unpack_v2_count(&buf, end, len, 1, &count) < 0)
+        return -1;
+    m->series = tts_arena_alloc(arena, count * sizeof(*m->series));
+    for (size_t i = 0; i < count; ++i)
+        if (unpack_v2_name(&buf, end, codec, arena,
+                           &m->series[i].ts_name_len,
+                           &m->series[i].ts_name) < 0)
+            return -1;
+    m->series_nr = count;
+    return 0;
+}
+
+/* Results pushed to a subscriber are encoded as a TTS_QUERY_RESPONSE */
+static inline int v2_encoded(const struct tts_codec *codec,
+                             union tts_header header) {
+    return codec && codec->version >= TTS_PROTOCOL_V2 &&
+        (header.opcode == TTS_ADDPOINTS || header.opcode == TTS_MADDPOINTS ||
+         header.opcode == TTS_QUERY_RESPONSE || header.opcode == TTS_MLAST ||
+         (header.opcode == TTS_SUBSCRIBE && header.type == TTS_RESPONSE));
+}
+
+/* A connection starts on the first version, with empty dictionaries */
+void tts_codec_init(struct tts_codec *codec) {
+    codec->version = TTS_PROTOCOL_V1;
+    codec->in_bytes = 0;
+    TTS_VECTOR_NEW(codec->in);
+    codec->out_bytes = 0;
+    codec->out_nr = 0;
+    codec->out = NULL;
+}
+
+void tts_codec_destroy(struct tts_codec *codec) {
+    struct tts_dict_entry *entry, *tmp;
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(codec->in); ++i)
+        free(TTS_VECTOR_AT(codec->in, i).str);
+    TTS_VECTOR_DESTROY(codec->in);
+    HASH_ITER(hh, codec->out, entry, tmp) {
+        HASH_DEL(codec->out, entry);
+        free(entry->str);
+        free(entry);
+    }
+}
+
+/*
+ * Move to a version of the wire format, both sides do on a TTS_HELLO, with
+ * empty dictionaries
+ */
+void tts_codec_reset(struct tts_codec *codec, uint8_t version) {
+    tts_codec_destroy(codec);
+    tts_codec_init(codec);
+    codec->version = version;
+}
+
+/*
+ * Unpack a packet in the version of the wire format of the connection, a
+ * NULL codec means the first version. Return 0 on success, -1 if the packet
+ * is malformed
+ */
+int tts_codec_unpack(struct tts_codec *codec, uint8_t *buf,
+                     struct tts_packet *tts_p, struct tts_arena *arena) {
+    int64_t val = 0;
+    int rc = 0;
+    union tts_header header = { .byte = *buf };
+    if (!v2_encoded(codec, header))
+        return unpack_tts_packet(buf, tts_p, arena);
+    tts_p->header.byte = *buf++;
+    unpack_integer(&buf, 'I', &val);
+    tts_p->len = val;
+    switch (tts_p->header.opcode) {
+        case TTS_ADDPOINTS:
+            rc = unpack_v2_addpoints(codec, buf, tts_p->len,
+                                     &tts_p->addpoints, arena);
+            break;
+        case TTS_MADDPOINTS:
+            rc = unpack_v2_maddpoints(codec, buf, tts_p->len,
+                                      &tts_p->maddpoints, arena);
+            break;
+        case TTS_QUERY_RESPONSE:
+        case TTS_SUBSCRIBE:
+            rc = unpack_v2_query_response(codec, buf, tts_p->len,
+                                          &tts_p->query_r, arena);
             break;
+        case TTS_MLAST:
+            rc = unpack_v2_mlast(codec, buf, tts_p->len, &tts_p->mlast, arena);
+            break;
+    }
+    return rc;
+}
+
+/*
+ * Pack a packet in the version of the wire format of the connection, a NULL
+ * codec means the first version
+ */
+ssize_t tts_codec_pack(struct tts_codec *codec,
+                       const struct tts_packet *tts_p, uint8_t *buf) {
+    if (!v2_encoded(codec, tts_p->header))
+        return pack_tts_packet(tts_p, buf);
+    int len_offset = sizeof(uint32_t);
+    ssize_t len = pack_integer(&buf, 'B', tts_p->header.byte);
+    ssize_t plen = 0;
+    switch (tts_p->header.opcode) {
         case TTS_ADDPOINTS:
-            free(packet->addpoints.ts_name);
-            for (int i = 0; i < packet->addpoints.points_len; ++i)
-                free(packet->addpoints.points[i].labels);
-            free(packet->addpoints.points);
+            plen = pack_v2_addpoints(codec, &tts_p->addpoints,
+                                     buf + len_offset);
             break;
-        case TTS_QUERY:
-            free(packet->query.ts_name);
+        case TTS_MADDPOINTS:
+            plen = pack_v2_maddpoints(codec, &tts_p->maddpoints,
+                                      buf + len_offset);
+            break;
+        case TTS_QUERY_RESPONSE:
+        case TTS_SUBSCRIBE:
+            plen = pack_v2_query_response(codec, &tts_p->query_r,
+                                          buf + len_offset);
+            break;
+        case TTS_MLAST:
+            plen = pack_v2_mlast(codec, &tts_p->mlast, buf + len_offset);
+            break;
+    }
+    len += plen;
+    len += pack_integer(&buf, 'I', plen);
+    return len;
+}
+
+static size_t v2_addpoints_size(const struct tts_addpoints *a) {
+    size_t len = V2_STRING_MAX_SIZE(a->ts_name_len);
+    for (uint32_t i = 0; i < a->points_len; ++i) {
+        len += V2_POINT_MAX_SIZE;
+        for (int j = 0; j < a->points[i].labels_len; ++j)
+            len += V2_STRING_MAX_SIZE(a->points[i].labels[j].label_len) +
+                V2_STRING_MAX_SIZE(a->points[i].labels[j].value_len);
+    }
+    return len;
+}
+
+/*
+ * Return the maximum number of bytes a packet could take once packed in the
+ * version of the wire format of the connection, header included, strings are
+ * accounted as new ones
+ */
+size_t tts_codec_packet_size(const struct tts_codec *codec,
+                             const struct tts_packet *tts_p) {
+    if (!v2_encoded(codec, tts_p->header))
+        return tts_packet_size(tts_p);
+    size_t len = TTS_HEADER_SIZE + V2_BATCH_MAX_SIZE;
+    const struct tts_query_response *qr = &tts_p->query_r;
+    switch (tts_p->header.opcode) {
+        case TTS_ADDPOINTS:
+            len += v2_addpoints_size(&tts_p->addpoints);
+            break;
+        case TTS_MADDPOINTS:
+            for (uint32_t i = 0; i < tts_p->maddpoints.points_len; ++i)
+                len += v2_addpoints_size(&tts_p->maddpoints.pts[i]);
+            break;
+        case TTS_QUERY_RESPONSE:
+        case TTS_SUBSCRIBE:
+            for (uint64_t i = 0; i < qr->len; ++i) {
+                len += V2_POINT_MAX_SIZE;
+                for (size_t j = 0; j < qr->results[i].labels_len; ++j)
+                    len += V2_STRING_MAX_SIZE(qr->results[i].labels[j].label_len)
+                        + V2_STRING_MAX_SIZE(qr->results[i].labels[j].value_len);
+            }
+            break;
+        case TTS_MLAST:
+            /* The points varint takes 3 bytes at most, in place of flags */
+            len += 2;
+            for (uint32_t i = 0; i < tts_p->mlast.series_nr; ++i)
+                len += V2_STRING_MAX_SIZE(tts_p->mlast.series[i].ts_name_len);
             break;
     }
+    return len;
 }
@@ -31,8 +31,48 @@
 #include "tts.h"
 #include <stdint.h>
 
+/* Header byte plus the packet length field */
+#define TTS_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+
 #define TTS_QUERY_ALL_TIMESERIES     0x00
 #define TTS_QUERY_ALL_TIMESERIES_AVG 0x01
+#define TTS_QUERY_FILTER             0x20
+#define TTS_QUERY_AGGREGATE          0x40
+#define TTS_QUERY_SELECT             0x80
+
+/* Maximum number of quantiles requested by a single query */
+#define TTS_QUERY_QUANTILES_MAX 8
+
+/*
+ * Versions of the wire format, every connection starts on the first one and
+ * can move to the second by a TTS_HELLO request
+ */
+#define TTS_PROTOCOL_V1 1
+#define TTS_PROTOCOL_V2 2
+
+/*
+ * Bounds of each dictionary of strings of a v2 connection, strings past them
+ * are sent literally every time
+ */
+#define TTS_DICT_MAX_STRINGS 65536
+#define TTS_DICT_MAX_BYTES   (1 << 20)
+
+/*
+ * Aggregates computed on each window of a query, requested by a bitmask,
+ * results of a window follow the order of the bits, quantiles last in the
+ * order requested
+ */
+enum {
+    TTS_AGG_AVG      = 1 << 0,
+    TTS_AGG_SUM      = 1 << 1,
+    TTS_AGG_MIN      = 1 << 2,
+    TTS_AGG_MAX      = 1 << 3,
+    TTS_AGG_COUNT    = 1 << 4,
+    TTS_AGG_FIRST    = 1 << 5,
+    TTS_AGG_LAST     = 1 << 6,
+    TTS_AGG_STDDEV   = 1 << 7,
+    TTS_AGG_QUANTILE = 1 << 8
+};
 
 /*
  * Header type field, separate tts packets into requests and responses, it is
@@ -46,7 +86,8 @@ enum {
 /*
  * Header opcode field, describe what command the packet is carrying, there's
  * no real distinction between requests and responses here, although the only
- * 2 valid responses opcode are, as of now, TTS_QUERY_RESPONSE and TTS_ACK.
+ * valid responses opcode are, as of now, TTS_QUERY_RESPONSE and TTS_ACK, and
+ * TTS_SUBSCRIBE for the results pushed to a subscriber.
  *
  * These opcodes can be summarized as
  * - TTS_CREATE_TS      Used to create a new timeseries, refer to
@@ -62,6 +103,16 @@ enum {
  *                      connected client
  * - TTS_ACK            *Response* Used as an acknoledgement packet in response
  *                      to an operation request to a connected client
+ * - TTS_HELLO          Used to negotiate the version of the wire format, the
+ *                      response carries the version chosen, refer to
+ *                      `struct tts_hello`
+ * - TTS_MLAST          Used to retrieve the latest points of multiple
+ *                      timeseries at once, refer to `struct tts_mlast`
+ * - TTS_INFO           Used to retrieve the statistics of the server, the
+ *                      response carries them as text, refer to
+ *                      `struct tts_info`
+ * - TTS_SUBSCRIBE      Used to get pushed the points added to one or more
+ *                      timeseries from then on, refer to `struct tts_query`
  */
 enum {
     TTS_CREATE_TS = 0x00,
@@ -70,21 +121,49 @@ enum {
     TTS_MADDPOINTS,
     TTS_QUERY,
     TTS_QUERY_RESPONSE,
-    TTS_ACK
+    TTS_ACK,
+    TTS_HELLO,
+    TTS_MLAST,
+    TTS_INFO,
+    TTS_SUBSCRIBE
 };
 
 /*
  * Header status field, describe the return code of the requested operation, a
- * TTS_ACK responses is entirely contained in just the tts_header
+ * TTS_ACK responses is entirely contained in just the tts_header. The
+ * statuses following TTS_UNKNOWN_CMD don't fit its 2 bits, they're carried by
+ * the body of the TTS_ACK only, see `struct tts_ack`
  */
 enum {
     TTS_OK = 0x00,
-    TTS_ENOTS,       // Not found error, generally a timeseries
-    TTS_EEXIST,      // The timeseries already exists
-    TTS_UNKNOWN_CMD, // Unknown command error
-    TTS_EOOM         // Out of memory error
+    TTS_ENOTS,        // Not found error, generally a timeseries
+    TTS_EEXIST,       // The timeseries already exists
+    TTS_UNKNOWN_CMD,  // Unknown command error
+    TTS_EOOM,         // Out of memory error
+    TTS_ELATE,        // Points too far out of order, rejected
+    TTS_EUNREACHABLE, // A node of the cluster couldn't be reached
+    TTS_EIO           // The write-ahead log failed, changes are refused
 };
 
+/*
+ * Status set on the header for `status`, the closest one fitting it: points
+ * rejected as too late leave the request done for the others, the
+ * timeseries of a node that couldn't be reached are missing
+ */
+static inline uint8_t tts_header_status(int status) {
+    switch (status) {
+        case TTS_EOOM:
+        case TTS_EIO:
+            return TTS_UNKNOWN_CMD;
+        case TTS_ELATE:
+            return TTS_OK;
+        case TTS_EUNREACHABLE:
+            return TTS_ENOTS;
+        default:
+            return status;
+    }
+}
+
 /* Helper macros, first argument must be a pointer to a tts_packet struct */
 #define TTS_SET_REQUEST_HEADER(r, o) do {   \
     (r)->header.type = TTS_REQUEST;         \
@@ -93,7 +172,7 @@ enum {
 
 #define TTS_SET_RESPONSE_HEADER(r, o, s) do {   \
     (r)->header.type = TTS_RESPONSE;            \
-    (r)->header.status = (s);                   \
+    (r)->header.status = tts_header_status(s);  \
     (r)->header.opcode = (o);                   \
 } while (0)
 
@@ -108,9 +187,11 @@ enum {
  *
  * |   Bit      |  7  |  6  |  5  |  4  |  3  |  2  |  1  |  0  |
  * |------------|-----------------------------------------------|
- * | Byte 0     | typ |          opcode       |   status  | res.|
+ * | Byte 0     | typ |          opcode       |   status  | more|
  * |____________|_____|_______________________|___________|_____|
  *
+ * The `more` bit is set on responses streamed in multiple frames, it marks
+ * every frame but the last one of the response.
  */
 union tts_header {
     uint8_t byte;
@@ -118,7 +199,7 @@ union tts_header {
         uint8_t type : 1;
         uint8_t opcode : 4;
         uint8_t status : 2;
-        uint8_t reserved : 1;
+        uint8_t more : 1;
     };
 };
 
@@ -149,7 +230,7 @@ struct tts_delete_ts {
  */
 struct tts_addpoints {
     TS_NAME_FIELD
-    uint16_t points_len;
+    uint32_t points_len;
     struct {
         union {
             uint8_t byte;
@@ -177,7 +258,7 @@ struct tts_addpoints {
  * insert multiple points into differents timeseries in a single call
  */
 struct tts_maddpoints {
-    uint16_t points_len;
+    uint32_t points_len;
     struct tts_addpoints *pts;
 };
 
@@ -193,8 +274,39 @@ struct tts_maddpoints {
  * Proceeding in incremental improvements, for now we just accept seconds as
  * values on mean_val, major_of, minor_of.
  *
- * TODO Add tags field, to be indexed, probably in a hashmap
+ * If the filter flag is set, the query is restricted to the points carrying
+ * all the labels in `filters`, with the given values.
+ *
+ * If the aggregate flag is set, the `aggregates` bitmask tells the aggregates
+ * to compute on each window of `mean_val` milliseconds, or on the whole range
+ * without the mean flag, in place of the sole average. Quantiles are
+ * expressed in hundredths of a percent.
+ *
+ * If the select flag is set, the name is a glob pattern, as by fnmatch(3),
+ * and the query runs on every timeseries matching it, in name order, within
+ * the timeseries of each node in a cluster. Their results are labelled by
+ * "timeseries" and the name of their timeseries ahead of their own labels,
+ * in frames all carrying the `more` bit, the response is closed by an empty
+ * one, carrying its status.
+ *
+ * Command TTS_SUBSCRIBE carries a query as well, acknowledged by a TTS_ACK,
+ * TTS_ENOTS if the timeseries doesn't exist, the connection is then pushed
+ * the points added to the timeseries, or to the ones matching the pattern,
+ * carrying the labels filtered; with the mean flag they're aggregated into
+ * windows of `mean_val` milliseconds, aligned to multiples of it, stamped
+ * with their upper bound and pushed once a point past them comes. The
+ * aggregate flag works as in queries, ranges, first and last are ignored.
+ * Results are pushed as TTS_SUBSCRIBE responses carrying a query response,
+ * labelled by "timeseries" and the name of their timeseries ahead of their
+ * own labels, never marked with the `more` bit.
  */
+struct tts_query_filter {
+    uint16_t label_len;
+    uint8_t *label;
+    uint16_t value_len;
+    uint8_t *value;
+};
+
 struct tts_query {
     TS_NAME_FIELD
     union {
@@ -206,24 +318,61 @@ struct tts_query {
             uint8_t major_of : 1;
             uint8_t minor_of : 1;
             uint8_t filter : 1;
-            uint8_t reserved : 2;
+            uint8_t aggregate : 1;
+            uint8_t select : 1;
         } bits;
     };
     uint64_t mean_val;   // present only if mean = 1
     uint64_t major_of;   // present only if major_of = 1
     uint64_t minor_of;   // present only if minor_of = 1
-    struct {
-        uint16_t label_len;
-        uint8_t *label;
-        uint16_t value_len;
-        uint8_t *value;
-    } *filters;
+    uint16_t aggregates; // present only if aggregate = 1
+    uint8_t quantiles_nr; // present only if TTS_AGG_QUANTILE is requested
+    uint16_t quantiles[TTS_QUERY_QUANTILES_MAX];
+    uint16_t filters_nr; // not on the wire, filters span to the end
+    struct tts_query_filter *filters; // present only if filter = 1
+};
+
+/*
+ * Command TTS_MLAST, retrieve the latest `points` points, 1 if 0, of each
+ * timeseries named, answered by a single TTS_QUERY_RESPONSE with the points
+ * of every timeseries found, oldest first, in the order they're named; each
+ * point is labelled by "timeseries" and the name of its timeseries ahead of
+ * its own labels.
+ *
+ * |   Bit      |  7  |  6  |  5  |  4  |  3  |  2  |  1  |  0  |
+ * |------------|-----------------------------------------------|
+ * | Byte 5     |                 Points MSB                    |
+ * | Byte 6     |                 Points LSB                    |
+ * |------------|-----------------------------------------------|<- Array start
+ * | Byte 7     |             Time series name len              |
+ * |------------|-----------------------------------------------|
+ * | Byte 8     |                                               |
+ * |   .        |              Time series name                 |
+ * | Byte N     |                                               |
+ * |____________|_______________________________________________|
+ *
+ * Names are repeated until the end of the packet.
+ */
+struct tts_mlast {
+    uint16_t points;
+    uint32_t series_nr; // not on the wire, names span to the end
+    struct tts_mlast_series {
+        TS_NAME_FIELD
+    } *series;
 };
 
 /*
  * An ACK response for a query request, it carries an array of tuples with
- * return codes and optional values as part of the result of the query issued
+ * return codes and optional values as part of the result of the query issued,
+ * aggregated results carry the name of their aggregate as a label
  */
+struct tts_query_label {
+    uint16_t label_len;
+    uint8_t *label;
+    uint16_t value_len;
+    uint8_t *value;
+};
+
 struct tts_query_response {
     uint64_t len;
     struct {
@@ -232,15 +381,83 @@ struct tts_query_response {
         uint64_t ts_nsec;
         long double value;
         uint16_t labels_len;
-        struct {
-            uint16_t label_len;
-            uint8_t *label;
-            uint16_t value_len;
-            uint8_t *value;
-        } *labels;
+        struct tts_query_label *labels;
     } *results;
 };
 
+/*
+ * An ACK response is entirely contained in the header, but for the ones to a
+ * TTS_MADDPOINTS, carrying the status of each timeseries written and the
+ * number of points stored into it, in the order the timeseries first appear
+ * in the request; the header status is the first error among them, if any.
+ * An ACK to a TTS_ADDPOINTS with a status not fitting the header, like
+ * TTS_ELATE, carries it that way as well, as a single timeseries, and so
+ * does the one of a request forwarded to a node that couldn't be reached,
+ * with TTS_EUNREACHABLE, and the one of a change refused while the
+ * write-ahead log can't be written, with TTS_EIO.
+ */
+struct tts_ack {
+    uint32_t series_nr; // not on the wire, series span to the end
+    struct tts_ack_series {
+        uint8_t status;
+        uint32_t points;
+    } *series;
+};
+
+/*
+ * Command TTS_HELLO, carries the highest version of the wire format the
+ * client speaks, the response the one the server picked, which applies to
+ * every packet following it in both directions. Servers not knowing it answer
+ * with a TTS_UNKNOWN_CMD TTS_ACK, the connection stays on the first version.
+ *
+ * The second version changes only the payloads of TTS_ADDPOINTS,
+ * TTS_MADDPOINTS and TTS_QUERY_RESPONSE, which carry points in batches, and
+ * of TTS_MLAST; the results pushed by TTS_SUBSCRIBE are encoded as any
+ * TTS_QUERY_RESPONSE:
+ *
+ * - counts are varints, up to 32 bits
+ * - timestamps are varints, zigzag encoded deltas from the previous point of
+ *   the batch, plus one, 0 meaning no timestamp, the first one from 0
+ * - values are either raw IEEE 754 binary64, or XOR'ed against the previous
+ *   one, with a control byte telling the number of leading and trailing zero
+ *   bytes (high and low nibble) followed by the bytes left, depending on the
+ *   batch flags, the encoder picks the shortest
+ * - strings, timeseries names and labels, are references to a dictionary of
+ *   the strings sent so far by the same side of the connection, a varint
+ *   index plus one, or 0 followed by a varint length and the bytes of a new
+ *   string, added to the dictionary unless it's full
+ *
+ * TTS_ADDPOINTS  name, count, flags, points of timestamp value labels
+ * TTS_MADDPOINTS count, flags, entries of name timestamp value labels
+ * TTS_QUERY_RESPONSE a sequence of batches of count, flags, results of
+ *                    timestamp value labels, streamed frames can then be
+ *                    joined, results don't carry a return code, always
+ *                    TTS_OK
+ * TTS_MLAST          points, count, names
+ *
+ * Labels are a varint count followed by the pairs of label and value.
+ */
+struct tts_hello {
+    uint8_t version;
+};
+
+/*
+ * Set on the version of a TTS_HELLO by the nodes of a cluster connecting to
+ * each other, requests coming from a peer are never forwarded again
+ */
+#define TTS_HELLO_PEER 0x80
+
+/*
+ * Command TTS_INFO, the request carries an optional glob pattern, selecting
+ * the timeseries to report one by one, all of them if empty; the response
+ * carries the statistics of the server in the Prometheus text format. Both
+ * span the whole payload, on both versions of the wire format.
+ */
+struct tts_info {
+    uint32_t len;
+    uint8_t *data;
+};
+
 /*
  * Generic TTS packet, it can contains requests or responses, based on the
  * header opcode, just a union of previously defined structures
@@ -271,11 +488,57 @@ struct tts_packet {
         struct tts_maddpoints maddpoints;
         struct tts_query query;
         struct tts_query_response query_r;
+        struct tts_hello hello;
+        struct tts_ack ack;
+        struct tts_mlast mlast;
+        struct tts_info info;
     };
 };
 
-void unpack_tts_packet(uint8_t *, struct tts_packet *);
+/*
+ * State of the wire format of a connection, on each side, the dictionaries
+ * of the strings received, referenced by index, and of the strings sent,
+ * indexed by content; both store their strings nul-terminated
+ */
+struct tts_dict_string {
+    uint16_t len;
+    uint8_t *str;
+};
+
+struct tts_dict_entry {
+    uint32_t id;
+    uint16_t len;
+    uint8_t *str;
+    UT_hash_handle hh;
+};
+
+struct tts_codec {
+    uint8_t version;
+    size_t in_bytes;
+    TTS_VECTOR(struct tts_dict_string) in;
+    size_t out_bytes;
+    uint32_t out_nr;
+    struct tts_dict_entry *out;
+};
+
+struct tts_arena;
+
+int unpack_tts_packet(uint8_t *, struct tts_packet *, struct tts_arena *);
 ssize_t pack_tts_packet(const struct tts_packet *, uint8_t *);
-void tts_packet_destroy(struct tts_packet *);
+ssize_t tts_packet_frame_len(uint8_t *, size_t, size_t);
+size_t tts_query_response_size(const struct tts_query_response *);
+size_t tts_packet_size(const struct tts_packet *);
+struct tts_query_filter *tts_query_filters_copy(const struct tts_query_filter *,
+                                                size_t);
+void tts_query_filters_destroy(struct tts_query_filter *, size_t);
+void tts_codec_init(struct tts_codec *);
+void tts_codec_destroy(struct tts_codec *);
+void tts_codec_reset(struct tts_codec *, uint8_t);
+int tts_codec_unpack(struct tts_codec *, uint8_t *, struct tts_packet *,
+                     struct tts_arena *);
+ssize_t tts_codec_pack(struct tts_codec *, const struct tts_packet *,
+                       uint8_t *);
+size_t tts_codec_packet_size(const struct tts_codec *,
+                             const struct tts_packet *);
 
 #endif
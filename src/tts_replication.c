@@ -0,0 +1,664 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "tts.h"
+#include "pack.h"
+#include "tts_log.h"
+#include "tts_handlers.h"
+#include "tts_replication.h"
+
+#define REPL_MAGIC_LEN    8
+#define REPL_HEADER_SIZE  (REPL_MAGIC_LEN + sizeof(uint64_t))
+#define REPL_BUFSIZE      65536
+#define REPL_BACKLOG      4096
+#define REPL_RETRY        1
+#define REPL_TMP_PATH     "/tmp/tts-replica-XXXXXX"
+
+enum slot_state {
+    SLOT_FREE,
+    SLOT_BOOTSTRAP,
+    SLOT_LOADING,
+    SLOT_STREAMING,
+    SLOT_DONE
+};
+
+/* Write all of `buf` on a socket, a replica gone away is just an error */
+static int send_all(int fd, const uint8_t *buf, size_t len) {
+    ssize_t n = 0;
+    while (len > 0) {
+        n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    ssize_t n = 0;
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read exactly `len` bytes, the stream ending before is an error */
+static int recv_all(int fd, uint8_t *buf, size_t len) {
+    ssize_t n = 0;
+    while (len > 0) {
+        n = recv(fd, buf, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void lock_shards(struct tts_database *db) {
+    for (int i = 0; i < TTS_DB_SHARDS; ++i)
+        pthread_mutex_lock(&db->shards[i].lock);
+}
+
+static void unlock_shards(struct tts_database *db) {
+    for (int i = 0; i < TTS_DB_SHARDS; ++i)
+        pthread_mutex_unlock(&db->shards[i].lock);
+}
+
+/*
+ * Bytes appended past the end of the stream `end` when a replica streaming
+ * acknowledged its snapshot and not sent to it yet, the ones appended while
+ * it was loading the snapshot aren't counted
+ */
+static inline uint64_t slot_lag(const struct tts_replication_slot *slot,
+                                uint64_t end) {
+    return end - (slot->offset > slot->acked ? slot->offset : slot->acked);
+}
+
+/*
+ * Make room for `len` bytes at the end of the backlog, dropping the bytes
+ * already sent to every replica, then the replicas lagging furthest behind
+ * as long as their lag would grow past the maximum size of the backlog. The
+ * replicas still loading their snapshot are never dropped, the backlog grows
+ * as needed to hold the bytes they're yet to be sent. Must be called with
+ * the replication locked
+ */
+static void backlog_reserve(struct tts_replication *repl, size_t len) {
+    uint64_t end = repl->base + repl->size, min = end, lag = 0;
+    struct tts_replication_slot *slot = NULL;
+    for (;;) {
+        lag = 0;
+        for (int i = 0; i < TTS_REPLICATION_MAX_REPLICAS; ++i) {
+            slot = &repl->slots[i];
+            if (slot->state == SLOT_STREAMING && !slot->dropped &&
+                slot_lag(slot, end) > lag)
+                lag = slot_lag(slot, end);
+        }
+        if (lag == 0 || lag + len <= repl->max_size)
+            break;
+        for (int i = 0; i < TTS_REPLICATION_MAX_REPLICAS; ++i) {
+            slot = &repl->slots[i];
+            if (slot->state != SLOT_STREAMING || slot->dropped ||
+                slot_lag(slot, end) != lag)
+                continue;
+            log_warning("Dropping a replica lagging %lu bytes behind",
+                        (unsigned long) lag);
+            slot->dropped = 1;
+        }
+        pthread_cond_broadcast(&repl->cond);
+    }
+    for (int i = 0; i < TTS_REPLICATION_MAX_REPLICAS; ++i) {
+        slot = &repl->slots[i];
+        if ((slot->state == SLOT_LOADING || slot->state == SLOT_STREAMING) &&
+            !slot->dropped && slot->offset < min)
+            min = slot->offset;
+    }
+    memmove(repl->buf, repl->buf + (min - repl->base), end - min);
+    repl->size = end - min;
+    repl->base = min;
+    if (repl->capacity - repl->size < len) {
+        while (repl->capacity - repl->size < len)
+            repl->capacity *= 2;
+        repl->buf = realloc(repl->buf, repl->capacity);
+    }
+}
+
+/*
+ * Append a packet to the backlog, if any replica is streaming, they're sent
+ * the packet once woken up by the next flush. Must be called with the shard
+ * of the timeseries changed locked, as the write-ahead log appends, so a
+ * snapshot taken with all the shards locked sits right between two packets
+ */
+void tts_replication_append(struct tts_replication *repl,
+                            const struct tts_packet *packet) {
+    size_t len = tts_packet_size(packet);
+    pthread_mutex_lock(&repl->lock);
+    if (repl->replicas > 0) {
+        if (repl->capacity - repl->size < len)
+            backlog_reserve(repl, len);
+        repl->size += pack_tts_packet(packet, repl->buf + repl->size);
+        repl->pending = 1;
+    }
+    pthread_mutex_unlock(&repl->lock);
+}
+
+/*
+ * Wake up the replicas to send them the packets appended, meant to be
+ * called once per batch of requests handled
+ */
+void tts_replication_flush(struct tts_replication *repl) {
+    pthread_mutex_lock(&repl->lock);
+    if (repl->pending == 1) {
+        repl->pending = 0;
+        pthread_cond_broadcast(&repl->cond);
+    }
+    pthread_mutex_unlock(&repl->lock);
+}
+
+/*
+ * Send a new replica a snapshot of the database, written by a forked child as
+ * the background snapshots, with all the shards locked meanwhile the replica
+ * gets its offset at the end of the backlog, so it's sent exactly the
+ * changes following the snapshot, once it acknowledges it. Return 0 on
+ * success, -1 on error
+ */
+static int replication_bootstrap(struct tts_replication_slot *slot) {
+    struct tts_replication *repl = slot->repl;
+    char path[] = REPL_TMP_PATH;
+    uint8_t buf[REPL_BUFSIZE];
+    struct stat st;
+    int status = 0, rc = -1;
+    ssize_t n = 0;
+    pid_t pid;
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        log_error("Replica bootstrap failed: %s", strerror(errno));
+        return -1;
+    }
+    close(fd);
+    fd = -1;
+    lock_shards(repl->db);
+    pthread_mutex_lock(&repl->lock);
+    slot->offset = repl->base + repl->size;
+    slot->state = SLOT_LOADING;
+    repl->replicas++;
+    pthread_mutex_unlock(&repl->lock);
+    pid = fork();
+    if (pid == 0)
+        _exit(tts_snapshot_save(repl->db, path, NULL) == 0 ?
+              EXIT_SUCCESS : EXIT_FAILURE);
+    unlock_shards(repl->db);
+    if (pid < 0) {
+        log_error("Replica bootstrap failed: %s", strerror(errno));
+        goto out;
+    }
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        log_error("Replica bootstrap failed, no snapshot written");
+        goto out;
+    }
+    if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+        goto out;
+    memcpy(buf, TTS_REPLICATION_MAGIC, REPL_MAGIC_LEN);
+    packi64(buf + REPL_MAGIC_LEN, st.st_size);
+    if (send_all(slot->fd, buf, REPL_HEADER_SIZE) < 0)
+        goto out;
+    while ((n = read(fd, buf, sizeof(buf))) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || send_all(slot->fd, buf, n) < 0)
+            goto out;
+    }
+    if (recv_all(slot->fd, buf, REPL_MAGIC_LEN) < 0 ||
+        memcmp(buf, TTS_REPLICATION_MAGIC, REPL_MAGIC_LEN) != 0) {
+        log_error("Replica bootstrap failed, snapshot not acknowledged");
+        goto out;
+    }
+    pthread_mutex_lock(&repl->lock);
+    slot->acked = repl->base + repl->size;
+    slot->state = SLOT_STREAMING;
+    pthread_mutex_unlock(&repl->lock);
+    rc = 0;
+out:
+    if (fd >= 0)
+        close(fd);
+    unlink(path);
+    return rc;
+}
+
+/*
+ * Serve a replica, after the snapshot it's sent the backlog from its offset
+ * on, waiting for more once it's reached the end, till it's dropped, the
+ * connection fails or the replication is stopped
+ */
+static void *replication_serve(void *arg) {
+    struct tts_replication_slot *slot = arg;
+    struct tts_replication *repl = slot->repl;
+    uint8_t *buf = malloc(REPL_BUFSIZE);
+    size_t n = 0;
+    int err = replication_bootstrap(slot);
+    while (err == 0) {
+        pthread_mutex_lock(&repl->lock);
+        while (atomic_load(&repl->running) && !slot->dropped &&
+               slot->offset == repl->base + repl->size)
+            pthread_cond_wait(&repl->cond, &repl->lock);
+        if (!atomic_load(&repl->running) || slot->dropped) {
+            pthread_mutex_unlock(&repl->lock);
+            break;
+        }
+        n = repl->base + repl->size - slot->offset;
+        if (n > REPL_BUFSIZE)
+            n = REPL_BUFSIZE;
+        memcpy(buf, repl->buf + (slot->offset - repl->base), n);
+        pthread_mutex_unlock(&repl->lock);
+        if ((err = send_all(slot->fd, buf, n)) == 0) {
+            pthread_mutex_lock(&repl->lock);
+            slot->offset += n;
+            pthread_mutex_unlock(&repl->lock);
+        }
+    }
+    free(buf);
+    pthread_mutex_lock(&repl->lock);
+    if (slot->state == SLOT_LOADING || slot->state == SLOT_STREAMING)
+        repl->replicas--;
+    slot->state = SLOT_DONE;
+    close(slot->fd);
+    slot->fd = -1;
+    pthread_mutex_unlock(&repl->lock);
+    log_info("Replica disconnected");
+    return NULL;
+}
+
+/*
+ * Accept the replicas connecting, each one is served by a thread of its own,
+ * the thread of a replica disconnected is joined once its slot is reused
+ */
+static void *replication_accept(void *arg) {
+    struct tts_replication *repl = arg;
+    struct tts_replication_slot *slot = NULL;
+    for (;;) {
+        int fd = accept(repl->fd, NULL, NULL);
+        if (fd < 0) {
+            if (!atomic_load(&repl->running))
+                break;
+            if (errno != EINTR) {
+                log_error("Replica accept failed: %s", strerror(errno));
+                sleep(REPL_RETRY);
+            }
+            continue;
+        }
+        slot = NULL;
+        pthread_mutex_lock(&repl->lock);
+        for (int i = 0; !slot && i < TTS_REPLICATION_MAX_REPLICAS; ++i)
+            if (repl->slots[i].state == SLOT_FREE ||
+                repl->slots[i].state == SLOT_DONE)
+                slot = &repl->slots[i];
+        pthread_mutex_unlock(&repl->lock);
+        if (!slot) {
+            log_error("Too many replicas, connection refused");
+            close(fd);
+            continue;
+        }
+        if (slot->state == SLOT_DONE)
+            pthread_join(slot->thread, NULL);
+        pthread_mutex_lock(&repl->lock);
+        slot->fd = fd;
+        slot->dropped = 0;
+        slot->state = SLOT_BOOTSTRAP;
+        pthread_mutex_unlock(&repl->lock);
+        log_info("New replica connected");
+        pthread_create(&slot->thread, NULL, replication_serve, slot);
+    }
+    return NULL;
+}
+
+static int replication_listen(const char *host, int port) {
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = AI_PASSIVE
+    };
+    struct addrinfo *result, *rp;
+    char service[8];
+    int fd = -1, yes = 1;
+    snprintf(service, sizeof(service), "%i", port);
+    if (getaddrinfo(host, service, &hints, &result) != 0)
+        return -1;
+    for (rp = result; rp; rp = rp->ai_next) {
+        fd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, rp->ai_addr, rp->ai_addrlen) == 0 &&
+            listen(fd, TTS_REPLICATION_MAX_REPLICAS) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    return fd;
+}
+
+/*
+ * Start serving replicas on `host`:`port`, `max_size` is the size in bytes
+ * the backlog can grow up to. Return 0 on success, -1 on error
+ */
+int tts_replication_start(struct tts_replication *repl,
+                          struct tts_database *db, const char *host,
+                          int port, size_t max_size) {
+    repl->fd = replication_listen(host, port);
+    if (repl->fd < 0) {
+        log_error("Can't listen for replicas on %s:%i: %s",
+                  host, port, strerror(errno));
+        return -1;
+    }
+    pthread_mutex_init(&repl->lock, NULL);
+    pthread_cond_init(&repl->cond, NULL);
+    atomic_init(&repl->running, 1);
+    repl->pending = 0;
+    repl->db = db;
+    repl->replicas = 0;
+    for (int i = 0; i < TTS_REPLICATION_MAX_REPLICAS; ++i)
+        repl->slots[i] = (struct tts_replication_slot) {
+            .repl = repl, .fd = -1, .state = SLOT_FREE
+        };
+    repl->base = 0;
+    repl->size = 0;
+    repl->capacity = REPL_BACKLOG;
+    repl->max_size = max_size;
+    repl->buf = malloc(repl->capacity);
+    pthread_create(&repl->thread, NULL, replication_accept, repl);
+    log_info("Serving replicas on %s:%i", host, port);
+    return 0;
+}
+
+/*
+ * Stop accepting replicas and disconnect the ones connected, waiting for
+ * their threads to return
+ */
+void tts_replication_stop(struct tts_replication *repl) {
+    pthread_mutex_lock(&repl->lock);
+    atomic_store(&repl->running, 0);
+    shutdown(repl->fd, SHUT_RDWR);
+    for (int i = 0; i < TTS_REPLICATION_MAX_REPLICAS; ++i)
+        if (repl->slots[i].fd >= 0)
+            shutdown(repl->slots[i].fd, SHUT_RDWR);
+    pthread_cond_broadcast(&repl->cond);
+    pthread_mutex_unlock(&repl->lock);
+    pthread_join(repl->thread, NULL);
+    for (int i = 0; i < TTS_REPLICATION_MAX_REPLICAS; ++i)
+        if (repl->slots[i].state != SLOT_FREE)
+            pthread_join(repl->slots[i].thread, NULL);
+    close(repl->fd);
+    free(repl->buf);
+    pthread_cond_destroy(&repl->cond);
+    pthread_mutex_destroy(&repl->lock);
+}
+
+/*
+ * Replace the database with the snapshot at `path`, all the shards are
+ * locked meanwhile, so clients see either the old database or the new one
+ */
+static int replica_load(struct tts_replica *replica, const char *path) {
+    struct tts_database *db = replica->db;
+    struct tts_timeseries *ts, *tmp;
+    int n = 0;
+    lock_shards(db);
+    for (int i = 0; i < TTS_DB_SHARDS; ++i) {
+        HASH_ITER(hh, db->shards[i].timeseries, ts, tmp) {
+            HASH_DEL(db->shards[i].timeseries, ts);
+            tts_names_del(&db->names, ts->name);
+            TTS_TIMESERIES_DESTROY(ts);
+        }
+    }
+    tts_snapshot_unmap(&replica->snapshot);
+    n = tts_snapshot_load(db, path, &replica->snapshot);
+    unlock_shards(db);
+    return n;
+}
+
+static void replica_disconnect(struct tts_replica *replica) {
+    pthread_mutex_lock(&replica->lock);
+    if (atomic_load(&replica->connected))
+        tts_client_disconnect(&replica->client);
+    atomic_store(&replica->connected, 0);
+    pthread_mutex_unlock(&replica->lock);
+}
+
+/*
+ * Connect to the primary and load the snapshot it sends first, received
+ * into a temporary file removed once mapped, acknowledged sending the magic
+ * back. Return 0 on success, -1 on error
+ */
+static int replica_sync(struct tts_replica *replica) {
+    char path[] = REPL_TMP_PATH;
+    uint8_t header[REPL_HEADER_SIZE];
+    uint64_t size = 0, len = 0;
+    int fd = -1, n = 0;
+    pthread_mutex_lock(&replica->lock);
+    if (atomic_load(&replica->running) &&
+        tts_client_connect(&replica->client) == 0)
+        atomic_store(&replica->connected, 1);
+    pthread_mutex_unlock(&replica->lock);
+    if (!atomic_load(&replica->connected))
+        return -1;
+    if (recv_all(replica->client.fd, header, REPL_HEADER_SIZE) < 0 ||
+        memcmp(header, TTS_REPLICATION_MAGIC, REPL_MAGIC_LEN) != 0)
+        goto err;
+    size = unpacku64(header + REPL_MAGIC_LEN);
+    if ((fd = mkstemp(path)) < 0)
+        goto err;
+    for (; size > 0; size -= len) {
+        len = size < replica->capacity ? size : replica->capacity;
+        if (recv_all(replica->client.fd, replica->buf, len) < 0 ||
+            write_all(fd, replica->buf, len) < 0)
+            goto err;
+    }
+    close(fd);
+    fd = -1;
+    n = replica_load(replica, path);
+    unlink(path);
+    if (n < 0 || send_all(replica->client.fd,
+                          (const uint8_t *) TTS_REPLICATION_MAGIC,
+                          REPL_MAGIC_LEN) < 0)
+        goto err;
+    replica->size = 0;
+    log_info("Synced %i timeseries from the primary %s:%i",
+             n, replica->host, replica->opts.s_port);
+    return 0;
+err:
+    log_error("Sync with the primary %s:%i failed",
+              replica->host, replica->opts.s_port);
+    if (fd >= 0) {
+        close(fd);
+        unlink(path);
+    }
+    replica_disconnect(replica);
+    return -1;
+}
+
+/*
+ * Apply the complete packets received from the primary, through the same
+ * handlers serving the clients, the responses are just discarded. Return -1
+ * on a malformed packet, the stream of changes can't be trusted past it
+ */
+static int replica_apply(struct tts_replica *replica,
+                         struct tts_payload *payload) {
+    size_t offset = 0;
+    ssize_t len = 0;
+    while ((len = tts_packet_frame_len(replica->buf + offset,
+                                       replica->size - offset, 0)) > 0) {
+        if (unpack_tts_packet(replica->buf + offset, &payload->packet,
+                              &replica->arena) < 0) {
+            tts_arena_reset(&replica->arena);
+            return -1;
+        }
+        switch (payload->packet.header.opcode) {
+            case TTS_CREATE_TS:
+            case TTS_DELETE_TS:
+            case TTS_ADDPOINTS:
+            case TTS_MADDPOINTS:
+                tts_handle_packet(payload);
+                break;
+        }
+        tts_arena_reset(&replica->arena);
+        ev_buf_list_reset(payload->out);
+        offset += len;
+    }
+    replica->size -= offset;
+    memmove(replica->buf, replica->buf + offset, replica->size);
+    return 0;
+}
+
+/*
+ * Stream the changes from the primary, connecting again, and so loading a
+ * new snapshot, every time the connection is lost
+ */
+static void *replica_run(void *arg) {
+    struct tts_replica *replica = arg;
+    ev_buf_list out = { .len = 0, .capacity = 0, .bufs = NULL };
+    struct tts_stream stream = { .active = 0, .ts_name = NULL };
+    struct tts_payload payload = {
+        .out = &out,
+        .tts_db = replica->db,
+        .stream = &stream,
+        .subs = replica->subs
+    };
+    ssize_t n = 0;
+    while (atomic_load(&replica->running)) {
+        if (!atomic_load(&replica->connected) &&
+            replica_sync(replica) < 0) {
+            sleep(REPL_RETRY);
+            continue;
+        }
+        if (replica->size == replica->capacity) {
+            replica->capacity *= 2;
+            replica->buf = realloc(replica->buf, replica->capacity);
+        }
+        n = recv(replica->client.fd, replica->buf + replica->size,
+                 replica->capacity - replica->size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (atomic_load(&replica->running))
+                log_warning("Lost the connection to the primary %s:%i",
+                            replica->host, replica->opts.s_port);
+            replica_disconnect(replica);
+            continue;
+        }
+        replica->size += n;
+        if (replica_apply(replica, &payload) < 0) {
+            log_error("Malformed change from the primary %s:%i",
+                      replica->host, replica->opts.s_port);
+            replica_disconnect(replica);
+        }
+    }
+    ev_buf_list_free(&out);
+    return NULL;
+}
+
+/*
+ * Replicate the primary at `primary`, an `host:port` address, the first
+ * snapshot is loaded before returning, if the primary can't be reached it's
+ * retried in background. Return 0 on success, -1 if the address is malformed
+ */
+int tts_replica_start(struct tts_replica *replica, struct tts_database *db,
+                      struct tts_subscriptions *subs, const char *primary) {
+    const char *colon = strrchr(primary, ':');
+    if (!colon || colon == primary ||
+        (size_t) (colon - primary) >= sizeof(replica->host) ||
+        atoi(colon + 1) <= 0) {
+        log_error("Malformed primary address \"%s\"", primary);
+        return -1;
+    }
+    snprintf(replica->host, sizeof(replica->host), "%.*s",
+             (int) (colon - primary), primary);
+    replica->opts = (struct tts_connect_options) {
+        .timeout = 0,
+        .s_family = AF_INET,
+        .s_port = atoi(colon + 1),
+        .s_addr = replica->host,
+        .version = TTS_PROTOCOL_V1
+    };
+    pthread_mutex_init(&replica->lock, NULL);
+    atomic_init(&replica->running, 1);
+    atomic_init(&replica->connected, 0);
+    replica->db = db;
+    replica->subs = subs;
+    replica->snapshot.map = NULL;
+    replica->snapshot.size = 0;
+    replica->size = 0;
+    replica->capacity = REPL_BUFSIZE;
+    replica->buf = malloc(replica->capacity);
+    tts_client_init(&replica->client, &replica->opts);
+    tts_arena_init(&replica->arena);
+    if (replica_sync(replica) < 0)
+        log_warning("Primary %s unreachable, retrying in background",
+                    primary);
+    pthread_create(&replica->thread, NULL, replica_run, replica);
+    return 0;
+}
+
+/*
+ * Disconnect from the primary and wait for the replica thread to return, the
+ * snapshot stays mapped, it's to be unmapped once the database is destroyed
+ */
+void tts_replica_stop(struct tts_replica *replica) {
+    pthread_mutex_lock(&replica->lock);
+    atomic_store(&replica->running, 0);
+    if (atomic_load(&replica->connected))
+        shutdown(replica->client.fd, SHUT_RDWR);
+    pthread_mutex_unlock(&replica->lock);
+    pthread_join(replica->thread, NULL);
+    replica_disconnect(replica);
+    tts_client_destroy(&replica->client);
+    tts_arena_destroy(&replica->arena);
+    free(replica->buf);
+    pthread_mutex_destroy(&replica->lock);
+}
@@ -0,0 +1,140 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TTS_REPLICATION_H
+#define TTS_REPLICATION_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "tts_client.h"
+#include "tts_snapshot.h"
+
+/*
+ * Asynchronous replication, a primary streams the changes applied to its
+ * database to read-only replicas, in the format of the write-ahead log: every
+ * CREATE, DELETE and ADD applied, in their wire format with the timestamps
+ * already resolved, a MADD as an ADD per timeseries. A replica connecting to
+ * the replication port is sent a snapshot of the database first, then the
+ * packets following it:
+ *
+ * | magic "TTSREPL1" | snapshot size (64) | snapshot | packet | packet | ..
+ *
+ * The replica sends the magic back once the snapshot is loaded, the packets
+ * follow only then. Packets are appended to a backlog shared by all the
+ * replicas, each one served by a thread of its own from its offset in the
+ * stream, they're woken up once per batch of requests handled. A replica
+ * falling behind by more than the size of the backlog is dropped, it
+ * bootstraps again from a new snapshot once reconnected; the packets
+ * appended till it acknowledges its snapshot are kept for it whatever their
+ * size though, so a snapshot taking long to send and load doesn't get the
+ * replica dropped right away, over and over.
+ */
+
+#define TTS_REPLICATION_MAGIC        "TTSREPL1"
+#define TTS_REPLICATION_MAX_REPLICAS 16
+
+struct tts_database;
+struct tts_packet;
+struct tts_replication;
+struct tts_subscriptions;
+
+/*
+ * A replica connected to the primary, `offset` is the position in the stream
+ * of the next byte to send it, meaningful once its snapshot is taken,
+ * `acked` the end of the stream when it acknowledged the snapshot, only
+ * the bytes appended past it count as its lag
+ */
+struct tts_replication_slot {
+    struct tts_replication *repl;
+    pthread_t thread;
+    int fd;
+    int state;
+    int dropped;
+    uint64_t offset;
+    uint64_t acked;
+};
+
+/*
+ * Primary side, `base` is the position in the stream of the first byte of
+ * the backlog, `replicas` the number of replicas past their snapshot,
+ * nothing is appended without any. `pending` tells packets have been appended since the
+ * replicas were last woken up.
+ */
+struct tts_replication {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    int fd;
+    _Atomic int running;
+    int pending;
+    struct tts_database *db;
+    unsigned replicas;
+    struct tts_replication_slot slots[TTS_REPLICATION_MAX_REPLICAS];
+    uint64_t base;
+    size_t size;
+    size_t capacity;
+    size_t max_size;
+    uint8_t *buf;
+};
+
+/*
+ * Replica side, the database is replaced by the snapshot sent by the primary
+ * on every connection, `snapshot` is the mapping of the last one, it must
+ * outlive the timeseries loaded from it. `size` bytes of the stream are
+ * buffered in `buf`, the last packet possibly incomplete. Points replicated
+ * are fed to the subscriptions of the replica, `subs`.
+ */
+struct tts_replica {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    _Atomic int running;
+    _Atomic int connected;
+    struct tts_database *db;
+    struct tts_subscriptions *subs;
+    char host[0xFF];
+    struct tts_connect_options opts;
+    tts_client client;
+    struct tts_snapshot snapshot;
+    struct tts_arena arena;
+    size_t size;
+    size_t capacity;
+    uint8_t *buf;
+};
+
+int tts_replication_start(struct tts_replication *, struct tts_database *,
+                          const char *, int, size_t);
+void tts_replication_append(struct tts_replication *,
+                            const struct tts_packet *);
+void tts_replication_flush(struct tts_replication *);
+void tts_replication_stop(struct tts_replication *);
+
+int tts_replica_start(struct tts_replica *, struct tts_database *,
+                      struct tts_subscriptions *, const char *);
+void tts_replica_stop(struct tts_replica *);
+
+#endif
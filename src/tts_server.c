@@ -26,8 +26,15 @@
  */
 
 #include <stdio.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #define EV_SOURCE
 #define EV_TCP_SOURCE
 #include "ev_tcp.h"
@@ -36,50 +43,543 @@
 #include "tts_server.h"
 #include "tts_handlers.h"
 #include "tts_protocol.h"
+#include "tts_snapshot.h"
+#include "tts_kernel.h"
+#include "tts_arena.h"
+#include "tts_stats.h"
+#include "tts_cluster.h"
+#include "tts_replication.h"
+#include "tts_subscription.h"
 
 #define BACKLOG 128
 
+/*
+ * Period of the retention sweeper in nanoseconds, every run sweeps a single
+ * shard, so the whole keyspace is swept every TTS_DB_SHARDS periods
+ */
+#define RETENTION_SWEEP_PERIOD 100000000LL
+
+/*
+ * Closed connections kept by each worker to be reused by the next ones, their
+ * buffers are shrunk back to this size if they've grown larger
+ */
+#define CONNECTION_POOL_SIZE   64
+#define CONNECTION_BUFSIZE_MAX (EV_TCP_BUFSIZE * 8)
+
+/* Longest HTTP request accepted by the statistics endpoint */
+#define STATS_REQUEST_MAX 8192
+
 struct tts_server tts_server;
 
+/*
+ * Connected client wrapper, the handle buffer carries the incoming stream of
+ * bytes while responses are batched into a dedicated list of buffers, written
+ * out by a single gather write. A range query response can be streamed out
+ * in multiple writes, requests pipelined after it are held till it's over
+ */
+/*
+ * Requests received on a connection are decoded into its arena, released as
+ * a whole once each one is handled, in the wire format negotiated by the
+ * client, tracked by the codec. `peer` is set on connections from the other
+ * nodes of a cluster, whose requests are always handled locally. A request
+ * forwarded to them by this node sets `forward` till they answer, the
+ * requests pipelined after it are held the same way, `forwarded` is the
+ * clock it was received at. Results of its subscriptions, if any, are queued
+ * to `subscriber`
+ */
+struct tts_connection {
+    ev_tcp_handle handle;
+    ev_buf_list out;
+    struct tts_stream stream;
+    struct tts_arena arena;
+    struct tts_codec codec;
+    struct tts_subscriber subscriber;
+    struct tts_worker *worker;
+    struct tts_connection *next;
+    struct tts_cluster_forward *forward;
+    uint64_t forwarded;
+    int peer;
+};
+
+/*
+ * Worker wrapper, every worker runs its own event loop and listening socket
+ * bound on the same address, the kernel spreads the incoming connections
+ * among them, each connection is then served by a single worker for all its
+ * lifetime. The keyspace is shared, guarded by the shards locks.
+ * Closed connections are pooled by the worker, with their buffers and arena,
+ * so short-lived clients don't go through the allocator on every connect.
+ * Every worker records its own counters into `stats`, and keeps its own
+ * connections to the other nodes of the cluster, if any, into `links`. The
+ * subscribers among its connections with results queued are posted to its
+ * `mailbox`.
+ */
+struct tts_worker {
+    pthread_t thread;
+    ev_context *ctx;
+    ev_tcp_server server;
+    struct tts_connection *pool;
+    size_t pool_len;
+    struct tts_stats *stats;
+    struct tts_cluster_links links;
+    struct tts_mailbox mailbox;
+};
+
+/*
+ * Shrink a buffer grown past CONNECTION_BUFSIZE_MAX back to the default size,
+ * before pooling it
+ */
+static void connection_buf_shrink(ev_buf *buf) {
+    if (buf->capacity <= CONNECTION_BUFSIZE_MAX)
+        return;
+    buf->capacity = EV_TCP_BUFSIZE;
+    buf->buf = realloc(buf->buf, buf->capacity);
+}
+
+static void connection_free(struct tts_connection *conn) {
+    tts_subscriber_destroy(&conn->subscriber);
+    tts_arena_destroy(&conn->arena);
+    ev_buf_list_free(&conn->out);
+    free(conn->handle.buffer.buf);
+    free(conn);
+}
+
+/*
+ * Give a connection back to the pool of its worker, or release it if the pool
+ * is full, only the first buffer of the output list is kept
+ */
+static void connection_put(struct tts_connection *conn) {
+    struct tts_worker *worker = conn->worker;
+    if (worker->pool_len == CONNECTION_POOL_SIZE) {
+        connection_free(conn);
+        return;
+    }
+    for (size_t i = 1; i < conn->out.capacity; ++i) {
+        free(conn->out.bufs[i].buf);
+        conn->out.bufs[i] = (ev_buf) { 0, 0, NULL };
+    }
+    ev_buf_list_reset(&conn->out);
+    if (conn->out.capacity > 0)
+        connection_buf_shrink(&conn->out.bufs[0]);
+    connection_buf_shrink(&conn->handle.buffer);
+    tts_arena_reset(&conn->arena);
+    conn->next = worker->pool;
+    worker->pool = conn;
+    worker->pool_len++;
+}
+
 static void on_close(ev_tcp_handle *client, int err) {
-    (void) client;
+    struct tts_connection *conn = (struct tts_connection *) client;
     if (err == EV_TCP_SUCCESS)
         log_debug("Closed connection with %s:%i", client->addr, client->port);
     else
         log_debug("Connection closed: %s", ev_tcp_err(err));
-    free(client);
+    tts_stream_close(&conn->stream);
+    if (conn->forward) {
+        tts_cluster_forward_release(conn->forward);
+        conn->forward = NULL;
+    }
+    tts_subscriber_close(&conn->subscriber, tts_server.subs);
+    tts_codec_destroy(&conn->codec);
+    tts_stats_add(&conn->worker->stats->disconnections, 1);
+    connection_put(conn);
 }
 
-static void on_write(ev_tcp_handle *client) {
-    log_debug("Written %lu bytes to %s:%i",
-              client->to_write, client->addr, client->port);
+static inline int is_change(const struct tts_packet *packet) {
+    return packet->header.opcode == TTS_CREATE_TS ||
+        packet->header.opcode == TTS_DELETE_TS ||
+        packet->header.opcode == TTS_ADDPOINTS ||
+        packet->header.opcode == TTS_MADDPOINTS;
 }
 
-static void on_data(ev_tcp_handle *client) {
+/*
+ * Replicas are read-only, the requests changing the database are answered
+ * with an unknown command ACK, as a server not supporting them would
+ */
+static void refuse_change(struct tts_payload *payload) {
+    struct tts_packet response = {0};
+    TTS_SET_RESPONSE_HEADER(&response, TTS_ACK, TTS_UNKNOWN_CMD);
+    tts_handle_response(payload, &response);
+}
+
+static void on_forwarded(struct tts_cluster_forward *, void *);
+static void connection_resume(struct tts_connection *);
+
+/*
+ * Handle all the complete requests received, framing packets by the length
+ * carried in their header, a single read can carry multiple pipelined
+ * requests, the last of them possibly incomplete, its bytes are left in the
+ * buffer till the rest arrives. Responses are all written out at once, the
+ * changes logged to the write-ahead log are written out right before them.
+ * Each request is timed from its decoding to its response being packed.
+ * A request larger than max_frame_size, refused as soon as its header is in,
+ * or one malformed closes the connection, as the stream can't be framed past
+ * it anymore.
+ */
+static void handle_requests(struct tts_connection *conn) {
+    ev_tcp_handle *client = &conn->handle;
+    struct tts_stats *stats = conn->worker->stats;
+    struct tts_payload payload = {
+        .out = &conn->out,
+        .tts_db = tts_server.db,
+        .stream = &conn->stream,
+        .wal = tts_server.wal,
+        .repl = tts_server.repl,
+        .subs = tts_server.subs,
+        .subscriber = &conn->subscriber,
+        .codec = &conn->codec,
+        .stats = tts_server.stats,
+        .stats_nr = tts_server.workers_nr
+    };
+    uint8_t *buf = (uint8_t *) client->buffer.buf;
+    size_t offset = 0, max = (size_t) conf->max_frame_size << 20;
+    ssize_t len = 0;
+    uint64_t start = 0;
+    const char *refused = "larger than max_frame_size";
+    while (conn->stream.active == 0 && !conn->forward &&
+           (len = tts_packet_frame_len(buf + offset,
+                                       client->buffer.size - offset,
+                                       max)) > 0) {
+        start = tts_stats_clock();
+        if (tts_codec_unpack(&conn->codec, buf + offset,
+                             &payload.packet, &conn->arena) < 0) {
+            tts_arena_reset(&conn->arena);
+            refused = "malformed";
+            len = -1;
+            break;
+        }
+        if (payload.packet.header.opcode == TTS_HELLO &&
+            (payload.packet.hello.version & TTS_HELLO_PEER))
+            conn->peer = 1;
+        if (tts_server.replica && is_change(&payload.packet))
+            refuse_change(&payload);
+        else if (!tts_server.cluster || conn->peer ||
+                 tts_cluster_route(&conn->worker->links, &payload,
+                                   on_forwarded, conn, &conn->forward) == 0)
+            tts_handle_packet(&payload);
+        tts_arena_reset(&conn->arena);
+        if (conn->forward)
+            conn->forwarded = start;
+        else
+            tts_histogram_record(&stats->requests[payload.packet.header.opcode],
+                                 tts_stats_clock() - start);
+        offset += len;
+    }
+    tts_stats_add(&stats->bytes_in, offset);
+    client->buffer.size -= offset;
+    memmove(buf, buf + offset, client->buffer.size);
+    if (len < 0) {
+        log_warning("Request from %s:%i %s, closing the connection",
+                    client->addr, client->port, refused);
+        client->buffer.size = 0;
+        shutdown(client->c->fd, SHUT_RDWR);
+    }
+    if (tts_server.wal && offset > 0)
+        tts_wal_flush(tts_server.wal);
+    if (tts_server.repl && offset > 0)
+        tts_replication_flush(tts_server.repl);
+    /*
+     * Held while a request is forwarded, to go out along with its response,
+     * or the first of the results it relays
+     */
+    if (conn->forward)
+        connection_resume(conn);
+    else if (conn->out.size > 0)
+        ev_tcp_enqueue_write(client);
+}
+
+/*
+ * Pack the results queued to the subscriptions of a connection, only if
+ * nothing is being written out, otherwise they're packed once it's done, so
+ * they wait for a slow client in the queue of the subscriber, which is
+ * bounded, and never pile up into the output. Subscribers falling behind are
+ * shut down, the connection is closed as the read of its end comes, as it
+ * can be called right before the loop goes back to reading it
+ */
+static void connection_push(struct tts_connection *conn) {
     struct tts_payload payload = {
-        .buf = &client->buffer,
-        .tts_db = tts_server.db
+        .out = &conn->out,
+        .subscriber = &conn->subscriber,
+        .codec = &conn->codec
     };
-    unpack_tts_packet((uint8_t *) client->buffer.buf, &payload.packet);
-    int err = tts_handle_packet(&payload);
-    if (err == TTS_OK)
+    if (!conn->subscriber.subscriptions || conn->stream.active == 1 ||
+        conn->out.len > 0)
+        return;
+    if (tts_handle_subscriber(&payload) < 0) {
+        log_warning("Subscriber %s:%i fell behind, closing the connection",
+                    conn->handle.addr, conn->handle.port);
+        ev_buf_list_reset(&conn->out);
+        shutdown(conn->handle.c->fd, SHUT_RDWR);
+        return;
+    }
+    if (conn->out.size > 0)
+        ev_tcp_enqueue_write(&conn->handle);
+}
+
+/*
+ * Pack the response of a request forwarded to other nodes once it's put
+ * together, right after the responses held waiting for it, only if nothing
+ * is being written out, otherwise it's packed once it's done, then go on
+ * with the requests received in the meanwhile. The results relayed are
+ * written out as they come the same way, the response is over with the last
+ */
+static void connection_resume(struct tts_connection *conn) {
+    struct tts_cluster_forward *forward = conn->forward;
+    struct tts_payload payload = {
+        .out = &conn->out,
+        .codec = &conn->codec
+    };
+    if (conn->handle.to_write > 0)
+        return;
+    if (forward->relay) {
+        if (tts_cluster_forward_take(forward, &conn->out) == 0) {
+            if (conn->out.size > 0)
+                ev_tcp_enqueue_write(&conn->handle);
+            return;
+        }
+    } else if (!forward->done) {
+        return;
+    } else {
+        tts_handle_response(&payload, &forward->response);
+    }
+    tts_histogram_record(
+        &conn->worker->stats->requests[forward->request.header.opcode],
+        tts_stats_clock() - conn->forwarded);
+    tts_cluster_forward_release(forward);
+    conn->forward = NULL;
+    handle_requests(conn);
+}
+
+static void on_forwarded(struct tts_cluster_forward *forward, void *data) {
+    (void) forward;
+    connection_resume(data);
+}
+
+/*
+ * Woken up by the workers feeding the subscriptions, the subscribers posted
+ * are taken off the mailbox all at once
+ */
+static void on_subscribers(ev_context *ctx, void *data) {
+    (void) ctx;
+    struct tts_worker *worker = data;
+    struct tts_subscriber *sub = tts_mailbox_take(&worker->mailbox), *next;
+    for (; sub; sub = next) {
+        next = tts_mailbox_next(&worker->mailbox, sub);
+        connection_push((struct tts_connection *)
+                        ((char *) sub -
+                         offsetof(struct tts_connection, subscriber)));
+    }
+}
+
+static void on_write(ev_tcp_handle *client) {
+    struct tts_connection *conn = (struct tts_connection *) client;
+    struct tts_payload payload = {
+        .out = &conn->out,
+        .tts_db = tts_server.db,
+        .stream = &conn->stream,
+        .codec = &conn->codec
+    };
+    ev_buf_list_reset(&conn->out);
+    if (client->err > 0)
+        tts_stats_add(&conn->worker->stats->bytes_out, client->err);
+    log_debug("Written %i bytes to %s:%i",
+              client->err, client->addr, client->port);
+    /*
+     * A streamed response is going on, the next frame is packed only now
+     * that the previous one is out, so a slow client never makes it pile up
+     * in memory
+     */
+    if (conn->stream.active == 1) {
+        tts_handle_stream(&payload);
         ev_tcp_enqueue_write(client);
-    tts_packet_destroy(&payload.packet);
+        return;
+    }
+    /*
+     * A partial packet could be pending in the incoming bytes, or the
+     * response of a forwarded request
+     */
+    if (conn->forward)
+        connection_resume(conn);
+    else
+        handle_requests(conn);
+    connection_push(conn);
 }
 
+static void on_data(ev_tcp_handle *client) {
+    handle_requests((struct tts_connection *) client);
+}
+
+/*
+ * The listening handle is the one of the worker server, each connection is
+ * taken from the pool of the worker if any is left, or allocated zeroed
+ */
 static void on_connection(ev_tcp_handle *server) {
     int err = 0;
-    ev_tcp_handle *client = malloc(sizeof(*client));
+    struct tts_worker *worker = (struct tts_worker *)
+        ((char *) server - offsetof(struct tts_worker, server));
+    struct tts_connection *conn = worker->pool;
+    if (conn) {
+        worker->pool = conn->next;
+        worker->pool_len--;
+    } else {
+        conn = calloc(1, sizeof(*conn));
+        tts_arena_init(&conn->arena);
+        tts_subscriber_init(&conn->subscriber, &worker->mailbox);
+        conn->worker = worker;
+    }
+    ev_tcp_handle *client = &conn->handle;
     if ((err = ev_tcp_server_accept(server, client, on_data, on_write)) < 0) {
             log_error("Error occured: %s",
                       err == -1 ? strerror(errno) : ev_tcp_err(err));
-        free(client);
+        connection_put(conn);
     } else {
         log_debug("New connection from %s:%i", client->addr, client->port);
+        tts_stats_add(&worker->stats->connections, 1);
+        ev_buf_list_reset(&conn->out);
+        client->out = &conn->out;
+        conn->stream.active = 0;
+        conn->stream.ts_name = NULL;
+        conn->stream.pattern = NULL;
+        conn->stream.filters_nr = 0;
+        conn->stream.filters = NULL;
+        conn->peer = 0;
+        conn->forward = NULL;
+        /*
+         * Responses of forwarded requests and frames of streamed ones are
+         * written one at a time, without waiting on the ACK of the last
+         */
+        if (conf->mode == TTS_AF_INET)
+            (void) setsockopt(client->c->fd, IPPROTO_TCP, TCP_NODELAY,
+                              &(int){ 1 }, sizeof(int));
+        tts_codec_init(&conn->codec);
         ev_tcp_handle_set_on_close(client, on_close);
     }
 }
 
+/*
+ * Statistics endpoint, an HTTP/1.0 server exposing the report of the
+ * statistics to Prometheus, run by the first worker. Every request gets the
+ * whole report, a `series` parameter, e.g. `/metrics?series=cpu.*`, selects
+ * the timeseries to report one by one, none are without it. The connection
+ * is shut down once the response is written out, it's closed as the client
+ * closes its side.
+ */
+struct stats_connection {
+    ev_tcp_handle handle;
+    int answered;
+};
+
+static inline int hex_digit(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    c |= 0x20;
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+/*
+ * Copy the value of the `series` parameter of the query of a request target
+ * into `pattern`, percent-decoded, return 0 if there's none
+ */
+static int stats_pattern(const char *target, size_t len, char *pattern) {
+    const char *query = memchr(target, '?', len), *end = target + len;
+    size_t n = 0;
+    while (query && query < end) {
+        ++query;
+        if (end - query > 7 && strncmp(query, "series=", 7) == 0)
+            break;
+        query = memchr(query, '&', end - query);
+    }
+    if (!query || query >= end)
+        return 0;
+    for (query += 7; query < end && *query != '&' &&
+         n + 1 < TTS_TS_NAME_MAX_LENGTH; ++query) {
+        if (*query == '%' && end - query > 2 &&
+            hex_digit(query[1]) >= 0 && hex_digit(query[2]) >= 0) {
+            pattern[n++] = hex_digit(query[1]) << 4 | hex_digit(query[2]);
+            query += 2;
+        } else {
+            pattern[n++] = *query == '+' ? ' ' : *query;
+        }
+    }
+    pattern[n] = '\0';
+    return n > 0;
+}
+
+static void stats_respond(ev_tcp_handle *client, const char *status,
+                          const char *body, size_t len) {
+    ev_buf *buf = &client->buffer;
+    int n = snprintf(NULL, 0, "HTTP/1.0 %s\r\nContent-Type: text/plain; "
+                     "version=0.0.4\r\nContent-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n", status, len);
+    if (buf->capacity < n + len + 1) {
+        buf->capacity = n + len + 1;
+        buf->buf = realloc(buf->buf, buf->capacity);
+    }
+    snprintf(buf->buf, n + 1, "HTTP/1.0 %s\r\nContent-Type: text/plain; "
+             "version=0.0.4\r\nContent-Length: %zu\r\n"
+             "Connection: close\r\n\r\n", status, len);
+    memcpy(buf->buf + n, body, len);
+    buf->size = n + len;
+    ev_tcp_enqueue_write(client);
+}
+
+/*
+ * Answer once the headers of the request are all in, reads always leave a
+ * byte spare in the buffer, to terminate it
+ */
+static void on_stats_data(ev_tcp_handle *client) {
+    struct stats_connection *conn = (struct stats_connection *) client;
+    char *buf = client->buffer.buf, *target = NULL;
+    char pattern[TTS_TS_NAME_MAX_LENGTH];
+    struct tts_report report;
+    if (conn->answered == 1) {
+        client->buffer.size = 0;
+        return;
+    }
+    buf[client->buffer.size] = '\0';
+    if (!strstr(buf, "\r\n\r\n") && !strstr(buf, "\n\n")) {
+        if (client->buffer.size >= STATS_REQUEST_MAX)
+            ev_tcp_enqueue_close(client);
+        return;
+    }
+    conn->answered = 1;
+    if (strncmp(buf, "GET ", 4) != 0) {
+        stats_respond(client, "405 Method Not Allowed", "", 0);
+        return;
+    }
+    target = buf + 4;
+    tts_report_init(&report);
+    tts_stats_report(&report, tts_server.stats, tts_server.workers_nr,
+                     tts_server.db,
+                     stats_pattern(target, strcspn(target, " \r\n"),
+                                   pattern) ? pattern : "");
+    stats_respond(client, "200 OK", report.text, report.size);
+    tts_report_destroy(&report);
+}
+
+static void on_stats_write(ev_tcp_handle *client) {
+    shutdown(client->c->fd, SHUT_WR);
+}
+
+static void on_stats_close(ev_tcp_handle *client, int err) {
+    (void) err;
+    free(client->buffer.buf);
+    free(client);
+}
+
+static void on_stats_connection(ev_tcp_handle *server) {
+    struct stats_connection *conn = calloc(1, sizeof(*conn));
+    int err = ev_tcp_server_accept(server, &conn->handle,
+                                   on_stats_data, on_stats_write);
+    if (err < 0) {
+        log_error("Error occured: %s",
+                  err == -1 ? strerror(errno) : ev_tcp_err(err));
+        free(conn->handle.buffer.buf);
+        free(conn);
+        return;
+    }
+    ev_tcp_handle_set_on_close(&conn->handle, on_stats_close);
+}
+
 static void ts_destroy(struct tts_timeseries *tss) {
     struct tts_timeseries *ts, *tmp;
     HASH_ITER(hh, tss, ts, tmp) {
@@ -88,35 +588,314 @@ static void ts_destroy(struct tts_timeseries *tss) {
     }
 }
 
-int tts_start_server(const char *host, int port) {
+/*
+ * Retention sweeper, periodically run on the main event loop, it releases the
+ * points expired of every timeseries of a shard, moving to the next shard on
+ * the next run. Retention is applied as points are added by just moving the
+ * cutoff of the timeseries forward, actually freeing the memory is left to
+ * this task, off the write and query paths.
+ */
+static void tts_retention_sweep(ev_context *ctx, void *data) {
+    (void) ctx;
+    size_t *next = data;
+    struct tts_shard *shard = &tts_server.db->shards[*next];
+    struct tts_timeseries *ts, *tmp;
+    uint64_t start = tts_stats_clock();
+    pthread_mutex_lock(&shard->lock);
+    HASH_ITER(hh, shard->timeseries, ts, tmp)
+        tts_timeseries_trim(ts);
+    pthread_mutex_unlock(&shard->lock);
+    /* The sweeper runs on the first worker, it records into its counters */
+    tts_histogram_record(&tts_server.stats[0].sweep,
+                         tts_stats_clock() - start);
+    *next = (*next + 1) & (TTS_DB_SHARDS - 1);
+}
+
+/*
+ * Periodic snapshot, run on the main event loop, a new snapshot is written by
+ * a forked child, unless the previous one is still running
+ */
+static void tts_snapshot_cron(ev_context *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    int status = 0;
+    if (tts_server.snapshot_pid > 0) {
+        if (waitpid(tts_server.snapshot_pid, &status, WNOHANG) == 0)
+            return;
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+            log_error("Background snapshot failed");
+        else if (tts_server.wal)
+            tts_wal_compact(tts_server.wal, &tts_server.snapshot_wal);
+        tts_server.snapshot_pid = -1;
+    }
+    tts_server.snapshot_pid =
+        tts_snapshot_save_background(tts_server.db, conf->snapshot_path,
+                                     tts_server.wal,
+                                     &tts_server.snapshot_wal);
+}
+
+/*
+ * Group commit of the write-ahead log, everything written since the last
+ * run is synced to disk at once; a log failed is written again, every
+ * second in sync mode
+ */
+static void tts_wal_cron(ev_context *ctx, void *data) {
+    (void) ctx;
+    (void) data;
+    tts_wal_sync(tts_server.wal);
+}
+
+static void tts_worker_on_cycle(ev_context *ctx, long long ns, void *data) {
+    (void) ctx;
+    struct tts_worker *worker = data;
+    tts_histogram_record(&worker->stats->loop, ns);
+}
+
+static void tts_worker_init(struct tts_worker *worker, ev_context *ctx,
+                            struct tts_stats *stats,
+                            const char *host, int port) {
     int err = 0;
-    tts_server.db = malloc(sizeof(struct tts_database));
-    tts_server.db->timeseries = NULL;
-    ev_context *ctx = ev_get_ev_context();
-    ev_tcp_server server;
-    ev_tcp_server_init(&server, ctx, BACKLOG);
+    worker->ctx = ctx;
+    worker->pool = NULL;
+    worker->pool_len = 0;
+    worker->stats = stats;
+    if (tts_server.cluster)
+        tts_cluster_links_init(&worker->links, tts_server.cluster, ctx);
+    if (tts_mailbox_init(&worker->mailbox) < 0)
+        log_fatal("Error occured: %s\n", strerror(errno));
+    ev_register_event(ctx, worker->mailbox.fd, EV_CLOSEFD|EV_READ,
+                      on_subscribers, worker);
+    ev_set_on_cycle(ctx, tts_worker_on_cycle, worker);
+    ev_tcp_server_init(&worker->server, ctx, BACKLOG);
     if (conf->mode == TTS_AF_INET)
-        err = ev_tcp_server_listen(&server, host, port, on_connection);
+        err = ev_tcp_server_listen(&worker->server, host, port, on_connection);
     else if (conf->mode == TTS_AF_UNIX)
-        err = ev_tcp_server_listen_unix(&server, conf->host, on_connection);
+        err = ev_tcp_server_listen_unix(&worker->server,
+                                        conf->host, on_connection);
     if (err < 0) {
         if (err == -1)
             log_fatal("Error occured: %s\n", strerror(errno));
         else
             log_fatal("Error occured: %s\n", ev_tcp_err(err));
     }
+}
+
+static void *tts_worker_run(void *arg) {
+    struct tts_worker *worker = arg;
+    // Blocking call
+    ev_tcp_server_run(&worker->server);
+    return NULL;
+}
+
+/*
+ * Wake up a worker loop to make it stop, the same way `ev_tcp_server_stop`
+ * does, the loop returns at the next cycle
+ */
+static void tts_worker_wakeup(struct tts_worker *worker) {
+#if defined(EPOLL) || defined(__linux__)
+    eventfd_write(worker->server.run, 1);
+#else
+    (void) write(worker->server.run[0],
+                 &(unsigned long){1}, sizeof(unsigned long));
+#endif
+}
+
+int tts_start_server(const char *host, int port) {
+    /*
+     * A UNIX socket path can't be shared among multiple listening sockets,
+     * a single worker is used in that case
+     */
+    int workers_nr = conf->mode == TTS_AF_UNIX ? 1 : conf->workers;
+    size_t sweep_shard = 0;
+    struct tts_worker *workers = calloc(workers_nr, sizeof(*workers));
+    ev_tcp_server stats_server;
+    tts_kernel_init();
+    tts_server.stats = tts_stats_new(workers_nr);
+    tts_server.workers_nr = workers_nr;
+    tts_server.cluster = NULL;
+    if (conf->cluster_nodes[0]) {
+        char self[0xFFF];
+        if (conf->cluster_self[0])
+            snprintf(self, sizeof(self), "%s", conf->cluster_self);
+        else
+            snprintf(self, sizeof(self), "%s:%i", host, port);
+        tts_server.cluster = malloc(sizeof(*tts_server.cluster));
+        if (tts_cluster_init(tts_server.cluster, conf->cluster_nodes,
+                             self) < 0)
+            log_fatal("Unable to set up the cluster");
+        /* A peer going away must not take this node down on a write */
+        signal(SIGPIPE, SIG_IGN);
+        log_info("Cluster node %u of %u", tts_server.cluster->self + 1,
+                 tts_server.cluster->nodes_nr);
+    }
+    for (int i = 0; i < TTS_ROLLUP_TIERS; ++i)
+        tts_rollup_tiers[i].retention =
+            conf->rollup_retention[i] * (tts_timestamp) 1e9;
+    tts_server.db = malloc(sizeof(struct tts_database));
+    for (int i = 0; i < TTS_DB_SHARDS; ++i) {
+        pthread_mutex_init(&tts_server.db->shards[i].lock, NULL);
+        tts_server.db->shards[i].timeseries = NULL;
+        tts_labels_init(&tts_server.db->shards[i].labels);
+    }
+    tts_names_init(&tts_server.db->names);
+    tts_server.snapshot_pid = -1;
+    tts_server.snapshot.map = NULL;
+    tts_server.snapshot.size = 0;
+    /*
+     * A replica is loaded from its primary on every start, a snapshot or a
+     * log of its own would only be replaced
+     */
+    if (conf->replica_of[0] && (conf->snapshot_path[0] || conf->wal_path[0])) {
+        log_warning("Persistence is disabled on replicas");
+        conf->snapshot_path[0] = conf->wal_path[0] = '\0';
+    }
+    /*
+     * Warm restart, the last snapshot is mapped and served as it is, points
+     * are paged in lazily as they're queried
+     */
+    if (conf->snapshot_path[0])
+        tts_snapshot_load(tts_server.db, conf->snapshot_path,
+                          &tts_server.snapshot);
+    /*
+     * Then the changes following the snapshot are replayed from the
+     * write-ahead log
+     */
+    tts_server.wal = NULL;
+    if (conf->wal_path[0]) {
+        tts_server.wal = malloc(sizeof(*tts_server.wal));
+        if (tts_wal_open(tts_server.wal, conf->wal_path,
+                         conf->wal_fsync_interval == 0, tts_server.db,
+                         tts_server.snapshot.map ?
+                         &tts_server.snapshot.wal : NULL) < 0)
+            log_fatal("Unable to open the write-ahead log");
+    }
+
+    tts_server.subs = malloc(sizeof(*tts_server.subs));
+    tts_subscriptions_init(tts_server.subs);
+
+    tts_server.repl = NULL;
+    tts_server.replica = NULL;
+    if (conf->replica_of[0]) {
+        tts_server.replica = malloc(sizeof(*tts_server.replica));
+        if (tts_replica_start(tts_server.replica, tts_server.db,
+                              tts_server.subs, conf->replica_of) < 0)
+            log_fatal("Unable to replicate %s", conf->replica_of);
+    } else if (conf->replication_port > 0) {
+        tts_server.repl = malloc(sizeof(*tts_server.repl));
+        if (tts_replication_start(tts_server.repl, tts_server.db, host,
+                                  conf->replication_port,
+                                  (size_t) conf->replication_backlog << 20) < 0)
+            log_fatal("Unable to serve the replicas");
+    }
+
+    /*
+     * The first worker runs on the main thread with the default context, the
+     * one handling SIGINT and SIGTERM, all the others get their own context
+     * and thread
+     */
+    tts_worker_init(&workers[0], ev_get_ev_context(), &tts_server.stats[0],
+                    host, port);
+    ev_register_cron(workers[0].ctx, tts_retention_sweep, &sweep_shard,
+                     0, RETENTION_SWEEP_PERIOD);
+    if (conf->snapshot_path[0] && conf->snapshot_interval > 0)
+        ev_register_cron(workers[0].ctx, tts_snapshot_cron, NULL,
+                         conf->snapshot_interval, 0);
+    if (tts_server.wal && conf->wal_fsync_interval > 0)
+        ev_register_cron(workers[0].ctx, tts_wal_cron, NULL,
+                         conf->wal_fsync_interval / 1000,
+                         (conf->wal_fsync_interval % 1000) * 1000000LL);
+    else if (tts_server.wal)
+        ev_register_cron(workers[0].ctx, tts_wal_cron, NULL, 1, 0);
+    if (conf->stats_port > 0) {
+        ev_tcp_server_init(&stats_server, workers[0].ctx, BACKLOG);
+        if (ev_tcp_server_listen(&stats_server, host, conf->stats_port,
+                                 on_stats_connection) < 0)
+            log_fatal("Error occured: %s\n", strerror(errno));
+    }
+    for (int i = 1; i < workers_nr; ++i) {
+        ev_context *ctx = malloc(sizeof(*ctx));
+        ev_init(ctx, EVENTLOOP_MAX_EVENTS);
+        tts_worker_init(&workers[i], ctx, &tts_server.stats[i], host, port);
+        if (pthread_create(&workers[i].thread, NULL,
+                           tts_worker_run, &workers[i]) != 0)
+            log_fatal("Error occured: %s\n", strerror(errno));
+    }
 
-    log_debug("Listening on %s:%i", host, port);
+    log_debug("Listening on %s:%i with %i workers", host, port, workers_nr);
 
     // Blocking call
-    ev_tcp_server_run(&server);
+    tts_worker_run(&workers[0]);
+
+    // The main loop has been stopped by a SIGINT|SIGTERM, stop the others
+    for (int i = 1; i < workers_nr; ++i) {
+        tts_worker_wakeup(&workers[i]);
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    if (tts_server.repl) {
+        tts_replication_stop(tts_server.repl);
+        free(tts_server.repl);
+    }
+    if (tts_server.replica)
+        tts_replica_stop(tts_server.replica);
+
+    if (conf->stats_port > 0)
+        ev_tcp_server_stop(&stats_server);
+    for (int i = 0; i < workers_nr; ++i) {
+        ev_tcp_server_stop(&workers[i].server);
+        while (workers[i].pool) {
+            struct tts_connection *conn = workers[i].pool;
+            workers[i].pool = conn->next;
+            connection_free(conn);
+        }
+        if (tts_server.cluster)
+            tts_cluster_links_destroy(&workers[i].links);
+        if (i > 0) {
+            ev_destroy(workers[i].ctx);
+            free(workers[i].ctx);
+        }
+        tts_mailbox_destroy(&workers[i].mailbox);
+    }
+    tts_subscriptions_destroy(tts_server.subs);
+    free(tts_server.subs);
+    if (tts_server.cluster) {
+        tts_cluster_destroy(tts_server.cluster);
+        free(tts_server.cluster);
+    }
 
-    // This could be registered to a SIGINT|SIGTERM signal notification
-    // to stop the server with Ctrl+C
-    ev_tcp_server_stop(&server);
+    /*
+     * All the loops are stopped, a last snapshot is written in foreground
+     * once a background one still running is done
+     */
+    if (tts_server.snapshot_pid > 0)
+        waitpid(tts_server.snapshot_pid, NULL, 0);
+    if (conf->snapshot_path[0]) {
+        struct tts_wal_position pos = { .gen = 0, .offset = 0 };
+        if (tts_server.wal)
+            tts_wal_position(tts_server.wal, &pos);
+        if (tts_snapshot_save(tts_server.db, conf->snapshot_path, &pos) == 0
+            && tts_server.wal)
+            tts_wal_compact(tts_server.wal, &pos);
+    }
+    if (tts_server.wal) {
+        tts_wal_close(tts_server.wal);
+        free(tts_server.wal);
+    }
 
-    ts_destroy(tts_server.db->timeseries);
+    for (int i = 0; i < TTS_DB_SHARDS; ++i) {
+        ts_destroy(tts_server.db->shards[i].timeseries);
+        tts_labels_destroy(&tts_server.db->shards[i].labels);
+        pthread_mutex_destroy(&tts_server.db->shards[i].lock);
+    }
+    tts_names_destroy(&tts_server.db->names);
     free(tts_server.db);
+    free(workers);
+    tts_stats_free(tts_server.stats);
+    tts_snapshot_unmap(&tts_server.snapshot);
+    if (tts_server.replica) {
+        tts_snapshot_unmap(&tts_server.replica->snapshot);
+        free(tts_server.replica);
+    }
 
     return 0;
 }
@@ -28,13 +28,39 @@
 #ifndef TTS_SERVER_H
 #define TTS_SERVER_H
 
+#include "tts_wal.h"
+#include "tts_snapshot.h"
+
 struct tts_database;
+struct tts_stats;
+struct tts_cluster;
+struct tts_replication;
+struct tts_replica;
+struct tts_subscriptions;
 
 /*
- * Global server instance, still deciding if maintain it global
+ * Global server instance, still deciding if maintain it global, it tracks the
+ * snapshot the database has been loaded from, if any, the pid of the child
+ * writing a new one in background, -1 if none is running, with the position
+ * of the write-ahead log it covers. `wal` is NULL if the log is disabled.
+ * `stats` are the counters of each one of the `workers_nr` workers.
+ * `cluster` is NULL unless running as a node of a cluster. `repl` is NULL
+ * unless serving replicas, `replica` unless replicating a primary, the
+ * database is read-only for the clients then. `subs` are the subscriptions
+ * of all the connections.
  */
 struct tts_server {
     struct tts_database *db;
+    struct tts_wal *wal;
+    struct tts_snapshot snapshot;
+    pid_t snapshot_pid;
+    struct tts_wal_position snapshot_wal;
+    struct tts_stats *stats;
+    int workers_nr;
+    struct tts_cluster *cluster;
+    struct tts_replication *repl;
+    struct tts_replica *replica;
+    struct tts_subscriptions *subs;
 };
 
 extern struct tts_server tts_server;
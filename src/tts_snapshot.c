@@ -0,0 +1,540 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <errno.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tts.h"
+#include "pack.h"
+#include "tts_log.h"
+#include "tts_snapshot.h"
+
+#define SNAPSHOT_PAGE_SIZE     4096
+#define SNAPSHOT_MAGIC_LEN     8
+#define SNAPSHOT_HEADER_SIZE   (SNAPSHOT_MAGIC_LEN + 7 * sizeof(uint64_t))
+
+static const uint8_t zeros[SNAPSHOT_PAGE_SIZE] = {0};
+
+/*
+ * Growing buffer used to build the catalog while the chunks are written out,
+ * it's flushed to the file as a whole at the end
+ */
+struct catalog {
+    size_t size;
+    size_t capacity;
+    uint8_t *data;
+};
+
+static uint8_t *catalog_reserve(struct catalog *c, size_t len) {
+    if (c->size + len > c->capacity) {
+        while (c->size + len > c->capacity)
+            c->capacity *= 2;
+        c->data = realloc(c->data, c->capacity);
+    }
+    c->size += len;
+    return c->data + c->size - len;
+}
+
+static inline void catalog_u64(struct catalog *c, uint64_t value) {
+    packi64(catalog_reserve(c, sizeof(uint64_t)), value);
+}
+
+static inline void catalog_u16(struct catalog *c, uint16_t value) {
+    packi16(catalog_reserve(c, sizeof(uint16_t)), value);
+}
+
+/* Doubles are stored by their IEEE 754 bit pattern */
+static inline void catalog_double(struct catalog *c, double value) {
+    uint64_t bits = 0;
+    memcpy(&bits, &value, sizeof(bits));
+    catalog_u64(c, bits);
+}
+
+static inline void catalog_string(struct catalog *c, const char *str) {
+    size_t len = strlen(str);
+    catalog_u16(c, len);
+    memcpy(catalog_reserve(c, len), str, len);
+}
+
+/*
+ * Write `len` bytes to the snapshot file tracking the current offset
+ */
+static inline void snapshot_write(FILE *fp, const void *data,
+                                  size_t len, size_t *offset) {
+    fwrite(data, len, 1, fp);
+    *offset += len;
+}
+
+/* Zero-pad the snapshot file till the next page boundary */
+static void snapshot_align(FILE *fp, size_t *offset) {
+    size_t rem = *offset % SNAPSHOT_PAGE_SIZE;
+    if (rem > 0)
+        snapshot_write(fp, zeros, SNAPSHOT_PAGE_SIZE - rem, offset);
+}
+
+/*
+ * Write out a chunk appending its descriptor to the catalog, `start` is the
+ * offset of the data section
+ */
+static void snapshot_write_chunk(FILE *fp, struct catalog *c,
+                                 const struct tts_chunk *chunk,
+                                 size_t start, size_t *offset) {
+    catalog_u64(c, chunk->min_ts);
+    catalog_u64(c, chunk->max_ts);
+    catalog_u64(c, chunk->index);
+    catalog_u64(c, chunk->len);
+    catalog_u64(c, chunk->size);
+    catalog_u64(c, *offset - start);
+    snapshot_write(fp, chunk->data, chunk->size, offset);
+}
+
+static void snapshot_write_timeseries(FILE *fp, struct catalog *c,
+                                      const struct tts_timeseries *ts,
+                                      size_t start, size_t *offset) {
+    size_t head = TTS_VECTOR_SIZE(ts->timestamps) > 0 ? 1 : 0;
+    catalog_string(c, ts->name);
+    catalog_u64(c, ts->retention);
+    catalog_u64(c, ts->cutoff);
+    catalog_u64(c, TTS_VECTOR_SIZE(ts->chunks) + head);
+    catalog_u64(c, TTS_VECTOR_SIZE(ts->records));
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(ts->chunks); ++i)
+        snapshot_write_chunk(fp, c, &TTS_VECTOR_AT(ts->chunks, i),
+                             start, offset);
+    if (head == 1) {
+        // The head is sealed into a shorter chunk, just for the snapshot
+        struct tts_chunk chunk = { .index = ts->offset };
+        tts_chunk_encode(&chunk, ts->timestamps.data, ts->values.data,
+                         TTS_VECTOR_SIZE(ts->timestamps));
+        snapshot_write_chunk(fp, c, &chunk, start, offset);
+        free(chunk.data);
+    }
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(ts->records); ++i) {
+        const struct tts_record *record = &TTS_VECTOR_AT(ts->records, i);
+        catalog_u64(c, record->index);
+        catalog_u64(c, record->len);
+        *catalog_reserve(c, 1) = record->set->labels_nr;
+        for (size_t j = 0; j < record->set->labels_nr; ++j) {
+            catalog_string(c, record->set->labels[j].field->str);
+            catalog_string(c, record->set->labels[j].value->str);
+        }
+    }
+    /*
+     * Buckets of the tiers disabled are not kept up to date, they're left
+     * out so they're never served if the tier is enabled again
+     */
+    for (int i = 0; i < TTS_ROLLUP_TIERS; ++i) {
+        const struct tts_rollup *rollup = &ts->rollups[i];
+        size_t buckets_nr = tts_rollup_tiers[i].retention > 0 ?
+            TTS_VECTOR_SIZE(rollup->buckets) : 0;
+        catalog_u64(c, buckets_nr > 0 ? rollup->since : 0);
+        catalog_u64(c, buckets_nr);
+        for (size_t j = 0; j < buckets_nr; ++j) {
+            const struct tts_bucket *b = &TTS_VECTOR_AT(rollup->buckets, j);
+            catalog_u64(c, b->end);
+            catalog_u64(c, b->count);
+            catalog_double(c, b->sum);
+            /* The mean isn't kept anymore, it's written as it was */
+            catalog_double(c, b->sum / b->count);
+            catalog_double(c, b->m2);
+            catalog_double(c, b->min);
+            catalog_double(c, b->max);
+            catalog_double(c, b->first);
+            catalog_double(c, b->last);
+            catalog_u64(c, b->first_ts);
+            catalog_u64(c, b->last_ts);
+        }
+    }
+}
+
+/*
+ * Write a snapshot of the database to `path`, it's first written to a
+ * temporary file, then renamed, so an existing snapshot is replaced only once
+ * the new one is complete. The database shouldn't be modified meanwhile,
+ * but for the points staged out of order, merged into the rows first, a
+ * forked child merges them into its own copy only.
+ * `wal` is the position of the write-ahead log it covers, if any.
+ * Return 0 on success, -1 otherwise.
+ */
+int tts_snapshot_save(struct tts_database *db, const char *path,
+                      const struct tts_wal_position *wal) {
+    char tmp[0xFFF + 4];
+    uint8_t header[SNAPSHOT_HEADER_SIZE];
+    uint8_t *ptr = header + SNAPSHOT_MAGIC_LEN;
+    struct catalog c = { .size = 0, .capacity = SNAPSHOT_PAGE_SIZE };
+    struct tts_timeseries *ts, *tmp_ts;
+    size_t offset = 0, series_nr = 0, data_offset = 0, data_size = 0;
+    size_t catalog_offset = 0;
+    int err = 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE *fp = fopen(tmp, "w");
+    if (!fp) {
+        log_error("Snapshot failed, can't open %s: %s", tmp, strerror(errno));
+        return -1;
+    }
+    c.data = malloc(c.capacity);
+    // The header page is written at the end, once offsets are known
+    snapshot_write(fp, zeros, SNAPSHOT_PAGE_SIZE, &offset);
+    data_offset = offset;
+    for (int i = 0; i < TTS_DB_SHARDS; ++i) {
+        HASH_ITER(hh, db->shards[i].timeseries, ts, tmp_ts) {
+            tts_timeseries_merge(ts);
+            snapshot_write_timeseries(fp, &c, ts, data_offset, &offset);
+            ++series_nr;
+        }
+    }
+    data_size = offset - data_offset;
+    snapshot_align(fp, &offset);
+    catalog_offset = offset;
+    snapshot_write(fp, c.data, c.size, &offset);
+    free(c.data);
+    memcpy(header, TTS_SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    packi64(ptr, series_nr);
+    packi64(ptr + 8, data_offset);
+    packi64(ptr + 16, data_size);
+    packi64(ptr + 24, catalog_offset);
+    packi64(ptr + 32, c.size);
+    packi64(ptr + 40, wal ? wal->gen : 0);
+    packi64(ptr + 48, wal ? wal->offset : 0);
+    if (fseek(fp, 0, SEEK_SET) == 0)
+        fwrite(header, sizeof(header), 1, fp);
+    if (ferror(fp) || fflush(fp) != 0 || fsync(fileno(fp)) != 0)
+        err = -1;
+    if (fclose(fp) != 0)
+        err = -1;
+    if (err == 0 && rename(tmp, path) != 0)
+        err = -1;
+    if (err < 0) {
+        log_error("Snapshot on %s failed: %s", path, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    log_info("Snapshot of %zu timeseries saved on %s", series_nr, path);
+    return 0;
+}
+
+/*
+ * Write a snapshot from a forked child, the event loops go on while the child
+ * writes out its copy-on-write view of the database. All the shards are
+ * locked for the time of the fork, so the child gets a consistent copy, in
+ * the meanwhile the position of the write-ahead log, if any, is stored in
+ * `pos`, as nothing can be appended.
+ * Return the pid of the child, -1 on error
+ */
+pid_t tts_snapshot_save_background(struct tts_database *db, const char *path,
+                                   struct tts_wal *wal,
+                                   struct tts_wal_position *pos) {
+    pid_t pid;
+    pos->gen = pos->offset = 0;
+    for (int i = 0; i < TTS_DB_SHARDS; ++i)
+        pthread_mutex_lock(&db->shards[i].lock);
+    if (wal)
+        tts_wal_position(wal, pos);
+    pid = fork();
+    if (pid == 0)
+        _exit(tts_snapshot_save(db, path, pos) == 0 ?
+              EXIT_SUCCESS : EXIT_FAILURE);
+    for (int i = 0; i < TTS_DB_SHARDS; ++i)
+        pthread_mutex_unlock(&db->shards[i].lock);
+    if (pid < 0)
+        log_error("Background snapshot failed: %s", strerror(errno));
+    return pid;
+}
+
+/*
+ * Bounds checked reader of the catalog section
+ */
+struct cursor {
+    uint8_t *ptr;
+    uint8_t *end;
+};
+
+static int read_u64(struct cursor *cur, uint64_t *value) {
+    if (cur->end - cur->ptr < (ptrdiff_t) sizeof(uint64_t))
+        return -1;
+    *value = unpacku64(cur->ptr);
+    cur->ptr += sizeof(uint64_t);
+    return 0;
+}
+
+static int read_u8(struct cursor *cur, uint8_t *value) {
+    if (cur->ptr == cur->end)
+        return -1;
+    *value = *cur->ptr++;
+    return 0;
+}
+
+/* Read a string into a newly allocated nul-terminated copy */
+static int read_double(struct cursor *cur, double *value) {
+    uint64_t bits = 0;
+    if (read_u64(cur, &bits) < 0)
+        return -1;
+    memcpy(value, &bits, sizeof(bits));
+    return 0;
+}
+
+static char *read_string(struct cursor *cur) {
+    uint16_t len = 0;
+    if (cur->end - cur->ptr < (ptrdiff_t) sizeof(uint16_t))
+        return NULL;
+    len = unpacku16(cur->ptr);
+    cur->ptr += sizeof(uint16_t);
+    if (cur->end - cur->ptr < len)
+        return NULL;
+    char *str = strndup((char *) cur->ptr, len);
+    cur->ptr += len;
+    return str;
+}
+
+/*
+ * Read a record, its labels are interned back into the dictionary of the
+ * timeseries, then every row of the run is labelled with the set
+ */
+static int read_record(struct cursor *cur, struct tts_timeseries *ts) {
+    uint64_t index = 0, len = 0;
+    uint8_t labels_nr = 0, i = 0;
+    struct tts_label pairs[TTS_LABELS_MAX];
+    if (read_u64(cur, &index) < 0 || read_u64(cur, &len) < 0 ||
+        read_u8(cur, &labels_nr) < 0 || len == 0 || labels_nr == 0 ||
+        len > ts->offset || index > ts->offset - len)
+        return -1;
+    for (; i < labels_nr; ++i) {
+        char *field = read_string(cur), *value = field ? read_string(cur) : NULL;
+        if (!value) {
+            free(field);
+            goto err;
+        }
+        pairs[i].field = tts_labels_intern(ts->labels, field, strlen(field));
+        pairs[i].value = tts_labels_intern(ts->labels, value, strlen(value));
+        free(field);
+        free(value);
+    }
+    struct tts_labelset *set = tts_labels_set(ts->labels, pairs, labels_nr);
+    for (uint64_t j = 0; j < len; ++j) {
+        // Each row passes a reference, extending the run of the first one
+        if (j > 0)
+            ++set->refs;
+        tts_timeseries_label(ts, index + j, set);
+    }
+    return 0;
+err:
+    while (i-- > 0) {
+        tts_labels_release(ts->labels, pairs[i].field);
+        tts_labels_release(ts->labels, pairs[i].value);
+    }
+    return -1;
+}
+
+/*
+ * Read a timeseries from the catalog, chunks just reference the data section
+ * of the mapping
+ */
+/*
+ * Read the buckets of a rollup tier, a tier without buckets only holds the
+ * points following the latest one loaded, the buckets of the previous ones
+ * are missing
+ */
+static int read_rollup(struct cursor *cur, struct tts_timeseries *ts,
+                       int tier) {
+    struct tts_rollup *rollup = &ts->rollups[tier];
+    tts_timestamp width = tts_rollup_tiers[tier].width, last = 0;
+    uint64_t since = 0, buckets_nr = 0, end = 0, first_ts = 0, last_ts = 0;
+    double value = 0.0, mean = 0.0;
+    size_t index = 0;
+    if (read_u64(cur, &since) < 0 || read_u64(cur, &buckets_nr) < 0)
+        return -1;
+    rollup->since = since;
+    for (uint64_t i = 0; i < buckets_nr; ++i) {
+        struct tts_bucket b;
+        if (read_u64(cur, &end) < 0 || read_u64(cur, &b.count) < 0 ||
+            read_double(cur, &b.sum) < 0 || read_double(cur, &mean) < 0 ||
+            read_double(cur, &b.m2) < 0 || read_double(cur, &b.min) < 0 ||
+            read_double(cur, &b.max) < 0 || read_double(cur, &b.first) < 0 ||
+            read_double(cur, &b.last) < 0 ||
+            read_u64(cur, &first_ts) < 0 || read_u64(cur, &last_ts) < 0)
+            return -1;
+        b.end = end;
+        b.first_ts = first_ts;
+        b.last_ts = last_ts;
+        TTS_VECTOR_APPEND(rollup->buckets, b);
+    }
+    if (buckets_nr == 0 && tts_timeseries_last(ts, &last, &value, &index))
+        rollup->since = (last + width - 1) / width * width;
+    return 0;
+}
+
+static struct tts_timeseries *read_timeseries(struct tts_database *db,
+                                              struct cursor *cur,
+                                              uint8_t *data,
+                                              uint64_t data_size) {
+    uint64_t retention = 0, cutoff = 0, chunks_nr = 0, records_nr = 0;
+    uint64_t fields[6];
+    char *name = read_string(cur);
+    if (!name)
+        return NULL;
+    if (strlen(name) >= TTS_TS_NAME_MAX_LENGTH ||
+        read_u64(cur, &retention) < 0 || read_u64(cur, &cutoff) < 0 ||
+        read_u64(cur, &chunks_nr) < 0 || read_u64(cur, &records_nr) < 0) {
+        free(name);
+        return NULL;
+    }
+    struct tts_timeseries *ts = malloc(sizeof(*ts));
+    size_t name_len = strlen(name);
+    TTS_TIMESERIES_INIT(ts, name, name_len, (int64_t) retention,
+                        &tts_database_shard(db, name, name_len)->labels);
+    free(name);
+    ts->cutoff = cutoff;
+    for (uint64_t i = 0; i < chunks_nr; ++i) {
+        for (int j = 0; j < 6; ++j)
+            if (read_u64(cur, &fields[j]) < 0)
+                goto err;
+        // Offset and size must fall within the data section
+        if (fields[3] == 0 || fields[3] > TTS_CHUNK_POINTS ||
+            fields[5] > data_size || fields[4] > data_size - fields[5])
+            goto err;
+        struct tts_chunk chunk = {
+            .min_ts = fields[0],
+            .max_ts = fields[1],
+            .index = fields[2],
+            .len = fields[3],
+            .size = fields[4],
+            .mapped = 1,
+            .data = data + fields[5]
+        };
+        TTS_VECTOR_APPEND(ts->chunks, chunk);
+        ts->offset = chunk.index + chunk.len;
+    }
+    for (uint64_t i = 0; i < records_nr; ++i)
+        if (read_record(cur, ts) < 0)
+            goto err;
+    for (int i = 0; i < TTS_ROLLUP_TIERS; ++i)
+        if (read_rollup(cur, ts, i) < 0)
+            goto err;
+    return ts;
+err:
+    TTS_TIMESERIES_DESTROY(ts);
+    return NULL;
+}
+
+/*
+ * Map a snapshot and load its timeseries into an empty database, points are
+ * not read at all, chunks are served straight from the mapping, only the
+ * catalog is actually parsed, to rebuild the labels records and tags. A
+ * missing snapshot is not an error, the database is just left empty.
+ * Return the number of timeseries loaded, -1 on error
+ */
+int tts_snapshot_load(struct tts_database *db, const char *path,
+                      struct tts_snapshot *snapshot) {
+    struct stat st;
+    struct cursor cur;
+    struct tts_shard *shard;
+    struct tts_timeseries *ts, *tmp;
+    uint64_t series_nr = 0, data_offset = 0, data_size = 0;
+    uint64_t catalog_offset = 0, catalog_size = 0;
+    uint8_t *map = NULL;
+    snapshot->map = NULL;
+    snapshot->size = 0;
+    snapshot->wal.gen = snapshot->wal.offset = 0;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 && errno == ENOENT)
+        return 0;
+    if (fd < 0 || fstat(fd, &st) < 0)
+        goto err;
+    if ((size_t) st.st_size < SNAPSHOT_PAGE_SIZE) {
+        errno = EINVAL;
+        goto err;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    fd = -1;
+    if (map == MAP_FAILED)
+        goto err;
+    snapshot->map = map;
+    snapshot->size = st.st_size;
+    series_nr = unpacku64(map + SNAPSHOT_MAGIC_LEN);
+    data_offset = unpacku64(map + SNAPSHOT_MAGIC_LEN + 8);
+    data_size = unpacku64(map + SNAPSHOT_MAGIC_LEN + 16);
+    catalog_offset = unpacku64(map + SNAPSHOT_MAGIC_LEN + 24);
+    catalog_size = unpacku64(map + SNAPSHOT_MAGIC_LEN + 32);
+    snapshot->wal.gen = unpacku64(map + SNAPSHOT_MAGIC_LEN + 40);
+    snapshot->wal.offset = unpacku64(map + SNAPSHOT_MAGIC_LEN + 48);
+    if (memcmp(map, TTS_SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 ||
+        data_offset > snapshot->size ||
+        data_size > snapshot->size - data_offset ||
+        catalog_offset > snapshot->size ||
+        catalog_size > snapshot->size - catalog_offset) {
+        errno = EINVAL;
+        goto err;
+    }
+    cur.ptr = map + catalog_offset;
+    cur.end = cur.ptr + catalog_size;
+    for (uint64_t i = 0; i < series_nr; ++i) {
+        ts = read_timeseries(db, &cur, map + data_offset, data_size);
+        if (!ts) {
+            errno = EINVAL;
+            goto err;
+        }
+        shard = tts_database_shard(db, ts->name, strlen(ts->name));
+        HASH_FIND_STR(shard->timeseries, ts->name, tmp);
+        if (tmp) {
+            TTS_TIMESERIES_DESTROY(ts);
+            errno = EINVAL;
+            goto err;
+        }
+        HASH_ADD_STR(shard->timeseries, name, ts);
+        tts_names_add(&db->names, ts->name);
+    }
+    log_info("Loaded %lu timeseries from snapshot %s",
+             (unsigned long) series_nr, path);
+    return series_nr;
+err:
+    log_error("Can't load snapshot %s: %s", path, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    for (int i = 0; i < TTS_DB_SHARDS; ++i) {
+        HASH_ITER(hh, db->shards[i].timeseries, ts, tmp) {
+            HASH_DEL(db->shards[i].timeseries, ts);
+            tts_names_del(&db->names, ts->name);
+            TTS_TIMESERIES_DESTROY(ts);
+        }
+    }
+    tts_snapshot_unmap(snapshot);
+    return -1;
+}
+
+void tts_snapshot_unmap(struct tts_snapshot *snapshot) {
+    if (snapshot->map)
+        munmap(snapshot->map, snapshot->size);
+    snapshot->map = NULL;
+    snapshot->size = 0;
+}
@@ -0,0 +1,99 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TTS_SNAPSHOT_H
+#define TTS_SNAPSHOT_H
+
+#include <sys/types.h>
+#include "tts_wal.h"
+
+/*
+ * Binary snapshot of the database, all integers are stored big-endian as on
+ * the wire, sections start on page boundaries:
+ *
+ * - Header, the first page
+ *
+ *   | magic "TTSSNAP4" | series nr | data offset | data size |
+ *   | catalog offset | catalog size | WAL generation | WAL offset |
+ *
+ *   the last two fields being the position of the write-ahead log covered by
+ *   the snapshot, both 0 if there's no log
+ *
+ * - Data, the compressed chunks of every timeseries one after the other, the
+ *   uncompressed head is sealed into a last shorter chunk. Chunks are in the
+ *   same format they have in memory, so once mapped they're served as they
+ *   are, without being decoded or copied first
+ *
+ * - Catalog, the descriptor of every timeseries, read on load
+ *
+ *   | name len (16) | name | retention | cutoff | chunks nr | records nr |
+ *   | chunks descriptors | records | rollups |
+ *
+ *   where each chunk descriptor is
+ *
+ *   | min_ts | max_ts | index | len | size | data offset |
+ *
+ *   and each record, the labels of a run of rows, is
+ *
+ *   | index | len | labels nr (8) | field len (16) | field |
+ *   | value len (16) | value | ..
+ *
+ *   followed by the buckets of every rollup tier, from the finest one
+ *
+ *   | since | buckets nr | end | count | sum | mean | m2 | min | max |
+ *   | first | last | first ts | last ts | ..
+ *
+ *   the values of the buckets being doubles, stored by their bit pattern
+ * Every field is 64 bits wide where not specified.
+ */
+
+#define TTS_SNAPSHOT_MAGIC "TTSSNAP4"
+
+struct tts_database;
+
+/*
+ * Snapshot file mapping, chunks loaded point straight into it, so it must
+ * outlive the timeseries loaded, `wal` is the position of the write-ahead log
+ * covered
+ */
+struct tts_snapshot {
+    void *map;
+    size_t size;
+    struct tts_wal_position wal;
+};
+
+int tts_snapshot_save(struct tts_database *, const char *,
+                      const struct tts_wal_position *);
+pid_t tts_snapshot_save_background(struct tts_database *, const char *,
+                                   struct tts_wal *,
+                                   struct tts_wal_position *);
+int tts_snapshot_load(struct tts_database *, const char *,
+                      struct tts_snapshot *);
+void tts_snapshot_unmap(struct tts_snapshot *);
+
+#endif
@@ -0,0 +1,415 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fnmatch.h>
+#include "tts.h"
+#include "tts_stats.h"
+
+/*
+ * Name of the requests reported for each opcode, responses opcodes are never
+ * received as requests, unknown ones are all reported together
+ */
+static const char *const opcode_names[TTS_STATS_OPCODES] = {
+    "create", "delete", "add", "madd", "query", NULL, NULL, "hello", "mlast",
+    "info", "subscribe"
+};
+
+/*
+ * Bounds of the buckets exported, powers of 4 nanoseconds, from about a
+ * microsecond to about 17 seconds, they're edges of the buckets recorded as
+ * well, so no bucket recorded straddles a bound
+ */
+#define EXPORT_MIN_BITS 10
+#define EXPORT_MAX_BITS 34
+#define EXPORT_STEP_BITS 2
+
+/* A histogram summed up over the workers */
+struct histogram_view {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[TTS_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Allocate the counters of `n` workers, zeroed, each one on its own cache
+ * lines
+ */
+struct tts_stats *tts_stats_new(size_t n) {
+    struct tts_stats *stats = aligned_alloc(_Alignof(struct tts_stats),
+                                            n * sizeof(*stats));
+    memset(stats, 0x00, n * sizeof(*stats));
+    return stats;
+}
+
+void tts_stats_free(struct tts_stats *stats) {
+    free(stats);
+}
+
+static size_t histogram_bucket(uint64_t value) {
+    if (value < (1ULL << TTS_HISTOGRAM_SUB_BITS))
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    if (msb >= TTS_HISTOGRAM_MAX_BITS)
+        return TTS_HISTOGRAM_BUCKETS - 1;
+    int shift = msb - TTS_HISTOGRAM_SUB_BITS;
+    return ((size_t) (shift + 1) << TTS_HISTOGRAM_SUB_BITS) +
+        ((value >> shift) & ((1 << TTS_HISTOGRAM_SUB_BITS) - 1));
+}
+
+/* First value past a bucket */
+static uint64_t histogram_bucket_end(size_t bucket) {
+    if (bucket < (1 << TTS_HISTOGRAM_SUB_BITS))
+        return bucket + 1;
+    int shift = (bucket >> TTS_HISTOGRAM_SUB_BITS) - 1;
+    uint64_t sub = bucket & ((1 << TTS_HISTOGRAM_SUB_BITS) - 1);
+    return ((1ULL << TTS_HISTOGRAM_SUB_BITS) + sub + 1) << shift;
+}
+
+/*
+ * Record a value in nanoseconds, to be called only by the thread owning the
+ * histogram
+ */
+void tts_histogram_record(struct tts_histogram *h, uint64_t value) {
+    tts_stats_add(&h->count, 1);
+    tts_stats_add(&h->sum, value);
+    tts_stats_add(&h->buckets[histogram_bucket(value)], 1);
+    if (value > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, value, memory_order_relaxed);
+}
+
+static void histogram_merge(struct histogram_view *view,
+                            const struct tts_histogram *h) {
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    view->count += atomic_load_explicit(&h->count, memory_order_relaxed);
+    view->sum += atomic_load_explicit(&h->sum, memory_order_relaxed);
+    view->max = max > view->max ? max : view->max;
+    for (size_t i = 0; i < TTS_HISTOGRAM_BUCKETS; ++i)
+        view->buckets[i] +=
+            atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+}
+
+/*
+ * Value at a quantile, the end of the bucket reaching it, capped by the
+ * maximum recorded; counts are read bucket by bucket while they're being
+ * written, so they may not add up to the total, which is then ignored
+ */
+static uint64_t histogram_quantile(const struct histogram_view *view,
+                                   double q) {
+    uint64_t total = 0, seen = 0, end = 0;
+    for (size_t i = 0; i < TTS_HISTOGRAM_BUCKETS; ++i)
+        total += view->buckets[i];
+    if (total == 0)
+        return 0;
+    uint64_t rank = q * total < total ? q * total : total - 1;
+    for (size_t i = 0; i < TTS_HISTOGRAM_BUCKETS; ++i) {
+        seen += view->buckets[i];
+        if (view->buckets[i] > 0 && seen > rank) {
+            end = histogram_bucket_end(i) - 1;
+            break;
+        }
+    }
+    return end < view->max ? end : view->max;
+}
+
+void tts_report_init(struct tts_report *report) {
+    report->size = 0;
+    report->capacity = 4096;
+    report->text = malloc(report->capacity);
+    report->text[0] = '\0';
+}
+
+void tts_report_destroy(struct tts_report *report) {
+    free(report->text);
+}
+
+static void report_printf(struct tts_report *report, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(report->text + report->size,
+                      report->capacity - report->size, fmt, args);
+    va_end(args);
+    if (report->size + n >= report->capacity) {
+        while (report->size + n >= report->capacity)
+            report->capacity *= 2;
+        report->text = realloc(report->text, report->capacity);
+        va_start(args, fmt);
+        vsnprintf(report->text + report->size,
+                  report->capacity - report->size, fmt, args);
+        va_end(args);
+    }
+    report->size += n;
+}
+
+static void report_append(struct tts_report *report,
+                          const struct tts_report *other) {
+    report_printf(report, "%.*s", (int) other->size, other->text);
+}
+
+static void report_header(struct tts_report *report, const char *name,
+                          const char *type, const char *help) {
+    report_printf(report, "# HELP %s %s\n# TYPE %s %s\n",
+                  name, help, name, type);
+}
+
+/* Label values escape backslashes, double quotes and line feeds */
+static void report_series(struct tts_report *report, const char *name,
+                          const char *series) {
+    report_printf(report, "%s{series=\"", name);
+    for (const char *c = series; *c; ++c) {
+        if (*c == '\\' || *c == '"')
+            report_printf(report, "\\%c", *c);
+        else if (*c == '\n')
+            report_printf(report, "\\n");
+        else
+            report_printf(report, "%c", *c);
+    }
+    report_printf(report, "\"}");
+}
+
+/*
+ * Lines of a histogram in seconds, cumulative buckets, sum and count, then
+ * its quantiles as a gauge of their own, `labels` are the labels identifying
+ * the histogram, without braces, if any
+ */
+static void report_histogram(struct tts_report *report,
+                             struct tts_report *quantiles, const char *name,
+                             const char *labels,
+                             const struct histogram_view *view) {
+    static const double qs[] = { 0.5, 0.99, 0.999, 1.0 };
+    const char *sep = labels[0] ? "," : "";
+    const char *open = labels[0] ? "{" : "", *close = labels[0] ? "}" : "";
+    uint64_t seen = 0;
+    size_t i = 0;
+    for (int bits = EXPORT_MIN_BITS; bits <= EXPORT_MAX_BITS;
+         bits += EXPORT_STEP_BITS) {
+        for (; i < TTS_HISTOGRAM_BUCKETS &&
+             histogram_bucket_end(i) <= (1ULL << bits); ++i)
+            seen += view->buckets[i];
+        report_printf(report, "%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n",
+                      name, labels, sep, (1ULL << bits) / 1e9, seen);
+    }
+    for (; i < TTS_HISTOGRAM_BUCKETS; ++i)
+        seen += view->buckets[i];
+    report_printf(report, "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n",
+                  name, labels, sep, seen);
+    report_printf(report, "%s_sum%s%s%s %.9f\n",
+                  name, open, labels, close, view->sum / 1e9);
+    report_printf(report, "%s_count%s%s%s %" PRIu64 "\n",
+                  name, open, labels, close, seen);
+    for (size_t j = 0; j < sizeof(qs) / sizeof(*qs); ++j)
+        report_printf(quantiles, "%s_quantile{%s%squantile=\"%g\"} %.9f\n",
+                      name, labels, sep, qs[j],
+                      histogram_quantile(view, qs[j]) / 1e9);
+}
+
+/* Strings and sets interned into a labels dictionary */
+static void labels_count(const struct tts_labels *labels,
+                         size_t *strings, size_t *sets) {
+    *strings += HASH_COUNT(labels->strings);
+    *sets += HASH_COUNT(labels->sets);
+}
+
+/* Distinct label values indexed by a timeseries */
+static size_t series_label_values(const struct tts_timeseries *ts) {
+    const struct tts_tag *tag, *tmp;
+    size_t n = 0;
+    HASH_ITER(hh, ts->tags, tag, tmp)
+        n += HASH_COUNT(tag->tag);
+    return n;
+}
+
+/*
+ * Points of a timeseries a query would return, rows and staged late points
+ * past the retention cutoff, the rows expired but not swept yet are left out:
+ * rows are sorted, everything following the first one live is live too, so
+ * at most the chunk holding the cutoff gets decoded
+ */
+static size_t series_points(const struct tts_timeseries *ts) {
+    struct tts_timeseries_iter it;
+    struct tts_span span;
+    size_t n = 0, late = 0;
+    tts_timeseries_iter_init(&it, ts, 0);
+    if (tts_timeseries_iter_next(&it, &span) == 1)
+        n = tts_timeseries_end_index(ts) - span.index;
+    while (late < TTS_VECTOR_SIZE(ts->late) &&
+           TTS_VECTOR_AT(ts->late, late).timestamp < it.from)
+        ++late;
+    return n + TTS_VECTOR_SIZE(ts->late) - late;
+}
+
+/*
+ * Counters of the workers and of the database, visited one shard at a time,
+ * as the Prometheus text format; timeseries matching `pattern`, every one
+ * if NULL, are each reported as well, in no particular order
+ */
+static void report_database(struct tts_report *report,
+                            struct tts_database *db, const char *pattern) {
+    struct tts_report series[4];
+    size_t nr = 0, points = 0, bytes = 0, strings = 0, sets = 0;
+    for (int i = 0; i < 4; ++i)
+        tts_report_init(&series[i]);
+    report_header(&series[0], "tts_series_points", "gauge",
+                  "Points stored by the timeseries.");
+    report_header(&series[1], "tts_series_chunks", "gauge",
+                  "Compressed chunks of the timeseries.");
+    report_header(&series[2], "tts_series_memory_bytes", "gauge",
+                  "Memory allocated by the timeseries.");
+    report_header(&series[3], "tts_series_label_values", "gauge",
+                  "Distinct label values indexed by the timeseries.");
+    for (int i = 0; i < TTS_DB_SHARDS; ++i) {
+        struct tts_shard *shard = &db->shards[i];
+        struct tts_timeseries *ts, *tmp;
+        pthread_mutex_lock(&shard->lock);
+        HASH_ITER(hh, shard->timeseries, ts, tmp) {
+            size_t n = series_points(ts), size = tts_timeseries_memory(ts);
+            ++nr;
+            points += n;
+            bytes += size;
+            if (pattern && fnmatch(pattern, ts->name, 0) != 0)
+                continue;
+            report_series(&series[0], "tts_series_points", ts->name);
+            report_printf(&series[0], " %zu\n", n);
+            report_series(&series[1], "tts_series_chunks", ts->name);
+            report_printf(&series[1], " %zu\n", TTS_VECTOR_SIZE(ts->chunks));
+            report_series(&series[2], "tts_series_memory_bytes", ts->name);
+            report_printf(&series[2], " %zu\n", size);
+            report_series(&series[3], "tts_series_label_values", ts->name);
+            report_printf(&series[3], " %zu\n", series_label_values(ts));
+        }
+        labels_count(&shard->labels, &strings, &sets);
+        pthread_mutex_unlock(&shard->lock);
+    }
+    report_header(report, "tts_timeseries", "gauge", "Timeseries stored.");
+    report_printf(report, "tts_timeseries %zu\n", nr);
+    report_header(report, "tts_points", "gauge", "Points stored.");
+    report_printf(report, "tts_points %zu\n", points);
+    report_header(report, "tts_memory_bytes", "gauge",
+                  "Memory allocated by the timeseries.");
+    report_printf(report, "tts_memory_bytes %zu\n", bytes);
+    report_header(report, "tts_label_strings", "gauge",
+                  "Label names and values interned.");
+    report_printf(report, "tts_label_strings %zu\n", strings);
+    report_header(report, "tts_label_sets", "gauge",
+                  "Distinct sets of labels interned.");
+    report_printf(report, "tts_label_sets %zu\n", sets);
+    for (int i = 0; i < 4; ++i) {
+        report_append(report, &series[i]);
+        tts_report_destroy(&series[i]);
+    }
+}
+
+static uint64_t stats_sum(const struct tts_stats *stats, size_t n,
+                          size_t offset) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < n; ++i)
+        sum += atomic_load_explicit((const _Atomic uint64_t *)
+                                    ((const char *) &stats[i] + offset),
+                                    memory_order_relaxed);
+    return sum;
+}
+
+/*
+ * Write the report of the counters of `n` workers and of the database into
+ * `report`, in the Prometheus text format, timeseries are reported one by
+ * one if they match `pattern`, every one if NULL
+ */
+void tts_stats_report(struct tts_report *report, const struct tts_stats *stats,
+                      size_t n, struct tts_database *db, const char *pattern) {
+    struct tts_report quantiles;
+    struct histogram_view *view = malloc(sizeof(*view));
+    struct histogram_view *unknown = calloc(1, sizeof(*unknown));
+    char labels[64];
+    uint64_t in = stats_sum(stats, n, offsetof(struct tts_stats, bytes_in));
+    uint64_t out = stats_sum(stats, n, offsetof(struct tts_stats, bytes_out));
+    uint64_t opened =
+        stats_sum(stats, n, offsetof(struct tts_stats, connections));
+    uint64_t closed =
+        stats_sum(stats, n, offsetof(struct tts_stats, disconnections));
+    tts_report_init(&quantiles);
+    report_header(report, "tts_received_bytes_total", "counter",
+                  "Bytes of the requests received.");
+    report_printf(report, "tts_received_bytes_total %" PRIu64 "\n", in);
+    report_header(report, "tts_sent_bytes_total", "counter",
+                  "Bytes of the responses sent.");
+    report_printf(report, "tts_sent_bytes_total %" PRIu64 "\n", out);
+    report_header(report, "tts_connections_total", "counter",
+                  "Connections accepted.");
+    report_printf(report, "tts_connections_total %" PRIu64 "\n", opened);
+    report_header(report, "tts_connected_clients", "gauge",
+                  "Clients connected.");
+    report_printf(report, "tts_connected_clients %" PRIu64 "\n",
+                  opened - closed);
+    report_header(report, "tts_request_duration_seconds", "histogram",
+                  "Time taken to decode and handle requests.");
+    report_header(&quantiles, "tts_request_duration_seconds_quantile",
+                  "gauge", "Quantiles of the time taken by requests.");
+    for (int op = 0; op < TTS_STATS_OPCODES; ++op) {
+        memset(view, 0x00, sizeof(*view));
+        for (size_t i = 0; i < n; ++i)
+            histogram_merge(opcode_names[op] ? view : unknown,
+                            &stats[i].requests[op]);
+        if (!opcode_names[op] || view->count == 0)
+            continue;
+        snprintf(labels, sizeof(labels), "command=\"%s\"", opcode_names[op]);
+        report_histogram(report, &quantiles, "tts_request_duration_seconds",
+                         labels, view);
+    }
+    if (unknown->count > 0)
+        report_histogram(report, &quantiles, "tts_request_duration_seconds",
+                         "command=\"unknown\"", unknown);
+    report_header(report, "tts_loop_cycle_seconds", "histogram",
+                  "Time taken to process the events of a loop cycle.");
+    report_header(&quantiles, "tts_loop_cycle_seconds_quantile", "gauge",
+                  "Quantiles of the time taken by loop cycles.");
+    for (size_t i = 0; i < n; ++i) {
+        memset(view, 0x00, sizeof(*view));
+        histogram_merge(view, &stats[i].loop);
+        snprintf(labels, sizeof(labels), "worker=\"%zu\"", i);
+        report_histogram(report, &quantiles, "tts_loop_cycle_seconds",
+                         labels, view);
+    }
+    report_header(report, "tts_retention_sweep_seconds", "histogram",
+                  "Time taken to sweep the expired points of a shard.");
+    report_header(&quantiles, "tts_retention_sweep_seconds_quantile",
+                  "gauge", "Quantiles of the time taken by sweeps.");
+    memset(view, 0x00, sizeof(*view));
+    for (size_t i = 0; i < n; ++i)
+        histogram_merge(view, &stats[i].sweep);
+    report_histogram(report, &quantiles, "tts_retention_sweep_seconds",
+                     "", view);
+    report_append(report, &quantiles);
+    report_database(report, db, pattern);
+    tts_report_destroy(&quantiles);
+    free(unknown);
+    free(view);
+}
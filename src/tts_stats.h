@@ -0,0 +1,116 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TTS_STATS_H
+#define TTS_STATS_H
+
+#include <time.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+struct tts_database;
+
+/*
+ * Latency histograms, log-linear buckets à la HDR histogram: values below
+ * 2^TTS_HISTOGRAM_SUB_BITS nanoseconds have a bucket each, every power of 2
+ * above is split into 2^TTS_HISTOGRAM_SUB_BITS buckets, so any value is
+ * recorded within 1/16 of itself; values past 2^TTS_HISTOGRAM_MAX_BITS
+ * nanoseconds, about 18 minutes, fall into the last bucket.
+ */
+#define TTS_HISTOGRAM_SUB_BITS 4
+#define TTS_HISTOGRAM_MAX_BITS 40
+#define TTS_HISTOGRAM_BUCKETS \
+    ((TTS_HISTOGRAM_MAX_BITS - TTS_HISTOGRAM_SUB_BITS + 1) \
+     << TTS_HISTOGRAM_SUB_BITS)
+
+struct tts_histogram {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[TTS_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Number of request histograms, one for each opcode the header can carry
+ */
+#define TTS_STATS_OPCODES 16
+
+/*
+ * Counters of a worker, each one is written only by the thread of its
+ * worker, by plain relaxed loads and stores, and read by any thread reporting
+ * them, which just sums up those of all the workers; this way the hot path
+ * never takes a lock nor issues a locked instruction. Workers' counters are
+ * aligned to a cache line, so they never share one.
+ *
+ * - requests, the time taken to decode and handle each request, by opcode
+ * - loop, the time taken to process the events of each loop cycle
+ * - sweep, the time taken by the retention sweeper on each shard
+ */
+struct tts_stats {
+    _Alignas(64) _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic uint64_t connections;
+    _Atomic uint64_t disconnections;
+    struct tts_histogram requests[TTS_STATS_OPCODES];
+    struct tts_histogram loop;
+    struct tts_histogram sweep;
+};
+
+/*
+ * Text of a report, grown as it's written
+ */
+struct tts_report {
+    size_t size;
+    size_t capacity;
+    char *text;
+};
+
+/* Monotonic clock in nanoseconds, to time the events recorded */
+static inline uint64_t tts_stats_clock(void) {
+    struct timespec tv;
+    clock_gettime(CLOCK_MONOTONIC, &tv);
+    return tv.tv_sec * (uint64_t) 1e9 + tv.tv_nsec;
+}
+
+/* Add to a counter, to be called only by the thread owning it */
+static inline void tts_stats_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter,
+                          atomic_load_explicit(counter,
+                                               memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+struct tts_stats *tts_stats_new(size_t);
+void tts_stats_free(struct tts_stats *);
+void tts_histogram_record(struct tts_histogram *, uint64_t);
+void tts_report_init(struct tts_report *);
+void tts_report_destroy(struct tts_report *);
+void tts_stats_report(struct tts_report *, const struct tts_stats *, size_t,
+                      struct tts_database *, const char *);
+
+#endif
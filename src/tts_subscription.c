@@ -0,0 +1,486 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <sys/eventfd.h>
+#include "tts_log.h"
+#include "tts_subscription.h"
+
+void tts_subscriptions_init(struct tts_subscriptions *subs) {
+    pthread_rwlock_init(&subs->lock, NULL);
+    atomic_init(&subs->count, 0);
+    subs->names = NULL;
+    subs->patterns = NULL;
+}
+
+/* Subscriptions belong to their subscribers, only the index is released */
+void tts_subscriptions_destroy(struct tts_subscriptions *subs) {
+    struct tts_subscription_key *key, *tmp;
+    HASH_ITER(hh, subs->names, key, tmp) {
+        HASH_DEL(subs->names, key);
+        free(key->name);
+        free(key);
+    }
+    pthread_rwlock_destroy(&subs->lock);
+}
+
+/*
+ * Chain of the subscriptions on the name of a timeseries, or by pattern,
+ * `create` tells whether to index a name not subscribed yet
+ */
+static struct tts_subscription **registry_chain(struct tts_subscriptions *subs,
+                                                const struct tts_subscription *s,
+                                                int create) {
+    struct tts_subscription_key *key = NULL;
+    if (s->select == 1)
+        return &subs->patterns;
+    HASH_FIND_STR(subs->names, s->pattern, key);
+    if (!key && create == 1) {
+        key = malloc(sizeof(*key));
+        key->name = strdup(s->pattern);
+        key->subscriptions = NULL;
+        HASH_ADD_KEYPTR(hh, subs->names, key->name, strlen(key->name), key);
+    }
+    return key ? &key->subscriptions : NULL;
+}
+
+static void registry_del(struct tts_subscriptions *subs,
+                         struct tts_subscription *s) {
+    struct tts_subscription **chain = registry_chain(subs, s, 0);
+    for (; chain && *chain; chain = &(*chain)->link) {
+        if (*chain == s) {
+            *chain = s->link;
+            break;
+        }
+    }
+    if (s->select == 0) {
+        struct tts_subscription_key *key = NULL;
+        HASH_FIND_STR(subs->names, s->pattern, key);
+        if (key && !key->subscriptions) {
+            HASH_DEL(subs->names, key);
+            free(key->name);
+            free(key);
+        }
+    }
+    atomic_fetch_sub(&subs->count, 1);
+}
+
+/*
+ * Register a subscription of `sub` on the timeseries, or the pattern, of a
+ * query, return -1 if the subscriber has TTS_SUBSCRIPTIONS_MAX already
+ */
+int tts_subscribe(struct tts_subscriptions *subs, struct tts_subscriber *sub,
+                  const struct tts_query *query) {
+    if (sub->subscriptions_nr == TTS_SUBSCRIPTIONS_MAX)
+        return -1;
+    struct tts_subscription *s = calloc(1, sizeof(*s));
+    s->subscriber = sub;
+    s->pattern = malloc(query->ts_name_len + 1);
+    memcpy(s->pattern, query->ts_name, query->ts_name_len);
+    s->pattern[query->ts_name_len] = '\0';
+    s->select = query->bits.select;
+    s->filters_nr = query->filters_nr;
+    s->filters = tts_query_filters_copy(query->filters, query->filters_nr);
+    if (query->bits.mean == 1) {
+        uint64_t ms = query->mean_val < TTS_SUBSCRIPTION_WINDOW_MAX ?
+            query->mean_val : TTS_SUBSCRIPTION_WINDOW_MAX;
+        s->window = ms > 0 ? ms * 1000000ULL : 1;
+        s->aggregates = TTS_AGG_AVG;
+    }
+    if (query->bits.mean == 1 && query->bits.aggregate == 1) {
+        s->labelled = 1;
+        s->aggregates = query->aggregates & ((TTS_AGG_QUANTILE << 1) - 1);
+        if (s->aggregates & TTS_AGG_QUANTILE) {
+            s->quantiles_nr = query->quantiles_nr;
+            memcpy(s->quantiles, query->quantiles, sizeof(s->quantiles));
+        }
+        for (size_t i = 0; i < TTS_AGGREGATE_NAMES_NR; ++i) {
+            if ((s->aggregates & (1 << i)) == 0)
+                continue;
+            s->labels[s->labels_nr++] = (struct tts_query_label) {
+                .label_len = sizeof("aggregate") - 1,
+                .label = (uint8_t *) "aggregate",
+                .value_len = strlen(tts_aggregate_names[i]),
+                .value = (uint8_t *) tts_aggregate_names[i]
+            };
+        }
+        for (size_t i = 0; i < s->quantiles_nr; ++i) {
+            tts_aggregate_quantile_name(s->quantile_names[i],
+                                        sizeof(s->quantile_names[i]),
+                                        s->quantiles[i]);
+            s->labels[s->labels_nr++] = (struct tts_query_label) {
+                .label_len = sizeof("aggregate") - 1,
+                .label = (uint8_t *) "aggregate",
+                .value_len = strlen(s->quantile_names[i]),
+                .value = (uint8_t *) s->quantile_names[i]
+            };
+        }
+    }
+    s->next = sub->subscriptions;
+    sub->subscriptions = s;
+    sub->subscriptions_nr++;
+    pthread_rwlock_wrlock(&subs->lock);
+    struct tts_subscription **chain = registry_chain(subs, s, 1);
+    s->link = *chain;
+    *chain = s;
+    atomic_fetch_add(&subs->count, 1);
+    pthread_rwlock_unlock(&subs->lock);
+    log_debug("Subscribed to \"%s\" (w=%llu)", s->pattern, s->window);
+    return 0;
+}
+
+static void subscription_free(struct tts_subscription *s) {
+    struct tts_subscription_series *series, *tmp;
+    HASH_ITER(hh, s->series, series, tmp) {
+        HASH_DEL(s->series, series);
+        if (s->window > 0)
+            tts_aggregate_destroy(&series->agg);
+        free(series->name);
+        free(series);
+    }
+    tts_query_filters_destroy(s->filters, s->filters_nr);
+    free(s->pattern);
+    free(s);
+}
+
+/* A point matches if it carries all the labels filtered, with their values */
+static int point_matches(const struct tts_subscription *s,
+                         const struct tts_addpoints *pa, uint32_t i) {
+    for (uint16_t f = 0; f < s->filters_nr; ++f) {
+        const struct tts_query_filter *filter = &s->filters[f];
+        int found = 0;
+        for (uint16_t j = 0; found == 0 && j < pa->points[i].labels_len; ++j)
+            found = pa->points[i].labels[j].label_len == filter->label_len &&
+                pa->points[i].labels[j].value_len == filter->value_len &&
+                memcmp(pa->points[i].labels[j].label, filter->label,
+                       filter->label_len) == 0 &&
+                memcmp(pa->points[i].labels[j].value, filter->value,
+                       filter->value_len) == 0;
+        if (found == 0)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Queue a result, return 0 once the subscriber has fallen behind, results
+ * are dropped from then on, its connection is closed as soon as its worker
+ * gets to it
+ */
+static int subscriber_push(struct tts_subscriber *sub,
+                           const struct tts_push *push) {
+    if (sub->overflow == 1)
+        return 0;
+    if (TTS_VECTOR_SIZE(sub->pending) == TTS_SUBSCRIBER_BACKLOG) {
+        sub->overflow = 1;
+        return 0;
+    }
+    TTS_VECTOR_APPEND(sub->pending, *push);
+    return 1;
+}
+
+/* Queue a raw point, its labels copied into a single block */
+static void push_point(struct tts_subscriber *sub, const char *name,
+                       tts_timestamp t, double value,
+                       const struct tts_addpoints *pa, uint32_t i) {
+    struct tts_push push = {
+        .series = name, .t = t, .value = value,
+        .labels_nr = pa->points[i].labels_len
+    };
+    size_t size = push.labels_nr * sizeof(*push.labels);
+    for (uint16_t j = 0; j < push.labels_nr; ++j)
+        size += pa->points[i].labels[j].label_len +
+            pa->points[i].labels[j].value_len + 2;
+    if (push.labels_nr > 0) {
+        push.labels = malloc(size);
+        push.owned = 1;
+        uint8_t *str = (uint8_t *) (push.labels + push.labels_nr);
+        for (uint16_t j = 0; j < push.labels_nr; ++j) {
+            struct tts_query_label *label = &push.labels[j];
+            label->label_len = pa->points[i].labels[j].label_len;
+            label->label = str;
+            memcpy(str, pa->points[i].labels[j].label, label->label_len);
+            str[label->label_len] = '\0';
+            str += label->label_len + 1;
+            label->value_len = pa->points[i].labels[j].value_len;
+            label->value = str;
+            memcpy(str, pa->points[i].labels[j].value, label->value_len);
+            str[label->value_len] = '\0';
+            str += label->value_len + 1;
+        }
+    }
+    if (subscriber_push(sub, &push) == 0)
+        free(push.labels);
+}
+
+/*
+ * Queue the results of the window of a timeseries, one for each aggregate,
+ * in the order of their bits, quantiles last, as queries do
+ */
+static void push_window(struct tts_subscription *s,
+                        struct tts_subscription_series *series) {
+    struct tts_push push = { .series = series->name, .t = series->step };
+    size_t l = 0;
+    for (size_t i = 0; i < TTS_AGGREGATE_NAMES_NR; ++i) {
+        if ((s->aggregates & (1 << i)) == 0)
+            continue;
+        push.value = tts_aggregate_value(&series->agg, 1 << i);
+        push.labels_nr = s->labelled;
+        push.labels = s->labelled ? &s->labels[l++] : NULL;
+        subscriber_push(s->subscriber, &push);
+    }
+    for (size_t i = 0; i < s->quantiles_nr; ++i) {
+        push.value = tts_aggregate_quantile(&series->agg, s->quantiles[i]);
+        push.labels_nr = 1;
+        push.labels = &s->labels[l++];
+        subscriber_push(s->subscriber, &push);
+    }
+    series->pushed = series->step;
+    tts_aggregate_reset(&series->agg);
+}
+
+/* End of the window of `t`, windows cover (kW, (k + 1)W] */
+static inline tts_timestamp window_end(tts_timestamp t, tts_timestamp w) {
+    return t % w == 0 ? t : t - t % w + w;
+}
+
+/*
+ * Wake up the worker of a subscriber with results queued, unless it's in its
+ * mailbox already; the mailbox is signaled only as it gets its first one
+ */
+static void subscriber_post(struct tts_subscriber *sub) {
+    struct tts_mailbox *mailbox = sub->mailbox;
+    int wake = 0;
+    pthread_mutex_lock(&mailbox->lock);
+    if (sub->queued == 0) {
+        sub->queued = 1;
+        wake = mailbox->ready == NULL;
+        sub->next = mailbox->ready;
+        mailbox->ready = sub;
+    }
+    pthread_mutex_unlock(&mailbox->lock);
+    if (wake == 1)
+        eventfd_write(mailbox->fd, 1);
+}
+
+/* Feed the points of a timeseries, already stored, to a subscription */
+static void subscription_feed(struct tts_subscription *s, const char *name,
+                              const struct tts_addpoints *pa) {
+    struct tts_subscriber *sub = s->subscriber;
+    struct tts_subscription_series *series = NULL;
+    size_t queued = 0;
+    pthread_mutex_lock(&sub->lock);
+    queued = TTS_VECTOR_SIZE(sub->pending);
+    HASH_FIND_STR(s->series, name, series);
+    if (!series) {
+        series = calloc(1, sizeof(*series));
+        series->name = strdup(name);
+        if (s->window > 0)
+            tts_aggregate_init(&series->agg, s->aggregates);
+        HASH_ADD_KEYPTR(hh, s->series, series->name,
+                        strlen(series->name), series);
+    }
+    for (uint32_t i = 0; i < pa->points_len; ++i) {
+        if (point_matches(s, pa, i) == 0)
+            continue;
+        tts_timestamp t = pa->points[i].ts_sec * (tts_timestamp) 1e9 +
+            pa->points[i].ts_nsec;
+        double value = (double) pa->points[i].value;
+        if (s->window == 0) {
+            push_point(sub, series->name, t, value, pa, i);
+            continue;
+        }
+        if (series->agg.count > 0 && t > series->step)
+            push_window(s, series);
+        if (series->pushed > 0 && t <= series->pushed)
+            continue;
+        if (series->agg.count == 0)
+            series->step = window_end(t, s->window);
+        tts_aggregate_update(&series->agg, &value, 1);
+    }
+    queued = TTS_VECTOR_SIZE(sub->pending) > queued;
+    pthread_mutex_unlock(&sub->lock);
+    if (queued)
+        subscriber_post(sub);
+}
+
+/*
+ * Feed the points just added to a timeseries to the subscriptions on it, or
+ * on a pattern matching its name, must be called with the shard of the
+ * timeseries locked and its timestamps resolved
+ */
+void tts_subscriptions_notify(struct tts_subscriptions *subs,
+                              const struct tts_addpoints *pa) {
+    struct tts_subscription_key *key = NULL;
+    char name[TTS_TS_NAME_MAX_LENGTH];
+    if (atomic_load_explicit(&subs->count, memory_order_relaxed) == 0)
+        return;
+    snprintf(name, sizeof(name), "%.*s",
+             pa->ts_name_len, (const char *) pa->ts_name);
+    pthread_rwlock_rdlock(&subs->lock);
+    HASH_FIND_STR(subs->names, name, key);
+    for (struct tts_subscription *s = key ? key->subscriptions : NULL;
+         s; s = s->link)
+        subscription_feed(s, name, pa);
+    for (struct tts_subscription *s = subs->patterns; s; s = s->link)
+        if (fnmatch(s->pattern, name, 0) == 0)
+            subscription_feed(s, name, pa);
+    pthread_rwlock_unlock(&subs->lock);
+}
+
+int tts_mailbox_init(struct tts_mailbox *mailbox) {
+    mailbox->fd = eventfd(0, EFD_NONBLOCK);
+    if (mailbox->fd < 0)
+        return -1;
+    pthread_mutex_init(&mailbox->lock, NULL);
+    mailbox->ready = NULL;
+    return 0;
+}
+
+void tts_mailbox_destroy(struct tts_mailbox *mailbox) {
+    close(mailbox->fd);
+    pthread_mutex_destroy(&mailbox->lock);
+}
+
+/*
+ * Take all the subscribers queued, to be walked by `tts_mailbox_next`; they
+ * stay marked as queued till then, so their links are left alone
+ */
+struct tts_subscriber *tts_mailbox_take(struct tts_mailbox *mailbox) {
+    pthread_mutex_lock(&mailbox->lock);
+    struct tts_subscriber *ready = mailbox->ready;
+    mailbox->ready = NULL;
+    pthread_mutex_unlock(&mailbox->lock);
+    return ready;
+}
+
+/*
+ * Return the subscriber following one taken, which can be queued again from
+ * now on, to be done with before looking at its results
+ */
+struct tts_subscriber *tts_mailbox_next(struct tts_mailbox *mailbox,
+                                        struct tts_subscriber *sub) {
+    pthread_mutex_lock(&mailbox->lock);
+    struct tts_subscriber *next = sub->next;
+    sub->queued = 0;
+    sub->next = NULL;
+    pthread_mutex_unlock(&mailbox->lock);
+    return next;
+}
+
+void tts_subscriber_init(struct tts_subscriber *sub,
+                         struct tts_mailbox *mailbox) {
+    pthread_mutex_init(&sub->lock, NULL);
+    sub->mailbox = mailbox;
+    sub->next = NULL;
+    sub->queued = 0;
+    sub->overflow = 0;
+    TTS_VECTOR_NEW(sub->pending);
+    TTS_VECTOR_NEW(sub->sending);
+    sub->subscriptions = NULL;
+    sub->subscriptions_nr = 0;
+}
+
+static void pushes_release(struct tts_push *pushes, size_t n) {
+    for (size_t i = 0; i < n; ++i)
+        if (pushes[i].owned)
+            free(pushes[i].labels);
+}
+
+/*
+ * Drop all the subscriptions of a subscriber whose connection is closed, the
+ * registry is write locked, no point is being fed to them once it's done;
+ * the subscriber can be used again then
+ */
+void tts_subscriber_close(struct tts_subscriber *sub,
+                          struct tts_subscriptions *subs) {
+    struct tts_subscription *s = sub->subscriptions, *next = NULL;
+    struct tts_mailbox *mailbox = sub->mailbox;
+    if (!s)
+        return;
+    pthread_rwlock_wrlock(&subs->lock);
+    for (; s; s = s->next)
+        registry_del(subs, s);
+    pthread_rwlock_unlock(&subs->lock);
+    for (s = sub->subscriptions; s; s = next) {
+        next = s->next;
+        subscription_free(s);
+    }
+    sub->subscriptions = NULL;
+    sub->subscriptions_nr = 0;
+    pthread_mutex_lock(&mailbox->lock);
+    for (struct tts_subscriber **ready = &mailbox->ready;
+         sub->queued == 1 && *ready; ready = &(*ready)->next) {
+        if (*ready == sub) {
+            *ready = sub->next;
+            break;
+        }
+    }
+    sub->queued = 0;
+    sub->next = NULL;
+    pthread_mutex_unlock(&mailbox->lock);
+    pushes_release(sub->pending.data, TTS_VECTOR_SIZE(sub->pending));
+    sub->pending.size = 0;
+    sub->overflow = 0;
+}
+
+void tts_subscriber_destroy(struct tts_subscriber *sub) {
+    TTS_VECTOR_DESTROY(sub->pending);
+    TTS_VECTOR_DESTROY(sub->sending);
+    pthread_mutex_destroy(&sub->lock);
+}
+
+/*
+ * Take the results queued to a subscriber, swapped out with the ones sent
+ * last, so the workers feeding it can go on queuing meanwhile; they're valid
+ * till `tts_subscriber_done`. Return -1 if the subscriber has fallen behind.
+ */
+int tts_subscriber_take(struct tts_subscriber *sub,
+                        struct tts_push **pushes, size_t *n) {
+    pthread_mutex_lock(&sub->lock);
+    int overflow = sub->overflow;
+    struct tts_push *data = sub->sending.data;
+    size_t capacity = sub->sending.capacity;
+    sub->sending.data = sub->pending.data;
+    sub->sending.capacity = sub->pending.capacity;
+    sub->sending.size = sub->pending.size;
+    sub->pending.data = data;
+    sub->pending.capacity = capacity;
+    sub->pending.size = 0;
+    pthread_mutex_unlock(&sub->lock);
+    *pushes = sub->sending.data;
+    *n = TTS_VECTOR_SIZE(sub->sending);
+    return overflow == 1 ? -1 : 0;
+}
+
+void tts_subscriber_done(struct tts_subscriber *sub) {
+    pushes_release(sub->sending.data, TTS_VECTOR_SIZE(sub->sending));
+    sub->sending.size = 0;
+}
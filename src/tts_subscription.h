@@ -0,0 +1,187 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef TTS_SUBSCRIPTION_H
+#define TTS_SUBSCRIPTION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include "tts.h"
+#include "tts_protocol.h"
+#include "tts_aggregate.h"
+
+/*
+ * Subscriptions, a client registers by a TTS_SUBSCRIBE to a timeseries, or to
+ * the ones matching a pattern, and gets pushed the points added to them from
+ * then on, carrying the labels filtered, either as they come or aggregated
+ * into windows. Windows are aligned to multiples of their width, left-open,
+ * stamped with their upper bound as the aligned windows of a query; a window
+ * is pushed once the first point past it comes, points falling into a window
+ * already pushed are left out.
+ *
+ * Points are fed to the subscriptions by the worker adding them, while the
+ * shard of their timeseries is locked, so each timeseries is fed in the
+ * order its points are stored. Results are queued to the subscriber and its
+ * worker is woken up through its mailbox to pack them, only once the ones
+ * before are written out, so a slow client never makes them pile up into
+ * the output; subscribers falling behind by TTS_SUBSCRIBER_BACKLOG results
+ * get their connection closed.
+ */
+
+/* Results queued to a subscriber at most */
+#define TTS_SUBSCRIBER_BACKLOG 65536
+
+/* Subscriptions of a single connection at most */
+#define TTS_SUBSCRIPTIONS_MAX 64
+
+/* Widest window in milliseconds, a year */
+#define TTS_SUBSCRIPTION_WINDOW_MAX (365 * 24 * 3600 * 1000ULL)
+
+struct tts_subscriber;
+
+/*
+ * Subscribers of a worker with results queued, the worker is woken up by
+ * `fd`, an eventfd registered on its loop, once the list gets one
+ */
+struct tts_mailbox {
+    pthread_mutex_t lock;
+    int fd;
+    struct tts_subscriber *ready;
+};
+
+/*
+ * A result queued to a subscriber, the name of its timeseries is owned by
+ * the subscription, as the labels of the aggregates; the labels of a raw
+ * point are copied along with it, into a single block, `owned` then
+ */
+struct tts_push {
+    const char *series;
+    tts_timestamp t;
+    double value;
+    uint16_t labels_nr;
+    struct tts_query_label *labels;
+    int owned;
+};
+
+/*
+ * State of a timeseries fed to a subscription, the window being aggregated
+ * ends at `step`, `pushed` is the end of the last one pushed
+ */
+struct tts_subscription_series {
+    char *name;
+    tts_timestamp step;
+    tts_timestamp pushed;
+    struct tts_aggregate agg;
+    UT_hash_handle hh;
+};
+
+/*
+ * A subscription of a connection, `window` in nanoseconds, 0 to push the
+ * raw points; `labels` name the aggregates of each window in the order
+ * their results are pushed, as in queries. `link` chains the subscriptions
+ * on the same name, or by pattern, into the registry, `next` the ones of
+ * the subscriber.
+ */
+struct tts_subscription {
+    struct tts_subscriber *subscriber;
+    struct tts_subscription *link;
+    struct tts_subscription *next;
+    char *pattern;
+    int select;
+    tts_timestamp window;
+    unsigned aggregates;
+    int labelled;
+    uint8_t quantiles_nr;
+    uint16_t quantiles[TTS_QUERY_QUANTILES_MAX];
+    uint16_t filters_nr;
+    struct tts_query_filter *filters;
+    size_t labels_nr;
+    struct tts_query_label
+        labels[TTS_AGGREGATE_NAMES_NR + TTS_QUERY_QUANTILES_MAX];
+    char quantile_names[TTS_QUERY_QUANTILES_MAX][12];
+    struct tts_subscription_series *series;
+};
+
+/*
+ * Subscriber state of a connection, `lock` guards the results queued and the
+ * series of its subscriptions, fed by all the workers; `queued` and `next`
+ * belong to the mailbox, guarded by its lock. `overflow` is set once the
+ * results queued reach TTS_SUBSCRIBER_BACKLOG.
+ */
+struct tts_subscriber {
+    pthread_mutex_t lock;
+    struct tts_mailbox *mailbox;
+    struct tts_subscriber *next;
+    int queued;
+    int overflow;
+    TTS_VECTOR(struct tts_push) pending;
+    TTS_VECTOR(struct tts_push) sending;
+    struct tts_subscription *subscriptions;
+    size_t subscriptions_nr;
+};
+
+/*
+ * Subscriptions on a timeseries are indexed by its name, the ones by pattern
+ * are matched against the name of every timeseries points are added to
+ */
+struct tts_subscription_key {
+    char *name;
+    struct tts_subscription *subscriptions;
+    UT_hash_handle hh;
+};
+
+/*
+ * Registry of the subscriptions of all the connections, read locked while
+ * feeding points, `count` tells whether any is there without locking, so
+ * the points are fed only if any is
+ */
+struct tts_subscriptions {
+    pthread_rwlock_t lock;
+    atomic_size_t count;
+    struct tts_subscription_key *names;
+    struct tts_subscription *patterns;
+};
+
+void tts_subscriptions_init(struct tts_subscriptions *);
+void tts_subscriptions_destroy(struct tts_subscriptions *);
+int tts_subscribe(struct tts_subscriptions *, struct tts_subscriber *,
+                  const struct tts_query *);
+void tts_subscriptions_notify(struct tts_subscriptions *,
+                              const struct tts_addpoints *);
+
+int tts_mailbox_init(struct tts_mailbox *);
+void tts_mailbox_destroy(struct tts_mailbox *);
+struct tts_subscriber *tts_mailbox_take(struct tts_mailbox *);
+struct tts_subscriber *tts_mailbox_next(struct tts_mailbox *,
+                                        struct tts_subscriber *);
+
+void tts_subscriber_init(struct tts_subscriber *, struct tts_mailbox *);
+void tts_subscriber_close(struct tts_subscriber *, struct tts_subscriptions *);
+void tts_subscriber_destroy(struct tts_subscriber *);
+int tts_subscriber_take(struct tts_subscriber *, struct tts_push **, size_t *);
+void tts_subscriber_done(struct tts_subscriber *);
+
+#endif
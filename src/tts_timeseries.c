@@ -0,0 +1,1375 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <limits.h>
+#include <string.h>
+#include "tts.h"
+
+/*
+ * ===============================
+ *  Gorilla-like chunk compression
+ * ===============================
+ *
+ * Each chunk starts with the first timestamp and value written raw in 64 bits,
+ * following points are encoded as:
+ *
+ * - Timestamps, delta-of-delta D against the previous delta, prefixed by a
+ *   variable length control code, as timestamps have nanoseconds precision
+ *   buckets are wider than the ones proposed by the original paper:
+ *
+ *   '0'                  D == 0
+ *   '10'   + 12 bits     D in [-2^11, 2^11)
+ *   '110'  + 24 bits     D in [-2^23, 2^23)
+ *   '1110' + 36 bits     D in [-2^35, 2^35)
+ *   '1111' + 64 bits     any other D
+ *
+ * - Values, XOR of the IEEE 754 64 bit representation against the previous
+ *   one, '0' if it's 0, otherwise '1' followed by
+ *
+ *   '0' + meaningful bits   when they fit into the previous leading/trailing
+ *                           zeros window
+ *   '1' + 5 bits leading zeros + 6 bits meaningful bits length + meaningful
+ *   bits
+ *
+ * Values are stored with double precision, which is exactly what the wire
+ * format carries on 64 bits.
+ */
+
+/* Worst case space in bits taken by a single point */
+#define POINT_MAX_BITS  ((4 + 64) + (2 + 5 + 6 + 64))
+
+struct bitstream {
+    uint8_t *data;
+    size_t pos;
+};
+
+/*
+ * Write the `nbits` least significant bits of `value`, most significant
+ * first, the underlying buffer is expected to be zero'ed
+ */
+static void bitstream_write(struct bitstream *bs, uint64_t value, int nbits) {
+    while (nbits > 0) {
+        int avail = 8 - (bs->pos & 7);
+        int take = nbits < avail ? nbits : avail;
+        uint8_t bits = (value >> (nbits - take)) & ((1U << take) - 1);
+        bs->data[bs->pos >> 3] |= bits << (avail - take);
+        bs->pos += take;
+        nbits -= take;
+    }
+}
+
+static uint64_t bitstream_read(struct bitstream *bs, int nbits) {
+    uint64_t value = 0;
+    while (nbits > 0) {
+        int avail = 8 - (bs->pos & 7);
+        int take = nbits < avail ? nbits : avail;
+        uint8_t byte = bs->data[bs->pos >> 3];
+        value = (value << take) | ((byte >> (avail - take)) & ((1U << take) - 1));
+        bs->pos += take;
+        nbits -= take;
+    }
+    return value;
+}
+
+/* Sign-extend a `nbits` two's complement number */
+static inline int64_t sign_extend(uint64_t value, int nbits) {
+    uint64_t sign = 1ULL << (nbits - 1);
+    return (int64_t) ((value ^ sign) - sign);
+}
+
+static inline uint64_t double_to_bits(double value) {
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+static inline double bits_to_double(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void encode_dod(struct bitstream *bs, int64_t dod) {
+    if (dod == 0) {
+        bitstream_write(bs, 0x00, 1);
+    } else if (dod >= -(1LL << 11) && dod < (1LL << 11)) {
+        bitstream_write(bs, 0x02, 2);
+        bitstream_write(bs, (uint64_t) dod, 12);
+    } else if (dod >= -(1LL << 23) && dod < (1LL << 23)) {
+        bitstream_write(bs, 0x06, 3);
+        bitstream_write(bs, (uint64_t) dod, 24);
+    } else if (dod >= -(1LL << 35) && dod < (1LL << 35)) {
+        bitstream_write(bs, 0x0E, 4);
+        bitstream_write(bs, (uint64_t) dod, 36);
+    } else {
+        bitstream_write(bs, 0x0F, 4);
+        bitstream_write(bs, (uint64_t) dod, 64);
+    }
+}
+
+static int64_t decode_dod(struct bitstream *bs) {
+    if (bitstream_read(bs, 1) == 0)
+        return 0;
+    if (bitstream_read(bs, 1) == 0)
+        return sign_extend(bitstream_read(bs, 12), 12);
+    if (bitstream_read(bs, 1) == 0)
+        return sign_extend(bitstream_read(bs, 24), 24);
+    if (bitstream_read(bs, 1) == 0)
+        return sign_extend(bitstream_read(bs, 36), 36);
+    return (int64_t) bitstream_read(bs, 64);
+}
+
+/*
+ * Encode `len` points into a chunk, tracking its time bounds, the index of
+ * the first row is up to the caller
+ */
+void tts_chunk_encode(struct tts_chunk *chunk, const tts_timestamp *timestamps,
+                      const double *values, size_t len) {
+    struct bitstream bs = {
+        .data = calloc((len * POINT_MAX_BITS + 7) / 8 + 16, sizeof(uint8_t)),
+        .pos = 0
+    };
+    uint64_t prev_bits = 0, bits = 0, xor = 0;
+    int64_t delta = 0, prev_delta = 0;
+    int leading = -1, trailing = 0, lz = 0, tz = 0;
+    chunk->len = len;
+    chunk->min_ts = chunk->max_ts = timestamps[0];
+    bitstream_write(&bs, timestamps[0], 64);
+    prev_bits = double_to_bits(values[0]);
+    bitstream_write(&bs, prev_bits, 64);
+    for (size_t i = 1; i < len; ++i) {
+        if (timestamps[i] < chunk->min_ts)
+            chunk->min_ts = timestamps[i];
+        if (timestamps[i] > chunk->max_ts)
+            chunk->max_ts = timestamps[i];
+        delta = (int64_t) (timestamps[i] - timestamps[i - 1]);
+        encode_dod(&bs, delta - prev_delta);
+        prev_delta = delta;
+        bits = double_to_bits(values[i]);
+        xor = bits ^ prev_bits;
+        prev_bits = bits;
+        if (xor == 0) {
+            bitstream_write(&bs, 0x00, 1);
+            continue;
+        }
+        lz = __builtin_clzll(xor);
+        tz = __builtin_ctzll(xor);
+        if (lz > 31)
+            lz = 31;
+        if (leading != -1 && lz >= leading && tz >= trailing) {
+            bitstream_write(&bs, 0x02, 2);
+            bitstream_write(&bs, xor >> trailing, 64 - leading - trailing);
+        } else {
+            leading = lz;
+            trailing = tz;
+            bitstream_write(&bs, 0x03, 2);
+            bitstream_write(&bs, leading, 5);
+            // 64 meaningful bits can't happen with leading zeros, 0 means 64
+            bitstream_write(&bs, (64 - leading - trailing) & 0x3F, 6);
+            bitstream_write(&bs, xor >> trailing, 64 - leading - trailing);
+        }
+    }
+    chunk->size = (bs.pos + 7) / 8;
+    chunk->data = realloc(bs.data, chunk->size);
+}
+
+/*
+ * Decode all the points of a chunk into the columns passed in, which must be
+ * large enough to store `chunk->len` points, return the number of points
+ * decoded
+ */
+size_t tts_chunk_decode(const struct tts_chunk *chunk,
+                        tts_timestamp *timestamps, double *values) {
+    struct bitstream bs = { .data = chunk->data, .pos = 0 };
+    uint64_t bits = 0;
+    int64_t delta = 0;
+    int leading = 0, trailing = 0, meaningful = 0;
+    timestamps[0] = bitstream_read(&bs, 64);
+    bits = bitstream_read(&bs, 64);
+    values[0] = bits_to_double(bits);
+    for (size_t i = 1; i < chunk->len; ++i) {
+        delta += decode_dod(&bs);
+        timestamps[i] = timestamps[i - 1] + delta;
+        if (bitstream_read(&bs, 1) == 1) {
+            if (bitstream_read(&bs, 1) == 1) {
+                leading = bitstream_read(&bs, 5);
+                meaningful = bitstream_read(&bs, 6);
+                if (meaningful == 0)
+                    meaningful = 64;
+                trailing = 64 - leading - meaningful;
+            }
+            bits ^= bitstream_read(&bs, 64 - leading - trailing) << trailing;
+        }
+        values[i] = bits_to_double(bits);
+    }
+    return chunk->len;
+}
+
+/*
+ * ===================
+ *  Timeseries storage
+ * ===================
+ */
+
+/*
+ * Return the position of the first timestamp greater or equal than `t` in a
+ * sorted column, `len` if there's none
+ */
+static size_t lower_bound(const tts_timestamp *timestamps,
+                          size_t len, tts_timestamp t) {
+    size_t left = 0, right = len, middle = 0;
+    if (len == 0 || timestamps[0] >= t)
+        return 0;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (timestamps[middle] < t)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    return left;
+}
+
+/*
+ * Rollup tiers of 1 minute, 1 hour and 1 day, retentions are set by the
+ * configuration on startup
+ */
+struct tts_rollup_tier tts_rollup_tiers[TTS_ROLLUP_TIERS] = {
+    { .width = 60 * (tts_timestamp) 1e9, .retention = 0 },
+    { .width = 3600 * (tts_timestamp) 1e9, .retention = 0 },
+    { .width = 86400 * (tts_timestamp) 1e9, .retention = 0 }
+};
+
+/*
+ * Account a point into the bucket of a rollup it falls into, creating it if
+ * it doesn't exist yet, usually the last one, points older than the retention
+ * of the tier are just ignored. The variance is kept as the sum of squared
+ * deviations, updated with the Welford's method, first and last values track
+ * their timestamps as points can arrive out of order
+ */
+static void rollup_add(struct tts_rollup *rollup, tts_timestamp width,
+                       tts_timestamp timestamp, double value) {
+    tts_timestamp end = (timestamp + width - 1) / width * width;
+    struct tts_bucket *bucket = NULL;
+    size_t size = TTS_VECTOR_SIZE(rollup->buckets), i = size;
+    if (end <= rollup->since)
+        return;
+    if (size > 0 && TTS_VECTOR_LAST(rollup->buckets).end < end) {
+        i = size;
+    } else if (size > 0) {
+        i = tts_rollup_lower_bound(rollup, end);
+        if (TTS_VECTOR_AT(rollup->buckets, i).end == end)
+            bucket = &TTS_VECTOR_AT(rollup->buckets, i);
+    }
+    if (!bucket) {
+        struct tts_bucket b = { .end = end, .min = value, .max = value,
+                                .first = value, .first_ts = timestamp,
+                                .last_ts = timestamp };
+        TTS_VECTOR_APPEND(rollup->buckets, b);
+        bucket = &TTS_VECTOR_AT(rollup->buckets, i);
+        if (i < size) {
+            memmove(bucket + 1, bucket, (size - i) * sizeof(*bucket));
+            *bucket = b;
+        }
+    }
+    double delta = bucket->count > 0 ? value - bucket->sum / bucket->count : 0;
+    bucket->count++;
+    bucket->sum += value;
+    bucket->m2 += delta * (value - bucket->sum / bucket->count);
+    if (value < bucket->min)
+        bucket->min = value;
+    if (value > bucket->max)
+        bucket->max = value;
+    if (timestamp < bucket->first_ts) {
+        bucket->first = value;
+        bucket->first_ts = timestamp;
+    }
+    if (timestamp >= bucket->last_ts) {
+        bucket->last = value;
+        bucket->last_ts = timestamp;
+    }
+}
+
+/*
+ * Drop the buckets of a rollup older than the retention of its tier
+ */
+static void rollup_trim(struct tts_rollup *rollup, tts_timestamp retention) {
+    size_t size = TTS_VECTOR_SIZE(rollup->buckets);
+    if (size == 0 || TTS_VECTOR_LAST(rollup->buckets).end <= retention)
+        return;
+    size_t n = tts_rollup_lower_bound(rollup,
+                                      TTS_VECTOR_LAST(rollup->buckets).end -
+                                      retention + 1);
+    if (n == 0)
+        return;
+    rollup->since = TTS_VECTOR_AT(rollup->buckets, n - 1).end;
+    TTS_VECTOR_RESIZE(rollup->buckets, n);
+    TTS_VECTOR_SHRINK(rollup->buckets);
+}
+
+/*
+ * Return the coarsest rollup tier able to answer an aggregation on windows of
+ * `window` nanoseconds aligned to `from`: its buckets must tile the windows
+ * and it must still hold every point following `from`; -1 if there's none
+ */
+int tts_timeseries_rollup(const struct tts_timeseries *ts,
+                          tts_timestamp window, tts_timestamp from) {
+    for (int i = TTS_ROLLUP_TIERS - 1; i >= 0; --i) {
+        tts_timestamp width = tts_rollup_tiers[i].width;
+        if (tts_rollup_tiers[i].retention > 0 && window % width == 0 &&
+            from % width == 0 && from >= ts->rollups[i].since)
+            return i;
+    }
+    return -1;
+}
+
+/*
+ * Timestamp of the latest row stored, rows are sorted so it's the last one,
+ * return 0 if there's none
+ */
+static int latest_timestamp(const struct tts_timeseries *ts,
+                             tts_timestamp *timestamp) {
+    if (TTS_VECTOR_SIZE(ts->timestamps) > 0)
+        *timestamp = TTS_VECTOR_LAST(ts->timestamps);
+    else if (TTS_VECTOR_SIZE(ts->chunks) > 0)
+        *timestamp = TTS_VECTOR_LAST(ts->chunks).max_ts;
+    else
+        return 0;
+    return 1;
+}
+
+/*
+ * Copy `len` rows into the head columns, the last of them into the ring of
+ * the latest ones too
+ */
+static void head_append(struct tts_timeseries *ts,
+                        const tts_timestamp *timestamps,
+                        const double *values, size_t len) {
+    struct tts_latest *latest = &ts->latest;
+    TTS_VECTOR_APPEND_N(ts->timestamps, timestamps, len);
+    TTS_VECTOR_APPEND_N(ts->values, values, len);
+    for (size_t i = len > TTS_LAST_POINTS ? len - TTS_LAST_POINTS : 0;
+         i < len; ++i) {
+        latest->timestamps[latest->next] = timestamps[i];
+        latest->values[latest->next] = values[i];
+        latest->next = (latest->next + 1) % TTS_LAST_POINTS;
+        if (latest->size < TTS_LAST_POINTS)
+            ++latest->size;
+    }
+}
+
+/*
+ * Stage a point arrived out of order, keeping the staged ones sorted, points
+ * already expired by the retention are just dropped. Once enough points are
+ * staged they're merged into the rows.
+ */
+static void late_stage(struct tts_timeseries *ts, tts_timestamp timestamp,
+                       double value, struct tts_labelset *set) {
+    struct tts_late point = { timestamp, value, set };
+    size_t left = 0, right = TTS_VECTOR_SIZE(ts->late), middle = 0;
+    if (ts->retention > 0 && timestamp < ts->cutoff) {
+        if (set)
+            tts_labels_set_release(ts->labels, set);
+        return;
+    }
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (TTS_VECTOR_AT(ts->late, middle).timestamp <= timestamp)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    TTS_VECTOR_APPEND(ts->late, point);
+    if (left < TTS_VECTOR_SIZE(ts->late) - 1) {
+        memmove(ts->late.data + left + 1, ts->late.data + left,
+                (ts->late.size - left - 1) * sizeof(*ts->late.data));
+        TTS_VECTOR_AT(ts->late, left) = point;
+    }
+    if (TTS_VECTOR_SIZE(ts->late) >= TTS_LATE_POINTS)
+        tts_timeseries_merge(ts);
+}
+
+/*
+ * Append a new point to the head of the timeseries, sealing it into a new
+ * compressed chunk once it's full.
+ * If a retention is set, points older than the maximum age allowed, relative
+ * to the latest point, are expired by just moving the cutoff forward, it's up
+ * to `tts_timeseries_trim` to actually release them later on. The point is
+ * accounted into every rollup tier enabled as well
+ */
+void tts_timeseries_append(struct tts_timeseries *ts,
+                           tts_timestamp timestamp, double value) {
+    tts_timeseries_append_batch(ts, &timestamp, &value, NULL, 1);
+}
+
+/*
+ * Append a run of `len` points, as `tts_timeseries_append` does, labelling
+ * each one with its set in `sets`, if any, whose references pass to the
+ * timeseries. Consecutive points in order are copied in bulk into the head
+ * columns, up to the end of the chunk being built each time, points older
+ * than the latest one stored are staged apart. A full head is sealed, the
+ * points staged are merged first, if any, so they're likely to land into the
+ * head instead of a chunk to decode.
+ */
+void tts_timeseries_append_batch(struct tts_timeseries *ts,
+                                 const tts_timestamp *timestamps,
+                                 const double *values,
+                                 struct tts_labelset *const *sets,
+                                 size_t len) {
+    tts_timestamp latest = 0, newest = 0;
+    int any = latest_timestamp(ts, &latest);
+    for (size_t j = 0; j < len; ++j)
+        newest = timestamps[j] > newest ? timestamps[j] : newest;
+    if (ts->retention > 0 && newest > (tts_timestamp) ts->retention &&
+        newest - ts->retention > ts->cutoff)
+        ts->cutoff = newest - ts->retention;
+    /*
+     * Rollups are fed after the cutoff moves, so they account only for the
+     * points actually stored, expired ones are dropped or ignored by queries
+     */
+    for (int i = 0; i < TTS_ROLLUP_TIERS; ++i)
+        for (size_t j = 0; tts_rollup_tiers[i].retention > 0 && j < len; ++j)
+            if (ts->retention <= 0 || timestamps[j] >= ts->cutoff)
+                rollup_add(&ts->rollups[i], tts_rollup_tiers[i].width,
+                           timestamps[j], values[j]);
+    for (size_t i = 0, n = 0; i < len; i += n) {
+        if (any == 1 && timestamps[i] < latest) {
+            late_stage(ts, timestamps[i], values[i], sets ? sets[i] : NULL);
+            n = 1;
+            continue;
+        }
+        size_t size = TTS_VECTOR_SIZE(ts->timestamps);
+        size_t first = ts->offset + size;
+        for (n = 1; i + n < len && size + n < TTS_CHUNK_POINTS &&
+             timestamps[i + n] >= timestamps[i + n - 1]; ++n)
+            ;
+        head_append(ts, timestamps + i, values + i, n);
+        for (size_t k = 0; sets && k < n; ++k)
+            if (sets[i + k])
+                tts_timeseries_label(ts, first + k, sets[i + k]);
+        latest = timestamps[i + n - 1];
+        any = 1;
+        if (TTS_VECTOR_SIZE(ts->timestamps) < TTS_CHUNK_POINTS)
+            continue;
+        if (TTS_VECTOR_SIZE(ts->late) > 0)
+            tts_timeseries_merge(ts);
+        else
+            tts_timeseries_seal(ts);
+    }
+}
+
+/*
+ * Seal the current head into a new compressed chunk, leaving the head
+ * columns empty but with their capacity untouched, ready for new appends
+ */
+void tts_timeseries_seal(struct tts_timeseries *ts) {
+    size_t len = TTS_VECTOR_SIZE(ts->timestamps);
+    if (len == 0)
+        return;
+    struct tts_chunk chunk = { .index = ts->offset };
+    tts_chunk_encode(&chunk, ts->timestamps.data, ts->values.data, len);
+    TTS_VECTOR_APPEND(ts->chunks, chunk);
+    ts->offset += len;
+    ts->timestamps.size = ts->values.size = 0;
+}
+
+/*
+ * Drop the entries of the tags indexes referencing rows from `index` onward,
+ * they're the last ones of each column
+ */
+static void tags_truncate(struct tts_timeseries *ts, size_t index) {
+    struct tts_tag *tag, *ttmp, *sub, *sub_tmp;
+    HASH_ITER(hh, ts->tags, tag, ttmp) {
+        HASH_ITER(hh, tag->tag, sub, sub_tmp) {
+            size_t left = 0, right = TTS_VECTOR_SIZE(sub->column), middle = 0;
+            while (left < right) {
+                middle = left + (right - left) / 2;
+                if (TTS_VECTOR_AT(sub->column, middle) < index)
+                    left = middle + 1;
+                else
+                    right = middle;
+            }
+            sub->column.size = left;
+        }
+    }
+}
+
+/*
+ * Merge the points staged out of order into the rows: the rows following the
+ * oldest one staged, from the first chunk holding any, are gathered along
+ * with their labels, merged by timestamp with the staged points, placed after
+ * the rows with the same timestamp, and laid out again from the same index,
+ * sealed into chunks as they fill, then labelled and indexed again.
+ * The cost is proportional to the rows following the oldest point staged,
+ * bounded by TTS_LATE_CHUNKS chunks and the head, as points reaching farther
+ * back are rejected, a chunk or two for points late by seconds.
+ */
+void tts_timeseries_merge(struct tts_timeseries *ts) {
+    size_t late_nr = TTS_VECTOR_SIZE(ts->late);
+    size_t left = 0, right = TTS_VECTOR_SIZE(ts->chunks), middle = 0;
+    if (late_nr == 0)
+        return;
+    const struct tts_late *late = ts->late.data;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (TTS_VECTOR_AT(ts->chunks, middle).max_ts <= late[0].timestamp)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    size_t base = left < TTS_VECTOR_SIZE(ts->chunks) ?
+        TTS_VECTOR_AT(ts->chunks, left).index : ts->offset;
+    size_t total = tts_timeseries_end_index(ts) - base + late_nr;
+    size_t n = late_nr, r = 0, i = 0, j = 0, k = 0;
+    tts_timestamp *timestamps = malloc(total * sizeof(*timestamps));
+    double *values = malloc(total * sizeof(*values));
+    struct tts_labelset **sets = calloc(total, sizeof(*sets));
+    /*
+     * Rows are gathered past the room for the staged points, so the merge
+     * can be done in place, front to back
+     */
+    for (i = left; i < TTS_VECTOR_SIZE(ts->chunks); ++i) {
+        n += tts_chunk_decode(&TTS_VECTOR_AT(ts->chunks, i),
+                              timestamps + n, values + n);
+        TTS_CHUNK_DESTROY(&TTS_VECTOR_AT(ts->chunks, i));
+    }
+    memcpy(timestamps + n, ts->timestamps.data,
+           TTS_VECTOR_SIZE(ts->timestamps) * sizeof(*timestamps));
+    memcpy(values + n, ts->values.data,
+           TTS_VECTOR_SIZE(ts->values) * sizeof(*values));
+    /* The latest rows laid out again leave the ring as well */
+    n = tts_timeseries_end_index(ts) - base;
+    n = n < ts->latest.size ? n : ts->latest.size;
+    ts->latest.size -= n;
+    ts->latest.next =
+        (ts->latest.next + TTS_LAST_POINTS - n) % TTS_LAST_POINTS;
+    ts->chunks.size = left;
+    ts->timestamps.size = ts->values.size = 0;
+    ts->offset = base;
+    /*
+     * Each row gathered takes a reference to its labels set, records are
+     * released, but for the first part of a run starting before `base`
+     */
+    r = tts_timeseries_record_lower_bound(ts, base);
+    for (i = r; i < TTS_VECTOR_SIZE(ts->records); ++i) {
+        struct tts_record *record = &TTS_VECTOR_AT(ts->records, i);
+        size_t row = record->index > base ? record->index : base;
+        for (; row < record->index + record->len; ++row)
+            sets[late_nr + row - base] = tts_labels_set_retain(record->set);
+        if (record->index < base) {
+            record->len = base - record->index;
+            ++r;
+        } else {
+            tts_labels_set_release(ts->labels, record->set);
+        }
+    }
+    ts->records.size = r;
+    tags_truncate(ts, base);
+    for (i = late_nr, j = 0, k = 0; j < late_nr; ++k) {
+        if (i < total && timestamps[i] <= late[j].timestamp) {
+            timestamps[k] = timestamps[i];
+            values[k] = values[i];
+            sets[k] = sets[i];
+            ++i;
+        } else {
+            timestamps[k] = late[j].timestamp;
+            values[k] = late[j].value;
+            sets[k] = late[j].set;
+            ++j;
+        }
+    }
+    ts->late.size = 0;
+    for (i = 0; i < total; i += n) {
+        n = total - i < TTS_CHUNK_POINTS ? total - i : TTS_CHUNK_POINTS;
+        head_append(ts, timestamps + i, values + i, n);
+        if (n == TTS_CHUNK_POINTS)
+            tts_timeseries_seal(ts);
+    }
+    for (i = 0; i < total; ++i)
+        if (sets[i])
+            tts_timeseries_label(ts, base + i, sets[i]);
+    free(sets);
+    free(values);
+    free(timestamps);
+}
+
+/*
+ * Retrieve the latest point of the timeseries, return 0 if it's empty. Points
+ * out of order are staged only if older than the latest one, so it's always
+ * the last row
+ */
+int tts_timeseries_last(const struct tts_timeseries *ts,
+                        tts_timestamp *timestamp, double *value,
+                        size_t *index) {
+    tts_timestamp t = 0;
+    double v = 0.0;
+    if (tts_timeseries_latest(ts, 1, &t, &v, NULL) == 0)
+        return 0;
+    *timestamp = t;
+    if (value)
+        *value = v;
+    if (index)
+        *index = tts_timeseries_end_index(ts) - 1;
+    return 1;
+}
+
+/*
+ * Merge backward the points staged out of order with the latest `count` rows
+ * read, keeping the latest `n` points, staged points go after the rows with
+ * the same timestamp. Rows are copied apart first, the merge fills the
+ * buffers from the end. Return how many points the buffers hold.
+ */
+static size_t latest_merge(const struct tts_timeseries *ts, size_t n,
+                           size_t count, tts_timestamp *timestamps,
+                           double *values, struct tts_labelset **sets) {
+    const struct tts_late *late = ts->late.data;
+    size_t i = count, j = TTS_VECTOR_SIZE(ts->late), k = n;
+    tts_timestamp *row_timestamps = malloc(count * sizeof(*row_timestamps));
+    double *row_values = malloc(count * sizeof(*row_values));
+    struct tts_labelset **row_sets =
+        sets ? malloc(count * sizeof(*row_sets)) : NULL;
+    memcpy(row_timestamps, timestamps, count * sizeof(*timestamps));
+    memcpy(row_values, values, count * sizeof(*values));
+    if (sets)
+        memcpy(row_sets, sets, count * sizeof(*sets));
+    while (k > 0 && (i > 0 || j > 0)) {
+        --k;
+        if (j > 0 &&
+            (i == 0 || late[j - 1].timestamp >= row_timestamps[i - 1])) {
+            --j;
+            timestamps[k] = late[j].timestamp;
+            values[k] = late[j].value;
+            if (sets)
+                sets[k] = late[j].set;
+        } else {
+            --i;
+            timestamps[k] = row_timestamps[i];
+            values[k] = row_values[i];
+            if (sets)
+                sets[k] = row_sets[i];
+        }
+    }
+    if (k > 0) {
+        memmove(timestamps, timestamps + k, (n - k) * sizeof(*timestamps));
+        memmove(values, values + k, (n - k) * sizeof(*values));
+        if (sets)
+            memmove(sets, sets + k, (n - k) * sizeof(*sets));
+    }
+    free(row_sets);
+    free(row_values);
+    free(row_timestamps);
+    return n - k;
+}
+
+/*
+ * Copy up to the latest `n` points of the timeseries, oldest first, into
+ * `timestamps` and `values`, return how many were copied, `sets`, if not
+ * NULL, gets the labels set of each one. Served from the ring of the latest
+ * rows as long as it holds enough of them, otherwise rows are read backward
+ * from the head and then from the chunks, decoding the fewest needed, the
+ * points staged out of order are merged into them; expired points are left
+ * out.
+ */
+size_t tts_timeseries_latest(const struct tts_timeseries *ts, size_t n,
+                             tts_timestamp *timestamps, double *values,
+                             struct tts_labelset **sets) {
+    const struct tts_latest *latest = &ts->latest;
+    tts_timestamp chunk_timestamps[TTS_CHUNK_POINTS];
+    double chunk_values[TTS_CHUNK_POINTS];
+    size_t end = tts_timeseries_end_index(ts);
+    size_t first = TTS_VECTOR_SIZE(ts->chunks) > 0 ?
+        TTS_VECTOR_AT(ts->chunks, 0).index : ts->offset;
+    size_t count = end - first < n ? end - first : n;
+    size_t i = 0, len = 0, take = 0, c = 0, skip = 0, rec = 0;
+    if (count == 0)
+        return 0;
+    if (count <= latest->size) {
+        size_t pos =
+            (latest->next + TTS_LAST_POINTS - count) % TTS_LAST_POINTS;
+        for (i = 0; i < count; ++i, pos = (pos + 1) % TTS_LAST_POINTS) {
+            timestamps[i] = latest->timestamps[pos];
+            values[i] = latest->values[pos];
+        }
+    } else {
+        /* Fill from the back, from the head and then chunk by chunk */
+        len = TTS_VECTOR_SIZE(ts->timestamps);
+        take = len < count ? len : count;
+        i = count - take;
+        memcpy(timestamps + i, ts->timestamps.data + len - take,
+               take * sizeof(*timestamps));
+        memcpy(values + i, ts->values.data + len - take,
+               take * sizeof(*values));
+        for (c = TTS_VECTOR_SIZE(ts->chunks); i > 0 && c > 0; i -= take) {
+            len = tts_chunk_decode(&TTS_VECTOR_AT(ts->chunks, --c),
+                                   chunk_timestamps, chunk_values);
+            take = len < i ? len : i;
+            memcpy(timestamps + i - take, chunk_timestamps + len - take,
+                   take * sizeof(*timestamps));
+            memcpy(values + i - take, chunk_values + len - take,
+                   take * sizeof(*values));
+        }
+    }
+    if (sets) {
+        rec = tts_timeseries_record_lower_bound(ts, end - count);
+        for (i = 0; i < count; ++i)
+            sets[i] = tts_timeseries_row_labels(ts, end - count + i, &rec);
+    }
+    if (TTS_VECTOR_SIZE(ts->late) > 0)
+        count = latest_merge(ts, n, count, timestamps, values, sets);
+    if (ts->retention > 0)
+        while (skip < count && timestamps[skip] < ts->cutoff)
+            ++skip;
+    if (skip > 0) {
+        memmove(timestamps, timestamps + skip,
+                (count - skip) * sizeof(*timestamps));
+        memmove(values, values + skip, (count - skip) * sizeof(*values));
+        if (sets)
+            memmove(sets, sets + skip, (count - skip) * sizeof(*sets));
+    }
+    return count - skip;
+}
+
+/*
+ * Index the label `field` with value `value` of the row `index` into the tags
+ * of the timeseries. Labels can be in arbitrary number, their interned
+ * strings act as keys on a multilevel hashmap, compared just by address.
+ * For each label we want to first check if it exists already on the
+ * timeseries `tags` pointer map, and if it doesn't we create it in place and
+ * fill it with the value key on the next level.
+ *
+ * The hierarchy is simply a map of maps:
+ *
+ * TS:tags : {
+ *      label_name: {
+ *          label_value: vector[row index],
+ *               .
+ *               .
+ *          label_valueN: vector[row index]
+ *      },
+ *           .
+ *           .
+ *      label_nameN: {..}
+ * }
+ *
+ * TS:tags[label_name][label_value] = vector[row index]
+ *
+ * Tags hold a reference to their interned names, they're created once per
+ * label while records are free to be released by the retention
+ */
+static void tag(struct tts_timeseries *ts, struct tts_string *field,
+                struct tts_string *value, size_t index) {
+    struct tts_tag *tag = NULL, *sub = NULL;
+    HASH_FIND_PTR(ts->tags, &field, tag);
+    if (!tag) {
+        tag = malloc(sizeof(*tag));
+        tag->tag = NULL;
+        tag->name = tts_labels_retain(field);
+        /* Rows are indexed by the values only */
+        TTS_VECTOR_EMPTY(tag->column);
+        HASH_ADD_PTR(ts->tags, name, tag);
+    }
+    HASH_FIND_PTR(tag->tag, &value, sub);
+    if (!sub) {
+        sub = malloc(sizeof(*sub));
+        sub->tag = NULL;
+        sub->name = tts_labels_retain(value);
+        /* Plenty of values label a single row, like ids, columns are compact */
+        TTS_VECTOR_INIT(sub->column, 1);
+        HASH_ADD_PTR(tag->tag, name, sub);
+    }
+    /* A label repeated on the same point is indexed once */
+    if (TTS_VECTOR_SIZE(sub->column) == 0 ||
+        TTS_VECTOR_LAST(sub->column) != index)
+        TTS_VECTOR_APPEND_POLICY(sub->column, index, TTS_VECTOR_COMPACT);
+}
+
+/*
+ * Label the row `index` with an interned set of labels, the reference to the
+ * set held by the caller passes to the timeseries. Rows are labelled in
+ * ascending order, a row carrying the same set of the previous one just
+ * extends the run of its record, then every label is indexed into the tags.
+ */
+void tts_timeseries_label(struct tts_timeseries *ts, size_t index,
+                          struct tts_labelset *set) {
+    struct tts_record *last = TTS_VECTOR_SIZE(ts->records) > 0 ?
+        &TTS_VECTOR_LAST(ts->records) : NULL;
+    if (last && last->set == set && last->index + last->len == index) {
+        ++last->len;
+        tts_labels_set_release(ts->labels, set);
+    } else {
+        struct tts_record record = { .index = index, .len = 1, .set = set };
+        TTS_VECTOR_APPEND(ts->records, record);
+    }
+    for (size_t i = 0; i < set->labels_nr; ++i)
+        tag(ts, set->labels[i].field, set->labels[i].value, index);
+}
+
+/*
+ * Release the tags indexes entries referencing rows before `first`, columns
+ * are sorted so the expired entries are found by binary search, values and
+ * labels left without any row are released as well
+ */
+static void tags_trim(struct tts_timeseries *ts, size_t first) {
+    struct tts_tag *tag, *ttmp, *sub, *sub_tmp;
+    HASH_ITER(hh, ts->tags, tag, ttmp) {
+        HASH_ITER(hh, tag->tag, sub, sub_tmp) {
+            size_t left = 0, right = TTS_VECTOR_SIZE(sub->column), middle = 0;
+            while (left < right) {
+                middle = left + (right - left) / 2;
+                if (TTS_VECTOR_AT(sub->column, middle) < first)
+                    left = middle + 1;
+                else
+                    right = middle;
+            }
+            if (left < TTS_VECTOR_SIZE(sub->column)) {
+                TTS_VECTOR_RESIZE(sub->column, left);
+                TTS_VECTOR_SHRINK_POLICY(sub->column, TTS_VECTOR_COMPACT);
+                continue;
+            }
+            HASH_DEL(tag->tag, sub);
+            TTS_VECTOR_DESTROY(sub->column);
+            tts_labels_release(ts->labels, sub->name);
+            free(sub);
+        }
+        if (tag->tag)
+            continue;
+        HASH_DEL(ts->tags, tag);
+        TTS_VECTOR_DESTROY(tag->column);
+        tts_labels_release(ts->labels, tag->name);
+        free(tag);
+    }
+}
+
+/*
+ * Release the points expired by the retention, if any: chunks entirely
+ * expired are dropped as a whole, a partially expired one is kept till all of
+ * his points are expired, queries just ignore them in the meanwhile, head rows
+ * are dropped only once there's no chunk left. Labels records and tags
+ * indexes referencing dropped rows are released. Rollup buckets follow the
+ * retention of their tier instead.
+ * The points staged out of order are merged into the rows too, iterators
+ * merge them on the fly till then.
+ * It's meant to be run periodically in background, as the cost is
+ * proportional to what's dropped, apart from the tags scan, off the hot path.
+ */
+void tts_timeseries_trim(struct tts_timeseries *ts) {
+    size_t n = 0;
+    tts_timeseries_merge(ts);
+    for (int i = 0; i < TTS_ROLLUP_TIERS; ++i)
+        if (tts_rollup_tiers[i].retention > 0)
+            rollup_trim(&ts->rollups[i], tts_rollup_tiers[i].retention);
+    if (ts->retention <= 0 || ts->cutoff == 0)
+        return;
+    for (; n < TTS_VECTOR_SIZE(ts->chunks) &&
+         TTS_VECTOR_AT(ts->chunks, n).max_ts < ts->cutoff; ++n)
+        TTS_CHUNK_DESTROY(&TTS_VECTOR_AT(ts->chunks, n));
+    if (n > 0) {
+        TTS_VECTOR_RESIZE(ts->chunks, n);
+        TTS_VECTOR_SHRINK(ts->chunks);
+    }
+    /* The head is sealed as it fills a chunk, its capacity is kept */
+    if (TTS_VECTOR_SIZE(ts->chunks) == 0) {
+        n = lower_bound(ts->timestamps.data,
+                        TTS_VECTOR_SIZE(ts->timestamps), ts->cutoff);
+        TTS_VECTOR_RESIZE(ts->timestamps, n);
+        TTS_VECTOR_RESIZE(ts->values, n);
+        ts->offset += n;
+    }
+    size_t first = tts_timeseries_first_index(ts);
+    size_t r = tts_timeseries_record_lower_bound(ts, first);
+    for (size_t i = 0; i < r; ++i)
+        tts_labels_set_release(ts->labels, TTS_VECTOR_AT(ts->records, i).set);
+    TTS_VECTOR_RESIZE(ts->records, r);
+    TTS_VECTOR_SHRINK(ts->records);
+    /* The first run left could be partially expired */
+    struct tts_record *record = TTS_VECTOR_SIZE(ts->records) > 0 ?
+        &TTS_VECTOR_FIRST(ts->records) : NULL;
+    if (record && record->index < first) {
+        record->len -= first - record->index;
+        record->index = first;
+    } else if (r == 0) {
+        return;
+    }
+    tags_trim(ts, first);
+}
+
+/*
+ * Bytes allocated by a timeseries, its vectors by their capacity, chunks
+ * mapped from a snapshot are not accounted, their data is not owned; the
+ * labels sets and strings referenced are accounted by the dictionary
+ */
+size_t tts_timeseries_memory(const struct tts_timeseries *ts) {
+    const struct tts_tag *tag, *tmp, *sub_tag, *sub_tmp;
+    size_t size = sizeof(*ts) +
+        TTS_VECTOR_CAPACITY(ts->chunks) * sizeof(*ts->chunks.data) +
+        TTS_VECTOR_CAPACITY(ts->timestamps) * sizeof(*ts->timestamps.data) +
+        TTS_VECTOR_CAPACITY(ts->values) * sizeof(*ts->values.data) +
+        TTS_VECTOR_CAPACITY(ts->records) * sizeof(*ts->records.data) +
+        TTS_VECTOR_CAPACITY(ts->late) * sizeof(*ts->late.data);
+    for (size_t i = 0; i < TTS_VECTOR_SIZE(ts->chunks); ++i)
+        if (TTS_VECTOR_AT(ts->chunks, i).mapped == 0)
+            size += TTS_VECTOR_AT(ts->chunks, i).size;
+    for (int i = 0; i < TTS_ROLLUP_TIERS; ++i)
+        size += TTS_VECTOR_CAPACITY(ts->rollups[i].buckets) *
+            sizeof(*ts->rollups[i].buckets.data);
+    HASH_ITER(hh, ts->tags, tag, tmp) {
+        size += sizeof(*tag) +
+            TTS_VECTOR_CAPACITY(tag->column) * sizeof(*tag->column.data);
+        HASH_ITER(hh, tag->tag, sub_tag, sub_tmp)
+            size += sizeof(*sub_tag) + TTS_VECTOR_CAPACITY(sub_tag->column) *
+                sizeof(*sub_tag->column.data);
+    }
+    return size;
+}
+
+/*
+ * Init an iterator to stream through all the points with a timestamp greater
+ * or equal than `from`, chunks entirely older than that are skipped without
+ * being decoded, as the points staged older than that
+ */
+void tts_timeseries_iter_init(struct tts_timeseries_iter *it,
+                              const struct tts_timeseries *ts,
+                              tts_timestamp from) {
+    size_t left = 0, right = TTS_VECTOR_SIZE(ts->chunks), middle = 0;
+    it->ts = ts;
+    it->head_done = 0;
+    it->index = 0;
+    it->from = from > ts->cutoff ? from : ts->cutoff;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (TTS_VECTOR_AT(ts->chunks, middle).max_ts < it->from)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    it->chunk = left;
+    left = 0;
+    right = TTS_VECTOR_SIZE(ts->late);
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (TTS_VECTOR_AT(ts->late, middle).timestamp < it->from)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    it->late = left;
+}
+
+/*
+ * Move the iterator forward to the row with absolute index `index`, allowing
+ * to resume an iteration later on just by remembering the next row, rows
+ * expired in the meanwhile are simply skipped. Only rows are sought, the
+ * staged points keep being merged from where they were.
+ */
+void tts_timeseries_iter_seek(struct tts_timeseries_iter *it, size_t index) {
+    const struct tts_timeseries *ts = it->ts;
+    size_t left = it->chunk, right = TTS_VECTOR_SIZE(ts->chunks), middle = 0;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (TTS_VECTOR_AT(ts->chunks, middle).index +
+            TTS_VECTOR_AT(ts->chunks, middle).len <= index)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    it->chunk = left;
+    it->index = index;
+}
+
+/*
+ * Whether a point staged out of order carries all the labels of a selection,
+ * labels sets are interned, labels are compared by address
+ */
+static int late_match(const struct tts_late *point,
+                      const struct tts_select_column *columns,
+                      size_t columns_nr) {
+    for (size_t i = 0; i < columns_nr; ++i) {
+        size_t j = 0;
+        for (; point->set && j < point->set->labels_nr; ++j)
+            if (point->set->labels[j].field == columns[i].field &&
+                point->set->labels[j].value == columns[i].value)
+                break;
+        if (!point->set || j == point->set->labels_nr)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * Merge the points staged out of order, from the next one of the iterator and
+ * older than `until`, carrying the labels of `columns`, into a span of rows,
+ * empty once the rows are over: each goes after the rows with the same
+ * timestamp, as it will once merged into the rows for good. Staged points as
+ * old as the last row of the span are left for the next one, which could
+ * start with rows having the same timestamp. The merged span is copied into
+ * the buffers of the iterator, along with the labels set of each point.
+ * Return 0, leaving the span untouched, if there's none to merge.
+ */
+static int late_merge(struct tts_timeseries_iter *it,
+                      const struct tts_select_column *columns,
+                      size_t columns_nr, tts_timestamp until,
+                      struct tts_span *span) {
+    const struct tts_timeseries *ts = it->ts;
+    const struct tts_late *late = ts->late.data;
+    size_t end = it->late, i = 0, j = it->late, k = 0, rec = 0, next = 0;
+    int any = 0;
+    for (; end < TTS_VECTOR_SIZE(ts->late) && late[end].timestamp < until;
+         ++end)
+        any = any || late_match(&late[end], columns, columns_nr);
+    if (any == 0) {
+        it->late = end;
+        return 0;
+    }
+    if (span->len > 0)
+        rec = tts_timeseries_record_lower_bound(ts, tts_span_index(span, 0));
+    next = span->len > 0 ? tts_span_index(span, span->len - 1) + 1 :
+        span->index;
+    while (i < span->len || j < end) {
+        if (j < end && late_match(&late[j], columns, columns_nr) == 0) {
+            ++j;
+            continue;
+        }
+        if (i < span->len &&
+            (j == end || span->timestamps[i] <= late[j].timestamp)) {
+            it->merged_rows[k] = tts_span_index(span, i);
+            it->merged_timestamps[k] = span->timestamps[i];
+            it->merged_values[k] = span->values[i];
+            it->merged_sets[k] =
+                tts_timeseries_row_labels(ts, it->merged_rows[k], &rec);
+            ++i;
+        } else {
+            it->merged_rows[k] =
+                i < span->len ? tts_span_index(span, i) : next;
+            it->merged_timestamps[k] = late[j].timestamp;
+            it->merged_values[k] = late[j].value;
+            it->merged_sets[k] = late[j].set;
+            ++j;
+        }
+        ++k;
+    }
+    it->late = end;
+    span->index = it->merged_rows[0];
+    span->len = k;
+    span->rows = it->merged_rows;
+    span->timestamps = it->merged_timestamps;
+    span->values = it->merged_values;
+    span->sets = it->merged_sets;
+    return 1;
+}
+
+/*
+ * Fetch the next span of rows, decoding the next chunk if needed, return 0
+ * once all the rows have been streamed through
+ */
+static int iter_rows(struct tts_timeseries_iter *it, struct tts_span *span) {
+    const struct tts_timeseries *ts = it->ts;
+    size_t len = 0, start = 0;
+    while (it->chunk < TTS_VECTOR_SIZE(ts->chunks)) {
+        const struct tts_chunk *chunk = &TTS_VECTOR_AT(ts->chunks, it->chunk++);
+        len = tts_chunk_decode(chunk, it->timestamps, it->values);
+        start = lower_bound(it->timestamps, len, it->from);
+        if (it->index > chunk->index + start)
+            start = it->index - chunk->index;
+        if (start >= len)
+            continue;
+        span->index = chunk->index + start;
+        span->len = len - start;
+        span->rows = NULL;
+        span->timestamps = it->timestamps + start;
+        span->values = it->values + start;
+        span->sets = NULL;
+        return 1;
+    }
+    if (it->head_done == 1)
+        return 0;
+    it->head_done = 1;
+    len = TTS_VECTOR_SIZE(ts->timestamps);
+    start = lower_bound(ts->timestamps.data, len, it->from);
+    if (it->index > ts->offset + start)
+        start = it->index - ts->offset;
+    if (start >= len)
+        return 0;
+    span->index = ts->offset + start;
+    span->len = len - start;
+    span->rows = NULL;
+    span->timestamps = ts->timestamps.data + start;
+    span->values = ts->values.data + start;
+    span->sets = NULL;
+    return 1;
+}
+
+/*
+ * Fetch the next span of points, the next span of rows merged with the points
+ * staged out of order falling among them, the ones following the last row
+ * are returned at last. Return 0 once all the points have been streamed
+ * through
+ */
+int tts_timeseries_iter_next(struct tts_timeseries_iter *it,
+                             struct tts_span *span) {
+    if (iter_rows(it, span) == 1) {
+        late_merge(it, NULL, 0, span->timestamps[span->len - 1], span);
+        return 1;
+    }
+    *span = (struct tts_span) { .index = tts_timeseries_end_index(it->ts) };
+    return late_merge(it, NULL, 0, ULLONG_MAX, span);
+}
+
+void tts_timeseries_select_init(struct tts_timeseries_select *sel,
+                                const struct tts_timeseries *ts,
+                                tts_timestamp from) {
+    tts_timeseries_iter_init(&sel->it, ts, from);
+    sel->empty = 0;
+    sel->next = 0;
+    TTS_VECTOR_EMPTY(sel->columns);
+}
+
+/*
+ * Restrict the selection to the rows labelled `field` with value `value`, a
+ * label never interned by the shard makes the selection empty, one no row
+ * carries could still be carried by points staged out of order
+ */
+void tts_timeseries_select_label(struct tts_timeseries_select *sel,
+                                 const char *field, size_t field_len,
+                                 const char *value, size_t value_len) {
+    const struct tts_timeseries *ts = sel->it.ts;
+    struct tts_string *f = tts_labels_lookup(ts->labels, field, field_len);
+    struct tts_string *v = tts_labels_lookup(ts->labels, value, value_len);
+    struct tts_tag *tag = NULL, *sub = NULL;
+    if (!f || !v) {
+        sel->empty = 1;
+        return;
+    }
+    HASH_FIND_PTR(ts->tags, &f, tag);
+    if (tag)
+        HASH_FIND_PTR(tag->tag, &v, sub);
+    if (sub && TTS_VECTOR_SIZE(sub->column) == 0)
+        sub = NULL;
+    struct tts_select_column column = {
+        .tag = sub, .field = f, .value = v, .pos = 0
+    };
+    TTS_VECTOR_APPEND(sel->columns, column);
+}
+
+void tts_timeseries_select_seek(struct tts_timeseries_select *sel,
+                                size_t index) {
+    tts_timeseries_iter_seek(&sel->it, index);
+    sel->next = index;
+}
+
+/*
+ * Position of the first row not lower than `target` in a sorted column,
+ * galloping forward from `pos`, consecutive rows selected are mostly close
+ * to each other
+ */
+static size_t column_seek(const size_t *rows, size_t len,
+                          size_t pos, size_t target) {
+    size_t right = pos, step = 1, middle = 0;
+    while (right < len && rows[right] < target) {
+        pos = right + 1;
+        right += step;
+        step *= 2;
+    }
+    if (right > len)
+        right = len;
+    while (pos < right) {
+        middle = pos + (right - pos) / 2;
+        if (rows[middle] < target)
+            pos = middle + 1;
+        else
+            right = middle;
+    }
+    return pos;
+}
+
+/*
+ * Find the first row not lower than `*row` carrying all the labels of the
+ * selection, the columns are searched in turn for the current candidate,
+ * every column not carrying it moves the candidate forward to its next row,
+ * till all the columns agree. Return 0 if there's no such row.
+ */
+static int select_intersect(struct tts_timeseries_select *sel, size_t *row) {
+    size_t n = TTS_VECTOR_SIZE(sel->columns), agree = 0, i = 0;
+    size_t candidate = *row;
+    while (agree < n) {
+        struct tts_select_column *c = &TTS_VECTOR_AT(sel->columns, i);
+        if (!c->tag)
+            return 0;
+        const size_t *rows = c->tag->column.data;
+        size_t len = TTS_VECTOR_SIZE(c->tag->column);
+        c->pos = column_seek(rows, len, c->pos, candidate);
+        if (c->pos == len)
+            return 0;
+        if (rows[c->pos] == candidate) {
+            ++agree;
+        } else {
+            candidate = rows[c->pos];
+            agree = 1;
+        }
+        i = (i + 1) % n;
+    }
+    *row = candidate;
+    return 1;
+}
+
+/*
+ * Fetch the next span of selected points: the iterator is moved straight to
+ * the next selected row, then all the selected rows of the span it returns
+ * are gathered, merged with the staged points selected falling among them,
+ * the ones following the last selected row are returned at last. Return 0
+ * once all the selected points have been returned.
+ */
+int tts_timeseries_select_next(struct tts_timeseries_select *sel,
+                               struct tts_span *span) {
+    struct tts_span raw;
+    size_t row = sel->next, n = 0;
+    if (sel->empty == 1)
+        return 0;
+    if (TTS_VECTOR_SIZE(sel->columns) == 0)
+        return tts_timeseries_iter_next(&sel->it, span);
+    int found = select_intersect(sel, &row);
+    while (found == 1) {
+        tts_timeseries_iter_seek(&sel->it, row);
+        if (iter_rows(&sel->it, &raw) == 0)
+            break;
+        /* Rows before the span are expired or before the lower bound */
+        n = 0;
+        while (found == 1 && row < raw.index + raw.len) {
+            if (row < raw.index) {
+                row = raw.index;
+            } else {
+                sel->rows[n] = row;
+                sel->timestamps[n] = raw.timestamps[row - raw.index];
+                sel->values[n] = raw.values[row - raw.index];
+                ++n;
+                ++row;
+            }
+            found = select_intersect(sel, &row);
+        }
+        if (n == 0)
+            continue;
+        sel->next = row;
+        span->index = sel->rows[0];
+        span->len = n;
+        span->rows = sel->rows;
+        span->timestamps = sel->timestamps;
+        span->values = sel->values;
+        span->sets = NULL;
+        late_merge(&sel->it, sel->columns.data, TTS_VECTOR_SIZE(sel->columns),
+                   raw.timestamps[raw.len - 1], span);
+        return 1;
+    }
+    sel->empty = 1;
+    *span = (struct tts_span) { .index = tts_timeseries_end_index(sel->it.ts) };
+    return late_merge(&sel->it, sel->columns.data,
+                      TTS_VECTOR_SIZE(sel->columns), ULLONG_MAX, span);
+}
+
+/*
+ * Position past the last row not greater than `target` in a sorted column
+ */
+static size_t column_upper_bound(const size_t *rows, size_t len,
+                                 size_t target) {
+    size_t left = 0, right = len, middle = 0;
+    while (left < right) {
+        middle = left + (right - left) / 2;
+        if (rows[middle] <= target)
+            left = middle + 1;
+        else
+            right = middle;
+    }
+    return left;
+}
+
+/*
+ * Last selected row, the same leapfrog of `select_intersect` run backward
+ * from the last rows of the columns, return 0 if there's none
+ */
+static int select_last_row(struct tts_timeseries_select *sel, size_t *row) {
+    size_t n = TTS_VECTOR_SIZE(sel->columns), agree = 0, i = 0, pos = 0;
+    size_t candidate = SIZE_MAX;
+    while (agree < n) {
+        const struct tts_tag *tag = TTS_VECTOR_AT(sel->columns, i).tag;
+        if (!tag)
+            return 0;
+        pos = column_upper_bound(tag->column.data,
+                                 TTS_VECTOR_SIZE(tag->column), candidate);
+        if (pos == 0)
+            return 0;
+        if (TTS_VECTOR_AT(tag->column, pos - 1) == candidate) {
+            ++agree;
+        } else {
+            candidate = TTS_VECTOR_AT(tag->column, pos - 1);
+            agree = 1;
+        }
+        i = (i + 1) % n;
+    }
+    *row = candidate;
+    return 1;
+}
+
+/*
+ * Fetch the last selected point as a span of a single point, the last
+ * selected row, unless a staged point selected follows it. Return 0 if
+ * there's no point selected.
+ */
+int tts_timeseries_select_last(struct tts_timeseries_select *sel,
+                               struct tts_span *span) {
+    const struct tts_timeseries *ts = sel->it.ts;
+    const struct tts_late *late = ts->late.data;
+    size_t n = TTS_VECTOR_SIZE(sel->columns), row = 0, j = 0;
+    int found = 0;
+    if (sel->empty == 1 || n == 0)
+        return 0;
+    /* The last selected row could be already expired */
+    if (select_last_row(sel, &row) == 1) {
+        tts_timeseries_iter_seek(&sel->it, row);
+        found = iter_rows(&sel->it, span) == 1 && span->index == row;
+    }
+    for (j = TTS_VECTOR_SIZE(ts->late); j > sel->it.late; --j)
+        if (late_match(&late[j - 1], sel->columns.data, n) == 1)
+            break;
+    if (j == sel->it.late ||
+        (found == 1 && late[j - 1].timestamp < span->timestamps[0])) {
+        span->len = found;
+        return found;
+    }
+    sel->it.merged_rows[0] =
+        found == 1 ? row + 1 : tts_timeseries_end_index(ts);
+    sel->it.merged_timestamps[0] = late[j - 1].timestamp;
+    sel->it.merged_values[0] = late[j - 1].value;
+    sel->it.merged_sets[0] = late[j - 1].set;
+    *span = (struct tts_span) {
+        .index = sel->it.merged_rows[0], .len = 1,
+        .rows = sel->it.merged_rows, .timestamps = sel->it.merged_timestamps,
+        .values = sel->it.merged_values, .sets = sel->it.merged_sets
+    };
+    return 1;
+}
+
+void tts_timeseries_select_destroy(struct tts_timeseries_select *sel) {
+    TTS_VECTOR_DESTROY(sel->columns);
+}
@@ -0,0 +1,407 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "tts.h"
+#include "pack.h"
+#include "tts_log.h"
+#include "tts_arena.h"
+#include "tts_wal.h"
+#include "tts_handlers.h"
+
+#define WAL_MAGIC_LEN    8
+#define WAL_HEADER_SIZE  (WAL_MAGIC_LEN + sizeof(uint64_t))
+#define WAL_BUFSIZE      4096
+
+static int write_all(int fd, const uint8_t *buf, size_t len) {
+    ssize_t n = 0;
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/*
+ * Create a new log file of generation `gen`, through a temporary file renamed
+ * once complete, if `src` is a valid descriptor the packets following
+ * `offset` in it are copied over. Return the descriptor of the new file, its
+ * size is stored into `size`, -1 on error
+ */
+static int wal_create(const char *path, uint64_t gen,
+                      int src, uint64_t offset, uint64_t *size) {
+    char tmp[0xFFF + 4];
+    uint8_t buf[WAL_BUFSIZE];
+    ssize_t n = 0;
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return -1;
+    memcpy(buf, TTS_WAL_MAGIC, WAL_MAGIC_LEN);
+    packi64(buf + WAL_MAGIC_LEN, gen);
+    if (write_all(fd, buf, WAL_HEADER_SIZE) < 0)
+        goto err;
+    *size = WAL_HEADER_SIZE;
+    while (src >= 0 && (n = pread(src, buf, sizeof(buf), offset)) != 0) {
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 || write_all(fd, buf, n) < 0)
+            goto err;
+        offset += n;
+        *size += n;
+    }
+    if (fdatasync(fd) < 0 || rename(tmp, path) < 0)
+        goto err;
+    return fd;
+err:
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+/*
+ * Replay the packets of a log mapped in memory, from `offset` onward, through
+ * the same handlers serving the clients, responses are just discarded.
+ * Return the offset past the last complete packet, a crash can leave a
+ * partially written one at the end, or a malformed one, the replay stops
+ * there.
+ */
+static uint64_t wal_replay(struct tts_database *db, uint8_t *map,
+                           uint64_t offset, uint64_t size) {
+    ev_buf_list out = { .len = 0, .capacity = 0, .bufs = NULL };
+    struct tts_stream stream = { .active = 0, .ts_name = NULL };
+    struct tts_payload payload = {
+        .out = &out,
+        .tts_db = db,
+        .stream = &stream,
+        .wal = NULL
+    };
+    struct tts_arena arena;
+    unsigned long packets = 0;
+    ssize_t len = 0;
+    tts_arena_init(&arena);
+    while ((len = tts_packet_frame_len(map + offset, size - offset, 0)) > 0) {
+        if (unpack_tts_packet(map + offset, &payload.packet, &arena) < 0) {
+            log_warning("Malformed request in the write-ahead log at %lu, "
+                        "replay stopped", (unsigned long) offset);
+            break;
+        }
+        switch (payload.packet.header.opcode) {
+            case TTS_CREATE_TS:
+            case TTS_DELETE_TS:
+            case TTS_ADDPOINTS:
+            case TTS_MADDPOINTS:
+                tts_handle_packet(&payload);
+                ++packets;
+                break;
+        }
+        tts_arena_reset(&arena);
+        ev_buf_list_reset(&out);
+        offset += len;
+    }
+    tts_arena_destroy(&arena);
+    ev_buf_list_free(&out);
+    log_info("Replayed %lu requests from the write-ahead log", packets);
+    return offset;
+}
+
+/*
+ * Open the log at `path`, replaying it into the database, `from` is the
+ * position covered by the snapshot the database has been loaded from, NULL
+ * if none: packets before it are already in the database. A log entirely
+ * covered by the snapshot is just replaced by a new one, same if there's no
+ * log at all. `sync` set means the log is flushed to disk on every batch.
+ * Return 0 on success, -1 on error
+ */
+int tts_wal_open(struct tts_wal *wal, const char *path, int sync,
+                 struct tts_database *db, const struct tts_wal_position *from) {
+    struct stat st;
+    uint8_t *map = NULL;
+    uint64_t gen = from ? from->gen + 1 : 1, start = WAL_HEADER_SIZE;
+    pthread_mutex_init(&wal->lock, NULL);
+    wal->path = path;
+    wal->sync = sync;
+    atomic_init(&wal->failed, 0);
+    wal->written = wal->size = 0;
+    wal->capacity = WAL_BUFSIZE;
+    wal->buf = malloc(wal->capacity);
+    int fd = open(path, O_RDWR);
+    if (fd < 0 && errno != ENOENT)
+        goto err;
+    if (fd >= 0) {
+        if (fstat(fd, &st) < 0)
+            goto err;
+        if ((size_t) st.st_size < WAL_HEADER_SIZE) {
+            errno = EINVAL;
+            goto err;
+        }
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            goto err;
+        if (memcmp(map, TTS_WAL_MAGIC, WAL_MAGIC_LEN) != 0) {
+            munmap(map, st.st_size);
+            errno = EINVAL;
+            goto err;
+        }
+        wal->pos.gen = unpacku64(map + WAL_MAGIC_LEN);
+        if (from && wal->pos.gen == from->gen &&
+            from->offset <= (uint64_t) st.st_size)
+            start = from->offset;
+        if (from && wal->pos.gen < from->gen) {
+            munmap(map, st.st_size);
+            close(fd);
+            fd = -1;
+        } else {
+            wal->pos.offset = wal_replay(db, map, start, st.st_size);
+            munmap(map, st.st_size);
+            if (wal->pos.offset < (uint64_t) st.st_size) {
+                log_warning("Truncating a partial packet at the end of %s",
+                            path);
+                if (ftruncate(fd, wal->pos.offset) < 0)
+                    goto err;
+            }
+            if (lseek(fd, wal->pos.offset, SEEK_SET) < 0)
+                goto err;
+        }
+    }
+    if (fd < 0) {
+        fd = wal_create(path, gen, -1, 0, &wal->pos.offset);
+        if (fd < 0)
+            goto err;
+        wal->pos.gen = gen;
+    }
+    wal->fd = fd;
+    wal->synced = wal->pos.offset;
+    return 0;
+err:
+    log_error("Can't open write-ahead log %s: %s", path, strerror(errno));
+    if (fd >= 0)
+        close(fd);
+    free(wal->buf);
+    pthread_mutex_destroy(&wal->lock);
+    return -1;
+}
+
+/*
+ * Append a packet to the log buffer, it's written out by the next flush
+ */
+void tts_wal_append(struct tts_wal *wal, const struct tts_packet *packet) {
+    size_t len = tts_packet_size(packet);
+    pthread_mutex_lock(&wal->lock);
+    if (wal->capacity - wal->size < len) {
+        while (wal->capacity - wal->size < len)
+            wal->capacity *= 2;
+        wal->buf = realloc(wal->buf, wal->capacity);
+    }
+    wal->size += pack_tts_packet(packet, wal->buf + wal->size);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Mark the log failed, changes are refused till the packets not synced are
+ * written again, must be called with the log locked
+ */
+static void wal_fail(struct tts_wal *wal, const char *op) {
+    if (atomic_load_explicit(&wal->failed, memory_order_relaxed) == 0)
+        log_error("Write-ahead log %s failed: %s, refusing changes", op,
+                  strerror(errno));
+    atomic_store_explicit(&wal->failed, 1, memory_order_release);
+}
+
+/*
+ * Write out the buffered packets, must be called with the log locked. Return
+ * -1 if the log failed, now or before
+ */
+static int wal_write(struct tts_wal *wal) {
+    if (atomic_load_explicit(&wal->failed, memory_order_relaxed) == 1)
+        return -1;
+    if (wal->written == wal->size)
+        return 0;
+    if (write_all(wal->fd, wal->buf + wal->written,
+                  wal->size - wal->written) < 0) {
+        wal_fail(wal, "write");
+        return -1;
+    }
+    wal->pos.offset += wal->size - wal->written;
+    wal->written = wal->size;
+    return 0;
+}
+
+/*
+ * Release the packets synced up to `offset`, must be called with the log
+ * locked
+ */
+static void wal_synced(struct tts_wal *wal, uint64_t offset) {
+    size_t n = offset - wal->synced;
+    memmove(wal->buf, wal->buf + n, wal->size - n);
+    wal->size -= n;
+    wal->written -= n;
+    wal->synced = offset;
+}
+
+/*
+ * Write again every packet not synced from the last position synced, what
+ * followed it on the file can't be trusted, and sync them, accepting changes
+ * again on success; must be called with the log locked
+ */
+static void wal_recover(struct tts_wal *wal) {
+    if (ftruncate(wal->fd, wal->synced) < 0 ||
+        lseek(wal->fd, wal->synced, SEEK_SET) < 0 ||
+        write_all(wal->fd, wal->buf, wal->size) < 0 ||
+        fdatasync(wal->fd) < 0) {
+        log_debug("Write-ahead log still failing: %s", strerror(errno));
+        return;
+    }
+    wal->pos.offset = wal->synced + wal->size;
+    wal->written = wal->size;
+    wal_synced(wal, wal->pos.offset);
+    atomic_store_explicit(&wal->failed, 0, memory_order_release);
+    log_info("Write-ahead log written again, accepting changes");
+}
+
+/*
+ * Tell if the log failed, the changes are to be refused as they couldn't be
+ * made durable
+ */
+int tts_wal_failed(struct tts_wal *wal) {
+    return atomic_load_explicit(&wal->failed, memory_order_acquire);
+}
+
+/*
+ * Write out all the packets buffered, by every worker, in a single write,
+ * syncing it to disk as well if the log is in sync mode
+ */
+void tts_wal_flush(struct tts_wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    if (wal_write(wal) == 0 && wal->sync == 1 &&
+        wal->synced != wal->pos.offset) {
+        if (fdatasync(wal->fd) < 0)
+            wal_fail(wal, "sync");
+        else
+            wal_synced(wal, wal->pos.offset);
+    }
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Group commit, sync to disk everything written since the last sync at once,
+ * meant to be called periodically, the log is not locked during the sync so
+ * workers can go on appending. A log failed is written again instead, with
+ * the log locked
+ */
+void tts_wal_sync(struct tts_wal *wal) {
+    uint64_t offset = 0, synced = 0;
+    int rc = 0;
+    pthread_mutex_lock(&wal->lock);
+    if (atomic_load_explicit(&wal->failed, memory_order_relaxed) == 1) {
+        wal_recover(wal);
+        pthread_mutex_unlock(&wal->lock);
+        return;
+    }
+    wal_write(wal);
+    offset = wal->pos.offset;
+    synced = wal->synced;
+    pthread_mutex_unlock(&wal->lock);
+    if (offset == synced)
+        return;
+    rc = fdatasync(wal->fd);
+    pthread_mutex_lock(&wal->lock);
+    if (rc < 0)
+        wal_fail(wal, "sync");
+    else if (offset > wal->synced)
+        wal_synced(wal, offset);
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Write out the buffered packets and store the current position on `pos`
+ */
+void tts_wal_position(struct tts_wal *wal, struct tts_wal_position *pos) {
+    pthread_mutex_lock(&wal->lock);
+    wal_write(wal);
+    *pos = wal->pos;
+    pthread_mutex_unlock(&wal->lock);
+}
+
+/*
+ * Drop the packets before `pos` once they're persisted by a snapshot, the
+ * packets following it are moved to a new log of the next generation.
+ * Return 0 on success. -1 on error, the current log is kept in that case.
+ */
+int tts_wal_compact(struct tts_wal *wal, const struct tts_wal_position *pos) {
+    uint64_t size = 0;
+    int fd = -1;
+    pthread_mutex_lock(&wal->lock);
+    if (wal_write(wal) < 0) {
+        pthread_mutex_unlock(&wal->lock);
+        log_error("Write-ahead log failed, not compacted");
+        return -1;
+    }
+    if (pos->gen != wal->pos.gen) {
+        pthread_mutex_unlock(&wal->lock);
+        return 0;
+    }
+    fd = wal_create(wal->path, wal->pos.gen + 1, wal->fd, pos->offset, &size);
+    if (fd < 0) {
+        pthread_mutex_unlock(&wal->lock);
+        log_error("Write-ahead log compaction failed: %s", strerror(errno));
+        return -1;
+    }
+    close(wal->fd);
+    wal->fd = fd;
+    wal->pos.gen++;
+    wal->pos.offset = wal->synced = size;
+    wal->written = wal->size = 0;
+    pthread_mutex_unlock(&wal->lock);
+    return 0;
+}
+
+void tts_wal_close(struct tts_wal *wal) {
+    tts_wal_flush(wal);
+    if (tts_wal_failed(wal)) {
+        pthread_mutex_lock(&wal->lock);
+        wal_recover(wal);
+        pthread_mutex_unlock(&wal->lock);
+    } else if (wal->synced != wal->pos.offset)
+        fdatasync(wal->fd);
+    close(wal->fd);
+    free(wal->buf);
+    pthread_mutex_destroy(&wal->lock);
+}
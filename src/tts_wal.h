@@ -0,0 +1,97 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#ifndef TTS_WAL_H
+#define TTS_WAL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*
+ * Write-ahead log, every request changing the database is appended as it's
+ * applied, in the same wire format it's received, with the timestamps left to
+ * the server resolved, so the log can be replayed on boot just by handling it
+ * again as a stream of requests:
+ *
+ * | magic "TTSWAL01" | generation (64) | packet | packet | ..
+ *
+ * Packets are buffered in memory and written out once per batch of requests
+ * handled, before their responses are sent back, they're flushed to disk
+ * every `wal_fsync_interval` milliseconds, a whole group at once, or after
+ * every batch if it's 0.
+ *
+ * Packets are kept in memory till they're synced. A write or a sync failing
+ * leaves the log `failed`: changes are refused with TTS_EIO, and the packets
+ * not synced yet, acknowledged or not, are written again from the last
+ * position synced by each sync following, till one succeeds.
+ *
+ * Once a snapshot is written, the log is compacted, the packets it covers
+ * are dropped and the generation is bumped, the snapshot tracks the position
+ * of the log it covers up to.
+ */
+
+#define TTS_WAL_MAGIC "TTSWAL01"
+
+struct tts_database;
+
+/*
+ * Position in the log, the generation of the file and the offset in it
+ */
+struct tts_wal_position {
+    uint64_t gen;
+    uint64_t offset;
+};
+
+struct tts_wal {
+    pthread_mutex_t lock;
+    int fd;
+    int sync;
+    _Atomic int failed;
+    const char *path;
+    struct tts_wal_position pos;
+    uint64_t synced;
+    size_t written;
+    size_t size;
+    size_t capacity;
+    uint8_t *buf;
+};
+
+struct tts_packet;
+
+int tts_wal_open(struct tts_wal *, const char *, int,
+                 struct tts_database *, const struct tts_wal_position *);
+void tts_wal_append(struct tts_wal *, const struct tts_packet *);
+void tts_wal_flush(struct tts_wal *);
+void tts_wal_sync(struct tts_wal *);
+int tts_wal_failed(struct tts_wal *);
+void tts_wal_position(struct tts_wal *, struct tts_wal_position *);
+int tts_wal_compact(struct tts_wal *, const struct tts_wal_position *);
+void tts_wal_close(struct tts_wal *);
+
+#endif
@@ -0,0 +1,173 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <float.h>
+#include <math.h>
+#include "tts.h"
+#include "test.h"
+
+/*
+ * Encode the points passed in into a chunk and decode them back, checking
+ * every timestamp and every value bit for bit, along with the time bounds
+ */
+static void roundtrip(const tts_timestamp *timestamps, const double *values,
+                      size_t len) {
+    tts_timestamp decoded_ts[TTS_CHUNK_POINTS];
+    double decoded_values[TTS_CHUNK_POINTS];
+    struct tts_chunk chunk = { .mapped = 0 };
+    tts_timestamp min = timestamps[0], max = timestamps[0];
+    size_t mismatches = 0;
+    tts_chunk_encode(&chunk, timestamps, values, len);
+    TEST_CHECK(chunk.len == len);
+    TEST_CHECK(tts_chunk_decode(&chunk, decoded_ts, decoded_values) == len);
+    for (size_t i = 0; i < len; ++i) {
+        min = timestamps[i] < min ? timestamps[i] : min;
+        max = timestamps[i] > max ? timestamps[i] : max;
+        if (decoded_ts[i] != timestamps[i] ||
+            !test_same_double(decoded_values[i], values[i]))
+            ++mismatches;
+    }
+    TEST_CHECK(mismatches == 0);
+    TEST_CHECK(chunk.min_ts == min);
+    TEST_CHECK(chunk.max_ts == max);
+    TTS_CHUNK_DESTROY(&chunk);
+}
+
+static double from_bits(uint64_t bits) {
+    double value;
+    memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+static void test_single_point(void) {
+    tts_timestamp t = 1600000000000000000ULL;
+    double v = 3.14;
+    roundtrip(&t, &v, 1);
+}
+
+/*
+ * Regular intervals and a constant value take a bit per field each, after
+ * the 128 bits of the first point and the first delta, on 40 bits
+ */
+static void test_regular(void) {
+    tts_timestamp timestamps[TTS_CHUNK_POINTS];
+    double values[TTS_CHUNK_POINTS];
+    struct tts_chunk chunk = { .mapped = 0 };
+    for (size_t i = 0; i < TTS_CHUNK_POINTS; ++i) {
+        timestamps[i] = 1600000000000000000ULL + i * 1000000000ULL;
+        values[i] = 42.0;
+    }
+    roundtrip(timestamps, values, TTS_CHUNK_POINTS);
+    tts_chunk_encode(&chunk, timestamps, values, TTS_CHUNK_POINTS);
+    TEST_CHECK(chunk.size ==
+               (128 + 40 + 1 + 2 * (TTS_CHUNK_POINTS - 2) + 7) / 8);
+    TTS_CHUNK_DESTROY(&chunk);
+}
+
+/* Delta of deltas on both sides of the bounds of every control code */
+static void test_dod_buckets(void) {
+    const int64_t dods[] = {
+        0, 1, -1, (1LL << 11) - 1, -(1LL << 11), 1LL << 11, -(1LL << 11) - 1,
+        (1LL << 23) - 1, -(1LL << 23), 1LL << 23, -(1LL << 23) - 1,
+        (1LL << 35) - 1, -(1LL << 35), 1LL << 35, -(1LL << 35) - 1,
+        1LL << 40, -(1LL << 40)
+    };
+    const size_t n = sizeof(dods) / sizeof(dods[0]);
+    tts_timestamp timestamps[1 + 2 * (sizeof(dods) / sizeof(dods[0]))];
+    double values[1 + 2 * (sizeof(dods) / sizeof(dods[0]))];
+    int64_t delta = 1LL << 42;
+    timestamps[0] = 1ULL << 62;
+    values[0] = 0.0;
+    for (size_t i = 0; i < n; ++i) {
+        /* Every bound is crossed and then crossed back */
+        delta += dods[i];
+        timestamps[2 * i + 1] = timestamps[2 * i] + delta;
+        delta -= dods[i];
+        timestamps[2 * i + 2] = timestamps[2 * i + 1] + delta;
+        values[2 * i + 1] = values[2 * i + 2] = (double) i;
+    }
+    roundtrip(timestamps, values, 1 + 2 * n);
+}
+
+/* Repeated timestamps, points written at the same instant */
+static void test_equal_timestamps(void) {
+    tts_timestamp timestamps[] = { 10, 10, 10, 11, 11, 20, 20, 20, 20 };
+    double values[] = { 1, 2, 3, 4, 5, 6, 7, 8, 9 };
+    roundtrip(timestamps, values, sizeof(values) / sizeof(values[0]));
+}
+
+/*
+ * Values whose XOR has no leading or trailing zeros, 64 meaningful bits,
+ * encoded as 0 on 6 bits, signed zeros, infinities, NaNs and denormals
+ */
+static void test_special_values(void) {
+    double values[] = {
+        from_bits(0x0000000000000001ULL), from_bits(0x8000000000000000ULL),
+        from_bits(0x0000000000000001ULL), 0.0, -0.0, INFINITY, -INFINITY,
+        NAN, from_bits(0x7FF0000000000001ULL), from_bits(0xFFFFFFFFFFFFFFFFULL),
+        DBL_MIN, DBL_MAX, -DBL_MAX, 1e-310, 1.0, 1.0
+    };
+    tts_timestamp timestamps[sizeof(values) / sizeof(values[0])];
+    for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+        timestamps[i] = i * 7;
+    roundtrip(timestamps, values, sizeof(values) / sizeof(values[0]));
+}
+
+/*
+ * Pseudo-random walks, values reusing the window of leading and trailing
+ * zeros of the previous XOR or opening a new one, jittered timestamps
+ */
+static void test_random(void) {
+    tts_timestamp timestamps[TTS_CHUNK_POINTS];
+    double values[TTS_CHUNK_POINTS];
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (int round = 0; round < 64; ++round) {
+        tts_timestamp t = 1600000000000000000ULL;
+        double v = 100.0;
+        for (size_t i = 0; i < TTS_CHUNK_POINTS; ++i) {
+            state ^= state << 13;
+            state ^= state >> 7;
+            state ^= state << 17;
+            t += 1000000 + state % (round % 2 ? 1000000000ULL : 1000ULL);
+            v += round % 3 == 0 ? (double) (state % 5) :
+                (double) (int64_t) (state % 2001 - 1000) / 64.0;
+            timestamps[i] = t;
+            values[i] = round % 4 == 3 ? from_bits(state) : v;
+        }
+        roundtrip(timestamps, values, TTS_CHUNK_POINTS);
+    }
+}
+
+int main(void) {
+    TEST_RUN(test_single_point);
+    TEST_RUN(test_regular);
+    TEST_RUN(test_dod_buckets);
+    TEST_RUN(test_equal_timestamps);
+    TEST_RUN(test_special_values);
+    TEST_RUN(test_random);
+    return TEST_EXIT();
+}
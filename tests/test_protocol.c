@@ -0,0 +1,461 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include "tts_arena.h"
+#include "tts_protocol.h"
+#include "test.h"
+
+/*
+ * Both sides of a connection on the second version of the wire format, the
+ * client packing into its dictionary of strings sent, the server unpacking
+ * from its dictionary of strings received
+ */
+struct wire {
+    struct tts_codec client;
+    struct tts_codec server;
+    struct tts_arena arena;
+};
+
+static void wire_init(struct wire *w) {
+    tts_codec_init(&w->client);
+    tts_codec_init(&w->server);
+    tts_codec_reset(&w->client, TTS_PROTOCOL_V2);
+    tts_codec_reset(&w->server, TTS_PROTOCOL_V2);
+    tts_arena_init(&w->arena);
+}
+
+static void wire_destroy(struct wire *w) {
+    tts_codec_destroy(&w->client);
+    tts_codec_destroy(&w->server);
+    tts_arena_destroy(&w->arena);
+}
+
+/*
+ * Pack a packet on the client side into a buffer of exactly the size it
+ * takes, unpacking it on the server side; the size estimated beforehand
+ * must hold it. Return the size of the packet, the buffer is to be freed
+ */
+static ssize_t transfer(struct wire *w, const struct tts_packet *in,
+                        struct tts_packet *out, uint8_t **buf) {
+    size_t max = tts_codec_packet_size(&w->client, in);
+    uint8_t *tmp = malloc(max);
+    ssize_t len = tts_codec_pack(&w->client, in, tmp);
+    TEST_CHECK(len > 0 && (size_t) len <= max);
+    TEST_CHECK(tts_packet_frame_len(tmp, len, 0) == len);
+    *buf = malloc(len);
+    memcpy(*buf, tmp, len);
+    free(tmp);
+    TEST_CHECK(tts_codec_unpack(&w->server, *buf, out, &w->arena) == 0);
+    return len;
+}
+
+/* Points of an ADDPOINTS, one in three carrying labels, one in five no time */
+static void addpoints_fill(struct tts_addpoints *a, size_t n, uint64_t seed) {
+    memset(a, 0x00, sizeof(*a));
+    a->ts_name = (uint8_t *) "cpu.load";
+    a->ts_name_len = 8;
+    a->points_len = n;
+    a->points = calloc(n, sizeof(*a->points));
+    for (size_t i = 0; i < n; ++i) {
+        if (i % 5 != 4) {
+            a->points[i].bits.ts_sec_set = 1;
+            a->points[i].bits.ts_nsec_set = 1;
+            /* Deltas going back in time as well, zigzag encoded */
+            a->points[i].ts_sec = 1600000000 + (i % 7) * 3;
+            a->points[i].ts_nsec = (seed * (i + 1)) % 1000000000;
+        }
+        a->points[i].value = seed ?
+            (double) ((seed * (i + 1)) % 1000) / 8.0 : 1.5;
+        if (i % 3 != 0)
+            continue;
+        a->points[i].labels_len = 2;
+        a->points[i].labels =
+            calloc(2, sizeof(*a->points[i].labels));
+        a->points[i].labels[0].label = (uint8_t *) "host";
+        a->points[i].labels[0].label_len = 4;
+        a->points[i].labels[0].value =
+            (uint8_t *) (i % 2 ? "web-1" : "web-2");
+        a->points[i].labels[0].value_len = 5;
+        a->points[i].labels[1].label = (uint8_t *) "dc";
+        a->points[i].labels[1].label_len = 2;
+        a->points[i].labels[1].value = (uint8_t *) "eu";
+        a->points[i].labels[1].value_len = 2;
+    }
+}
+
+static void addpoints_free(struct tts_addpoints *a) {
+    for (size_t i = 0; i < a->points_len; ++i)
+        free(a->points[i].labels);
+    free(a->points);
+}
+
+static void addpoints_packet(struct tts_packet *p, size_t n, uint64_t seed) {
+    memset(p, 0x00, sizeof(*p));
+    TTS_SET_REQUEST_HEADER(p, TTS_ADDPOINTS);
+    addpoints_fill(&p->addpoints, n, seed);
+}
+
+static int same_bytes(const uint8_t *a, size_t a_len,
+                      const uint8_t *b, size_t b_len) {
+    return a_len == b_len && memcmp(a, b, a_len) == 0;
+}
+
+static void addpoints_check(const struct tts_addpoints *in,
+                            const struct tts_addpoints *out) {
+    size_t mismatches = 0;
+    TEST_CHECK(same_bytes(in->ts_name, in->ts_name_len,
+                          out->ts_name, out->ts_name_len));
+    TEST_CHECK(in->points_len == out->points_len);
+    for (size_t i = 0; i < in->points_len && i < out->points_len; ++i) {
+        if (in->points[i].bits.ts_sec_set != out->points[i].bits.ts_sec_set ||
+            (in->points[i].bits.ts_sec_set &&
+             (in->points[i].ts_sec != out->points[i].ts_sec ||
+              in->points[i].ts_nsec != out->points[i].ts_nsec)) ||
+            !test_same_double((double) in->points[i].value,
+                              (double) out->points[i].value) ||
+            in->points[i].labels_len != out->points[i].labels_len) {
+            ++mismatches;
+            continue;
+        }
+        for (size_t j = 0; j < in->points[i].labels_len; ++j)
+            if (!same_bytes(in->points[i].labels[j].label,
+                            in->points[i].labels[j].label_len,
+                            out->points[i].labels[j].label,
+                            out->points[i].labels[j].label_len) ||
+                !same_bytes(in->points[i].labels[j].value,
+                            in->points[i].labels[j].value_len,
+                            out->points[i].labels[j].value,
+                            out->points[i].labels[j].value_len))
+                ++mismatches;
+    }
+    TEST_CHECK(mismatches == 0);
+}
+
+/*
+ * A batch of points survives the trip, the second time the strings are
+ * references to the dictionaries, the packet gets smaller
+ */
+static void test_addpoints(void) {
+    struct tts_packet in, out;
+    struct wire w;
+    uint8_t *first = NULL, *second = NULL;
+    ssize_t first_len = 0, second_len = 0;
+    wire_init(&w);
+    addpoints_packet(&in, 100, 7);
+    first_len = transfer(&w, &in, &out, &first);
+    addpoints_check(&in.addpoints, &out.addpoints);
+    second_len = transfer(&w, &in, &out, &second);
+    addpoints_check(&in.addpoints, &out.addpoints);
+    TEST_CHECK(second_len < first_len);
+    addpoints_free(&in.addpoints);
+    free(first);
+    free(second);
+    wire_destroy(&w);
+}
+
+/* Equal values XOR to a single byte, random bits are sent raw instead */
+static void test_value_encoding(void) {
+    struct tts_packet in, out;
+    struct wire w;
+    uint8_t *buf = NULL;
+    ssize_t len = 0;
+    uint64_t state = 88172645463325252ULL, bits = 0;
+    double value = 0.0;
+    wire_init(&w);
+    addpoints_packet(&in, 64, 0);
+    for (size_t i = 0; i < 64; ++i)
+        in.addpoints.points[i].labels_len = 0;
+    len = transfer(&w, &in, &out, &buf);
+    addpoints_check(&in.addpoints, &out.addpoints);
+    /* Timestamps up to 6 bytes, values 1 byte but the first one */
+    TEST_CHECK(len < 5 + 10 + 64 * (6 + 1 + 1) + 8);
+    free(buf);
+    for (size_t i = 0; i < 64; ++i) {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        /* Never a NaN, its payload may not survive a long double */
+        bits = state & ~(1ULL << 62);
+        memcpy(&value, &bits, sizeof(value));
+        in.addpoints.points[i].value = value;
+    }
+    len = transfer(&w, &in, &out, &buf);
+    addpoints_check(&in.addpoints, &out.addpoints);
+    TEST_CHECK(len <= 5 + 10 + 64 * (10 + 8 + 1));
+    free(buf);
+    addpoints_free(&in.addpoints);
+    wire_destroy(&w);
+}
+
+/*
+ * Every truncation of a packet is refused, read from a buffer of exactly the
+ * bytes left so any read past them is caught by the sanitizer
+ */
+static void test_truncated(void) {
+    struct tts_packet in, out;
+    struct wire w;
+    uint8_t *buf = NULL, *cut = NULL;
+    ssize_t len = 0;
+    size_t accepted = 0;
+    int64_t plen = 0;
+    wire_init(&w);
+    addpoints_packet(&in, 20, 3);
+    len = transfer(&w, &in, &out, &buf);
+    for (ssize_t n = TTS_HEADER_SIZE; n < len; ++n) {
+        struct tts_codec server;
+        tts_codec_init(&server);
+        tts_codec_reset(&server, TTS_PROTOCOL_V2);
+        cut = malloc(n);
+        memcpy(cut, buf, n);
+        plen = n - TTS_HEADER_SIZE;
+        cut[1] = plen >> 24;
+        cut[2] = plen >> 16;
+        cut[3] = plen >> 8;
+        cut[4] = plen;
+        if (tts_codec_unpack(&server, cut, &out, &w.arena) == 0)
+            ++accepted;
+        tts_arena_reset(&w.arena);
+        tts_codec_destroy(&server);
+        free(cut);
+    }
+    TEST_CHECK(accepted == 0);
+    addpoints_free(&in.addpoints);
+    free(buf);
+    wire_destroy(&w);
+}
+
+static void test_maddpoints(void) {
+    struct tts_packet in, out;
+    struct tts_addpoints pts[3];
+    struct wire w;
+    uint8_t *buf = NULL;
+    const char *names[] = { "a", "bb", "a" };
+    wire_init(&w);
+    memset(&in, 0x00, sizeof(in));
+    TTS_SET_REQUEST_HEADER(&in, TTS_MADDPOINTS);
+    in.maddpoints.points_len = 3;
+    in.maddpoints.pts = pts;
+    for (size_t i = 0; i < 3; ++i) {
+        addpoints_fill(&pts[i], 1, i + 1);
+        pts[i].ts_name = (uint8_t *) names[i];
+        pts[i].ts_name_len = strlen(names[i]);
+    }
+    pts[1].points[0].bits.ts_sec_set = pts[1].points[0].bits.ts_nsec_set = 0;
+    transfer(&w, &in, &out, &buf);
+    TEST_CHECK(out.maddpoints.points_len == 3);
+    for (size_t i = 0; i < 3 && i < out.maddpoints.points_len; ++i) {
+        addpoints_check(&pts[i], &out.maddpoints.pts[i]);
+        addpoints_free(&pts[i]);
+    }
+    free(buf);
+    wire_destroy(&w);
+}
+
+/* Results of a query, from the server to the client this time */
+static void query_response_fill(struct tts_query_response *qr, size_t n,
+                                tts_timestamp base, struct tts_query_label *l) {
+    qr->len = n;
+    qr->results = calloc(n, sizeof(*qr->results));
+    for (size_t i = 0; i < n; ++i) {
+        tts_timestamp t = base + i * 1000000007ULL;
+        qr->results[i].rc = TTS_OK;
+        qr->results[i].ts_sec = t / 1000000000ULL;
+        qr->results[i].ts_nsec = t % 1000000000ULL;
+        qr->results[i].value = (double) i * 0.25 - 3;
+        qr->results[i].labels_len = i % 2;
+        qr->results[i].labels = i % 2 ? l : NULL;
+    }
+}
+
+static size_t query_response_mismatches(const struct tts_query_response *in,
+                                        size_t from,
+                                        const struct tts_query_response *out) {
+    size_t mismatches = 0;
+    for (size_t i = 0; i < in->len; ++i) {
+        size_t j = from + i;
+        if (out->results[j].ts_sec != in->results[i].ts_sec ||
+            out->results[j].ts_nsec != in->results[i].ts_nsec ||
+            !test_same_double((double) out->results[j].value,
+                              (double) in->results[i].value) ||
+            out->results[j].labels_len != in->results[i].labels_len) {
+            ++mismatches;
+            continue;
+        }
+        for (size_t k = 0; k < in->results[i].labels_len; ++k)
+            if (!same_bytes(out->results[j].labels[k].label,
+                            out->results[j].labels[k].label_len,
+                            in->results[i].labels[k].label,
+                            in->results[i].labels[k].label_len) ||
+                !same_bytes(out->results[j].labels[k].value,
+                            out->results[j].labels[k].value_len,
+                            in->results[i].labels[k].value,
+                            in->results[i].labels[k].value_len))
+                ++mismatches;
+    }
+    return mismatches;
+}
+
+/*
+ * Frames of a response streamed are joined by concatenating their batches,
+ * the strings of the second one referencing the ones of the first
+ */
+static void test_query_response_frames(void) {
+    struct tts_query_label label = {
+        .label = (uint8_t *) "timeseries", .label_len = 10,
+        .value = (uint8_t *) "cpu.load", .value_len = 8
+    };
+    struct tts_packet frames[2], out;
+    struct tts_codec server, client, fresh;
+    struct tts_arena arena;
+    uint8_t *buf[2], *joined = NULL;
+    ssize_t len[2], fresh_len = 0;
+    tts_codec_init(&server);
+    tts_codec_init(&client);
+    tts_codec_reset(&server, TTS_PROTOCOL_V2);
+    tts_codec_reset(&client, TTS_PROTOCOL_V2);
+    tts_arena_init(&arena);
+    for (int i = 0; i < 2; ++i) {
+        memset(&frames[i], 0x00, sizeof(frames[i]));
+        TTS_SET_RESPONSE_HEADER(&frames[i], TTS_QUERY_RESPONSE, TTS_OK);
+        frames[i].header.more = i == 0;
+        query_response_fill(&frames[i].query_r, 10 + i * 5,
+                            1600000000000000000ULL + i * 100000000000ULL,
+                            &label);
+        buf[i] = malloc(tts_codec_packet_size(&server, &frames[i]));
+        len[i] = tts_codec_pack(&server, &frames[i], buf[i]);
+    }
+    /* Packed alone, the second frame would carry the strings again */
+    tts_codec_init(&fresh);
+    tts_codec_reset(&fresh, TTS_PROTOCOL_V2);
+    joined = malloc(tts_codec_packet_size(&fresh, &frames[1]));
+    fresh_len = tts_codec_pack(&fresh, &frames[1], joined);
+    TEST_CHECK(fresh_len == len[1] + (1 + 1 + 10 - 1) + (1 + 1 + 8 - 1));
+    free(joined);
+    tts_codec_destroy(&fresh);
+    /* One header, followed by the payloads of both */
+    size_t plen = len[0] + len[1] - 2 * TTS_HEADER_SIZE;
+    joined = malloc(TTS_HEADER_SIZE + plen);
+    joined[0] = buf[1][0];
+    joined[1] = plen >> 24;
+    joined[2] = plen >> 16;
+    joined[3] = plen >> 8;
+    joined[4] = plen;
+    memcpy(joined + TTS_HEADER_SIZE, buf[0] + TTS_HEADER_SIZE,
+           len[0] - TTS_HEADER_SIZE);
+    memcpy(joined + len[0], buf[1] + TTS_HEADER_SIZE,
+           len[1] - TTS_HEADER_SIZE);
+    TEST_CHECK(tts_codec_unpack(&client, joined, &out, &arena) == 0);
+    TEST_CHECK(out.header.opcode == TTS_QUERY_RESPONSE);
+    TEST_CHECK(out.query_r.len == 25);
+    if (out.query_r.len == 25) {
+        TEST_CHECK(query_response_mismatches(&frames[0].query_r, 0,
+                                             &out.query_r) == 0);
+        TEST_CHECK(query_response_mismatches(&frames[1].query_r, 10,
+                                             &out.query_r) == 0);
+    }
+    for (int i = 0; i < 2; ++i) {
+        free(frames[i].query_r.results);
+        free(buf[i]);
+    }
+    free(joined);
+    tts_arena_destroy(&arena);
+    tts_codec_destroy(&server);
+    tts_codec_destroy(&client);
+}
+
+/* An empty response, the one closing a stream, carries no batch at all */
+static void test_query_response_empty(void) {
+    struct tts_packet in, out;
+    struct tts_codec server, client;
+    struct tts_arena arena;
+    uint8_t buf[64];
+    tts_codec_init(&server);
+    tts_codec_init(&client);
+    tts_codec_reset(&server, TTS_PROTOCOL_V2);
+    tts_codec_reset(&client, TTS_PROTOCOL_V2);
+    tts_arena_init(&arena);
+    memset(&in, 0x00, sizeof(in));
+    TTS_SET_RESPONSE_HEADER(&in, TTS_QUERY_RESPONSE, TTS_EUNREACHABLE);
+    TEST_CHECK(tts_codec_pack(&server, &in, buf) == TTS_HEADER_SIZE);
+    TEST_CHECK(tts_codec_unpack(&client, buf, &out, &arena) == 0);
+    TEST_CHECK(out.query_r.len == 0);
+    TEST_CHECK(out.header.status == TTS_ENOTS);
+    tts_arena_destroy(&arena);
+    tts_codec_destroy(&server);
+    tts_codec_destroy(&client);
+}
+
+/* Without a codec, or on the first version, packets are packed as ever */
+static void test_first_version(void) {
+    struct tts_packet in, out;
+    struct tts_codec v1;
+    struct tts_arena arena;
+    uint8_t *a = NULL, *b = NULL;
+    ssize_t a_len = 0, b_len = 0;
+    tts_codec_init(&v1);
+    tts_arena_init(&arena);
+    addpoints_packet(&in, 10, 5);
+    a = malloc(tts_codec_packet_size(NULL, &in));
+    b = malloc(tts_codec_packet_size(&v1, &in));
+    a_len = tts_codec_pack(NULL, &in, a);
+    b_len = tts_codec_pack(&v1, &in, b);
+    TEST_CHECK(same_bytes(a, a_len, b, b_len));
+    TEST_CHECK(a_len == pack_tts_packet(&in, b));
+    TEST_CHECK(tts_codec_unpack(&v1, a, &out, &arena) == 0);
+    addpoints_check(&in.addpoints, &out.addpoints);
+    addpoints_free(&in.addpoints);
+    free(a);
+    free(b);
+    tts_arena_destroy(&arena);
+    tts_codec_destroy(&v1);
+}
+
+/* Statuses past the 2 bits of the header map to the closest one fitting */
+static void test_header_status(void) {
+    TEST_CHECK(tts_header_status(TTS_OK) == TTS_OK);
+    TEST_CHECK(tts_header_status(TTS_ENOTS) == TTS_ENOTS);
+    TEST_CHECK(tts_header_status(TTS_EEXIST) == TTS_EEXIST);
+    TEST_CHECK(tts_header_status(TTS_UNKNOWN_CMD) == TTS_UNKNOWN_CMD);
+    TEST_CHECK(tts_header_status(TTS_EOOM) == TTS_UNKNOWN_CMD);
+    TEST_CHECK(tts_header_status(TTS_ELATE) == TTS_OK);
+    TEST_CHECK(tts_header_status(TTS_EUNREACHABLE) == TTS_ENOTS);
+    TEST_CHECK(tts_header_status(TTS_EIO) == TTS_UNKNOWN_CMD);
+}
+
+int main(void) {
+    TEST_RUN(test_addpoints);
+    TEST_RUN(test_value_encoding);
+    TEST_RUN(test_truncated);
+    TEST_RUN(test_maddpoints);
+    TEST_RUN(test_query_response_frames);
+    TEST_RUN(test_query_response_empty);
+    TEST_RUN(test_first_version);
+    TEST_RUN(test_header_status);
+    return TEST_EXIT();
+}
@@ -0,0 +1,356 @@
+/* BSD 2-Clause License
+ *
+ * Copyright (c) 2020, Andrea Giacomo Baldan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * * Redistributions of source code must retain the above copyright notice, this
+ *   list of conditions and the following disclaimer.
+ *
+ * * Redistributions in binary form must reproduce the above copyright notice,
+ *   this list of conditions and the following disclaimer in the documentation
+ *   and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdlib.h>
+#include "tts.h"
+#include "test.h"
+
+/*
+ * The semantics checked against a plain model: points are read sorted by
+ * timestamp, the ones with the same timestamp in the order they arrived,
+ * whether they're rows, sealed into chunks or not yet, or points staged out
+ * of order, merged on the fly by the iterators or for good by
+ * `tts_timeseries_merge`; a selection returns the points carrying all of its
+ * labels, in the same order.
+ */
+
+#define POINTS 4000
+
+/* Labels carried by the points, sets are made of some of them */
+enum { HOST_A = 1 << 0, HOST_B = 1 << 1, DC_EU = 1 << 2, LATE = 1 << 3 };
+
+static const char *const label_fields[] = { "host", "host", "dc", "only" };
+static const char *const label_values[] = { "a", "b", "eu", "late" };
+
+#define SETS 5
+
+static const unsigned set_masks[SETS] = {
+    0, HOST_A, HOST_B, HOST_A | DC_EU, LATE
+};
+
+struct model_point {
+    tts_timestamp timestamp;
+    double value;
+    size_t seq;
+    int set;
+};
+
+struct fixture {
+    struct tts_labels labels;
+    struct tts_labelset *sets[SETS];
+    struct tts_timeseries *ts;
+    struct model_point points[POINTS];
+    size_t len;
+    uint64_t state;
+};
+
+static uint64_t next_random(struct fixture *f) {
+    f->state ^= f->state << 13;
+    f->state ^= f->state >> 7;
+    f->state ^= f->state << 17;
+    return f->state;
+}
+
+static struct tts_labelset *labelset(struct tts_labels *labels,
+                                     unsigned mask) {
+    struct tts_label pairs[4];
+    size_t n = 0;
+    for (int i = 0; i < 4; ++i) {
+        if (!(mask & (1U << i)))
+            continue;
+        pairs[n].field = tts_labels_intern(labels, label_fields[i],
+                                           strlen(label_fields[i]));
+        pairs[n].value = tts_labels_intern(labels, label_values[i],
+                                           strlen(label_values[i]));
+        ++n;
+    }
+    return tts_labels_set(labels, pairs, n);
+}
+
+static void fixture_init(struct fixture *f, int64_t retention) {
+    tts_labels_init(&f->labels);
+    f->sets[0] = NULL;
+    for (int i = 1; i < SETS; ++i)
+        f->sets[i] = labelset(&f->labels, set_masks[i]);
+    f->ts = malloc(sizeof(*f->ts));
+    TTS_TIMESERIES_INIT(f->ts, "test", 4, retention, &f->labels);
+    f->len = 0;
+    f->state = 0x2545F4914F6CDD1DULL;
+}
+
+static void fixture_destroy(struct fixture *f) {
+    TTS_TIMESERIES_DESTROY(f->ts);
+    for (int i = 1; i < SETS; ++i)
+        tts_labels_set_release(&f->labels, f->sets[i]);
+    TEST_CHECK(f->labels.sets == NULL && f->labels.strings == NULL);
+    tts_labels_destroy(&f->labels);
+}
+
+/* Append a batch of points to both the timeseries and the model */
+static void append(struct fixture *f, const tts_timestamp *timestamps,
+                   const double *values, const int *sets, size_t len) {
+    struct tts_labelset *refs[16];
+    for (size_t i = 0; i < len; ++i) {
+        refs[i] =
+            sets[i] ? tts_labels_set_retain(f->sets[sets[i]]) : NULL;
+        f->points[f->len] = (struct model_point) {
+            timestamps[i], values[i], f->len, sets[i]
+        };
+        ++f->len;
+    }
+    tts_timeseries_append_batch(f->ts, timestamps, values, refs, len);
+}
+
+static tts_timestamp latest(const struct fixture *f) {
+    tts_timestamp t = 0;
+    for (size_t i = 0; i < f->len; ++i)
+        t = f->points[i].timestamp > t ? f->points[i].timestamp : t;
+    return t;
+}
+
+/*
+ * Append `n` points in batches of up to 8, mostly in order, sometimes with
+ * the timestamp of the latest point, one in five late but never older than
+ * the horizon, as the handlers reject those, some with the timestamp of a
+ * point already stored. Late points are the only ones labelled LATE.
+ */
+static void workload(struct fixture *f, size_t n) {
+    tts_timestamp timestamps[8], last = latest(f), horizon = 0;
+    double values[8];
+    int sets[8];
+    while (n > 0) {
+        size_t batch = 1 + next_random(f) % 8;
+        batch = batch < n ? batch : n;
+        horizon = tts_timeseries_horizon(f->ts);
+        for (size_t i = 0; i < batch; ++i) {
+            uint64_t r = next_random(f);
+            if (f->len + i > 0 && r % 5 == 0 && last > horizon) {
+                timestamps[i] = horizon + r % (last - horizon);
+                /* Or the timestamp of a point stored, if still in reach */
+                if (r % 3 == 0 && f->len > 0 &&
+                    f->points[r % f->len].timestamp >= horizon &&
+                    f->points[r % f->len].timestamp < last)
+                    timestamps[i] = f->points[r % f->len].timestamp;
+                sets[i] = r % 2 ? 4 : r % 4;
+            } else {
+                last += r % 7 == 0 ? 0 : 1 + r % 1000;
+                timestamps[i] = last;
+                sets[i] = r % 4;
+            }
+            values[i] = (double) (f->len + i);
+        }
+        append(f, timestamps, values, sets, batch);
+        n -= batch;
+    }
+}
+
+static int model_cmp(const void *a, const void *b) {
+    const struct model_point *x = a, *y = b;
+    if (x->timestamp != y->timestamp)
+        return x->timestamp < y->timestamp ? -1 : 1;
+    return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Points of the model carrying all the labels of `mask`, from `from` on */
+static size_t expected(const struct fixture *f, unsigned mask,
+                       tts_timestamp from, struct model_point *out) {
+    size_t n = 0;
+    memcpy(out, f->points, f->len * sizeof(*out));
+    qsort(out, f->len, sizeof(*out), model_cmp);
+    for (size_t i = 0; i < f->len; ++i)
+        if (out[i].timestamp >= from &&
+            (set_masks[out[i].set] & mask) == mask &&
+            (f->ts->retention <= 0 || out[i].timestamp >= f->ts->cutoff))
+            out[n++] = out[i];
+    return n;
+}
+
+static void select_labels(struct tts_timeseries_select *sel, unsigned mask) {
+    for (int i = 0; i < 4; ++i)
+        if (mask & (1U << i))
+            tts_timeseries_select_label(sel, label_fields[i],
+                                        strlen(label_fields[i]),
+                                        label_values[i],
+                                        strlen(label_values[i]));
+}
+
+/*
+ * Read the points selected by `mask` from `from` on, checking them against
+ * the model: timestamps, values and labels sets, the latter through the
+ * records, as the handlers do, unless carried by the span
+ */
+static void check_select(struct fixture *f, unsigned mask,
+                         tts_timestamp from) {
+    static struct model_point want[POINTS];
+    struct tts_timeseries_select sel;
+    struct tts_span span;
+    size_t n = expected(f, mask, from, want), got = 0, mismatches = 0;
+    size_t rec = 0;
+    tts_timeseries_select_init(&sel, f->ts, from);
+    select_labels(&sel, mask);
+    while (tts_timeseries_select_next(&sel, &span) == 1) {
+        rec = span.len > 0 ?
+            tts_timeseries_record_lower_bound(f->ts, tts_span_index(&span, 0))
+            : 0;
+        for (size_t i = 0; i < span.len; ++i, ++got) {
+            struct tts_labelset *set = tts_span_labels(f->ts, &span, i, &rec);
+            if (got >= n || span.timestamps[i] != want[got].timestamp ||
+                span.values[i] != want[got].value ||
+                set != f->sets[want[got].set])
+                ++mismatches;
+        }
+    }
+    tts_timeseries_select_destroy(&sel);
+    TEST_CHECK(got == n);
+    TEST_CHECK(mismatches == 0);
+    /* The last point selected, by the backward leapfrog */
+    if (mask == 0)
+        return;
+    tts_timeseries_select_init(&sel, f->ts, 0);
+    select_labels(&sel, mask);
+    n = expected(f, mask, 0, want);
+    if (tts_timeseries_select_last(&sel, &span) == 1) {
+        TEST_CHECK(n > 0 && span.len == 1);
+        TEST_CHECK(n > 0 && span.timestamps[0] == want[n - 1].timestamp &&
+                   span.values[0] == want[n - 1].value);
+    } else {
+        TEST_CHECK(n == 0);
+    }
+    tts_timeseries_select_destroy(&sel);
+}
+
+static void check_all(struct fixture *f) {
+    const unsigned masks[] = {
+        0, HOST_A, HOST_B, DC_EU, HOST_A | DC_EU, HOST_B | DC_EU, LATE
+    };
+    tts_timestamp mid = f->len > 0 ? f->points[f->len / 2].timestamp : 0;
+    for (size_t i = 0; i < sizeof(masks) / sizeof(masks[0]); ++i) {
+        check_select(f, masks[i], 0);
+        check_select(f, masks[i], mid);
+    }
+}
+
+/* Late points read merged on the fly, then merged into the rows for good */
+static void test_merge(void) {
+    struct fixture f;
+    fixture_init(&f, 0);
+    for (int round = 0; round < 8; ++round) {
+        workload(&f, POINTS / 8);
+        check_all(&f);
+        if (round % 2 == 1) {
+            tts_timeseries_merge(f.ts);
+            TEST_CHECK(TTS_VECTOR_SIZE(f.ts->late) == 0);
+            check_all(&f);
+        }
+    }
+    TEST_CHECK(TTS_VECTOR_SIZE(f.ts->chunks) > TTS_LATE_CHUNKS);
+    fixture_destroy(&f);
+}
+
+/* A label carried only by staged points selects them before the merge */
+static void test_select_late_only(void) {
+    struct fixture f;
+    tts_timestamp timestamps[] = { 100, 200, 300, 150, 250 };
+    double values[] = { 1, 2, 3, 4, 5 };
+    int sets[] = { 1, 2, 1, 4, 4 };
+    fixture_init(&f, 0);
+    append(&f, timestamps, values, sets, 5);
+    TEST_CHECK(TTS_VECTOR_SIZE(f.ts->late) == 2);
+    check_all(&f);
+    tts_timeseries_merge(f.ts);
+    check_all(&f);
+    fixture_destroy(&f);
+}
+
+/* A label never interned, or never carried, selects nothing */
+static void test_select_missing(void) {
+    struct fixture f;
+    struct tts_timeseries_select sel;
+    struct tts_span span;
+    fixture_init(&f, 0);
+    workload(&f, 500);
+    tts_timeseries_select_init(&sel, f.ts, 0);
+    tts_timeseries_select_label(&sel, "host", 4, "nowhere", 7);
+    TEST_CHECK(tts_timeseries_select_next(&sel, &span) == 0);
+    TEST_CHECK(tts_timeseries_select_last(&sel, &span) == 0);
+    tts_timeseries_select_destroy(&sel);
+    check_select(&f, HOST_B | LATE, 0);
+    fixture_destroy(&f);
+}
+
+/* The latest points, served from the ring or the rows, late ones merged */
+static void test_latest(void) {
+    static struct model_point want[POINTS];
+    tts_timestamp timestamps[64];
+    double values[64];
+    struct tts_labelset *sets[64];
+    struct fixture f;
+    const size_t counts[] = { 1, 5, TTS_LAST_POINTS, 40, 64 };
+    size_t n = 0, got = 0, mismatches = 0;
+    fixture_init(&f, 0);
+    for (int round = 0; round < 6; ++round) {
+        workload(&f, 317);
+        n = expected(&f, 0, 0, want);
+        for (size_t c = 0; c < sizeof(counts) / sizeof(counts[0]); ++c) {
+            got = tts_timeseries_latest(f.ts, counts[c], timestamps,
+                                        values, sets);
+            TEST_CHECK(got == counts[c]);
+            mismatches = 0;
+            for (size_t i = 0; i < got; ++i)
+                if (timestamps[i] != want[n - got + i].timestamp ||
+                    values[i] != want[n - got + i].value ||
+                    sets[i] != f.sets[want[n - got + i].set])
+                    ++mismatches;
+            TEST_CHECK(mismatches == 0);
+        }
+    }
+    fixture_destroy(&f);
+}
+
+/* Points expired by the retention are left out, before and after a trim */
+static void test_retention(void) {
+    struct fixture f;
+    fixture_init(&f, 50000);
+    workload(&f, POINTS / 2);
+    TEST_CHECK(f.ts->cutoff > 0);
+    check_all(&f);
+    tts_timeseries_trim(f.ts);
+    check_all(&f);
+    workload(&f, POINTS / 2);
+    tts_timeseries_trim(f.ts);
+    check_all(&f);
+    fixture_destroy(&f);
+}
+
+int main(void) {
+    TEST_RUN(test_merge);
+    TEST_RUN(test_select_late_only);
+    TEST_RUN(test_select_missing);
+    TEST_RUN(test_latest);
+    TEST_RUN(test_retention);
+    return TEST_EXIT();
+}